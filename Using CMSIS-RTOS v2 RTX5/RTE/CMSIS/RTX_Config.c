@@ -28,17 +28,20 @@
 #include "cmsis_compiler.h"
 #include "rtx_os.h"
 #include "debug.h"
+#include "power.h"
+#include "cpu_meter.h"
 #include <MKL25Z4.h>
-extern uint32_t idle_counter;
 // OS Idle Thread
 __WEAK __NO_RETURN void osRtxIdleThread (void *argument) {
   (void)argument;
 	
   for (;;)
 	{
-		PTB->PTOR=MASK(DBG_7);
-		idle_counter++;
-		PTB->PTOR=MASK(DBG_7);
+#ifdef POWER_IDLE_SLEEP
+		Power_Idle();       // Time asleep is counted by power.c
+#else
+		CPU_Meter_Idle();   // Spins, converted with cpu_counts_per_ms
+#endif
 	}
 }
  
@@ -0,0 +1,413 @@
+/*
+ *
+ * Alex Dean, 2018
+ * agdean@ncsu.edu
+ *
+ */ 
+
+#include <MKL25Z4.h>
+#include "sd_server.h"
+#include "spi_io.h"
+#include "sd_io.h"
+#include "debug.h"
+#include "blkutil.h"
+
+static osMessageQueueId_t SDS_Queue_id;
+osThreadId_t SD_Server_id;
+
+// Request taken from the queue that did not fit into the last batch
+static SDS_TD_T * pending = NULL;
+
+SDS_STAGE_STATS SDS_Stage_Stats;
+
+#if (SDS_STAGE_SECTORS < 1) || (SDS_STAGE_SECTORS > 32) || (SDS_STAGE_SECTORS & (SDS_STAGE_SECTORS - 1))
+#error "SDS_STAGE_SECTORS must be a power of 2 up to 32"
+#endif
+
+#define STAGE_MASK	(SDS_STAGE_SECTORS - 1)
+#define STAGE_FULL	((uint32_t)(((uint64_t)1 << SDS_STAGE_SECTORS) - 1))
+
+// Window of deferred writes. The smallest AU is 16 KB (32 sectors), so a window aligned to
+// its own size always lies within one AU.
+static struct {
+	SD_DEV * Device;
+	uint32_t Base;						// First sector of the window
+	uint32_t Valid;						// Bit i: sector Base + i is staged
+	uint32_t Next;						// Sector after the last staged write
+	uint32_t Last_AU;					// AU of the last flush
+	SDRESULTS Error;					// First flush error since the last REQ_SYNC
+	BOOL Whole;							// The open stream pre-erased its whole AU
+	__ALIGNED(4) BYTE Data[SDS_STAGE_SECTORS][SD_BLK_SIZE];
+} stage = {NULL, 0, 0, 0, 0xFFFFFFFF, SD_OK, FALSE};
+static volatile BOOL stage_on = TRUE;
+
+static void Update_Trans(SDS_TD_T * t, SDRESULTS res) {
+	// Once Status is idle the owner may reuse *t (often on its stack)
+	osThreadId_t owner = t->Owner;
+	uint32_t flag = t->Flag;
+
+	t->ErrorCode = res;
+	t->Request = REQ_NONE; // Erase request code
+	t->Status = STAT_IDLE;
+	osThreadFlagsSet(owner, flag);
+}
+
+// Get the next request, waiting if there is none
+static SDS_TD_T * Next_Trans(uint32_t timeout) {
+	SDS_TD_T * t;
+	
+	if (pending != NULL) {
+		t = pending;
+		pending = NULL;
+		return t;
+	}
+	if (osMessageQueueGet(SDS_Queue_id, &t, NULL, timeout) != osOK)
+		return NULL;
+	return t;
+}
+
+// AU size of the staged device in sectors, 0 if the card did not tell
+static uint32_t Stage_AU(void) {
+	return (stage.Device->info.valid & SD_REG_SSR) ? stage.Device->info.ssr.au_sectors : 0;
+}
+
+// Is the window the start of a sequential run that continues in the same AU? Flushing it
+// on a short pause would split the AU write into partial commands.
+static BOOL Stage_Hold(void) {
+	uint32_t au = Stage_AU();
+	uint32_t k = stage.Next - stage.Base;
+	
+	return (au != 0) && (k < SDS_STAGE_SECTORS) && (stage.Valid == (1UL << k) - 1)
+		&& (stage.Next % au != 0);
+}
+
+// Idle time before the staged writes go out, or the open AU stream is closed
+static uint32_t Stage_Timeout(void) {
+	if (stage.Valid != 0)
+		return (Stage_Hold() ? SDS_STAGE_HOLD_MS : SDS_STAGE_IDLE_MS) * tick_freq / 1000;
+	if ((stage.Device != NULL) && stage.Device->stream)
+		return SDS_STAGE_HOLD_MS * tick_freq / 1000;
+	return osWaitForever;
+}
+
+static void Stage_Result(SDRESULTS res) {
+	if ((res != SD_OK) && (stage.Error == SD_OK))
+		stage.Error = res;
+}
+
+// End the multi-block write left open on the staged device
+static void Stage_Close(void) {
+	if ((stage.Device != NULL) && stage.Device->stream)
+		Stage_Result(SD_Stream_Close(stage.Device));
+}
+
+// Write n staged sectors from sector on. A run that follows the open stream joins it. A
+// full window at the start of an AU opens a stream over the whole AU with the AU
+// pre-erased, any other run one with just its own sectors pre-erased. The stream is
+// closed at the AU end, so no command straddles two AUs.
+static void Stage_Run(BYTE * const * bufs, uint32_t sector, BYTE n) {
+	SD_DEV * dev = stage.Device;
+	uint32_t au = Stage_AU();
+	uint32_t erase = n;
+	SDRESULTS res = SD_OK;
+	BYTE k;
+	
+	if (dev->stream && (dev->stream_next != sector))
+		Stage_Close();
+	if (!dev->stream) {
+		stage.Whole = (au != 0) && (sector % au == 0) && (n == SDS_STAGE_SECTORS);
+		if (stage.Whole) {
+			erase = au;
+			SDS_Stage_Stats.AU_Erases++;
+		}
+		SDS_Stage_Stats.Commands++;
+		res = SD_Stream_Open(dev, sector, erase);
+	}
+	if (res == SD_OK)
+		res = SD_Stream_Write(dev, bufs, n);
+	if (res != SD_OK) {
+		// The stream is closed, fall back to single blocks with retries
+		for (k = 0, res = SD_OK; k < n; k++)
+			if (SD_Write_Retry(dev, bufs[k], sector + k) != SD_OK)
+				res = SD_ERROR;
+		Stage_Result(res);
+		return;
+	}
+	SDS_Stage_Stats.Blocks += n;
+	if ((au == 0) || (dev->stream_next % au == 0)) {
+		if (stage.Whole)
+			SDS_Stage_Stats.AU_Whole++;
+		Stage_Close();
+	}
+}
+
+// Write the staged sectors out, in runs of consecutive sectors
+static void Stage_Flush(void) {
+	BYTE * bufs[SDS_STAGE_SECTORS];
+	uint32_t au;
+	BYTE i, n;
+	
+	if (stage.Valid == 0)
+		return;
+	au = Stage_AU();
+	if ((au != 0) && (stage.Base / au != stage.Last_AU)) {
+		SDS_Stage_Stats.AU_Switches++;
+		stage.Last_AU = stage.Base / au;
+	}
+	SDS_Stage_Stats.Flushes++;
+	for (i = 0; i < SDS_STAGE_SECTORS; i += n) {
+		for (n = 0; (i + n < SDS_STAGE_SECTORS) && (stage.Valid & (1UL << (i + n))); n++)
+			bufs[n] = stage.Data[i + n];
+		if (n == 0)
+			n = 1;
+		else
+			Stage_Run(bufs, stage.Base + i, n);
+	}
+	stage.Valid = 0;
+}
+
+// Does [sector, sector + n) overlap the staged window of dev?
+static BOOL Stage_Hit(SD_DEV * dev, uint32_t sector, uint32_t n) {
+	return (stage.Valid != 0) && (dev == stage.Device)
+		&& (sector < stage.Base + SDS_STAGE_SECTORS) && (sector + n > stage.Base);
+}
+
+// Serve a deferred write from the stage. Any other request on the staged device ends the
+// open stream first, and flushes the window where it needs the card to be current.
+// Returns TRUE if t is done.
+static BOOL Stage_Take(SDS_TD_T * t) {
+	uint32_t i;
+	SDRESULTS res;
+	
+	if ((t->Request == REQ_WRITE) && t->Defer && stage_on && (t->Sector <= t->Device->last_sector)) {
+		if ((t->Device != stage.Device) || ((t->Sector & ~STAGE_MASK) != stage.Base)) {
+			Stage_Flush();
+			if (t->Device != stage.Device)
+				Stage_Close();
+			stage.Device = t->Device;
+			stage.Base = t->Sector & ~STAGE_MASK;
+		}
+		i = t->Sector & STAGE_MASK;
+		Blk_Copy(stage.Data[i], t->Data, SD_BLK_SIZE);
+		stage.Valid |= 1UL << i;
+		stage.Next = t->Sector + 1;
+		SDS_Stage_Stats.Staged++;
+		Update_Trans(t, SD_OK);
+		if (stage.Valid == STAGE_FULL)
+			Stage_Flush();
+		return TRUE;
+	}
+	if (t->Device != stage.Device)
+		return FALSE;
+	switch (t->Request) {
+		case REQ_SYNC:
+			Stage_Flush();
+			Stage_Close();
+			res = SD_Sync(t->Device);
+			if (stage.Error != SD_OK)
+				res = stage.Error;
+			stage.Error = SD_OK;
+			Update_Trans(t, res);
+			return TRUE;
+		case REQ_READ: // Merged reads may reach past the first sector
+		case REQ_WRITE:
+			if (Stage_Hit(t->Device, t->Sector, SDS_MAX_BATCH))
+				Stage_Flush();
+			break;
+		case REQ_ERASE:
+			if (Stage_Hit(t->Device, t->Sector, t->Count))
+				Stage_Flush();
+			break;
+		default: // REQ_INIT: the card may have been swapped, write out what it was given
+			Stage_Flush();
+			break;
+	}
+	Stage_Close();
+	return FALSE;
+}
+
+static SDRESULTS Run_Single(SDS_TD_T * t) {
+	switch (t->Request) {
+		case REQ_INIT:
+			return SD_Init(t->Device);
+		case REQ_READ:
+			if (t->Check != BLK_CK_NONE)
+				return SD_Read_Check_Retry(t->Device, t->Data, t->Sector, t->Check, &t->Checksum);
+			return SD_Read_Retry(t->Device, t->Data, t->Sector, 0, SD_BLK_SIZE);
+		case REQ_WRITE:
+			return SD_Write_Retry(t->Device, t->Data, t->Sector);
+		case REQ_ERASE:
+			return SD_Erase(t->Device, t->Sector, t->Sector + t->Count - 1);
+		case REQ_SYNC:
+			return SD_Sync(t->Device);
+		default:
+			return SD_PARERR;
+	}
+}
+
+// Take the next request (or the idle timeout) and serve it
+static void Serve(void) {
+	SDS_TD_T * batch[SDS_MAX_BATCH];
+	BYTE * bufs[SDS_MAX_BATCH];
+	SDS_TD_T * t;
+	SDRESULTS res;
+	BYTE n, i;
+	
+	// Idle: write the staged writes out, or end the open multi-block write
+	batch[0] = Next_Trans(Stage_Timeout());
+	if (batch[0] == NULL) {
+		PTB->PSOR = MASK(DBG_4);
+		if (stage.Valid != 0)
+			Stage_Flush();
+		else
+			Stage_Close();
+		PTB->PCOR = MASK(DBG_4);
+		return;
+	}
+	if (Stage_Take(batch[0]))
+		return;
+	n = 1;
+	// Merge queued requests for the following sectors, checked reads and deferred
+	// writes go alone
+	if (((batch[0]->Request == REQ_READ) && (batch[0]->Check == BLK_CK_NONE))
+			|| (batch[0]->Request == REQ_WRITE)) {
+		while ((n < SDS_MAX_BATCH) && ((t = Next_Trans(0)) != NULL)) {
+			if ((t->Request != batch[0]->Request) || (t->Device != batch[0]->Device)
+					|| (t->Sector != batch[0]->Sector + n) || (t->Check != BLK_CK_NONE)
+					|| (t->Defer != batch[0]->Defer)) {
+				pending = t; // Serve it next round
+				break;
+			}
+			batch[n++] = t;
+		}
+	}
+	PTB->PSOR = MASK(DBG_4);
+	if (n == 1) {
+		Update_Trans(batch[0], Run_Single(batch[0]));
+	} else {
+		for (i = 0; i < n; i++)
+			bufs[i] = batch[i]->Data;
+		if (batch[0]->Request == REQ_READ)
+			res = SD_Read_Multi(batch[0]->Device, bufs, batch[0]->Sector, n);
+		else
+			res = SD_Write_Multi(batch[0]->Device, bufs, batch[0]->Sector, n);
+		for (i = 0; i < n; i++) {
+			if (res != SD_OK) // Fall back to single blocks with retries
+				Update_Trans(batch[i], Run_Single(batch[i]));
+			else
+				Update_Trans(batch[i], SD_OK);
+		}
+	}
+	PTB->PCOR = MASK(DBG_4);
+}
+
+void Thread_SD_Server(void *argument) {
+	tick_freq = osKernelGetTickFreq(); // Used by the driver timeouts
+	while (1)
+		Serve();
+}
+
+void SD_Server_Init(void) {
+	const osThreadAttr_t attr = {
+		.name = "SD_Server",
+		.stack_size = SDS_STACK_SIZE,
+		.priority = osPriorityAboveNormal,
+	};
+	
+	SDS_Queue_id = osMessageQueueNew(SDS_QUEUE_LEN, sizeof(SDS_TD_T *), NULL);
+	SD_Server_id = osThreadNew(Thread_SD_Server, NULL, &attr);
+}
+
+SDRESULTS SDS_Submit(SDS_TD_T * t) {
+	if ((t->Request == REQ_NONE) || (t->Request > REQ_SYNC))
+		return SD_PARERR;
+	if (t->Owner == NULL)
+		t->Owner = osThreadGetId();
+	if (t->Flag == 0)
+		t->Flag = SDS_FLAG_DONE;
+	t->Status = STAT_BUSY;
+	if (osMessageQueuePut(SDS_Queue_id, &t, 0, 0) != osOK) {
+		t->Status = STAT_IDLE;
+		return SD_BUSY; // Queue full, try again later
+	}
+	return SD_OK;
+}
+
+SDRESULTS SDS_Wait(SDS_TD_T * t) {
+	// Flag may be shared by several requests of the owner, so recheck Status
+	while (t->Status != STAT_IDLE)
+		osThreadFlagsWait(t->Flag, osFlagsWaitAny, osWaitForever);
+	return t->ErrorCode;
+}
+
+static SDRESULTS SDS_Transfer(SDS_REQ_T req, SD_DEV * dev, uint8_t * data, uint32_t sector,
+		BYTE check, DWORD * checksum) {
+	SDS_TD_T t = {REQ_NONE, NULL, NULL, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+	SDRESULTS res;
+	
+	t.Request = req;
+	t.Device = dev;
+	t.Data = data;
+	t.Sector = sector;
+	t.Check = check;
+	res = SDS_Submit(&t);
+	if (res != SD_OK)
+		return res;
+	res = SDS_Wait(&t);
+	if (checksum != NULL)
+		*checksum = t.Checksum;
+	return res;
+}
+
+SDRESULTS SDS_Init(SD_DEV * dev) {
+	return SDS_Transfer(REQ_INIT, dev, NULL, 0, BLK_CK_NONE, NULL);
+}
+
+SDRESULTS SDS_Read(SD_DEV * dev, uint8_t * data, uint32_t sector) {
+	return SDS_Transfer(REQ_READ, dev, data, sector, BLK_CK_NONE, NULL);
+}
+
+SDRESULTS SDS_Read_Check(SD_DEV * dev, uint8_t * data, uint32_t sector, BYTE check, DWORD * checksum) {
+	return SDS_Transfer(REQ_READ, dev, data, sector, check, checksum);
+}
+
+SDRESULTS SDS_Write(SD_DEV * dev, uint8_t * data, uint32_t sector) {
+	return SDS_Transfer(REQ_WRITE, dev, data, sector, BLK_CK_NONE, NULL);
+}
+
+SDRESULTS SDS_Write_Deferred(SD_DEV * dev, uint8_t * data, uint32_t sector) {
+	SDS_TD_T t = {REQ_NONE, NULL, NULL, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+	SDRESULTS res;
+	
+	t.Request = REQ_WRITE;
+	t.Device = dev;
+	t.Data = data;
+	t.Sector = sector;
+	t.Defer = TRUE;
+	res = SDS_Submit(&t);
+	if (res != SD_OK)
+		return res;
+	return SDS_Wait(&t);
+}
+
+SDRESULTS SDS_Sync(SD_DEV * dev) {
+	return SDS_Transfer(REQ_SYNC, dev, NULL, 0, BLK_CK_NONE, NULL);
+}
+
+void SDS_Set_Staging(BOOL on) {
+	stage_on = on;
+}
+
+SDRESULTS SDS_Erase(SD_DEV * dev, uint32_t sector, uint32_t count) {
+	SDS_TD_T t = {REQ_NONE, NULL, NULL, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+	SDRESULTS res;
+	
+	t.Request = REQ_ERASE;
+	t.Device = dev;
+	t.Sector = sector;
+	t.Count = count;
+	res = SDS_Submit(&t);
+	if (res != SD_OK)
+		return res;
+	return SDS_Wait(&t);
+}
@@ -0,0 +1,69 @@
+#ifndef BLKPACK_H
+#define BLKPACK_H
+#include <integer.h>
+
+/*
+ * Delta + varint packing of sampled data, one self-contained frame per
+ * sector so any sector decodes on its own. Rows of 1..BLK_PACK_MAX_CH
+ * signed 16-bit samples are stored as the zigzag-encoded difference to the
+ * previous row of the same frame (the first row to 0), 7 bits per byte,
+ * least significant group first, bit 7 set on all but the last byte.
+ *
+ * Frame, little-endian:
+ *   0  BLK_PACK_MAGIC
+ *   1  channels per row
+ *   2  rows (WORD)
+ *   4  encoded bytes after the header (WORD)
+ *   6  encoded rows, then zero padding up to the frame size
+ *
+ * Blk_Unpack is plain C and builds on a host to read cards back.
+ */
+
+#define BLK_PACK_MAGIC      0xD7
+#define BLK_PACK_HDR        6
+#define BLK_PACK_MAX_CH     8
+#define BLK_PACK_ROW_MAX(ch) (3 * (ch))  // Most bytes one row can take
+
+typedef struct {
+    BYTE *blk;              // Frame being filled
+    WORD cap;               // Frame size
+    WORD len;               // Bytes used, header included
+    WORD rows;
+    BYTE ch;
+    SHORT prev[BLK_PACK_MAX_CH];
+} BLK_PACK;
+
+/**
+ \brief Start a frame.
+ \param blk Frame buffer, e.g. a sector buffer.
+ \param cap Frame size in bytes, e.g. SD_PAYLOAD_SIZE.
+ \param channels Samples per row, 1..BLK_PACK_MAX_CH.
+ */
+void Blk_Pack_Start(BLK_PACK *p, BYTE *blk, WORD cap, BYTE channels);
+
+/**
+ \brief Append a row of samples.
+ \param row One sample per channel.
+ \return FALSE when the frame has no room for another row; finish it, write
+         it out and start the next frame with the same row.
+ */
+BOOL Blk_Pack_Row(BLK_PACK *p, const SHORT *row);
+
+/**
+ \brief Close a frame: write the header and clear the unused tail.
+ \return Bytes used, header included.
+ */
+WORD Blk_Pack_Finish(BLK_PACK *p);
+
+/**
+ \brief Decode a frame.
+ \param blk Frame.
+ \param cap Frame size in bytes.
+ \param rows Receives the samples, row after row.
+ \param max_rows Rows that fit in rows.
+ \param channels Receives the samples per row.
+ \return Rows decoded, 0 for an empty, foreign or damaged frame.
+ */
+WORD Blk_Unpack(const BYTE *blk, WORD cap, SHORT *rows, WORD max_rows, BYTE *channels);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * CPU availability meter
+ *
+ * Without POWER_IDLE_SLEEP the idle thread spins on CPU_Meter_Idle(). At
+ * boot the same loop is timed against SysTick before the kernel owns it,
+ * giving the number of idle iterations per millisecond. With it, the idle
+ * thread sleeps instead and power.c times the sleeps directly. Idle time over
+ * a span is the spin count divided by that rate plus the time asleep; spin
+ * counts are taken as differences modulo 2^32, so the counter may wrap.
+ */
+
+#include <MKL25Z4.h>
+#include "cmsis_os2.h"
+#include "cpu_meter.h"
+#include "power.h"
+#include "debug.h"
+
+uint32_t idle_counter = 0;
+DWORD cpu_counts_per_ms = 0;
+CPU_HIST cpu_second;
+
+static CPU_SPAN __CPU_Period;
+
+void CPU_Meter_Idle(void)
+{
+    PTB->PTOR = MASK(DBG_7);
+    idle_counter++;
+    PTB->PTOR = MASK(DBG_7);
+}
+
+void CPU_Meter_Calibrate(void)
+{
+    DWORD span = (SystemCoreClock / 1000) * CPU_METER_CAL_MS;
+    DWORD start, n = 0;
+
+    // Free-running down counter, no interrupt. RTX re-programs SysTick at start.
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+    start = SysTick->VAL;
+    while(((start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk) < span) {
+        CPU_Meter_Idle();
+        n++;
+    }
+    SysTick->CTRL = 0;
+    idle_counter = 0;
+    cpu_counts_per_ms = n / CPU_METER_CAL_MS;
+    if(cpu_counts_per_ms == 0)
+        cpu_counts_per_ms = 1;
+}
+
+uint64_t CPU_Meter_Idle_us(const CPU_SPAN *s)
+{
+    POWER_STATS st;
+    uint32_t spins = idle_counter - s->spins0;
+
+    Power_Get_Stats(&st);
+    return(((uint64_t)spins * 1000) / cpu_counts_per_ms + (st.asleep_us - s->asleep0));
+}
+
+void CPU_Meter_Add(CPU_HIST *h, BYTE pct)
+{
+    if(pct > 100)
+        pct = 100;
+    // Evict the oldest sample once the window is full
+    if(h->fill == CPU_METER_WINDOW)
+        h->bin[h->sample[h->next] / 10]--;
+    else
+        h->fill++;
+    h->sample[h->next] = pct;
+    h->bin[pct / 10]++;
+    if(++h->next == CPU_METER_WINDOW)
+        h->next = 0;
+    h->last = pct;
+    h->total++;
+}
+
+void CPU_Meter_Begin(CPU_SPAN *s)
+{
+    POWER_STATS st;
+
+    Power_Get_Stats(&st);
+    s->t0 = osKernelGetSysTimerCount();
+    s->spins0 = idle_counter;
+    s->asleep0 = st.asleep_us;
+}
+
+BYTE CPU_Meter_End(CPU_SPAN *s, CPU_HIST *h)
+{
+    uint64_t idle = CPU_Meter_Idle_us(s);
+    uint64_t span;
+    BYTE pct;
+
+    span = ((uint64_t)(osKernelGetSysTimerCount() - s->t0) * 1000000UL) / osKernelGetSysTimerFreq();
+    if(span == 0)
+        pct = 100;
+    else if(idle >= span)
+        pct = 100;
+    else
+        pct = (BYTE)((idle * 100) / span);
+    if(h)
+        CPU_Meter_Add(h, pct);
+    return(pct);
+}
+
+static void __CPU_Period_Tick(void *argument)
+{
+    (void)argument;
+    CPU_Meter_End(&__CPU_Period, &cpu_second);
+    CPU_Meter_Begin(&__CPU_Period);
+}
+
+void CPU_Meter_Start(void)
+{
+    osTimerId_t tmr;
+
+    tmr = osTimerNew(__CPU_Period_Tick, osTimerPeriodic, NULL, NULL);
+    CPU_Meter_Begin(&__CPU_Period);
+    osTimerStart(tmr, (CPU_METER_PERIOD_MS * osKernelGetTickFreq()) / 1000);
+}
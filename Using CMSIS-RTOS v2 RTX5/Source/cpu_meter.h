@@ -0,0 +1,79 @@
+#ifndef CPU_METER_H
+#define CPU_METER_H
+#include <integer.h>
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define CPU_METER_CAL_MS    (10)    // Idle loop calibration time at boot
+#define CPU_METER_PERIOD_MS (1000)  // Per-second availability sample
+#define CPU_METER_WINDOW    (32)    // Samples kept in each rolling histogram
+#define CPU_METER_BINS      (11)    // 0-9%, 10-19%, ... 90-99%, 100%
+
+// Rolling histogram of percent CPU available over the last CPU_METER_WINDOW samples
+typedef struct {
+    BYTE sample[CPU_METER_WINDOW];
+    BYTE next;                  // Ring position of the oldest sample
+    BYTE fill;                  // Samples held, up to CPU_METER_WINDOW
+    BYTE last;                  // Most recent percentage
+    WORD bin[CPU_METER_BINS];
+    DWORD total;                // Samples ever added
+} CPU_HIST;
+
+// Start point of a measured span
+typedef struct {
+    DWORD t0;                   // Kernel system timer count
+    uint32_t spins0;            // idle_counter
+    uint64_t asleep0;           // Time asleep (us)
+} CPU_SPAN;
+
+extern uint32_t idle_counter;   // Idle loop iterations, only while spinning, wraps
+extern DWORD cpu_counts_per_ms; // Idle loop iterations per ms of pure idle
+extern CPU_HIST cpu_second;     // Availability per CPU_METER_PERIOD_MS
+
+/**
+ \brief Time the idle loop against SysTick. Call before osKernelStart.
+ */
+void CPU_Meter_Calibrate(void);
+
+/**
+ \brief Start the per-second sampling timer. Call after osKernelInitialize.
+ */
+void CPU_Meter_Start(void);
+
+/**
+ \brief One pass of the idle thread loop when it spins. Not called with
+        POWER_IDLE_SLEEP: a pass then lasts a whole sleep, timed by power.c.
+ */
+void CPU_Meter_Idle(void);
+
+/**
+ \brief Idle time since the start of a span: calibrated spin counts plus
+        time asleep. The spin count may wrap once within the span.
+ \param s Span filled by CPU_Meter_Begin.
+ \return Microseconds.
+ */
+uint64_t CPU_Meter_Idle_us(const CPU_SPAN *s);
+
+/**
+ \brief Mark the start of an operation.
+ \param s Span to fill.
+ */
+void CPU_Meter_Begin(CPU_SPAN *s);
+
+/**
+ \brief Mark the end of an operation and record the percent CPU left idle.
+ \param s Span filled by CPU_Meter_Begin.
+ \param h Histogram updated with the result (may be NULL).
+ \return Percent CPU available (0..100) during the span.
+ */
+BYTE CPU_Meter_End(CPU_SPAN *s, CPU_HIST *h);
+
+/**
+ \brief Add one percentage sample to a rolling histogram.
+ \param h Histogram.
+ \param pct Percent CPU available (0..100).
+ */
+void CPU_Meter_Add(CPU_HIST *h, BYTE pct);
+
+#endif // CPU_METER_H
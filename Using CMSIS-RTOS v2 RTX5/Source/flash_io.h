@@ -0,0 +1,34 @@
+#ifndef FLASH_IO_H
+#define FLASH_IO_H
+#include <integer.h>
+
+/*
+ * Erase and program of the on-chip flash (FTFA), for the few bytes that
+ * must survive a power cycle. FLASH_STORE is the last sector of the 128 KB
+ * part; the projects end IROM1 below it so the linker never places code or
+ * constants there.
+ *
+ * Flash cannot be read while a command runs, so interrupts are off for its
+ * duration: about 70 us per longword, up to 100 ms for a sector erase.
+ */
+
+#define FLASH_SECTOR_SIZE   1024
+#define FLASH_STORE         0x0001FC00UL    // Reserved sector
+
+/**
+ \brief Erase a sector to 0xFF.
+ \param addr Sector address, a multiple of FLASH_SECTOR_SIZE.
+ \return FALSE if the controller reported an error.
+ */
+BOOL Flash_Erase(DWORD addr);
+
+/**
+ \brief Program erased flash.
+ \param addr Destination, a multiple of 4.
+ \param src Data, any alignment.
+ \param n Bytes, a partial last longword is padded with 0xFF.
+ \return FALSE if the controller reported an error.
+ */
+BOOL Flash_Write(DWORD addr, const void *src, WORD n);
+
+#endif // FLASH_IO_H
@@ -2,17 +2,35 @@
 #include <MKL25Z4.h>
 #include "spi_io.h"
 #include "sd_io.h"
+#include "sd_server.h"
 #include "LEDs.h"
 #include "debug.h"
 #include "cmsis_os2.h"
+#include "cpu_meter.h"
+#include "blkutil.h"
+#include "blkpack.h"
 
 #define NUM_SECTORS_TO_READ (100)
+// Encrypt the card data with AES-128 CTR, see SD_Set_Crypt and crypt_cycles
+// #define TEST_CRYPT
+// Log a synthetic sensor stream raw and packed once after init, see bench_log
+// #define BENCH_LOG
+#define LOG_ROWS (4000)      // Sample rows per run
+#define LOG_CH (3)           // Samples per row
+#define LOG_SECTOR (100000)  // First sector used by the log runs
+#define LOG_ERASE (32)       // Sectors erased ahead of the last run, covers a packed run
+#define LOG_IDLE_MS (250)    // Idle time between that erase and the run
+// Write scattered sectors write-through and deferred once after init, see bench_stage
+// #define BENCH_STAGE
+#define STAGE_SECTOR (200000) // First sector, a multiple of SDS_STAGE_SECTORS
+#define STAGE_WINDOWS (64)    // Staging windows written per run
 
 SD_DEV dev[1];          // SD device descriptor
-uint8_t buffer[512];    // Buffer for SD read or write data
-uint32_t idle_counter=0,tick_freq;
-uint32_t counter_before=0,counter_before_init=0,counter_before_read=0,counter_after_read=0;
-uint32_t counter_after=0,counter_after_init=0,counter_before_write=0,counter_after_write=0;
+__ALIGNED(4) uint8_t buffer[512]; // Buffer for SD read or write data, word aligned for blkutil
+uint32_t tick_freq;
+CPU_HIST cpu_read, cpu_write;  // Percent CPU available during each operation
+BYTE cpu_init;                  // ... during card initialization
+uint32_t bus_clock=0,read_throughput=0; // SPI clock (Hz) and read rate (bytes/s)
 osThreadId_t Makework_id,Test_id;
 void Thread_Makework(void *argument){
 	static int n=2;
@@ -45,65 +63,231 @@ void Error_Handler(void) {
 		;
 }
 
+#ifdef TEST_CRYPT
+BLK_CRYPT crypt;        // Card key, one context per SD device
+DWORD crypt_cycles;     // Keystream of one sector: SystemCoreClock*512/crypt_cycles bytes/s
+
+// Check the cipher against FIPS-197 C.1, time one sector of keystream
+// and key the card. read_throughput and cpu_read then include the cipher.
+void Test_Crypt_Init(void) {
+	static const BYTE kat_key[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+	static const BYTE kat_in[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+	static const BYTE kat_out[16] = {0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30,
+		0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A};
+	static const BYTE nonce[8] = {'u', 'l', 'i', 'b', 'S', 'D', 0, 1}; // Test key and nonce only
+	BYTE rk[BLK_AES_RK_SIZE], out[BLK_AES_BLOCK];
+	DWORD t0;
+
+	Blk_Aes128_Key(rk, kat_key);
+	Blk_Aes128_Encrypt(rk, kat_in, out);
+	if (!Blk_Equal(out, kat_out, BLK_AES_BLOCK)) {
+		Error_Handler();
+	}
+	Blk_Crypt_Init(&crypt, kat_key, nonce);
+	t0 = osKernelGetSysTimerCount();
+	Blk_Crypt_Stream(&crypt, 0, 0, BLK_CRYPT_SIZE);
+	crypt_cycles = osKernelGetSysTimerCount() - t0;
+	SD_Set_Crypt(dev, &crypt);
+}
+#endif
+
+#ifdef BENCH_LOG
+typedef struct {
+	DWORD sectors;      // Sectors written
+	DWORD cycles;       // CPU cycles to build them, source included
+	DWORD write_ticks;  // Kernel ticks spent in SDS_Write
+	DWORD erase_ticks;  // Kernel ticks spent in SDS_Erase before the run
+} BENCH_LOG_RUN;
+// [0] raw rows, [1] packed with blkpack, [2] packed into sectors erased
+// while idle. Cycles per input byte: cycles / (LOG_ROWS * LOG_CH * 2)
+BENCH_LOG_RUN bench_log[3];
+
+// Accelerometer on a slowly vibrating mount: triangle waves on two axes,
+// gravity on the third, a few counts of noise on all
+static void Sensor_Row(SHORT *row, DWORD i, WORD *lfsr) {
+	WORD t = i & 511;
+	SHORT tri = (SHORT)((t < 256) ? t : 511 - t);
+	
+	*lfsr = (*lfsr >> 1) ^ (-(*lfsr & 1) & 0xB400);
+	row[0] = tri * 8 - 1024 + (*lfsr & 7) - 4;
+	row[1] = tri * 4 - 512 + ((*lfsr >> 3) & 3) - 2;
+	row[2] = 1000 + ((*lfsr >> 5) & 15) - 8;
+}
+
+// Append a row to the sector in buffer, FALSE when it is full
+static BOOL Log_Add(BOOL packed, BLK_PACK *pack, WORD *len, const SHORT *row) {
+	BYTE c;
+	
+	if (packed)
+		return Blk_Pack_Row(pack, row);
+	if (*len + 2 * LOG_CH > SD_PAYLOAD_SIZE)
+		return FALSE;
+	for (c = 0; c < LOG_CH; c++) {
+		buffer[(*len)++] = (BYTE)row[c];
+		buffer[(*len)++] = (BYTE)((WORD)row[c] >> 8);
+	}
+	return TRUE;
+}
+
+// Close the sector in buffer and write it out
+static void Log_Flush(BOOL packed, BLK_PACK *pack, WORD len, DWORD sector, BENCH_LOG_RUN *b) {
+	uint32_t ticks;
+	
+	if (packed)
+		Blk_Pack_Finish(pack);
+	else
+		Blk_Fill(&buffer[len], 0, SD_PAYLOAD_SIZE - len);
+	ticks = osKernelGetTickCount();
+	if (SDS_Write(dev, buffer, sector) != SD_OK)
+		Error_Handler();
+	b->write_ticks += osKernelGetTickCount() - ticks;
+	b->sectors++;
+}
+
+// Same stream written raw, packed, then packed into an extent erased during
+// idle time, cycles counted outside the writes
+void Bench_Log(void) {
+	SHORT row[LOG_CH];
+	BLK_PACK pack;
+	BENCH_LOG_RUN *b;
+	DWORD i, sector = LOG_SECTOR, t0;
+	WORD lfsr, len;
+	BYTE run, packed;
+	
+	for (run = 0; run < 3; run++) {
+		b = &bench_log[run];
+		packed = (run != 0);
+		if (run == 2) {
+			t0 = osKernelGetTickCount();
+			if (SDS_Erase(dev, sector, LOG_ERASE) != SD_OK)
+				Error_Handler();
+			b->erase_ticks = osKernelGetTickCount() - t0;
+			osDelay(LOG_IDLE_MS * tick_freq / 1000);
+		}
+		lfsr = 0xACE1;
+		len = 0;
+		Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+		t0 = osKernelGetSysTimerCount();
+		for (i = 0; i < LOG_ROWS; i++) {
+			Sensor_Row(row, i, &lfsr);
+			if (!Log_Add(packed, &pack, &len, row)) {
+				b->cycles += osKernelGetSysTimerCount() - t0;
+				Log_Flush(packed, &pack, len, sector++, b);
+				t0 = osKernelGetSysTimerCount();
+				len = 0;
+				Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+				Log_Add(packed, &pack, &len, row);
+			}
+		}
+		b->cycles += osKernelGetSysTimerCount() - t0;
+		Log_Flush(packed, &pack, len, sector++, b);
+		// Staged writes report their errors here
+		t0 = osKernelGetTickCount();
+		if (SDS_Sync(dev) != SD_OK)
+			Error_Handler();
+		b->write_ticks += osKernelGetTickCount() - t0;
+	}
+}
+#endif
+
+#ifdef BENCH_STAGE
+// Kernel ticks to write STAGE_WINDOWS windows, the sectors of each out of
+// order, and sync: [0] SDS_Write, [1] SDS_Write_Deferred. Counters in
+// SDS_Stage_Stats.
+uint32_t bench_stage[2];
+
+void Bench_Stage(void) {
+	uint32_t t0;
+	DWORD w, i, sector;
+	BYTE defer;
+	
+	for (defer = 0; defer < 2; defer++) {
+		t0 = osKernelGetTickCount();
+		for (w = 0; w < STAGE_WINDOWS; w++) {
+			for (i = 0; i < SDS_STAGE_SECTORS; i++) {
+				// Odd stride: each sector of the window once, scattered
+				sector = STAGE_SECTOR + w * SDS_STAGE_SECTORS + ((i * 5 + 3) & (SDS_STAGE_SECTORS - 1));
+				if ((defer ? SDS_Write_Deferred(dev, buffer, sector) : SDS_Write(dev, buffer, sector)) != SD_OK)
+					Error_Handler();
+			}
+		}
+		if (SDS_Sync(dev) != SD_OK)
+			Error_Handler();
+		bench_stage[defer] = osKernelGetTickCount() - t0;
+	}
+}
+#endif
+
 void Thread_Test_SD(void *argument) {
 	// Write test data to given block (sector_num) in flash. 
 	// Read it back, compute simple checksum to confirm it is correct.
-	int i;
 	DWORD sector_num = 0, read_sector_count=0; 
-	uint32_t sum=0;
+	uint32_t sum=0, read_ticks;
 	SDRESULTS res;
+	CPU_SPAN span;
 	//	static char err_color_code = 0; // xxxxxRGB
 	tick_freq=osKernelGetTickFreq();
-	counter_before_init=idle_counter;
-	if (SD_Init(dev) != SD_OK) {
+#ifdef TEST_CRYPT
+	Test_Crypt_Init();
+#endif
+	CPU_Meter_Begin(&span);
+	if (SDS_Init(dev) != SD_OK) {
 		Error_Handler(); // Initialization error
 	}
-	counter_after_init=idle_counter;
+	cpu_init = CPU_Meter_End(&span, NULL);
 	Control_RGB_LEDs(0, 1, 1); // Cyan: initialized OK
+	bus_clock = dev->clock;
+#ifdef BENCH_LOG
+	Bench_Log();
+#endif
+#ifdef BENCH_STAGE
+	Bench_Stage();
+#endif
 	while (1) {
+		read_ticks = osKernelGetTickCount();
 		for (read_sector_count=0; read_sector_count < NUM_SECTORS_TO_READ; read_sector_count++) {
 			// erase buffer
-			for (i=0; i<SD_BLK_SIZE; i++)
-				buffer[i] = 0;
+			Blk_Fill(buffer, 0, SD_BLK_SIZE);
 			// perform SD card read
-			counter_before_read=idle_counter;
-			res = SD_Read(dev, (void *)buffer, sector_num, 0, 512);
-			counter_after_read=idle_counter;
-			if (res != SD_OK) { // Was read was OK?
+			CPU_Meter_Begin(&span);
+			res = SDS_Read(dev, buffer, sector_num);
+			CPU_Meter_End(&span, &cpu_read);
+			if (res != SD_OK) { // Was read was OK after retries?
 				Error_Handler(); // Read error
 			} else {
 				Control_RGB_LEDs(0, 0, 1); // Blue: Read OK
 			}
 			sector_num++; // Advance to next sector
 		}
+		read_ticks = osKernelGetTickCount() - read_ticks;
+		if (read_ticks)
+			read_throughput = (NUM_SECTORS_TO_READ*SD_BLK_SIZE*tick_freq)/read_ticks;
+		bus_clock = dev->clock; // May have stepped down after errors
 		// erase buffer
-		for (i=0; i<SD_BLK_SIZE; i++)
-			buffer[i] = 0;
+		Blk_Fill(buffer, 0, SD_BLK_SIZE);
 		// Load sample data into buffer
 		*(uint64_t *)(&buffer[0]) = 0xFEEDDC0D;
 		*(uint64_t *)(&buffer[508]) = 0xACE0FC0D;
 		// SD card write to sector_num
-		counter_before=idle_counter;
 		osDelay(tick_freq*1);
-		counter_after=idle_counter;
-		counter_before_write=idle_counter;
-		res = SD_Write(dev, (void *) buffer, sector_num);
-		counter_after_write=idle_counter;
+		CPU_Meter_Begin(&span);
+		res = SDS_Write(dev, buffer, sector_num);
+		CPU_Meter_End(&span, &cpu_write);
+		if (res == SD_OK) // A staged write reaches the card only here
+			res = SDS_Sync(dev);
 		if (res != SD_OK) { // Was write completed OK?
 			Error_Handler(); // Write error
 		} 
 		Control_RGB_LEDs(1, 0, 1); // Magenta: Write OK
-		// erase buffer
-		for (i=0; i<SD_BLK_SIZE; i++)
-			buffer[i] = 0;
-		// request SD card read to verify contents written correctly
-		res = SD_Read(dev, (void *)buffer, sector_num, 0, 512);	
+		// request SD card read to verify contents written correctly,
+		// summed as it arrives
+		res = SDS_Read_Check(dev, buffer, sector_num, BLK_CK_SUM, &sum);
 		if (res != SD_OK) { // Was verify read OK?
 			Error_Handler(); // Verify read error
 		} 
 		Control_RGB_LEDs(0, 0, 1); // Blue: Verify read OK
-		for (i = 0, sum = 0; i < SD_BLK_SIZE; i++)
-			sum += buffer[i];		// Compute checksum
 		if (sum != 0x0569) {
 			Error_Handler(); // Checksum error
 		} 
@@ -116,8 +300,11 @@ int main(void) {
 	Init_Debug_Signals();
 	Init_RGB_LEDs();
 	Control_RGB_LEDs(1,1,0);	// Yellow - starting up
+	CPU_Meter_Calibrate();                // Idle loop rate, before RTX takes SysTick
 
 	osKernelInitialize();                 // Initialize CMSIS-RTOS
+	CPU_Meter_Start();                    // Per-second availability samples
+	SD_Server_Init();                     // Thread owning the SD card
   Test_id=osThreadNew(Thread_Test_SD, NULL, NULL);
 	Makework_id=osThreadNew(Thread_Makework, NULL, NULL);// Create application main thread
   osKernelStart();                      // Start thread execution
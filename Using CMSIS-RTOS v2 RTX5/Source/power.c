@@ -0,0 +1,98 @@
+/*
+ * Idle-time power management for the RTX build
+ *
+ * The idle thread calls Power_Idle(). When the kernel has no work until a
+ * known timeout, the tick is suspended and the LPTMR (1 kHz LPO) wakes the
+ * core instead. The SPI interrupt used by SPI_RW in os_Wait mode ends the
+ * sleep early. The LPTMR is shared with SPI_Timer_*; while the driver is
+ * timing a command the idle thread only naps with the tick running.
+ */
+
+#include <MKL25Z4.h>
+#include "cmsis_os2.h"
+#include "power.h"
+
+static volatile DWORD __Power_Sleeps, __Power_Naps;
+static volatile uint64_t __Power_Asleep_us;
+
+// The wake interrupt only has to end WFI. Disable it but leave TCF set,
+// SPI_Timer_Status() and Power_Idle() both test the flag.
+void LPTMR0_IRQHandler(void) {
+    LPTMR0_CSR &= ~(LPTMR_CSR_TIE_MASK | LPTMR_CSR_TCF_MASK);
+}
+
+#ifdef POWER_TICKLESS
+static BOOL __Power_Sleep (DWORD ticks)
+{
+    DWORD freq = osKernelGetTickFreq();
+    DWORD ms, slept;
+
+    // osWaitForever when nothing is scheduled
+    if(ticks >= (POWER_MAX_SLEEP_MS * freq) / 1000)
+        ms = POWER_MAX_SLEEP_MS;
+    else
+        ms = (ticks * 1000) / freq;
+    if(ms < POWER_MIN_SLEEP_MS) {
+        osKernelResume(0);
+        return(FALSE);
+    }
+    SIM_SCGC5 |= SIM_SCGC5_LPTMR_MASK;
+    LPTMR0_CSR = 0;
+    LPTMR0_CMR = ms;
+    LPTMR0_PSR = LPTMR_PSR_PCS(1) | LPTMR_PSR_PBYP_MASK;
+    NVIC_ClearPendingIRQ(LPTMR0_IRQn);
+    NVIC_EnableIRQ(LPTMR0_IRQn);
+    // An interrupt pending from here on still ends WFI
+    __disable_irq();
+    LPTMR0_CSR = LPTMR_CSR_TEN_MASK | LPTMR_CSR_TIE_MASK;
+    __WFI();
+    if(LPTMR0_CSR & LPTMR_CSR_TCF_MASK) {
+        slept = ms;
+    } else {
+        // Woken early: the counter must be written before it can be read
+        LPTMR0_CNR = 0;
+        slept = LPTMR0_CNR;
+    }
+    LPTMR0_CSR = 0;
+    __enable_irq();
+    __Power_Sleeps++;
+    __Power_Asleep_us += slept * 1000UL;
+    slept = (slept * freq) / 1000;
+    osKernelResume((slept < ticks) ? slept : ticks);
+    return(TRUE);
+}
+#endif
+
+void Power_Idle(void)
+{
+    DWORD t0, t1;
+
+#ifdef POWER_TICKLESS
+    // LPTMR idle: no SD command is being timed
+    if(!(LPTMR0_CSR & LPTMR_CSR_TEN_MASK)) {
+        if(__Power_Sleep(osKernelSuspend()))
+            return;
+    }
+#endif
+    // Nap until the next interrupt, at the latest the kernel tick
+    __disable_irq();
+    t0 = osKernelGetSysTimerCount();
+    __WFI();
+    t1 = osKernelGetSysTimerCount();
+    __enable_irq();
+    __Power_Naps++;
+    __Power_Asleep_us += ((uint64_t)(t1 - t0) * 1000000UL) / osKernelGetSysTimerFreq();
+}
+
+void Power_Get_Stats(POWER_STATS *st)
+{
+    uint64_t total;
+
+    total = ((uint64_t)osKernelGetTickCount() * 1000000UL) / osKernelGetTickFreq();
+    __disable_irq();
+    st->sleeps = __Power_Sleeps;
+    st->naps = __Power_Naps;
+    st->asleep_us = __Power_Asleep_us;
+    __enable_irq();
+    st->awake_us = (total > st->asleep_us) ? (total - st->asleep_us) : 0;
+}
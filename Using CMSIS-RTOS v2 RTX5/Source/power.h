@@ -0,0 +1,31 @@
+#ifndef POWER_H
+#define POWER_H
+#include <integer.h>
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define POWER_IDLE_SLEEP            // Idle thread sleeps with WFI instead of spinning
+#define POWER_TICKLESS              // Stop the kernel tick while sleeping, wake on LPTMR
+#define POWER_MIN_SLEEP_MS  (2)     // Shorter idle periods keep the tick running
+#define POWER_MAX_SLEEP_MS  (1000)  // Longest LPTMR sleep (LPO, 1 ms per count)
+
+typedef struct {
+    DWORD sleeps;       // Tickless sleeps (tick stopped, LPTMR wake)
+    DWORD naps;         // WFI with the tick running
+    uint64_t asleep_us; // Time spent in WFI
+    uint64_t awake_us;  // Time spent running (threads, ISRs and the idle loop)
+} POWER_STATS;
+
+/**
+ \brief Sleep until the next interrupt or kernel timeout. Called by the idle thread.
+ */
+void Power_Idle(void);
+
+/**
+ \brief Snapshot of the sleep accounting (energy proxy).
+ \param st Filled with the counters and asleep/awake time since kernel start.
+ */
+void Power_Get_Stats(POWER_STATS *st);
+
+#endif // POWER_H
@@ -15,7 +15,9 @@
 #include "sd_io.h"
 #include <MKL25Z4.h>
 #include "debug.h"
+#include "blkutil.h"
 #include "cmsis_os2.h"
+#include "flash_io.h"
 
 /* Results of SD functions */
 char SD_Errors[7][8] = {
@@ -28,17 +30,14 @@ char SD_Errors[7][8] = {
     "NORESP"       /* 6: No response           */
 };
 
+/* Last command response and data token, kept for SD_Classify */
+static BYTE __SD_Last_R1;
+static BYTE __SD_Last_Token;
+
 /******************************************************************************
  Private Methods Prototypes - Direct work with SD card
 ******************************************************************************/
 
-/**
-    \brief Simple function to calculate power of two.
-    \param e Exponent.
-    \return Math function result.
-*/
-DWORD __SD_Power_Of_Two(BYTE e);
-
 /**
      \brief Assert the SD card (SPI CS low).
  */
@@ -63,25 +62,159 @@ void __SD_Speed_Transfer (BYTE throttle);
  */
 BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg);
 
+/**
+    \brief Read a register sent as a data block (CSD, CID, SCR, SD Status).
+    \param cmd CMD9, CMD10, ACMD51 or ACMD13.
+    \param buf Destination of the register.
+    \param len Register size in bytes.
+    \return TRUE if the register arrived.
+ */
+BOOL __SD_Read_Reg (BYTE cmd, BYTE *buf, BYTE len);
+
+/**
+    \brief Read SCR and SD Status from SD cards, then decode all registers
+           into dev->info.
+    \param dev Device descriptor, with CID and CSD already read.
+    \param ssr Receives the SD Status, SD_SSR_SIZE bytes.
+    \return SD_REG_SCR and SD_REG_SSR if read.
+ */
+BYTE __SD_Card_Info (SD_DEV *dev, BYTE *ssr);
+
+/**
+    \brief Decode the card registers into dev->info.
+    \param dev Device descriptor, with CID and CSD read.
+    \param ssr SD Status.
+    \param valid SD_REG_SCR and SD_REG_SSR if dev->scr and ssr hold them.
+ */
+void __SD_Info_Decode (SD_DEV *dev, const BYTE *ssr, BYTE valid);
+
 /**
     \brief Get the total numbers of sectors in SD card.
-    \param dev Device descriptor.
+    \param dev Device descriptor, with the CSD already read.
     \return Quantity of sectors. Zero if fail.
  */
 DWORD __SD_Sectors (SD_DEV *dev);
 
+/**
+    \brief Card address of a sector for SDHC and SDXC: the sector number.
+    \param sector Sector number.
+    \return Argument of the block commands.
+ */
+DWORD __SD_Addr_Block (DWORD sector);
+
+/**
+    \brief Card address of a sector for SDSC and MMC: the byte offset.
+    \param sector Sector number.
+    \return Argument of the block commands.
+ */
+DWORD __SD_Addr_Byte (DWORD sector);
+
+/**
+    \brief Card handshake from CMD0 to mount, on an SPI set up by SPI_Init.
+    \param dev Device descriptor.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Handshake (SD_DEV *dev);
+
+/**
+    \brief Read the card identity and registers and set the data clock. A
+           card matching the cached record takes its registers from there.
+    \param dev Device descriptor.
+    \return Quantity of sectors. Zero if fail.
+ */
+DWORD __SD_Identify (SD_DEV *dev);
+
+/**
+    \brief Take CSD, SCR and SD Status from the cached record if the CID and
+           OCR read at init are those of the cached card.
+    \param dev Device descriptor, with CID and OCR read.
+    \return TRUE on a match, dev->info is then decoded.
+ */
+BOOL __SD_Cache_Match (SD_DEV *dev);
+
+/**
+    \brief Store the registers of a freshly read card.
+    \param dev Device descriptor, with all registers read.
+    \param ssr SD Status.
+    \param valid SD_REG_SCR and SD_REG_SSR if read.
+ */
+void __SD_Cache_Refresh (SD_DEV *dev, const BYTE *ssr, BYTE valid);
+
+/**
+    \brief Wait for the end of a deferred write, if any.
+    \param dev Device descriptor.
+    \return SD_OK when ready, SD_BUSY if programming timed out.
+ */
+SDRESULTS __SD_Wait_Ready (SD_DEV *dev);
+
+/**
+    \brief Poll the card until it stops answering the idle value. Spins for
+           a window calibrated from past waits, then sleeps a tick per poll.
+    \param idle 0xFF while waiting for a token, 0x00 while busy.
+    \param ms Timeout in milliseconds.
+    \param ph Phase the latency is accounted to.
+    \return Last byte read, equal to idle on timeout.
+ */
+BYTE __SD_Poll (SD_DEV *dev, BYTE idle, WORD ms, SD_PHASE ph);
+
+/**
+    \brief Decode TRAN_SPEED, the max clock in default speed mode.
+    \param dev Device descriptor, with the CSD already read.
+    \return Max clock the card supports (Hz).
+ */
+DWORD __SD_Tran_Speed (SD_DEV *dev);
+
+/**
+    \brief Decode TRAN_SPEED and try to switch to high speed mode.
+    \param dev Device descriptor, with the CSD already read.
+    \return Max clock the card supports (Hz).
+ */
+DWORD __SD_Card_Clock (SD_DEV *dev);
+
+/**
+    \brief Run the data clock as fast as card, MCU and limit allow.
+    \param dev Device descriptor.
+ */
+void __SD_Set_Clock (SD_DEV *dev);
+
+#ifdef SD_IO_TRAILER
+/**
+    \brief Fill a sector trailer with the next sequence number and check value.
+    \param dev Device descriptor.
+    \param tr SD_TRAILER_SIZE bytes after the payload.
+    \param adler Adler-32 of the payload.
+    \param sector Sector the block is written to.
+ */
+void __SD_Tag_Build (SD_DEV *dev, BYTE *tr, DWORD adler, DWORD sector);
+
+/**
+    \brief Check a received sector trailer.
+    \param dev Device descriptor, last_seq is updated on success.
+    \param tr SD_TRAILER_SIZE bytes after the payload.
+    \param adler Adler-32 of the payload as received.
+    \param sector Sector the block was read from.
+    \return SD_OK, or SD_CORRUPT for a torn, misdirected or untagged block.
+ */
+SDRESULTS __SD_Tag_Verify (SD_DEV *dev, const BYTE *tr, DWORD adler, DWORD sector);
+
+/**
+    \brief Claim the next SD_IO_SEQ_RESERVE trailer sequences in the card
+           record, continuing from the highest number claimed before.
+    \param dev Device descriptor, seq and seq_limit are updated.
+ */
+void __SD_Seq_Claim (SD_DEV *dev);
+#endif
+
+/**
+    \brief Advance the trailer sequence after an accepted write.
+    \param dev Device descriptor.
+ */
+void __SD_Seq_Next (SD_DEV *dev);
+
 /******************************************************************************
  Private Methods - Direct work with SD card
 ******************************************************************************/
 
-DWORD __SD_Power_Of_Two(BYTE e)
-{
-    DWORD partial = 1;
-    BYTE idx;
-    for(idx=0; idx!=e; idx++) partial *= 2;
-    return(partial);
-}
-
 inline void __SD_Assert(void){
     SPI_CS_Low();
 }
@@ -107,11 +240,13 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
 					return (res);
     }
 
-    // Select the card
-    __SD_Deassert();
-    SPI_RW(0xFF);
-    __SD_Assert();
-    SPI_RW(0xFF);
+    // Select the card. CMD12 stops a CMD18 stream, the card stays selected.
+    if(cmd != CMD12) {
+        __SD_Deassert();
+        SPI_RW(0xFF);
+        __SD_Assert();
+        SPI_RW(0xFF);
+    }
 
     // Send complete command set
     SPI_RW(cmd);                        // Start and command index
@@ -127,6 +262,10 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
     if(cmd == CMD8) 
 			crc = 0x87;         // Valid CRC for CMD8(0x1AA)
     SPI_RW(crc);
+    // CMD12 goes out while the card still streams data: discard the
+    // stuff byte, or a data byte could pass for R1
+    if(cmd == CMD12)
+        SPI_RW(0xFF);
 
     // Receive command response
     // Wait for a valid response in timeout of 5 milliseconds
@@ -135,63 +274,450 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
         res = SPI_RW(0xFF);
     } while((res & 0x80)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
+    __SD_Last_R1 = res;
 		
     // Return with the response value
     return(res);
 }
 
-DWORD __SD_Sectors (SD_DEV *dev)
+BOOL __SD_Read_Reg (BYTE cmd, BYTE *buf, BYTE len)
 {
-    BYTE csd[16];
-    BYTE idx;
-    DWORD ss = 0;
-    WORD C_SIZE = 0;
-    BYTE C_SIZE_MULT = 0;
-    BYTE READ_BL_LEN = 0;
-    if(__SD_Send_Cmd(CMD9, 0)==0) 
-    {
-        // Wait for response
-        while (SPI_RW(0xFF) == 0xFF);
-        for (idx=0; idx!=16; idx++) 
-					csd[idx] = SPI_RW(0xFF);
-        // Dummy CRC
-        SPI_RW(0xFF);
+    BYTE idx, tkn;
+
+    if(__SD_Send_Cmd(cmd, 0) != 0) {
+        SPI_Release();
+        return(FALSE);
+    }
+    // ACMD13 answers R2, the second byte is more card status
+    if(cmd == ACMD13)
         SPI_RW(0xFF);
+    // Wait for the data token
+    SPI_Timer_On(100);
+    do {
+        tkn = SPI_RW(0xFF);
+    } while((tkn == 0xFF)&&(SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    if(tkn != 0xFE) {
         SPI_Release();
-        if(dev->cardtype & SDCT_SD1)
-        {
-            ss = csd[0];
-            // READ_BL_LEN[83:80]: max. read data block length
-            READ_BL_LEN = (csd[5] & 0x0F);
-            // C_SIZE [73:62]
-            C_SIZE = (csd[6] & 0x03);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[7]);
-            C_SIZE <<= 2;
-            C_SIZE |= ((csd[8] >> 6) & 0x03);
-            // C_SIZE_MULT [49:47]
-            C_SIZE_MULT = (csd[9] & 0x03);
-            C_SIZE_MULT <<= 1;
-            C_SIZE_MULT |= ((csd[10] >> 7) & 0x01);
+        return(FALSE);
+    }
+    for (idx=0; idx!=len; idx++) 
+        buf[idx] = SPI_RW(0xFF);
+    // Dummy CRC
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    SPI_Release();
+    return(TRUE);
+}
+
+DWORD __SD_Sectors (SD_DEV *dev)
+{
+    SD_CSD_INFO csd;
+
+    // The layout follows CSD_STRUCTURE, not the card type: SDSC cards of
+    // version 2 keep the version 1 CSD
+    return(SD_Reg_Csd(dev->csd, &csd) ? csd.sectors : 0);
+}
+
+DWORD __SD_Addr_Block (DWORD sector)
+{
+    return(sector);
+}
+
+DWORD __SD_Addr_Byte (DWORD sector)
+{
+    return(sector * SD_BLK_SIZE);
+}
+
+DWORD __SD_Identify (SD_DEV *dev)
+{
+    BYTE ssr[SD_SSR_SIZE], valid;
+
+    dev->warm = FALSE;
+    if(__SD_Read_Reg(CMD10, dev->cid, 16) == FALSE)
+        return(0);
+#ifdef SD_IO_FAST_INIT
+    // Same card as last boot? Then none of its registers can have changed:
+    // no CSD, SCR or SD Status read and no CMD6 probe.
+    if(__SD_Cache_Match(dev)) {
+        // CMD0 left the card in default speed mode, faster than SPI_MAX_FREQ
+        dev->card_clock = __SD_Tran_Speed(dev);
+        __SD_Set_Clock(dev);
+        return(__SD_Sectors(dev));
+    }
+#endif
+    if(__SD_Read_Reg(CMD9, dev->csd, 16) == FALSE)
+        return(0);
+    dev->card_clock = __SD_Card_Clock(dev);
+    __SD_Set_Clock(dev); // High speed transfer
+    valid = __SD_Card_Info(dev, ssr);
+    __SD_Cache_Refresh(dev, ssr, valid);
+    return(__SD_Sectors(dev));
+}
+
+// Byte sum of a record up to its check field
+static WORD __SD_Cache_Sum (const SD_CACHE *rec)
+{
+    return((WORD)Blk_Sum(rec, (WORD)((const BYTE *)&rec->check - (const BYTE *)rec)));
+}
+
+BOOL __SD_Cache_Match (SD_DEV *dev)
+{
+    SD_CACHE rec;
+
+    if(!SD_Cache_Load(&rec) || (rec.magic != SD_CACHE_MAGIC) || (rec.check != __SD_Cache_Sum(&rec)))
+        return(FALSE);
+    if((rec.cardtype != dev->cardtype) || !Blk_Equal(rec.cid, dev->cid, 16) || !Blk_Equal(rec.ocr, dev->ocr, 4))
+        return(FALSE);
+    Blk_Copy(dev->csd, rec.csd, 16);
+    Blk_Copy(dev->scr, rec.scr, SD_SCR_SIZE);
+    __SD_Info_Decode(dev, rec.ssr, rec.valid);
+    dev->warm = TRUE;
+    return(TRUE);
+}
+
+void __SD_Cache_Refresh (SD_DEV *dev, const BYTE *ssr, BYTE valid)
+{
+    SD_CACHE rec;
+    DWORD seq = dev->seq_limit;
+
+    // The claimed trailer sequences carry over to the new card's record
+    if(SD_Cache_Load(&rec) && (rec.magic == SD_CACHE_MAGIC) && (rec.check == __SD_Cache_Sum(&rec))
+       && (rec.seq > seq))
+        seq = rec.seq;
+    Blk_Fill(&rec, 0, sizeof(rec));
+    rec.magic = SD_CACHE_MAGIC;
+    rec.cardtype = dev->cardtype;
+    rec.valid = valid;
+    Blk_Copy(rec.cid, dev->cid, 16);
+    Blk_Copy(rec.csd, dev->csd, 16);
+    Blk_Copy(rec.ocr, dev->ocr, 4);
+    Blk_Copy(rec.scr, dev->scr, SD_SCR_SIZE);
+    Blk_Copy(rec.ssr, ssr, SD_SSR_SIZE);
+    rec.seq = seq;
+    rec.check = __SD_Cache_Sum(&rec);
+    SD_Cache_Store(&rec);
+}
+
+BYTE __SD_Card_Info (SD_DEV *dev, BYTE *ssr)
+{
+    BYTE valid = 0;
+
+    Blk_Fill(ssr, 0, SD_SSR_SIZE);
+    // Application commands of SD cards only
+    if(dev->cardtype & SDCT_SDC) {
+        if(__SD_Read_Reg(ACMD51, dev->scr, SD_SCR_SIZE))
+            valid |= SD_REG_SCR;
+        if(__SD_Read_Reg(ACMD13, ssr, SD_SSR_SIZE))
+            valid |= SD_REG_SSR;
+    }
+    __SD_Info_Decode(dev, ssr, valid);
+    return(valid);
+}
+
+void __SD_Info_Decode (SD_DEV *dev, const BYTE *ssr, BYTE valid)
+{
+    Blk_Fill(&dev->info, 0, sizeof(dev->info));
+    if(SD_Reg_Csd(dev->csd, &dev->info.csd))
+        dev->info.valid |= SD_REG_CSD;
+    SD_Reg_Cid(dev->cid, &dev->info.cid);
+    dev->info.valid |= SD_REG_CID;
+    if(valid & SD_REG_SCR) {
+        SD_Reg_Scr(dev->scr, &dev->info.scr);
+        dev->info.valid |= SD_REG_SCR;
+    }
+    if(valid & SD_REG_SSR) {
+        SD_Reg_Ssr(ssr, &dev->info.ssr);
+        dev->info.valid |= SD_REG_SSR;
+    }
+}
+
+DWORD __SD_Tran_Speed (SD_DEV *dev)
+{
+    // TRAN_SPEED [103:96]: time value x transfer rate unit
+    static const BYTE tv[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    static const DWORD unit[4] = {10000UL, 100000UL, 1000000UL, 10000000UL};
+
+    return(tv[(dev->csd[3] >> 3) & 0x0F] * unit[dev->csd[3] & 0x03]);
+}
+
+DWORD __SD_Card_Clock (SD_DEV *dev)
+{
+    DWORD hz;
+    BYTE sw[64];
+    BYTE idx, tkn;
+
+    hz = __SD_Tran_Speed(dev);
+#ifdef SD_IO_HIGH_SPEED
+    // Switch function needs SD v2 and command class 10 (CCC bit 10)
+    if((dev->cardtype & SDCT_SD2) && (dev->csd[4] & 0x40)) {
+        // Mode 1, group 1 function 1 (high speed), other groups unchanged
+        if(__SD_Send_Cmd(CMD6, 0x80FFFFF1) == 0) {
+            SPI_Timer_On(100);
+            do {
+                tkn = SPI_RW(0xFF);
+            } while((tkn == 0xFF)&&(SPI_Timer_Status()==TRUE));
+            SPI_Timer_Off();
+            if(tkn == 0xFE) {
+                // 512 bit switch status + CRC
+                for(idx = 0; idx != 64; idx++)
+                    sw[idx] = SPI_RW(0xFF);
+                SPI_RW(0xFF);
+                SPI_RW(0xFF);
+                // Function selected for group 1 [379:376]
+                if((sw[16] & 0x0F) == 1)
+                    hz = 50000000UL;
+            }
         }
-        else if(dev->cardtype & SDCT_SD2)
-        {
-						// READ_BL_LEN = 9;
-            // C_SIZE [69:48]
-            C_SIZE = (csd[7] & 0x3F);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[8] & 0xFF);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[9] & 0xFF);
-            C_SIZE_MULT = 8; // AD changed
+        SPI_Release();
+    }
+#endif
+    return(hz);
+}
+
+void __SD_Set_Clock (SD_DEV *dev)
+{
+    DWORD hz;
+
+    if(dev->clock_limit == 0)
+        dev->clock_limit = SD_IO_MAX_CLOCK;
+    hz = (dev->card_clock < dev->clock_limit) ? dev->card_clock : dev->clock_limit;
+    // Busy-wait transfers as at full speed, then the negotiated divider
+    SPI_Freq_High();
+    dev->clock = SPI_Freq_Set(hz);
+}
+
+#ifdef SD_IO_CACHE_FLASH
+/* Default record store: records appended to the reserved flash sector, which
+   is erased once they fill it. The last one written is current. */
+#define SD_CACHE_SLOT   ((sizeof(SD_CACHE) + 3) & ~3UL)
+#define SD_CACHE_SLOTS  (FLASH_SECTOR_SIZE / SD_CACHE_SLOT)
+
+static const SD_CACHE *__SD_Cache_Slot (BYTE i)
+{
+    return((const SD_CACHE *)(FLASH_STORE + i * SD_CACHE_SLOT));
+}
+
+__WEAK BOOL SD_Cache_Load (SD_CACHE *rec)
+{
+    BYTE i;
+
+    // Erased slots read 0xFFFF as magic
+    for(i = 0; (i != SD_CACHE_SLOTS) && (__SD_Cache_Slot(i)->magic != 0xFFFF); i++)
+        ;
+    if(i == 0)
+        return(FALSE);
+    Blk_Copy(rec, __SD_Cache_Slot(i - 1), sizeof(SD_CACHE));
+    return(TRUE);
+}
+
+__WEAK void SD_Cache_Store (const SD_CACHE *rec)
+{
+    BYTE i;
+
+    for(i = 0; (i != SD_CACHE_SLOTS) && (__SD_Cache_Slot(i)->magic != 0xFFFF); i++)
+        ;
+    if(i == SD_CACHE_SLOTS) {
+        if(!Flash_Erase(FLASH_STORE))
+            return;
+        i = 0;
+    }
+    Flash_Write(FLASH_STORE + i * SD_CACHE_SLOT, rec, sizeof(SD_CACHE));
+}
+#else
+/* Default record store: survives while the MCU stays powered */
+static SD_CACHE __SD_Cache;
+static BOOL __SD_Cache_Valid;
+
+__WEAK BOOL SD_Cache_Load (SD_CACHE *rec)
+{
+    if(!__SD_Cache_Valid)
+        return(FALSE);
+    *rec = __SD_Cache;
+    return(TRUE);
+}
+
+__WEAK void SD_Cache_Store (const SD_CACHE *rec)
+{
+    __SD_Cache = *rec;
+    __SD_Cache_Valid = TRUE;
+}
+#endif
+
+SDRESULTS __SD_Wait_Ready (SD_DEV *dev)
+{
+    DWORD ms, chunk;
+
+    if(dev->stream)
+        SD_Stream_Close(dev);
+    if(!dev->busy)
+        return(SD_OK);
+    // The card holds DO low while programming. Most of the time it has
+    // finished while the caller was preparing the next buffer, so the
+    // first poll already sees it released.
+    dev->busy = FALSE;
+    __SD_Assert();
+    if(SPI_RW(0xFF) != 0)
+        return(SD_OK);
+    ms = ((osKernelGetTickCount() - dev->busy_tick)*1000)/tick_freq;
+    ms = (ms < dev->busy_ms) ? dev->busy_ms - ms : 1;
+    // An erase limit can exceed what __SD_Poll times (WORD ms, and the
+    // system timer wraps after some 89 s), so wait chunk by chunk
+    do {
+        chunk = (ms > SD_IO_BUSY_CHUNK_MS) ? SD_IO_BUSY_CHUNK_MS : ms;
+        if(__SD_Poll(dev, 0x00, (WORD)chunk, SD_PH_READY) != 0)
+            return(SD_OK);
+        ms -= chunk;
+    } while(ms);
+    return(SD_BUSY);
+}
+
+BYTE __SD_Poll (SD_DEV *dev, BYTE idle, WORD ms, SD_PHASE ph)
+{
+    SD_WAIT_STATS *w = &dev->wait[ph];
+    uint32_t start, elapsed, per_us, spin, limit, nap, tick_us;
+    BOOL slept = FALSE;
+    BYTE d;
+
+    per_us = osKernelGetSysTimerFreq()/1000000;
+    // Spin about twice the usual latency of this phase, so short waits
+    // never pay a tick. Phases that are usually long sleep almost at once.
+    spin = 2*w->avg;
+    if((w->count == 0)||(spin < SD_IO_SPIN_MIN_US))
+        spin = SD_IO_SPIN_MIN_US;
+    if(spin > SD_IO_SPIN_MAX_US)
+        spin = (w->avg > SD_IO_SPIN_MAX_US) ? SD_IO_SPIN_MIN_US : SD_IO_SPIN_MAX_US;
+    spin *= per_us;
+    limit = (DWORD)ms*1000*per_us;
+    // Sleeps shorter than a tick wake on the PIT, so a card that programs
+    // in a few hundred us is not left waiting for the next tick
+    tick_us = 1000000UL/tick_freq;
+    nap = SD_IO_NAP_US;
+    start = osKernelGetSysTimerCount();
+    while((d = SPI_RW(0xFF)) == idle) {
+        elapsed = osKernelGetSysTimerCount() - start;
+        if(elapsed >= limit)
+            break;
+        if(elapsed >= spin) {
+            slept = TRUE;
+            if(nap < tick_us) {
+                SPI_Nap(nap);
+                nap *= 2;
+            } else {
+                osDelay(1);
+            }
         }
-        ss = (C_SIZE + 1);
-        ss *= __SD_Power_Of_Two(C_SIZE_MULT + 2);
-        ss *= __SD_Power_Of_Two(READ_BL_LEN);
-        // ss /= SD_BLK_SIZE; ?? Bug in original code?
+    }
+    elapsed = (osKernelGetSysTimerCount() - start)/per_us;
+    if((w->count == 0)||(elapsed < w->min))
+        w->min = elapsed;
+    if(elapsed > w->max)
+        w->max = elapsed;
+    w->avg = (w->count == 0) ? elapsed : w->avg - (w->avg >> 3) + (elapsed >> 3);
+    w->total += elapsed;
+    w->count++;
+    w->sleeps += slept;
+    return(d);
+}
+
+#ifdef SD_IO_TRAILER
+static void __SD_Put32 (BYTE *p, DWORD v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+static DWORD __SD_Get32 (const BYTE *p)
+{
+    return((DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24));
+}
+
+// Continue the payload Adler-32 over sequence number and sector, so a block
+// that landed at the wrong address fails the check too
+static DWORD __SD_Tag_Check (DWORD adler, DWORD seq, DWORD sector)
+{
+    BYTE b[8];
+
+    __SD_Put32(&b[0], seq);
+    __SD_Put32(&b[4], sector);
+    return(Blk_Adler32(adler, b, 8));
+}
+
+void __SD_Tag_Build (SD_DEV *dev, BYTE *tr, DWORD adler, DWORD sector)
+{
+    __SD_Put32(&tr[0], dev->seq);
+    __SD_Put32(&tr[4], __SD_Tag_Check(adler, dev->seq, sector));
+}
+
+SDRESULTS __SD_Tag_Verify (SD_DEV *dev, const BYTE *tr, DWORD adler, DWORD sector)
+{
+    DWORD seq = __SD_Get32(&tr[0]);
+
+    if(__SD_Get32(&tr[4]) != __SD_Tag_Check(adler, seq, sector))
+        return(SD_CORRUPT);
+    dev->last_seq = seq;
+    return(SD_OK);
+}
+
+// The sequence lives in RAM, so a reset would start it over and reuse
+// numbers already on the card. The record holds the end of the claimed
+// range instead: one record write per SD_IO_SEQ_RESERVE writes, and a
+// boot continues past every number it may have handed out.
+void __SD_Seq_Claim (SD_DEV *dev)
+{
+    SD_CACHE rec;
+
+    if(!SD_Cache_Load(&rec) || (rec.magic != SD_CACHE_MAGIC) || (rec.check != __SD_Cache_Sum(&rec))) {
+        // No record to keep the range in: claim in RAM only
+        dev->seq_limit = dev->seq + SD_IO_SEQ_RESERVE;
+        return;
+    }
+    // Remount within the range claimed by this boot: nothing to write
+    if((rec.seq == dev->seq_limit) && (dev->seq < dev->seq_limit))
+        return;
+    if(dev->seq < rec.seq)
+        dev->seq = rec.seq;
+    rec.seq = dev->seq + SD_IO_SEQ_RESERVE;
+    rec.check = __SD_Cache_Sum(&rec);
+    SD_Cache_Store(&rec);
+    dev->seq_limit = rec.seq;
+}
+
+// Payload with its Adler-32 folded in on the fly, then the trailer
+static void __SD_Send_Tagged (SD_DEV *dev, BYTE *dat, const BYTE *ks, DWORD sector)
+{
+    __SD_Tag_Build(dev, &dat[SD_PAYLOAD_SIZE], SPI_Write_Adler(dat, ks, SD_PAYLOAD_SIZE, 1), sector);
+    SPI_Write_Xor(&dat[SD_PAYLOAD_SIZE], ks ? &ks[SD_PAYLOAD_SIZE] : NULL, SD_TRAILER_SIZE);
+}
+
+// Whole block and CRC, checked against the trailer without a second pass
+static SDRESULTS __SD_Recv_Tagged (SD_DEV *dev, BYTE *dat, const BYTE *ks, DWORD sector)
+{
+    DWORD adler = SPI_Read_Check(dat, ks, SD_PAYLOAD_SIZE, BLK_CK_ADLER32, 1);
 
-        return (ss);
-    } else return (0); // Error
+    SPI_Read_Xor(&dat[SD_PAYLOAD_SIZE], ks ? &ks[SD_PAYLOAD_SIZE] : NULL, SD_TRAILER_SIZE);
+    SPI_Skip(2);
+    return(__SD_Tag_Verify(dev, &dat[SD_PAYLOAD_SIZE], adler, sector));
+}
+#endif
+
+void __SD_Seq_Next (SD_DEV *dev)
+{
+    dev->seq++;
+#ifdef SD_IO_TRAILER
+    if(dev->seq == dev->seq_limit)
+        __SD_Seq_Claim(dev);
+#endif
+}
+
+// Keystream of a whole sector, NULL without a key
+static const BYTE *__SD_Crypt_Stream (SD_DEV *dev, DWORD sector)
+{
+    if(!dev->crypt)
+        return(NULL);
+    return(Blk_Crypt_Stream(dev->crypt, sector, 0, SD_BLK_SIZE));
 }
 
 /******************************************************************************
@@ -199,18 +725,24 @@ DWORD __SD_Sectors (SD_DEV *dev)
 ******************************************************************************/
 
 SDRESULTS SD_Init(SD_DEV *dev)
+{
+    // Initialize SPI for use with the memory card
+    SPI_Init();
+    return(__SD_Handshake(dev));
+}
+
+SDRESULTS __SD_Handshake(SD_DEV *dev)
 {
     BYTE n, cmd, ct, ocr[4];
     BYTE idx;
     BYTE init_trys;
+    DWORD sectors;
 		uint32_t previous_tick,current_tick;
 		PTB->PSOR=MASK(DBG_5);
     ct = 0;
+    dev->stream = FALSE;    // The reset ends a multiple block write
     for(init_trys=0; ((init_trys!=SD_INIT_TRYS)&&(!ct)); init_trys++)
     {
-        // Initialize SPI for use with the memory card
-        SPI_Init();
-
         SPI_CS_High();
         SPI_Freq_Low();
 
@@ -218,7 +750,12 @@ SDRESULTS SD_Init(SD_DEV *dev)
         for(idx = 0; idx != 10; idx++) 
 					SPI_RW(0xFF);
 				PTB->PTOR=MASK(DBG_5);
+#ifdef SD_IO_FAST_INIT
+				// Only the minimum settle time, CMD0 below polls for readiness
+				osDelay((tick_freq*SD_IO_POWERUP_WAIT + 999)/1000);
+#else
 				osDelay((tick_freq/2));
+#endif
 				PTB->PTOR=MASK(DBG_5);
         /*SPI_Timer_On(500);
         while(SPI_Timer_Status()==TRUE) {
@@ -229,9 +766,11 @@ SDRESULTS SD_Init(SD_DEV *dev)
         SPI_Timer_Off();*/
 
         dev->mount = FALSE;
+        for (n = 0; n < 4; n++)
+            dev->ocr[n] = 0;
         //SPI_Timer_On(500);
-				previous_tick=osKernelGetTickCount();
-        while ((__SD_Send_Cmd(CMD0, 0) != 1)&& ((current_tick-previous_tick)!=(tick_freq/2))) {
+				current_tick=previous_tick=osKernelGetTickCount();
+        while ((__SD_Send_Cmd(CMD0, 0) != 1)&& ((current_tick-previous_tick)<(tick_freq/2))) {
 					current_tick=osKernelGetTickCount();
 					PTB->PTOR=MASK(DBG_5);
 					//PTB->PTOR=MASK(DBG_5);
@@ -250,8 +789,8 @@ SDRESULTS SD_Init(SD_DEV *dev)
                 {
                     // Wait for leaving idle state (ACMD41 with HCS bit)...
                     //SPI_Timer_On(1000);
-										previous_tick=osKernelGetTickCount();
-                    while (((current_tick-previous_tick)!=(tick_freq*1))&& (__SD_Send_Cmd(ACMD41, 1UL << 30))) {
+										current_tick=previous_tick=osKernelGetTickCount();
+                    while (((current_tick-previous_tick)<(tick_freq*1))&& (__SD_Send_Cmd(ACMD41, 1UL << 30))) {
 											current_tick=osKernelGetTickCount();
 											PTB->PTOR=MASK(DBG_5);
 											//PTB->PTOR=MASK(DBG_5);
@@ -259,11 +798,10 @@ SDRESULTS SD_Init(SD_DEV *dev)
 										PTB->PSOR=MASK(DBG_5);
                     //SPI_Timer_Off(); 
                     // CCS in the OCR? 
-										// AGD: Delete SPI_Timer_Status call?
-                    if ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(CMD58, 0) == 0))
+                    if (((current_tick-previous_tick)<(tick_freq*1))&&(__SD_Send_Cmd(CMD58, 0) == 0))
                     {
                         for (n = 0; n < 4; n++) 
-													ocr[n] = SPI_RW(0xFF);
+													dev->ocr[n] = ocr[n] = SPI_RW(0xFF);
                         // SD version 2?
                         ct = (ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
                     }
@@ -282,15 +820,15 @@ SDRESULTS SD_Init(SD_DEV *dev)
                 }
                 // Wait for leaving idle state
                 //SPI_Timer_On(250);
-								previous_tick=osKernelGetTickCount();
-                while(((current_tick-previous_tick)!=(tick_freq/4))&&(__SD_Send_Cmd(cmd, 0))) {
+								current_tick=previous_tick=osKernelGetTickCount();
+                while(((current_tick-previous_tick)<(tick_freq/4))&&(__SD_Send_Cmd(cmd, 0))) {
 									current_tick=osKernelGetTickCount();
 									PTB->PTOR=MASK(DBG_5);
 									//PTB->PTOR=MASK(DBG_5);
 								}
 								PTB->PSOR=MASK(DBG_5);
                 //SPI_Timer_Off();
-                if(SPI_Timer_Status()==FALSE) 
+                if((current_tick-previous_tick)>=(tick_freq/4)) 
 									ct = 0;
                 if(__SD_Send_Cmd(CMD59, 0))   
 									ct = 0;   // Deactivate CRC check (default)
@@ -301,110 +839,176 @@ SDRESULTS SD_Init(SD_DEV *dev)
     }
     if(ct) {
         dev->cardtype = ct;
-        dev->mount = TRUE;
-        dev->last_sector = __SD_Sectors(dev) - 1;
+        dev->addr = (ct & SDCT_BLOCK) ? __SD_Addr_Block : __SD_Addr_Byte;
+        dev->busy = FALSE;
         dev->debug.read = 0;
         dev->debug.write = 0;
-        __SD_Speed_Transfer(HIGH); // High speed transfer
+        sectors = __SD_Identify(dev);
+        if(sectors == 0)
+            ct = 0; // No usable identity, do not mount
+        dev->last_sector = sectors - 1;
+        dev->mount = ct ? TRUE : FALSE;
+#ifdef SD_IO_TRAILER
+        if(ct)
+            __SD_Seq_Claim(dev);
+#endif
     }
     SPI_Release();
 		PTB->PCOR=MASK(DBG_5);
     return (ct ? SD_OK : SD_NOINIT);
 }
 
-#pragma push
-#pragma diag_suppress 1441
 SDRESULTS SD_Read(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
+{
+    SD_RANGE rng;
+
+    rng.dat = dat;
+    rng.ofs = ofs;
+    rng.cnt = cnt;
+    return(SD_Read_Ranges(dev, sector, &rng, 1));
+}
+
+SDRESULTS SD_Read_Ranges(SD_DEV *dev, DWORD sector, const SD_RANGE *rng, BYTE n)
 {
     SDRESULTS res;
-    BYTE tkn, data;
+    BYTE tkn, r;
     WORD byte_num;
-		uint32_t previous_tick,current_tick; 
+    const BYTE *ks;
 		
 		PTB->PSOR=MASK(DBG_2);
     res = SD_ERROR;
-    if ((sector > dev->last_sector)||(cnt == 0)) 
+    if ((sector > dev->last_sector)||(n == 0)||(n > SD_IO_MAX_RANGES)) 
 			return(SD_PARERR);
-    // Convert sector number to byte address (sector * SD_BLK_SIZE)
-//    if (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE) == 0) { // Only for SDSC
-      if (__SD_Send_Cmd(CMD17, sector ) == 0) { // Only for SDHC or SDXC
-			//SPI_Timer_On(100);  // Wait for data packet (timeout of 100ms)
-			previous_tick=osKernelGetTickCount();
-				do {
-						PTB->PTOR=MASK(DBG_2);
-						osDelay(1);
-						PTB->PTOR=MASK(DBG_2);
-            tkn = SPI_RW(0xFF);
-						//PTB->PTOR=MASK(DBG_2);
-						current_tick=osKernelGetTickCount();
-        } while((tkn==0xFF)&& ((current_tick-previous_tick)!=(tick_freq/10)));
+    // Windows must be non-empty, ascending and inside the block
+    for (r = 0, byte_num = 0; r < n; r++) {
+        if ((rng[r].cnt == 0)||(rng[r].ofs < byte_num)||(rng[r].ofs + rng[r].cnt > SD_BLK_SIZE))
+            return(SD_PARERR);
+        byte_num = rng[r].ofs + rng[r].cnt;
+    }
+    res = __SD_Wait_Ready(dev);
+    if (res != SD_OK)
+        return(res);
+    res = SD_ERROR;
+      if (__SD_Send_Cmd(CMD17, dev->addr(sector)) == 0) {
+			// Keystream while the card looks the block up
+			ks = __SD_Crypt_Stream(dev, sector);
+			// Wait for data packet (timeout of 100ms)
+			tkn = __SD_Poll(dev, 0xFF, 100, SD_PH_TOKEN);
 				PTB->PSOR=MASK(DBG_2);
-        //SPI_Timer_Off();
+        __SD_Last_Token = tkn;
         // Token of single block?
         if(tkn==0xFE) { 
-					// AGD: Loop fusion to simplify FSM formation
-					byte_num = 0;
-          do {
-						data = SPI_RW(0xff);
-						if ((byte_num >= ofs) && (byte_num < ofs+cnt)) {
-               *(BYTE*)dat = data;
-               ((BYTE *) dat)++;
-						} // else discard bytes before and after data
+#ifdef SD_IO_TRAILER
+					// A whole block is checked against its trailer as it streams in
+					if ((n == 1)&&(rng[0].ofs == 0)&&(rng[0].cnt == SD_BLK_SIZE)) {
+						res = __SD_Recv_Tagged(dev, (BYTE *)rng[0].dat, ks, sector);
+					} else
+#endif
+					{
+					// Discard the gap ahead of each window and copy the window
+					// itself, so no byte needs an offset compare.
+					for (r = 0, byte_num = 0; r < n; r++) {
+						SPI_Skip(rng[r].ofs - byte_num);
+						SPI_Read_Xor((BYTE *)rng[r].dat, ks ? &ks[rng[r].ofs] : NULL, rng[r].cnt);
+						byte_num = rng[r].ofs + rng[r].cnt;
 						PTB->PTOR=MASK(DBG_2);
-          } while(++byte_num < SD_BLK_SIZE + 2 ); // 512 byte block + 2 byte CRC
+					}
+					// Rest of the 512 byte block + 2 byte CRC
+					SPI_Skip(SD_BLK_SIZE + 2 - byte_num);
+					res = SD_OK;
+					}
 					PTB->PSOR=MASK(DBG_2);
-          res = SD_OK;
         }
     }
     SPI_Release();
     dev->debug.read++;
+    dev->errors.ops++;
 		PTB->PCOR=MASK(DBG_2);
     return(res);
 }
-#pragma pop
+
+SDRESULTS SD_Read_Check(SD_DEV *dev, void *dat, DWORD sector, BYTE kind, DWORD *ck)
+{
+    SDRESULTS res;
+    BYTE tkn;
+    const BYTE *ks;
+
+    if(sector > dev->last_sector)
+        return(SD_PARERR);
+    res = __SD_Wait_Ready(dev);
+    if(res != SD_OK)
+        return(res);
+    res = SD_ERROR;
+    PTB->PSOR=MASK(DBG_2);
+    if(__SD_Send_Cmd(CMD17, dev->addr(sector)) == 0) {
+        ks = __SD_Crypt_Stream(dev, sector);
+        tkn = __SD_Poll(dev, 0xFF, 100, SD_PH_TOKEN);
+        __SD_Last_Token = tkn;
+        if(tkn == 0xFE) {
+            // Fold the check into the receive loop, no second pass
+            *ck = SPI_Read_Check((BYTE *)dat, ks, SD_BLK_SIZE, kind, Blk_Check_Init(kind));
+            // Dummy CRC
+            SPI_Skip(2);
+            res = SD_OK;
+        }
+    }
+    SPI_Release();
+    dev->debug.read++;
+    dev->errors.ops++;
+    PTB->PCOR=MASK(DBG_2);
+    return(res);
+}
 
 SDRESULTS SD_Write(SD_DEV *dev, void *dat, DWORD sector)
 {
-    WORD idx;
     BYTE line;
-		uint32_t previous_tick,current_tick;
+    const BYTE *ks;
 		
 		PTB->PSOR=MASK(DBG_3);
 		// Query invalid?
     if(sector > dev->last_sector) {
 			return(SD_PARERR);
 		}
+		// Keystream while the card may still program the last write
+		ks = __SD_Crypt_Stream(dev, sector);
+		if(__SD_Wait_Ready(dev) != SD_OK) {
+			return(SD_BUSY);
+		}
 
-    // Convert sector number to bytes address (sector * SD_BLK_SIZE)
-		//    if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)==0) { // Only for SDSC
-		if(__SD_Send_Cmd(CMD24, sector)==0) { // Only for SDHC or SDXC   
+		if(__SD_Send_Cmd(CMD24, dev->addr(sector))==0) {
 			// Send token (single block write)
 			SPI_RW(0xFE);
 			// Send block data
-			for(idx=0; idx!=SD_BLK_SIZE; idx++) 
-				SPI_RW(*((BYTE*)dat + idx));
+#ifdef SD_IO_TRAILER
+			__SD_Send_Tagged(dev, (BYTE *)dat, ks, sector);
+#else
+			SPI_Write_Xor((BYTE *)dat, ks, SD_BLK_SIZE);
+#endif
 			/* Dummy CRC */
 			SPI_RW(0xFF);
 			SPI_RW(0xFF);
 			// If not accepted, returns the reject error
-			if((SPI_RW(0xFF) & 0x1F) != 0x05) {
+			__SD_Last_Token = SPI_RW(0xFF) & 0x1F;
+			if(__SD_Last_Token != 0x05) {
 				return(SD_REJECT);
 			}
-			
+			__SD_Seq_Next(dev);
+#ifdef SD_IO_WRITE_DEFER_BUSY
+			// Let the card program in the background, the next command
+			// (or SD_Sync) picks up the busy state
+			dev->busy = TRUE;
+			dev->busy_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+			dev->busy_tick = osKernelGetTickCount();
+			dev->debug.write++;
+			dev->errors.ops++;
+			PTB->PCOR=MASK(DBG_3);
+			return(SD_OK);
+#else
 			// Waits until finish of data programming with a timeout
-			//SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
-			previous_tick=osKernelGetTickCount();
-			do {
-					PTB->PTOR=MASK(DBG_3);
-					osDelay(1);
-					PTB->PTOR=MASK(DBG_3);
-					line = SPI_RW(0xFF);
-					//PTB->PTOR=MASK(DBG_3);
-					current_tick=osKernelGetTickCount();
-			} while((line==0)&&((current_tick-previous_tick)!=(tick_freq/4)));
+			line = __SD_Poll(dev, 0x00, SD_IO_WRITE_TIMEOUT_WAIT, SD_PH_BUSY);
 			PTB->PSOR=MASK(DBG_3);
-			//SPI_Timer_Off();
 			dev->debug.write++;
+			dev->errors.ops++;
 
 			if(line==0) {
 				return(SD_BUSY);
@@ -412,12 +1016,369 @@ SDRESULTS SD_Write(SD_DEV *dev, void *dat, DWORD sector)
 				PTB->PCOR=MASK(DBG_3);
 				return(SD_OK);	
 			}
+#endif
 		}
     else {
 			return(SD_ERROR);
 		}
 }
 
+SDRESULTS SD_Read_Multi(SD_DEV *dev, BYTE * const *dat, DWORD sector, BYTE n)
+{
+    SDRESULTS res;
+    BYTE idx, tkn;
+    const BYTE *ks;
+
+    if((n == 0)||(sector > dev->last_sector)||(n - 1 > dev->last_sector - sector))
+        return(SD_PARERR);
+    res = __SD_Wait_Ready(dev);
+    if(res != SD_OK)
+        return(res);
+    res = SD_ERROR;
+    PTB->PSOR=MASK(DBG_2);
+    if(__SD_Send_Cmd(CMD18, dev->addr(sector)) == 0) {
+        for(idx = 0; idx != n; idx++) {
+            ks = __SD_Crypt_Stream(dev, sector + idx);
+            tkn = __SD_Poll(dev, 0xFF, 100, SD_PH_TOKEN);
+            __SD_Last_Token = tkn;
+            if(tkn != 0xFE)
+                break;
+#ifdef SD_IO_TRAILER
+            if(__SD_Recv_Tagged(dev, dat[idx], ks, sector + idx) != SD_OK) {
+                res = SD_CORRUPT;
+                break;
+            }
+#else
+            SPI_Read_Xor(dat[idx], ks, SD_BLK_SIZE);
+            // Dummy CRC
+            SPI_Skip(2);
+#endif
+            dev->debug.read++;
+            dev->errors.ops++;
+            PTB->PTOR=MASK(DBG_2);
+        }
+        // Stop the stream, R1b: the card may stay busy after R1
+        if(__SD_Send_Cmd(CMD12, 0) != 0)
+            res = SD_ERROR;
+        else if(__SD_Poll(dev, 0x00, 100, SD_PH_BUSY) == 0x00)
+            res = SD_BUSY;
+        else if(idx == n)
+            res = SD_OK;
+    }
+    SPI_Release();
+    PTB->PCOR=MASK(DBG_2);
+    return(res);
+}
+
+// Data blocks of an open CMD25 from sector on, ks the keystream of the
+// first, ms the busy limit of the first. Each is programmed before the next
+// may follow.
+static SDRESULTS __SD_Send_Blocks(SD_DEV *dev, BYTE * const *dat, DWORD sector, BYTE n, const BYTE *ks, WORD ms)
+{
+    BYTE idx;
+
+    for(idx = 0; idx != n; idx++) {
+        // Token of multiple block write
+        SPI_RW(0xFC);
+#ifdef SD_IO_TRAILER
+        __SD_Send_Tagged(dev, dat[idx], ks, sector + idx);
+#else
+        SPI_Write_Xor(dat[idx], ks, SD_BLK_SIZE);
+#endif
+        /* Dummy CRC */
+        SPI_RW(0xFF);
+        SPI_RW(0xFF);
+        __SD_Last_Token = SPI_RW(0xFF) & 0x1F;
+        if(__SD_Last_Token != 0x05)
+            return(SD_REJECT);
+        __SD_Seq_Next(dev);
+        // Keystream of the next block while this one programs
+        if(idx + 1 != n)
+            ks = __SD_Crypt_Stream(dev, sector + idx + 1);
+        if(__SD_Poll(dev, 0x00, ms, SD_PH_BUSY) == 0)
+            return(SD_BUSY);
+        ms = SD_IO_WRITE_TIMEOUT_WAIT;
+        dev->debug.write++;
+        dev->errors.ops++;
+        PTB->PTOR=MASK(DBG_3);
+    }
+    return(SD_OK);
+}
+
+// Stop token of a CMD25, the card then programs the last block
+static SDRESULTS __SD_Stop_Write(SD_DEV *dev, SDRESULTS res)
+{
+    SPI_RW(0xFD);
+    SPI_RW(0xFF);
+#ifdef SD_IO_WRITE_DEFER_BUSY
+    dev->busy = TRUE;
+    dev->busy_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+    dev->busy_tick = osKernelGetTickCount();
+#else
+    if((__SD_Poll(dev, 0x00, SD_IO_WRITE_TIMEOUT_WAIT, SD_PH_BUSY) == 0) && (res == SD_OK))
+        res = SD_BUSY;
+#endif
+    return(res);
+}
+
+SDRESULTS SD_Write_Multi(SD_DEV *dev, BYTE * const *dat, DWORD sector, BYTE n)
+{
+    SDRESULTS res;
+    const BYTE *ks;
+
+    if((n == 0)||(sector > dev->last_sector)||(n - 1 > dev->last_sector - sector))
+        return(SD_PARERR);
+    ks = __SD_Crypt_Stream(dev, sector);
+    if(__SD_Wait_Ready(dev) != SD_OK)
+        return(SD_BUSY);
+    PTB->PSOR=MASK(DBG_3);
+    if(__SD_Send_Cmd(CMD25, dev->addr(sector)) != 0) {
+        PTB->PCOR=MASK(DBG_3);
+        return(SD_ERROR);
+    }
+    res = __SD_Send_Blocks(dev, dat, sector, n, ks, SD_IO_WRITE_TIMEOUT_WAIT);
+    res = __SD_Stop_Write(dev, res);
+    PTB->PCOR=MASK(DBG_3);
+    return(res);
+}
+
+SDRESULTS SD_Stream_Open(SD_DEV *dev, DWORD sector, DWORD erase)
+{
+    DWORD ms = SD_IO_WRITE_TIMEOUT_WAIT;
+
+    if(sector > dev->last_sector)
+        return(SD_PARERR);
+    // Closes a stream still open
+    if(__SD_Wait_Ready(dev) != SD_OK)
+        return(SD_BUSY);
+    if(erase > dev->last_sector - sector + 1)
+        erase = dev->last_sector - sector + 1;
+    // ACMD23 takes 23 bits and applies to the next CMD25 only. A card that
+    // refuses it just writes without the pre-erase.
+    if((erase != 0) && (dev->cardtype & SDCT_SDC)) {
+        if(erase > 0x7FFFFF)
+            erase = 0x7FFFFF;
+        if(__SD_Send_Cmd(ACMD23, erase) == 0) {
+            // The card may erase them all before it programs the first block
+            ms += SD_Reg_Erase_Ms(&dev->info.ssr, erase);
+            if(ms > 0xFFFF)
+                ms = 0xFFFF;
+        }
+    }
+    if(__SD_Send_Cmd(CMD25, dev->addr(sector)) != 0) {
+        SPI_Release();
+        return(SD_ERROR);
+    }
+    dev->stream = TRUE;
+    dev->stream_next = sector;
+    dev->stream_ms = (WORD)ms;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Stream_Write(SD_DEV *dev, BYTE * const *dat, BYTE n)
+{
+    SDRESULTS res;
+
+    if(!dev->stream || (n == 0) || (n - 1 > dev->last_sector - dev->stream_next))
+        return(SD_PARERR);
+    PTB->PSOR=MASK(DBG_3);
+    res = __SD_Send_Blocks(dev, dat, dev->stream_next, n, __SD_Crypt_Stream(dev, dev->stream_next), dev->stream_ms);
+    if(res == SD_OK) {
+        dev->stream_next += n;
+        dev->stream_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+    } else {
+        dev->stream = FALSE;
+        __SD_Stop_Write(dev, res);
+    }
+    PTB->PCOR=MASK(DBG_3);
+    return(res);
+}
+
+SDRESULTS SD_Stream_Close(SD_DEV *dev)
+{
+    if(!dev->stream)
+        return(SD_OK);
+    dev->stream = FALSE;
+    return(__SD_Stop_Write(dev, SD_OK));
+}
+
+SDRESULTS SD_Erase(SD_DEV *dev, DWORD first, DWORD last)
+{
+    SDRESULTS res;
+    DWORD ms;
+
+    if((first > last)||(last > dev->last_sector))
+        return(SD_PARERR);
+    // CSD CCC class 5 (erase), bit 1 of CSD byte 4
+    if(!(dev->csd[4] & 0x02))
+        return(SD_REJECT);
+    res = __SD_Wait_Ready(dev);
+    if(res != SD_OK)
+        return(res);
+    if((__SD_Send_Cmd(CMD32, dev->addr(first)) != 0)||(__SD_Send_Cmd(CMD33, dev->addr(last)) != 0)
+            ||(__SD_Send_Cmd(CMD38, 0) != 0)) {
+        SPI_Release();
+        return(SD_ERROR);
+    }
+    // R1b: the card erases in the background, the next command
+    // (or SD_Sync) picks up the busy state
+    dev->busy = TRUE;
+    // The SD Status tells how long the AUs of the range may take
+    ms = SD_Reg_Erase_Ms(&dev->info.ssr, last - first + 1);
+    if(ms < SD_IO_ERASE_TIMEOUT_WAIT)
+        ms = SD_IO_ERASE_TIMEOUT_WAIT;
+    dev->busy_ms = ms;
+    dev->busy_tick = osKernelGetTickCount();
+    return(SD_OK);
+}
+
+SDRESULTS SD_Sync(SD_DEV *dev)
+{
+    SDRESULTS res;
+
+    res = __SD_Wait_Ready(dev);
+    SPI_Release();
+    return(res);
+}
+
+void SD_Set_Crypt(SD_DEV *dev, BLK_CRYPT *crypt)
+{
+    dev->crypt = crypt;
+}
+
+SDRESULTS SD_Get_Status(SD_DEV *dev, WORD *st)
+{
+    BYTE r1;
+
+    r1 = __SD_Send_Cmd(CMD13, 0);
+    if(r1 & 0x80) {
+        SPI_Release();
+        return(SD_NORESPONSE);
+    }
+    // R2: R1 followed by a second status byte
+    *st = ((WORD)r1 << 8) | SPI_RW(0xFF);
+    dev->status = *st;
+    SPI_Release();
+    return(SD_OK);
+}
+
+SD_ERRCLASS SD_Classify(SD_DEV *dev, SDRESULTS res)
+{
+    BYTE r1, r2, tkn;
+    WORD st;
+    DWORD idx;
+    SD_ERRCLASS ec;
+
+    if(res == SD_OK)
+        return(SD_EC_NONE);
+    // Keep the failing command's response, SEND_STATUS overwrites it
+    r1 = __SD_Last_R1;
+    tkn = __SD_Last_Token;
+    if(res == SD_PARERR) {
+        ec = SD_EC_ADDRESS;
+    } else if(res == SD_CORRUPT) {
+        // The card reported success, treat as a transfer error worth a re-read
+        ec = SD_EC_CRC;
+    } else if(SD_Get_Status(dev, &st) != SD_OK) {
+        ec = SD_EC_TIMEOUT;
+    } else if((st >> 8) & R1_IDLE) {
+        ec = SD_EC_RESET;
+    } else if((res == SD_NOINIT)||(res == SD_NORESPONSE)||(r1 & 0x80)) {
+        ec = SD_EC_TIMEOUT;
+    } else if(res == SD_REJECT) {
+        // Data response token: 0x0B CRC error, 0x0D write error
+        ec = (tkn == 0x0B) ? SD_EC_CRC : SD_EC_CARD;
+    } else {
+        // Error bits of the failed command and the sticky status bits
+        r1 |= (BYTE)(st >> 8);
+        r2 = (BYTE)st;
+        if(r1 & R1_CRC_ERR)
+            ec = SD_EC_CRC;
+        else if((r1 & (R1_ADDRESS_ERR|R1_PARAM_ERR))||(r2 & (R2_OUT_OF_RANGE|R2_WP_VIOLATION)))
+            ec = SD_EC_ADDRESS;
+        else if((r1 & (R1_ERASE_RESET|R1_ERASE_SEQ))||(r2 & (R2_ERASE_PARAM|R2_LOCK_FAILED)))
+            ec = SD_EC_ERASE;
+        else if(r2 & (R2_ERROR|R2_CC_ERROR|R2_ECC_FAILED))
+            ec = SD_EC_CARD;
+        else if((res == SD_ERROR)&&(tkn != 0xFF)&&(tkn != 0xFE))
+            // Data error token: out of range, card ECC, CC error or error
+            ec = (tkn & 0x08) ? SD_EC_ADDRESS : SD_EC_CARD;
+        else
+            // No data token in time or busy timeout, card state unknown
+            ec = SD_EC_TIMEOUT;
+    }
+    dev->errors.count[ec]++;
+    // A burst of transfer errors usually means the bus is too fast for
+    // the wiring or the card: halve the clock
+    if((ec == SD_EC_CRC)||(ec == SD_EC_TIMEOUT)) {
+        // DWORD difference, right across a wrap of errors.ops
+        idx = dev->errors.ops - dev->err_ops;
+        dev->err_ops = dev->errors.ops;
+        dev->err_burst = (idx < SD_IO_ERR_WINDOW) ? dev->err_burst + 1 : 1;
+        if((dev->err_burst >= SD_IO_ERR_BURST) && (dev->clock > SPI_MAX_FREQ/64)) {
+            dev->err_burst = 0;
+            dev->clock_limit = dev->clock / 2;
+            __SD_Set_Clock(dev);
+        }
+    }
+    return(ec);
+}
+
+SDRESULTS SD_Recover(SD_DEV *dev, SDRESULTS res, BYTE attempt)
+{
+    SD_ERRCLASS ec;
+
+    ec = SD_Classify(dev, res);
+    if((attempt >= SD_IO_RETRIES)||!SD_EC_RETRY(ec))
+        return(res);
+    dev->errors.retries++;
+    // Exponential backoff, at least one tick
+    osDelay(((tick_freq*((DWORD)SD_IO_BACKOFF << attempt)) + 999)/1000);
+    if(SD_EC_REINIT(ec)) {
+        dev->errors.reinits++;
+        // The SPI is set up already, only the card starts over
+        if(__SD_Handshake(dev) != SD_OK)
+            return(res);
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_Read_Retry(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
+{
+    SDRESULTS res;
+    BYTE attempt;
+
+    for(attempt = 0; ; attempt++) {
+        res = SD_Read(dev, dat, sector, ofs, cnt);
+        if((res == SD_OK)||(SD_Recover(dev, res, attempt) != SD_OK))
+            return(res);
+    }
+}
+
+SDRESULTS SD_Read_Check_Retry(SD_DEV *dev, void *dat, DWORD sector, BYTE kind, DWORD *ck)
+{
+    SDRESULTS res;
+    BYTE attempt;
+
+    for(attempt = 0; ; attempt++) {
+        res = SD_Read_Check(dev, dat, sector, kind, ck);
+        if((res == SD_OK)||(SD_Recover(dev, res, attempt) != SD_OK))
+            return(res);
+    }
+}
+
+SDRESULTS SD_Write_Retry(SD_DEV *dev, void *dat, DWORD sector)
+{
+    SDRESULTS res;
+    BYTE attempt;
+
+    for(attempt = 0; ; attempt++) {
+        res = SD_Write(dev, dat, sector);
+        if((res == SD_OK)||(SD_Recover(dev, res, attempt) != SD_OK))
+            return(res);
+    }
+}
+
 SDRESULTS SD_Status(SD_DEV *dev)
 {
     return(__SD_Send_Cmd(CMD0, 0) ? SD_OK : SD_NORESPONSE);
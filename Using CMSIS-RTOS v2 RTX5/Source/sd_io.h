@@ -17,21 +17,53 @@
 /*****************************************************************************/
 #define SD_IO_WRITE
 #define SD_IO_WRITE_TIMEOUT_WAIT 250
+#define SD_IO_ERASE_TIMEOUT_WAIT 3000   // Busy limit of an erase (ms)
+#define SD_IO_BUSY_CHUNK_MS 60000UL     // Longest single busy timer, longer limits run in chunks
+#define SD_IO_WRITE_DEFER_BUSY      // Return once the data is accepted, poll busy at next command
+#define SD_IO_MAX_RANGES 8          // Sub-ranges per partial block read
+// #define SD_IO_TRAILER               // Last 8 bytes of each sector: sequence number and Adler-32
+#define SD_IO_SEQ_RESERVE 4096UL    // Sequence numbers claimed per write of the card record
+#define SD_IO_RETRIES 4             // Retries of a failed transfer
+#define SD_IO_BACKOFF 1             // First retry delay (ms), doubled per retry
+#define SD_IO_FAST_INIT             // Poll instead of fixed delays, reuse cached card identity
+#define SD_IO_CACHE_FLASH           // Keep that identity in the reserved flash sector, else in RAM
+#define SD_IO_POWERUP_WAIT 1        // Power-up settle time (ms) with SD_IO_FAST_INIT
+#define SD_IO_HIGH_SPEED            // Try CMD6 high speed mode on SD v2 cards
+#define SD_IO_MAX_CLOCK 25000000UL  // Upper bound for the data clock (Hz)
+#define SD_IO_ERR_BURST 3           // CRC/timeout errors that halve the clock...
+#define SD_IO_ERR_WINDOW 16         // ...when they occur within this many transfers
+#define SD_IO_SPIN_MIN_US 20        // Card waits spin at least this long...
+#define SD_IO_SPIN_MAX_US 400       // ...and at most this long before sleeping
+#define SD_IO_NAP_US 50             // First sleep after the spin, doubled up to a kernel tick
 
 // #define SD_IO_DBG_COUNT
 /*****************************************************************************/
 
 #include "spi_io.h" /* Provide the low-level functions */
+#include "blkcrypt.h"
+#include "sd_reg.h"
 
 /* Definitions of SD commands */
 #define CMD0    (0x40+0)        /* GO_IDLE_STATE            */
 #define CMD1    (0x40+1)        /* SEND_OP_COND (MMC)       */
+#define CMD6    (0x40+6)        /* SWITCH_FUNC              */
+#define ACMD13  (0xC0+13)       /* SD_STATUS (SDC)          */
+#define ACMD23  (0xC0+23)       /* SET_WR_BLK_ERASE_COUNT (SDC) */
 #define ACMD41  (0xC0+41)       /* SEND_OP_COND (SDC)       */
+#define ACMD51  (0xC0+51)       /* SEND_SCR (SDC)           */
 #define CMD8    (0x40+8)        /* SEND_IF_COND             */
 #define CMD9    (0x40+9)        /* SEND_CSD                 */
+#define CMD10   (0x40+10)       /* SEND_CID                 */
+#define CMD12   (0x40+12)       /* STOP_TRANSMISSION        */
+#define CMD13   (0x40+13)       /* SEND_STATUS              */
 #define CMD16   (0x40+16)       /* SET_BLOCKLEN             */
 #define CMD17   (0x40+17)       /* READ_SINGLE_BLOCK        */
+#define CMD18   (0x40+18)       /* READ_MULTIPLE_BLOCK      */
 #define CMD24   (0x40+24)       /* WRITE_SINGLE_BLOCK       */
+#define CMD32   (0x40+32)       /* ERASE_WR_BLK_START_ADDR  */
+#define CMD33   (0x40+33)       /* ERASE_WR_BLK_END_ADDR    */
+#define CMD38   (0x40+38)       /* ERASE                    */
+#define CMD25   (0x40+25)       /* WRITE_MULTIPLE_BLOCK     */
 #define CMD42   (0x40+42)       /* LOCK_UNLOCK              */
 #define CMD55   (0x40+55)       /* APP_CMD                  */
 #define CMD58   (0x40+58)       /* READ_OCR                 */
@@ -48,6 +80,33 @@
 
 #define SD_BLK_SIZE     512
 
+/* Integrity trailer at the end of each sector: LE sequence number, LE check */
+#ifdef SD_IO_TRAILER
+#define SD_TRAILER_SIZE 8
+#else
+#define SD_TRAILER_SIZE 0
+#endif
+#define SD_PAYLOAD_SIZE (SD_BLK_SIZE - SD_TRAILER_SIZE) /* Application bytes */
+
+/* R1 response bits */
+#define R1_IDLE         0x01
+#define R1_ERASE_RESET  0x02
+#define R1_ILLEGAL_CMD  0x04
+#define R1_CRC_ERR      0x08
+#define R1_ERASE_SEQ    0x10
+#define R1_ADDRESS_ERR  0x20
+#define R1_PARAM_ERR    0x40
+
+/* Second byte of R2 (SEND_STATUS) response */
+#define R2_LOCKED       0x01
+#define R2_LOCK_FAILED  0x02
+#define R2_ERROR        0x04
+#define R2_CC_ERROR     0x08
+#define R2_ECC_FAILED   0x10
+#define R2_WP_VIOLATION 0x20
+#define R2_ERASE_PARAM  0x40
+#define R2_OUT_OF_RANGE 0x80
+
 /* Results of SD functions */
 typedef enum {
     SD_OK = 0,      /* 0: Function succeeded    */
@@ -56,9 +115,75 @@ typedef enum {
     SD_PARERR,      /* 3: Invalid parameter     */
     SD_BUSY,        /* 4: Programming busy      */
     SD_REJECT,      /* 5: Reject data           */
-    SD_NORESPONSE   /* 6: No response           */
+    SD_NORESPONSE,  /* 6: No response           */
+    SD_CORRUPT      /* 7: Trailer check failed  */
 } SDRESULTS;
 
+/* Byte window inside a block, used by partial reads */
+typedef struct _SD_RANGE {
+    void *dat;      /* Destination of the window        */
+    WORD ofs;       /* Byte offset in the sector        */
+    WORD cnt;       /* Byte count                       */
+} SD_RANGE;
+
+/* Error classes of the recovery layer */
+typedef enum {
+    SD_EC_NONE = 0, /* 0: No error                  */
+    SD_EC_TIMEOUT,  /* 1: Card did not answer       */
+    SD_EC_CRC,      /* 2: Transfer corrupted        */
+    SD_EC_ADDRESS,  /* 3: Bad address or parameter  */
+    SD_EC_ERASE,    /* 4: Erase sequence error      */
+    SD_EC_CARD,     /* 5: Internal card error       */
+    SD_EC_RESET     /* 6: Card fell back to idle    */
+} SD_ERRCLASS;
+
+#define SD_EC_NUM           7
+/* Address errors repeat on retry, everything else may be transient */
+#define SD_EC_RETRY(ec)     ((ec) != SD_EC_ADDRESS)
+/* Card lost or reset, needs the card handshake again before retrying */
+#define SD_EC_REINIT(ec)    (((ec) == SD_EC_TIMEOUT)||((ec) == SD_EC_RESET))
+
+typedef struct _SD_ERR_STATS {
+    WORD count[SD_EC_NUM];  /* Failures per class  */
+    WORD retries;
+    WORD reinits;
+    DWORD ops;              /* Sector transfers, not cleared at mount */
+} SD_ERR_STATS;
+
+/* Registers of the last card, persisted across boots by SD_Cache_Store */
+typedef struct _SD_CACHE {
+    WORD magic;
+    BYTE cardtype;
+    BYTE valid;             /* SD_REG_SCR, SD_REG_SSR: read from the card */
+    BYTE cid[16];
+    BYTE csd[16];
+    BYTE ocr[4];
+    BYTE scr[SD_SCR_SIZE];
+    BYTE ssr[SD_SSR_SIZE];
+    DWORD seq;              /* Trailer sequences below are claimed    */
+    WORD check;             /* Byte sum of the fields above          */
+} SD_CACHE;
+
+#define SD_CACHE_MAGIC  0x5347
+
+/* Phases the driver waits on the card */
+typedef enum {
+    SD_PH_TOKEN = 0,    /* 0: Read data token           */
+    SD_PH_BUSY,         /* 1: Write programming         */
+    SD_PH_READY,        /* 2: Deferred busy at next cmd */
+    SD_PH_NUM
+} SD_PHASE;
+
+/* Wait latency of one phase, in microseconds */
+typedef struct _SD_WAIT_STATS {
+    DWORD count;
+    DWORD total;
+    DWORD min;
+    DWORD max;
+    DWORD avg;          /* Running average, sets the spin window    */
+    DWORD sleeps;       /* Waits that slept after the spin        */
+} SD_WAIT_STATS;
+
 typedef struct _DBG_COUNT {
     WORD read;
     WORD write;
@@ -68,7 +193,32 @@ extern uint32_t tick_freq;
 typedef struct _SD_DEV {
     BOOL mount;
     BYTE cardtype;
+    DWORD (*addr)(DWORD sector); /* Sector to command argument, set at mount */
     DWORD last_sector;
+    BYTE cid[16];           /* Raw card registers                   */
+    BYTE csd[16];
+    BYTE ocr[4];
+    BYTE scr[SD_SCR_SIZE];
+    SD_INFO info;           /* Registers decoded at init            */
+    BOOL warm;              /* Identity matched the cached record   */
+    DWORD card_clock;       /* Max clock the card supports (Hz)     */
+    DWORD clock_limit;      /* Lowered on error bursts, 0 = default */
+    DWORD clock;            /* SPI clock achieved (Hz)              */
+    BYTE err_burst;
+    DWORD err_ops;          /* errors.ops at the last error         */
+    BOOL busy;              /* Card programming a deferred write    */
+    DWORD busy_ms;          /* ...or erasing, its busy limit (ms)    */
+    DWORD busy_tick;        /* Kernel tick the write was accepted   */
+    BOOL stream;            /* CMD25 left open by SD_Stream_Open    */
+    DWORD stream_next;      /* ...sector its next block goes to     */
+    WORD stream_ms;         /* ...busy limit of that block (ms)     */
+    WORD status;            /* Last SEND_STATUS, R1 << 8 | R2       */
+    DWORD seq;              /* Trailer sequence of the next write   */
+    DWORD last_seq;         /* Trailer sequence of the last read    */
+    DWORD seq_limit;        /* First sequence not claimed yet       */
+    BLK_CRYPT *crypt;       /* AES-CTR key, NULL = data in clear    */
+    SD_ERR_STATS errors;
+    SD_WAIT_STATS wait[SD_PH_NUM];
     DBG_COUNT debug;
 } SD_DEV;
 
@@ -92,14 +242,163 @@ SDRESULTS SD_Init (SD_DEV *dev);
  */
 SDRESULTS SD_Read (SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt);
 
+/**
+    \brief Read several byte windows of a single block.
+    \param sector Sector number.
+    \param rng Windows in ascending, non-overlapping order.
+    \param n Number of windows (1..SD_IO_MAX_RANGES).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Read_Ranges (SD_DEV *dev, DWORD sector, const SD_RANGE *rng, BYTE n);
+
+/**
+    \brief Read a whole block, folding a check value into the receive loop.
+    \param sector Sector number.
+    \param kind BLK_CK_* (blkutil.h), computed over all 512 bytes. The
+           SD_IO_TRAILER check is skipped for this read.
+    \param ck Receives the check value.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Read_Check (SD_DEV *dev, void *dat, DWORD sector, BYTE kind, DWORD *ck);
+
 /**
     \brief Write a single block.
-    \param dat Data to write.
+    \param dat Data to write. With SD_IO_TRAILER the last SD_TRAILER_SIZE bytes are
+           overwritten with the trailer.
     \param sector Sector number to write (internally is converted to byte address).
     \return If all goes well returns SD_OK.
  */
 SDRESULTS SD_Write (SD_DEV *dev, void *dat, DWORD sector);
 
+/**
+    \brief Read consecutive blocks with one command.
+    \param dat One 512 byte buffer per block.
+    \param sector First sector number.
+    \param n Number of blocks.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Read_Multi (SD_DEV *dev, BYTE * const *dat, DWORD sector, BYTE n);
+
+/**
+    \brief Write consecutive blocks with one command.
+    \param dat One 512 byte buffer per block.
+    \param sector First sector number.
+    \param n Number of blocks.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write_Multi (SD_DEV *dev, BYTE * const *dat, DWORD sector, BYTE n);
+
+/**
+    \brief Start a multiple block write that stays open across calls, so a
+           run of sectors that arrives piece by piece goes to the card as one
+           command. Any other command on the device closes it first.
+    \param sector First sector number.
+    \param erase Blocks to pre-erase (ACMD23) from sector on, 0: none. The
+           card may erase them all at once instead of block by block; those
+           not written before the stream is closed read as old data or erased.
+           The first block may then take the erase time the SD Status gives.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Stream_Open (SD_DEV *dev, DWORD sector, DWORD erase);
+
+/**
+    \brief Append blocks to the open stream, at dev->stream_next.
+    \param dat One 512 byte buffer per block.
+    \param n Number of blocks.
+    \return If all goes well returns SD_OK. On an error the stream is closed.
+ */
+SDRESULTS SD_Stream_Write (SD_DEV *dev, BYTE * const *dat, BYTE n);
+
+/**
+    \brief Close the open stream (stop token), if any.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Stream_Close (SD_DEV *dev);
+
+/**
+    \brief Erase a range of sectors (CMD32, CMD33, CMD38). Writes to erased
+           sectors skip the card's own erase. The card erases in the
+           background; the next command (or SD_Sync) waits, up to
+           SD_IO_ERASE_TIMEOUT_WAIT or the erase time the SD Status gives
+           for the range if longer.
+    \param first First sector.
+    \param last Last sector, inclusive.
+    \return SD_OK once the erase is started, SD_REJECT if the card has no
+            erase command class.
+ */
+SDRESULTS SD_Erase (SD_DEV *dev, DWORD first, DWORD last);
+
+/**
+    \brief Wait until the card finished programming a deferred write.
+    \return SD_OK when ready, SD_BUSY if programming timed out.
+ */
+SDRESULTS SD_Sync (SD_DEV *dev);
+
+/**
+    \brief Encrypt everything written to and read from the card.
+    \param crypt Keyed with Blk_Crypt_Init, NULL for data in clear. The keystream
+           of a write is built while the card still programs the previous one,
+           that of a read while the card looks the block up. It is XORed into
+           the data as it is clocked, so buffers are not copied. A trailer is
+           stamped into dat in clear and encrypted on the wire like the payload.
+ */
+void SD_Set_Crypt (SD_DEV *dev, BLK_CRYPT *crypt);
+
+/**
+    \brief Read the card status register (CMD13).
+    \param st R1 in the high byte, second R2 byte in the low byte.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Get_Status (SD_DEV *dev, WORD *st);
+
+/**
+    \brief Find out why the last transfer failed.
+    \param res Result of the failed call.
+    \return Error class, also counted in dev->errors.
+ */
+SD_ERRCLASS SD_Classify (SD_DEV *dev, SDRESULTS res);
+
+/**
+    \brief Retry a read after a recoverable error.
+    \return Result of the last attempt.
+ */
+SDRESULTS SD_Read_Retry (SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt);
+
+/**
+    \brief Retry a checked read after a recoverable error.
+ */
+SDRESULTS SD_Read_Check_Retry (SD_DEV *dev, void *dat, DWORD sector, BYTE kind, DWORD *ck);
+
+/**
+    \brief Retry a write after a recoverable error.
+    \return Result of the last attempt.
+ */
+SDRESULTS SD_Write_Retry (SD_DEV *dev, void *dat, DWORD sector);
+
+/**
+    \brief Classify a failure, back off and re-initialize if needed.
+    \param res Result of the failed call.
+    \param attempt Retries done so far.
+    \return SD_OK if the call should be retried, else res.
+ */
+SDRESULTS SD_Recover (SD_DEV *dev, SDRESULTS res, BYTE attempt);
+
+/**
+    \brief Fetch the persisted card record. The weak default keeps it in the
+           flash sector at FLASH_STORE with SD_IO_CACHE_FLASH, in RAM (lost
+           on power down) without. Override for another store.
+    \param rec Record to fill.
+    \return TRUE if a record was stored before.
+ */
+BOOL SD_Cache_Load (SD_CACHE *rec);
+
+/**
+    \brief Persist the card record. Weak, see SD_Cache_Load. Called by an
+           init that found another card than the stored one.
+    \param rec Record to store.
+ */
+void SD_Cache_Store (const SD_CACHE *rec);
+
 /**
     \brief Allows know status of SD card.
     \return If all goes well returns SD_OK.
@@ -0,0 +1,136 @@
+#ifndef SD_REG_H
+#define SD_REG_H
+#include <integer.h>
+
+/*
+ * Decoders for the SD card registers read at init: CSD (versions 1 to 3),
+ * CID, SCR (ACMD51) and SD Status (ACMD13). Registers come in as the card
+ * sends them, most significant byte first; field names and bit positions
+ * follow the SD Physical Layer Specification.
+ *
+ * Plain C without driver dependencies, builds on a host as well.
+ */
+
+#define SD_REG_CSD      0x01    // SD_INFO valid bits
+#define SD_REG_CID      0x02
+#define SD_REG_SCR      0x04
+#define SD_REG_SSR      0x08
+
+#define SD_SCR_SIZE     8
+#define SD_SSR_SIZE     64
+
+typedef struct {
+    BYTE structure;         // CSD_STRUCTURE: 0 SDSC/MMC, 1 SDHC/SDXC, 2 SDUC
+    BYTE taac;              // Data read access time, raw
+    BYTE nsac;              // Data read access time in 100 clocks, raw
+    DWORD tran_speed;       // Max data transfer rate (Hz)
+    WORD ccc;               // Card command classes, bit n: class n
+    BYTE read_bl_len;       // log2 of the max read block length
+    BYTE write_bl_len;      // log2 of the max write block length
+    BOOL read_bl_partial;
+    BOOL write_bl_partial;
+    BOOL read_blk_misalign;
+    BOOL write_blk_misalign;
+    BOOL dsr_imp;
+    DWORD c_size;
+    BYTE c_size_mult;       // Version 1 only
+    BOOL erase_blk_en;      // Erase of single 512 byte blocks allowed
+    BYTE sector_size;       // Erase sector in write blocks, minus 1
+    BYTE wp_grp_size;       // Write protect group in erase sectors, minus 1
+    BOOL wp_grp_enable;
+    BYTE r2w_factor;        // log2 of write time over read time
+    BOOL copy;
+    BOOL perm_write_protect;
+    BOOL tmp_write_protect;
+    BYTE file_format;       // FILE_FORMAT_GRP << 2 | FILE_FORMAT
+    DWORD sectors;          // Capacity in 512 byte sectors, 0xFFFFFFFF if larger
+    DWORD erase_sectors;    // Smallest erase unit in sectors
+} SD_CSD_INFO;
+
+typedef struct {
+    BYTE mid;               // Manufacturer ID
+    char oid[3];            // OEM/application ID, 2 characters
+    char pnm[6];            // Product name, 5 characters
+    BYTE prv;               // Product revision, BCD n.m
+    DWORD psn;              // Serial number
+    WORD year;              // Manufacturing date
+    BYTE month;
+} SD_CID_INFO;
+
+typedef struct {
+    BYTE structure;         // SCR_STRUCTURE
+    BYTE spec;              // Physical layer version x10: 10, 11, 20, 30, 40, 50..90
+    BYTE erase_value;       // DATA_STAT_AFTER_ERASE: erased bytes read 0x00 or 0xFF
+    BYTE security;          // SD_SECURITY
+    BYTE bus_widths;        // SD_BUS_WIDTHS, bit 0: 1 bit, bit 2: 4 bit
+    BYTE ex_security;
+    BYTE cmd_support;       // CMD_SUPPORT, bit 1: CMD23, bit 0: CMD20, ...
+} SD_SCR_INFO;
+
+typedef struct {
+    BYTE bus_width;         // DAT_BUS_WIDTH
+    BOOL secured;           // SECURED_MODE
+    WORD card_type;         // SD_CARD_TYPE, 0 for regular cards
+    DWORD protected_area;   // SIZE_OF_PROTECTED_AREA, raw
+    BYTE speed_class;       // Class 0 (none), 2, 4, 6 or 10 in MB/s
+    BYTE perf_move;         // PERFORMANCE_MOVE in MB/s, 0xFF: infinite
+    DWORD au_sectors;       // Allocation unit in sectors, 0: not defined
+    WORD erase_size;        // AUs erased within erase_timeout, 0: not supported
+    BYTE erase_timeout;     // Seconds for erase_size AUs
+    BYTE erase_offset;      // Seconds added to any erase
+    BYTE uhs_grade;         // UHS speed grade: 0, 1 (10 MB/s) or 3 (30 MB/s)
+    DWORD uhs_au_sectors;   // UHS allocation unit in sectors, 0: not defined
+    BYTE video_class;       // Video speed class V6..V90 in MB/s
+    WORD vsc_au_mb;         // Video speed class AU in MB
+    BYTE app_class;         // Application performance class A1, A2
+    BYTE perf_enhance;      // PERFORMANCE_ENHANCE, raw
+    BOOL discard;           // DISCARD_SUPPORT
+    BOOL fule;              // FULE_SUPPORT
+} SD_SSR_INFO;
+
+typedef struct {
+    BYTE valid;             // SD_REG_* of the registers decoded
+    SD_CSD_INFO csd;
+    SD_CID_INFO cid;
+    SD_SCR_INFO scr;
+    SD_SSR_INFO ssr;
+} SD_INFO;
+
+/**
+ \brief Decode the CSD.
+ \param raw 16 bytes as sent by CMD9.
+ \param csd Receives the fields.
+ \return FALSE for an unknown CSD_STRUCTURE.
+ */
+BOOL SD_Reg_Csd(const BYTE *raw, SD_CSD_INFO *csd);
+
+/**
+ \brief Decode the CID.
+ \param raw 16 bytes as sent by CMD10.
+ \param cid Receives the fields.
+ */
+void SD_Reg_Cid(const BYTE *raw, SD_CID_INFO *cid);
+
+/**
+ \brief Decode the SCR.
+ \param raw SD_SCR_SIZE bytes as sent by ACMD51.
+ \param scr Receives the fields.
+ */
+void SD_Reg_Scr(const BYTE *raw, SD_SCR_INFO *scr);
+
+/**
+ \brief Decode the SD Status.
+ \param raw SD_SSR_SIZE bytes as sent by ACMD13.
+ \param ssr Receives the fields.
+ */
+void SD_Reg_Ssr(const BYTE *raw, SD_SSR_INFO *ssr);
+
+/**
+ \brief Time an erase may take by the SD Status erase parameters.
+ \param ssr Decoded SD Status.
+ \param sectors Sectors erased.
+ \return Milliseconds, 0 when the card gives no erase parameters.
+ */
+DWORD SD_Reg_Erase_Ms(const SD_SSR_INFO *ssr, DWORD sectors);
+
+#endif
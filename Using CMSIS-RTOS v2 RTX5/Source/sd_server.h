@@ -0,0 +1,111 @@
+#ifndef SD_SERVER_H
+#define SD_SERVER_H
+#include <integer.h>
+#include "sd_io.h"
+#include "cmsis_os2.h"
+
+#define SDS_QUEUE_LEN	8			// Outstanding requests
+#define SDS_MAX_BATCH	8			// Adjacent requests merged into one multi-block command
+#define SDS_STACK_SIZE	768		// Server thread stack (bytes)
+#define SDS_FLAG_DONE	0x0001	// Default completion thread flag
+#define SDS_STAGE_SECTORS	8		// Deferred write window (sectors, power of 2 up to 32)
+#define SDS_STAGE_IDLE_MS	50		// Staged writes go out after this long without requests
+#define SDS_STAGE_HOLD_MS	500		// ... or this long while a sequential run continues in its AU
+
+// request types
+typedef enum {REQ_NONE, REQ_INIT, REQ_READ, REQ_WRITE, REQ_ERASE, REQ_SYNC} SDS_REQ_T;
+// status and results
+typedef enum {STAT_IDLE, STAT_BUSY} SDS_STATUS_T;
+	
+typedef struct { // SD Server Transaction Data
+	SDS_REQ_T Request;
+	SD_DEV * Device;
+	uint8_t * Data;
+	uint32_t Sector;
+	uint32_t Count;				// REQ_ERASE: sectors from Sector on
+	BOOL Defer;					// REQ_WRITE: done once staged, see SDS_Write_Deferred
+	BYTE Check;					// REQ_READ: BLK_CK_* folded into the transfer, BLK_CK_NONE: none
+	DWORD Checksum;				// ... its value once the read is done
+	osThreadId_t Owner;		// Thread notified on completion
+	uint32_t Flag;				// Thread flag set on completion
+	volatile SDS_STATUS_T Status;
+	SDRESULTS ErrorCode;
+} SDS_TD_T ;
+
+typedef struct { // Write staging counters
+	uint32_t Staged;			// Writes taken into the window
+	uint32_t Flushes;			// Windows written out
+	uint32_t Commands;		// Multi-block writes they opened
+	uint32_t Blocks;			// Sectors they wrote
+	uint32_t AU_Switches;	// Flushes into another allocation unit than the last
+	uint32_t AU_Erases;		// Writes opened at an AU start with the whole AU pre-erased
+	uint32_t AU_Whole;		// ... that went on to the AU end
+} SDS_STAGE_STATS;
+
+extern SDS_STAGE_STATS SDS_Stage_Stats;
+
+// Create the request queue and the server thread. Call before osKernelStart.
+void SD_Server_Init(void);
+
+// Queue a request without waiting. t must stay valid until Status is STAT_IDLE.
+SDRESULTS SDS_Submit(SDS_TD_T * t);
+
+// Block until a submitted request is done, returns its result
+SDRESULTS SDS_Wait(SDS_TD_T * t);
+
+// Submit and wait
+SDRESULTS SDS_Init(SD_DEV * dev);
+SDRESULTS SDS_Read(SD_DEV * dev, uint8_t * data, uint32_t sector);
+SDRESULTS SDS_Read_Check(SD_DEV * dev, uint8_t * data, uint32_t sector, BYTE check, DWORD * checksum);
+SDRESULTS SDS_Write(SD_DEV * dev, uint8_t * data, uint32_t sector);
+SDRESULTS SDS_Write_Deferred(SD_DEV * dev, uint8_t * data, uint32_t sector);
+SDRESULTS SDS_Erase(SD_DEV * dev, uint32_t sector, uint32_t count);
+SDRESULTS SDS_Sync(SD_DEV * dev);
+
+// Turn write staging on or off (on after reset). While off, deferred writes are written
+// through like SDS_Write.
+void SDS_Set_Staging(BOOL on);
+
+/*
+To request service...
+1. Requesting thread R fills in Request, Device, Data and Sector of its own SDS_TD_T.
+2. R calls SDS_Submit. The server owns the card, so any number of threads may submit.
+3. R may prepare more requests and submit them too (pipelining). Requests are served in order.
+4. When the server finishes a request it sets Status to STAT_IDLE and sets thread flag Flag of R.
+5. R calls SDS_Wait (or polls Status) and reads ErrorCode.
+
+A read with Check set returns Checksum of the data, computed while it streams in.
+
+An erase (REQ_ERASE, Count sectors from Sector) is done once the card has started it. The
+card keeps erasing in the background, so erasing the next log extent while the current one
+is still being filled makes the later writes to it cheaper. The next request waits for it.
+
+Reads or writes of consecutive sectors that are queued together are merged into one
+multi-block command, except checked reads and deferred writes. If that fails, each request
+is retried on its own.
+
+SDS_Write is write-through: it returns once the card has the data. A deferred write
+(SDS_Write_Deferred, or Defer set) is staged instead: the server copies the data into a
+window of SDS_STAGE_SECTORS sectors, aligned to its size so it never straddles an allocation
+unit (AU), and completes the write at once. In whatever order its sectors arrive, the window
+goes out once it is full, a write falls outside it, a request on the device touches it, or
+the server has been idle for SDS_STAGE_IDLE_MS. A window holding the start of a sequential
+run that goes on in the same AU (per the card's SD Status) waits up to SDS_STAGE_HOLD_MS
+instead, so a slow writer still fills it.
+
+Each run of staged sectors is written with ACMD23 pre-erase and a multi-block write (CMD25)
+that stays open: the run of the next window joins it if it follows on, so a sequential
+writer fills a whole AU with one command, ended at the AU boundary. Cheap cards are far
+slower on scattered or split writes than on sequential AU writes. A command opened by a full
+window at the start of an AU pre-erases the whole AU: sectors of that AU the writer does
+not reach before the command ends read back as old data or erased. Deferred writes are for
+a writer that owns the AUs it starts, such as a log; other commands pre-erase only what
+they write. The open command is ended by any other request on the device, or after
+SDS_STAGE_HOLD_MS without writes.
+
+Deferred writes report SD_OK once copied. Write errors are deferred: a failed flush is
+reported by the next REQ_SYNC (SDS_Sync), which also writes the window out, ends the command
+and waits for the card. Only then is deferred data on the card.
+*/
+
+#endif
@@ -12,10 +12,13 @@
 #include <MKL25Z4.h>
 #include "debug.h"
 #include "cmsis_os2.h"
+#include "blkutil.h"
 
 /******************************************************************************
  Module Public Functions - Low level SPI control functions
 ******************************************************************************/
+#define SPI_RX_WAIT 2 // Kernel ticks for an interrupt driven byte, longer means it was lost
+
 typedef enum {busy_wait=0,os_Wait} mode;
 mode waiting_mode;
 osMessageQueueId_t Message_id;
@@ -67,7 +70,9 @@ void SPI_Init (void) {
      * Bit 3:0          = 0 Reserved
      */
     SPI1_S = 0x00;
-		Message_id=osMessageQueueNew(8,sizeof(BYTE),NULL);
+		// Runs again on every SD_Init, the queue is made once
+		if (Message_id == NULL)
+			Message_id=osMessageQueueNew(8,sizeof(BYTE),NULL);
 }
 
 BYTE SPI_RW (BYTE d) {
@@ -93,7 +98,7 @@ BYTE SPI_RW (BYTE d) {
 		}
 		else if (waiting_mode==os_Wait)
 		{
-			result=osMessageQueueGet(Message_id,&dest_data,NULL,NULL);
+			result=osMessageQueueGet(Message_id,&dest_data,NULL,SPI_RX_WAIT);
 			if (result==osOK)
 			{
 				SPI1_D=dest_data;
@@ -101,6 +106,9 @@ BYTE SPI_RW (BYTE d) {
 				return(dest_data);
 			}
 		}
+		// No queue or no interrupt: what an idle card sends, so callers time out
+		PTB->PCOR=MASK(DBG_1);
+		return(0xFF);
 }
 void SPI1_IRQHandler(void)
 {
@@ -117,6 +125,166 @@ void SPI1_IRQHandler(void)
 	PTB->PCOR=MASK(DBG_6);
 }
 
+void SPI_Skip (WORD n) {
+    if (waiting_mode==os_Wait) {
+        // Low speed, interrupt driven: go through the message queue
+        while (n--)
+            SPI_RW(0xFF);
+        return;
+    }
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = 0xFF;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+void SPI_Read (BYTE *dst, WORD n) {
+    if (waiting_mode==os_Wait) {
+        while (n--)
+            *dst++ = SPI_RW(0xFF);
+        return;
+    }
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = 0xFF;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        *dst++ = (BYTE)SPI1_D;
+    }
+}
+
+void SPI_Write (const BYTE *src, WORD n) {
+    if (waiting_mode==os_Wait) {
+        while (n--)
+            SPI_RW(*src++);
+        return;
+    }
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = *src++;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+// One received byte, clocked with 0xFF
+__STATIC_INLINE BYTE __SPI_Rx (void) {
+    if (waiting_mode==os_Wait)
+        return(SPI_RW(0xFF));
+    while(!(SPI1_S & SPI_S_SPTEF_MASK))
+		;
+    SPI1_D = 0xFF;
+    while(!(SPI1_S & SPI_S_SPRF_MASK))
+		;
+    return((BYTE)SPI1_D);
+}
+
+void SPI_Read_Xor (BYTE *dst, const BYTE *ks, WORD n) {
+    if (!ks) {
+        SPI_Read(dst, n);
+        return;
+    }
+    while (n--)
+        *dst++ = __SPI_Rx() ^ *ks++;
+}
+
+void SPI_Write_Xor (const BYTE *src, const BYTE *ks, WORD n) {
+    if (!ks) {
+        SPI_Write(src, n);
+        return;
+    }
+    if (waiting_mode==os_Wait) {
+        while (n--)
+            SPI_RW(*src++ ^ *ks++);
+        return;
+    }
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = *src++ ^ *ks++;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+DWORD SPI_Read_Check (BYTE *dst, const BYTE *ks, WORD n, BYTE kind, DWORD ck) {
+    DWORD a, b;
+    BYTE d;
+
+    // One loop per kind keeps the kind test out of the byte loop. Keystream
+    // XOR and fold fit in the time the next byte takes to shift.
+    switch (kind) {
+    case BLK_CK_SUM:
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck += d;
+        }
+        break;
+    case BLK_CK_CRC16:
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck = (WORD)(ck << 8) ^ Blk_Crc16_Table[(BYTE)(ck >> 8) ^ d];
+        }
+        break;
+    case BLK_CK_CRC32:
+        ck = ~ck;
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck = (ck >> 8) ^ Blk_Crc32_Table[(BYTE)ck ^ d];
+        }
+        ck = ~ck;
+        break;
+    case BLK_CK_ADLER32:
+        a = ck & 0xFFFF;
+        b = ck >> 16;
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            a += d;
+            b += a;
+        }
+        ck = (Blk_Adler32_Mod(b) << 16) | Blk_Adler32_Mod(a);
+        break;
+    default:
+        SPI_Read_Xor(dst, ks, n);
+        break;
+    }
+    return(ck);
+}
+
+DWORD SPI_Write_Adler (const BYTE *src, const BYTE *ks, WORD n, DWORD adler) {
+    DWORD a = adler & 0xFFFF, b = adler >> 16;
+    BYTE d;
+
+    while (n--) {
+        d = *src ^ (ks ? *ks++ : 0);
+        if (waiting_mode==os_Wait) {
+            SPI_RW(d);
+        } else {
+            while(!(SPI1_S & SPI_S_SPTEF_MASK))
+				;
+            SPI1_D = d;
+            while(!(SPI1_S & SPI_S_SPRF_MASK))
+				;
+            (void)SPI1_D;
+        }
+        a += *src++;
+        b += a;
+    }
+    return((Blk_Adler32_Mod(b) << 16) | Blk_Adler32_Mod(a));
+}
+
 void SPI_Release (void) {
     WORD idx;
     for (idx=512; idx && (SPI_RW(0xFF)!=0xFF); idx--);
@@ -131,7 +299,7 @@ inline void SPI_CS_High (void){
 }
 
 inline void SPI_Freq_High (void) {
-		SPI1_BR = 0x01; 
+		SPI_Freq_Set(SPI_MAX_FREQ);
 		SPI1_C1=0x50;
 		waiting_mode=busy_wait;
 }	
@@ -141,10 +309,34 @@ inline void SPI_Freq_Low (void) {
 		SPI1_BR = 0x44; // 48MHz / 160 = 300kHz
 		NVIC_EnableIRQ(SPI1_IRQn);
 		__enable_irq();
+		osMessageQueueReset(Message_id); // No stale bytes from an earlier run
 		SPI1_C1=0xD0;
 		waiting_mode=os_Wait;
 }
 
+DWORD SPI_Freq_Set (DWORD hz) {
+    BYTE sppr, spr, br;
+    DWORD div, best;
+
+    // SCK = SystemCoreClock / ((SPPR+1) * 2^(SPR+1)), pick the smallest divisor
+    // that keeps SCK at or below the limit
+    if (hz > SPI_MAX_FREQ)
+        hz = SPI_MAX_FREQ;
+    best = 0;
+    br = 0x78;                          // Slowest: 48MHz / (8 * 512) = 48MHz / 4096
+    for (sppr = 0; sppr != 8; sppr++) {
+        for (spr = 0; spr != 9; spr++) {
+            div = (DWORD)(sppr + 1) << (spr + 1);
+            if ((SystemCoreClock / div <= hz) && (SystemCoreClock / div > best)) {
+                best = SystemCoreClock / div;
+                br = (sppr << 4) | spr;
+            }
+        }
+    }
+    SPI1_BR = br;
+    return (best ? best : SystemCoreClock / 4096);
+}
+
 void SPI_Timer_On (WORD ms) {
     SIM_SCGC5 |= SIM_SCGC5_LPTMR_MASK;  // Make sure clock is enabled
     LPTMR0_CSR = 0;                     // Reset LPTMR settings
@@ -163,6 +355,34 @@ inline void SPI_Timer_Off (void) {
     LPTMR0_CSR = 0;                     // Turn off timer
 }
 
+static osThreadId_t nap_thread;
+
+void PIT_IRQHandler (void) {
+    PIT_TFLG0 = PIT_TFLG_TIF_MASK;
+    PIT_TCTRL0 = 0;                     // One shot
+    osThreadFlagsSet(nap_thread, SPI_NAP_FLAG);
+}
+
+void SPI_Nap (DWORD us) {
+    DWORD bus;
+
+    // The LPTMR counts the 1 kHz LPO, too coarse: the PIT runs on the bus clock
+    bus = SystemCoreClock / (((SIM_CLKDIV1 & SIM_CLKDIV1_OUTDIV4_MASK) >> SIM_CLKDIV1_OUTDIV4_SHIFT) + 1);
+    SIM_SCGC6 |= SIM_SCGC6_PIT_MASK;
+    PIT_MCR = 0;                        // Module on, runs in wait mode
+    PIT_TCTRL0 = 0;
+    PIT_TFLG0 = PIT_TFLG_TIF_MASK;
+    PIT_LDVAL0 = us * (bus / 1000000UL) - 1;
+    nap_thread = osThreadGetId();
+    osThreadFlagsClear(SPI_NAP_FLAG);
+    NVIC_ClearPendingIRQ(PIT_IRQn);
+    NVIC_EnableIRQ(PIT_IRQn);
+    PIT_TCTRL0 = PIT_TCTRL_TIE_MASK | PIT_TCTRL_TEN_MASK;
+    // A tick at the latest, should the interrupt be lost
+    osThreadFlagsWait(SPI_NAP_FLAG, osFlagsWaitAny, 1);
+    PIT_TCTRL0 = 0;
+}
+
 #ifdef SPI_DEBUG_OSC
 inline void SPI_Debug_Init(void)
 {
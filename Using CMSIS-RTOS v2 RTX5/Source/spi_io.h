@@ -11,6 +11,9 @@
 
 #include "integer.h"        /* Type redefinition for portability */
 
+#define SPI_MAX_FREQ    12000000UL  /* Fastest SCK SPI1 supports as master */
+#define SPI_NAP_FLAG    0x40000000UL /* Thread flag SPI_Nap waits on, keep it free */
+
 
 /******************************************************************************
  Public methods
@@ -28,6 +31,63 @@ void SPI_Init (void);
  */
 BYTE SPI_RW (BYTE d);
 
+/**
+    \brief Clock in and discard bytes.
+    \param n Number of bytes to discard.
+ */
+void SPI_Skip (WORD n);
+
+/**
+    \brief Clock in a run of bytes.
+    \param dst Destination buffer.
+    \param n Number of bytes to read.
+ */
+void SPI_Read (BYTE *dst, WORD n);
+
+/**
+    \brief Clock out a run of bytes, discarding what arrives.
+    \param src Source buffer.
+    \param n Number of bytes to write.
+ */
+void SPI_Write (const BYTE *src, WORD n);
+
+/**
+    \brief Clock out a run of bytes XORed with a keystream, source unchanged.
+    \param src Source buffer.
+    \param ks Keystream, one byte per data byte, NULL to send them as they are.
+    \param n Number of bytes to write.
+ */
+void SPI_Write_Xor (const BYTE *src, const BYTE *ks, WORD n);
+
+/**
+    \brief Clock in a run of bytes, XORing a keystream into them on the way.
+    \param dst Destination buffer.
+    \param ks Keystream, one byte per data byte, NULL to read them as they are.
+    \param n Number of bytes to read.
+ */
+void SPI_Read_Xor (BYTE *dst, const BYTE *ks, WORD n);
+
+/**
+    \brief Clock in a run of bytes, folding them into a check value on the way.
+    \param dst Destination buffer.
+    \param ks Keystream XORed in before the fold, or NULL.
+    \param n Number of bytes to read, at most 5552 for Adler-32.
+    \param kind BLK_CK_* (blkutil.h).
+    \param ck Running check value, Blk_Check_Init(kind) to start.
+    \return Updated check value.
+ */
+DWORD SPI_Read_Check (BYTE *dst, const BYTE *ks, WORD n, BYTE kind, DWORD ck);
+
+/**
+    \brief Clock out a run of bytes, folding them into an Adler-32 on the way.
+    \param src Source buffer, folded as it is.
+    \param ks Keystream XORed into what goes out, or NULL.
+    \param n Number of bytes to write, at most 5552.
+    \param adler Running Adler-32, 1 to start.
+    \return Updated Adler-32.
+ */
+DWORD SPI_Write_Adler (const BYTE *src, const BYTE *ks, WORD n, DWORD adler);
+
 /**
     \brief Flush of SPI buffer.
  */
@@ -53,6 +113,14 @@ void SPI_Freq_High (void);
  */
 void SPI_Freq_Low (void);
 
+/**
+    \brief Setting the fastest SPI clock not above a limit. Changes the
+           divider only, SPI_Freq_High selects busy-wait transfers.
+    \param hz Upper limit in Hz.
+    \return Clock achieved in Hz.
+ */
+DWORD SPI_Freq_Set (DWORD hz);
+
 /**
     \brief Start a non-blocking timer.
     \param ms Milliseconds.
@@ -70,6 +138,14 @@ BOOL SPI_Timer_Status (void);
  */
 void SPI_Timer_Off (void);
 
+/**
+    \brief Block the calling thread for less than a kernel tick. PIT channel 0
+           sets SPI_NAP_FLAG when the time is up; other threads and the idle
+           thread run meanwhile.
+    \param us Microseconds, 1 up to a kernel tick.
+ */
+void SPI_Nap (DWORD us);
+
 #endif
 
 /*
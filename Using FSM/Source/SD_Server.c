@@ -10,79 +10,160 @@
 #include "spi_io.h"
 #include "sd_io.h"
 #include "debug.h"
+#include "sched.h"
+#include "fsm.h"
+#include "blkutil.h"
 
-SDS_TD_T g_trans = {REQ_NONE, 0, (uint8_t * ) 0, 0, STAT_IDLE, SD_OK};
+SDS_TD_T g_trans = {REQ_NONE, 0, (uint8_t * ) 0, 0, 0, BLK_CK_NONE, 0, STAT_IDLE, SD_OK};
 
 // Determines next state after S_IDLE based on request type
 // Entries must be in order of declaration in SDSTD_T Request field
-SDS_STATE_T Req_to_State[] = {S_IDLE, S_INIT, S_READ, S_WRITE};
+SDS_STATE_T Req_to_State[] = {S_IDLE, S_INIT, S_READ, S_WRITE, S_ERASE};
 
 void Update_Trans(SDS_TD_T * t, SDRESULTS res) {
 	t->ErrorCode = res;
 	t->Status = STAT_IDLE;
 	t->Request = REQ_NONE; // Erase request code
+	Sched_Signal(EV_DONE);
 }
 
-void Task_SD_Server(void) {
+// Local copy of transaction data, improves robustness
+static SDS_TD_T cur_trans;
+static BYTE attempt;
+static BOOL reinit;
+static TB_TIMER backoff;
+
+// Finish the current transaction, or schedule a retry if the error may be transient
+SDS_STATE_T Complete_Trans(SDRESULTS res) {
+	SD_ERRCLASS ec;
+	
+	if ((res != SD_OK) && (cur_trans.Request != REQ_INIT) && (attempt < SD_IO_RETRIES)) {
+		ec = SD_Classify(cur_trans.Device, res);
+		if (SD_EC_RETRY(ec)) {
+			cur_trans.Device->errors.retries++;
+			reinit = SD_EC_REINIT(ec);
+			TB_Timer_Start(&backoff, (DWORD)SD_IO_BACKOFF_US << attempt, EV_TIMER, NULL, NULL);
+			attempt++;
+			return S_BACKOFF;
+		}
+	}
+	attempt = 0;
+	Update_Trans(&g_trans, res);
+	return S_IDLE;
+}
+
+static BOOL Request_Posted(void *ctx) {
+	return (g_trans.Request != REQ_NONE) ? TRUE : FALSE;
+}
+
+static BYTE Accept_Request(void *ctx) {
+	cur_trans = g_trans; // Copy transaction request
+	if (cur_trans.Request <= REQ_ERASE) {
+		g_trans.Status = STAT_BUSY; 
+		return Req_to_State[cur_trans.Request];
+	}
+	// parameter error
+	g_trans.Status = STAT_IDLE;
+	g_trans.Request = REQ_NONE; // Erase request
+	g_trans.ErrorCode = SD_PARERR; 
+	Sched_Signal(EV_DONE);
+	return S_IDLE; // Stay in idle state
+}
+
+static BYTE Run_Init(void *ctx) {
+	if (Init.set_fsm==0)
+	{
+		Init.set_fsm=1;
+	}
+	SD_Init(cur_trans.Device);
+	if (Init.Status_fsm==STAT_IDLE && Init.Start_fsm==1)
+	{
+		Update_Trans(&g_trans, Init.ErrorCode_fsm);
+		return S_IDLE;
+	}
+	return FSM_STAY;
+}
+
+static BYTE Run_Read(void *ctx) {
+	SD_Read_Check_FSM(cur_trans.Device, cur_trans.Data, cur_trans.Sector, cur_trans.Check, &g_trans.Checksum);
+	if (Read.Status_fsm==STAT_IDLE && Read.Start_fsm==1)
+		return Complete_Trans(Read.ErrorCode_fsm);
+	return FSM_STAY;
+}
+
+static BYTE Run_Write(void *ctx) {
+	SD_Write_FSM(cur_trans.Device, cur_trans.Data, cur_trans.Sector);
+	if (Write.Status_fsm==STAT_IDLE && Write.Start_fsm==1)
+		return Complete_Trans(Write.ErrorCode_fsm);
+	return FSM_STAY;
+}
+
+static BYTE Run_Erase(void *ctx) {
+	SDRESULTS res;
 	
-	static SDS_STATE_T next_state = S_IDLE;
-	// Local copy of transaction data, improves robustness
-	static SDS_TD_T cur_trans;
-	static SDRESULTS res;
-	PTB->PSOR = MASK(DBG_5);
-	switch (next_state) {
-		case S_IDLE:
-				if (g_trans.Request != REQ_NONE) {
-						cur_trans = g_trans; // Copy transaction request
-					if (cur_trans.Request <= REQ_WRITE) {
-						next_state = Req_to_State[cur_trans.Request];
-						g_trans.Status = STAT_BUSY; 
-					} else { // parameter error
-						g_trans.Status = STAT_IDLE;
-						g_trans.Request = REQ_NONE; // Erase request
-						g_trans.ErrorCode = SD_PARERR; 
-						next_state = S_IDLE; // Stay in idle state
-					}
-				}
-			break;
-		case S_INIT:
-			if (Init.set_fsm==0)
-			{
-				Init.set_fsm=1;
-			}
-			SD_Init(cur_trans.Device);
-			if (Init.Status_fsm==STAT_IDLE && Init.Start_fsm==1)
-			{
-				res=Init.ErrorCode_fsm;
-				Update_Trans(&g_trans, res);
-				next_state = S_IDLE;
-			}
-			break;
-		case S_READ:
-			SD_Read_FSM(cur_trans.Device, cur_trans.Data, cur_trans.Sector, 0, 512);
-			if (Read.Status_fsm==STAT_IDLE && Read.Start_fsm==1)
-			{
-				res=Read.ErrorCode_fsm;
-				Update_Trans(&g_trans, res);
-				next_state = S_IDLE;
-			}
-			break;
-		case S_WRITE:
-			SD_Write_FSM(cur_trans.Device, cur_trans.Data, cur_trans.Sector);
-			if (Write.Status_fsm==STAT_IDLE && Write.Start_fsm==1)
-			{
-				res=Write.ErrorCode_fsm;
-				Update_Trans(&g_trans, res);
-				next_state = S_IDLE;
-			}
-			break;
-		case S_ERROR:
-			while (1)
-				;	// Optional: Add your code to handle the error here
-			break;
-		default:
-			break;
-		
+	res = SD_Erase(cur_trans.Device, cur_trans.Sector, cur_trans.Sector + cur_trans.Count - 1);
+	if (res == SD_BUSY) {
+		Sched_Wait(EV_TICK); // Card still programming, poll again next tick
+		return FSM_STAY;
+	}
+	return Complete_Trans(res);
+}
+
+static BYTE Halt(void *ctx) {
+	while (1)
+		;	// Optional: Add your code to handle the error here
+	return FSM_STAY;
+}
+
+static BOOL Backoff_Expired(void *ctx) {
+	return TB_Timer_Expired(&backoff);
+}
+
+static BYTE Retry(void *ctx) {
+	TB_Timer_Cancel(&backoff);
+	if (reinit)
+	{
+		cur_trans.Device->errors.reinits++;
+		Init.set_fsm=1;
+		return S_REINIT;
 	}
-	PTB->PCOR = MASK(DBG_5);
+	return Req_to_State[cur_trans.Request];
+}
+
+static BYTE Run_Reinit(void *ctx) {
+	SDRESULTS res;
+	
+	SD_Reinit(cur_trans.Device); // Card only, the SPI is set up
+	if (Init.Status_fsm==STAT_IDLE && Init.Start_fsm==1)
+	{
+		res=Init.ErrorCode_fsm;
+		if (res == SD_OK)
+		{
+			// Card is back, replay the preserved request
+			return Req_to_State[cur_trans.Request];
+		}
+		attempt = 0;
+		Update_Trans(&g_trans, res);
+		return S_IDLE;
+	}
+	return FSM_STAY;
+}
+
+// Indexed by SDS_STATE_T. The backoff time varies per attempt, so
+// Complete_Trans starts the timer itself instead of a table timeout.
+static const FSM_STATE_T Server_Table[] = {
+	// guard			action			timeout	on_timeout	wait
+	{Request_Posted,	Accept_Request,	0,		0,			EV_REQUEST},	// S_IDLE
+	{NULL,				Run_Init,		0,		0,			0},				// S_INIT
+	{NULL,				Run_Read,		0,		0,			0},				// S_READ
+	{NULL,				Run_Write,		0,		0,			0},				// S_WRITE
+	{NULL,				Halt,			0,		0,			0},				// S_ERROR
+	{Backoff_Expired,	Retry,			0,		0,			EV_TIMER},		// S_BACKOFF
+	{NULL,				Run_Reinit,		0,		0,			0},				// S_REINIT
+	{NULL,				Run_Erase,		0,		0,			0},				// S_ERASE
+};
+FSM_DEFINE(Server_Machine, Server_Table, DBG_5, SD_IO_INIT_BUDGET_US);
+
+void Task_SD_Server(void) {
+	FSM_Step(&Server_Machine, NULL);
 }
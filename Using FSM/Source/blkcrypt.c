@@ -0,0 +1,158 @@
+/*
+ * AES-128 counter mode keystream for sector data, see blkcrypt.h
+ */
+
+#include "blkcrypt.h"
+
+#define __BLK_AES_ROUNDS    10
+
+// Multiply by x in GF(2^8)
+#define __BLK_XT(x)         ((BYTE)(((x) << 1) ^ (((x) & 0x80) ? 0x1B : 0)))
+
+static const BYTE __Blk_Sbox[256] = {
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+// SubBytes source of each state byte after ShiftRows (column-major state)
+static const BYTE __Blk_Shift[16] = {0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11};
+
+void Blk_Aes128_Key(BYTE *rk, const BYTE *key)
+{
+    BYTE i, t0, t1, t2, t3, t, rcon = 1;
+
+    for(i = 0; i < 16; i++)
+        rk[i] = key[i];
+    for(i = 16; i < BLK_AES_RK_SIZE; i += 4) {
+        t0 = rk[i - 4];
+        t1 = rk[i - 3];
+        t2 = rk[i - 2];
+        t3 = rk[i - 1];
+        if((i & 15) == 0) {
+            // RotWord, SubWord, Rcon
+            t = t0;
+            t0 = __Blk_Sbox[t1] ^ rcon;
+            t1 = __Blk_Sbox[t2];
+            t2 = __Blk_Sbox[t3];
+            t3 = __Blk_Sbox[t];
+            rcon = __BLK_XT(rcon);
+        }
+        rk[i] = rk[i - 16] ^ t0;
+        rk[i + 1] = rk[i - 15] ^ t1;
+        rk[i + 2] = rk[i - 14] ^ t2;
+        rk[i + 3] = rk[i - 13] ^ t3;
+    }
+}
+
+void Blk_Aes128_Encrypt(const BYTE *rk, const BYTE *in, BYTE *out)
+{
+    BYTE s[16], t[16];
+    BYTE i, round, a0, a1, a2, a3, x;
+
+    for(i = 0; i < 16; i++)
+        s[i] = in[i] ^ rk[i];
+    for(round = 1; ; round++) {
+        rk += 16;
+        for(i = 0; i < 16; i++)
+            t[i] = __Blk_Sbox[s[__Blk_Shift[i]]];
+        if(round == __BLK_AES_ROUNDS)
+            break;
+        // MixColumns and AddRoundKey, one column at a time
+        for(i = 0; i < 16; i += 4) {
+            a0 = t[i];
+            a1 = t[i + 1];
+            a2 = t[i + 2];
+            a3 = t[i + 3];
+            x = a0 ^ a1 ^ a2 ^ a3;
+            s[i] = a0 ^ x ^ __BLK_XT(a0 ^ a1) ^ rk[i];
+            s[i + 1] = a1 ^ x ^ __BLK_XT(a1 ^ a2) ^ rk[i + 1];
+            s[i + 2] = a2 ^ x ^ __BLK_XT(a2 ^ a3) ^ rk[i + 2];
+            s[i + 3] = a3 ^ x ^ __BLK_XT(a3 ^ a0) ^ rk[i + 3];
+        }
+    }
+    for(i = 0; i < 16; i++)
+        out[i] = t[i] ^ rk[i];
+}
+
+void Blk_Crypt_Init(BLK_CRYPT *c, const BYTE *key, const BYTE *nonce)
+{
+    BYTE i;
+
+    Blk_Aes128_Key(c->rk, key);
+    for(i = 0; i < 8; i++)
+        c->nonce[i] = nonce[i];
+    c->sector = 0;
+    c->valid = 0;
+}
+
+// Switch the keystream buffer over to another sector
+static void __Blk_Crypt_Sector(BLK_CRYPT *c, DWORD sector)
+{
+    if(c->sector != sector) {
+        c->sector = sector;
+        c->valid = 0;
+    }
+}
+
+// Encrypt counter block i of the current sector into the keystream
+static void __Blk_Crypt_Block(BLK_CRYPT *c, BYTE i)
+{
+    BYTE ctr[BLK_AES_BLOCK];
+    BYTE k;
+
+    for(k = 0; k < 8; k++)
+        ctr[k] = c->nonce[k];
+    ctr[8] = (BYTE)(c->sector >> 24);
+    ctr[9] = (BYTE)(c->sector >> 16);
+    ctr[10] = (BYTE)(c->sector >> 8);
+    ctr[11] = (BYTE)c->sector;
+    ctr[12] = 0;
+    ctr[13] = 0;
+    ctr[14] = 0;
+    ctr[15] = i;
+    Blk_Aes128_Encrypt(c->rk, ctr, &c->ks[i * BLK_AES_BLOCK]);
+    c->valid |= 1UL << i;
+}
+
+BOOL Blk_Crypt_Fill(BLK_CRYPT *c, DWORD sector, BYTE blocks)
+{
+    BYTE i;
+
+    __Blk_Crypt_Sector(c, sector);
+    for(i = 0; (i < BLK_CRYPT_BLOCKS) && blocks; i++) {
+        if(!(c->valid & (1UL << i))) {
+            __Blk_Crypt_Block(c, i);
+            blocks--;
+        }
+    }
+    return((c->valid == 0xFFFFFFFFUL) ? TRUE : FALSE);
+}
+
+const BYTE *Blk_Crypt_Stream(BLK_CRYPT *c, DWORD sector, WORD ofs, WORD n)
+{
+    BYTE i, last;
+
+    __Blk_Crypt_Sector(c, sector);
+    if(n == 0)
+        return(c->ks);
+    last = (BYTE)((ofs + n - 1) / BLK_AES_BLOCK);
+    for(i = (BYTE)(ofs / BLK_AES_BLOCK); i <= last; i++) {
+        if(!(c->valid & (1UL << i)))
+            __Blk_Crypt_Block(c, i);
+    }
+    return(c->ks);
+}
@@ -0,0 +1,69 @@
+#ifndef BLKCRYPT_H
+#define BLKCRYPT_H
+#include <integer.h>
+
+/*
+ * AES-128 in counter mode for sector data. The keystream of one sector is
+ * built in a 512 byte buffer, 16 bytes at a time, and the SPI transfer XORs
+ * it into the data on the way, so block buffers are neither copied nor
+ * changed. CTR only needs the forward cipher: decrypting is the same XOR.
+ *
+ * Counter block: 8 byte nonce, sector (big-endian), 16 byte block index
+ * within the sector (big-endian). A rewritten sector reuses its keystream,
+ * so give each recording session its own nonce.
+ */
+
+#define BLK_AES_BLOCK       16
+#define BLK_AES_RK_SIZE     176     // AES-128 round keys
+#define BLK_CRYPT_SIZE      512     // Keystream bytes, one sector
+#define BLK_CRYPT_BLOCKS    (BLK_CRYPT_SIZE / BLK_AES_BLOCK)
+
+typedef struct {
+    BYTE rk[BLK_AES_RK_SIZE];
+    BYTE nonce[8];
+    DWORD sector;           // Sector the keystream belongs to
+    DWORD valid;            // Bit i set: ks[16*i..16*i+15] is ready
+    BYTE ks[BLK_CRYPT_SIZE];
+} BLK_CRYPT;
+
+/**
+ \brief Expand an AES-128 key.
+ \param rk Receives BLK_AES_RK_SIZE bytes of round keys.
+ \param key 16 byte key.
+ */
+void Blk_Aes128_Key(BYTE *rk, const BYTE *key);
+
+/**
+ \brief Encrypt one block with AES-128.
+ \param rk Round keys from Blk_Aes128_Key.
+ \param in 16 bytes of plaintext.
+ \param out 16 bytes of ciphertext, may be in.
+ */
+void Blk_Aes128_Encrypt(const BYTE *rk, const BYTE *in, BYTE *out);
+
+/**
+ \brief Key a counter mode context.
+ \param key 16 byte key.
+ \param nonce 8 byte nonce.
+ */
+void Blk_Crypt_Init(BLK_CRYPT *c, const BYTE *key, const BYTE *nonce);
+
+/**
+ \brief Build a few more keystream blocks of a sector, lowest first. Meant
+        for the gaps while a card programs or prepares a read.
+ \param sector Sector number, a new sector discards the old keystream.
+ \param blocks Most AES blocks to encrypt in this call.
+ \return TRUE once the whole sector keystream is ready.
+ */
+BOOL Blk_Crypt_Fill(BLK_CRYPT *c, DWORD sector, BYTE blocks);
+
+/**
+ \brief Keystream of a sector, building what is still missing of a byte range.
+ \param sector Sector number.
+ \param ofs First byte needed (0..511).
+ \param n Number of bytes needed, ofs + n at most 512.
+ \return Keystream of the whole sector, index it with the byte offset.
+ */
+const BYTE *Blk_Crypt_Stream(BLK_CRYPT *c, DWORD sector, WORD ofs, WORD n);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Delta + varint packing of sampled data, see blkpack.h
+ */
+
+#include "blkpack.h"
+#include "blkutil.h"
+
+void Blk_Pack_Start(BLK_PACK *p, BYTE *blk, WORD cap, BYTE channels)
+{
+    BYTE c;
+
+    p->blk = blk;
+    p->cap = cap;
+    p->len = BLK_PACK_HDR;
+    p->rows = 0;
+    p->ch = channels;
+    for(c = 0; c < channels; c++)
+        p->prev[c] = 0;
+}
+
+BOOL Blk_Pack_Row(BLK_PACK *p, const SHORT *row)
+{
+    BYTE *q;
+    DWORD z;
+    LONG d;
+    BYTE c;
+
+    // Checking the worst case keeps the byte loop free of bound tests
+    if(p->len + BLK_PACK_ROW_MAX(p->ch) > p->cap)
+        return(FALSE);
+    q = &p->blk[p->len];
+    for(c = 0; c < p->ch; c++) {
+        d = (LONG)row[c] - p->prev[c];
+        p->prev[c] = row[c];
+        z = (d < 0) ? ((DWORD)(-d) << 1) - 1 : (DWORD)d << 1;
+        while(z >= 0x80) {
+            *q++ = (BYTE)z | 0x80;
+            z >>= 7;
+        }
+        *q++ = (BYTE)z;
+    }
+    p->len = (WORD)(q - p->blk);
+    p->rows++;
+    return(TRUE);
+}
+
+WORD Blk_Pack_Finish(BLK_PACK *p)
+{
+    WORD n = p->len - BLK_PACK_HDR;
+
+    p->blk[0] = BLK_PACK_MAGIC;
+    p->blk[1] = p->ch;
+    p->blk[2] = (BYTE)p->rows;
+    p->blk[3] = (BYTE)(p->rows >> 8);
+    p->blk[4] = (BYTE)n;
+    p->blk[5] = (BYTE)(n >> 8);
+    Blk_Fill(&p->blk[p->len], 0, p->cap - p->len);
+    return(p->len);
+}
+
+WORD Blk_Unpack(const BYTE *blk, WORD cap, SHORT *rows, WORD max_rows, BYTE *channels)
+{
+    SHORT prev[BLK_PACK_MAX_CH];
+    const BYTE *q, *end;
+    WORD n, r;
+    DWORD z;
+    BYTE c, ch, shift;
+
+    if((cap < BLK_PACK_HDR) || (blk[0] != BLK_PACK_MAGIC))
+        return(0);
+    ch = blk[1];
+    n = blk[2] | ((WORD)blk[3] << 8);
+    end = &blk[BLK_PACK_HDR] + (blk[4] | ((WORD)blk[5] << 8));
+    if((ch == 0) || (ch > BLK_PACK_MAX_CH) || (n > max_rows) || (end > blk + cap))
+        return(0);
+    for(c = 0; c < ch; c++)
+        prev[c] = 0;
+    q = &blk[BLK_PACK_HDR];
+    for(r = 0; r < n; r++) {
+        for(c = 0; c < ch; c++) {
+            z = 0;
+            shift = 0;
+            do {
+                if((q == end) || (shift > 14))
+                    return(0);
+                z |= (DWORD)(*q & 0x7F) << shift;
+                shift += 7;
+            } while(*q++ & 0x80);
+            prev[c] = (SHORT)(prev[c] + ((z & 1) ? -(LONG)((z + 1) >> 1) : (LONG)(z >> 1)));
+            *rows++ = prev[c];
+        }
+    }
+    *channels = ch;
+    return((q == end) ? n : 0);
+}
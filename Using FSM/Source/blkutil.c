@@ -0,0 +1,314 @@
+/*
+ * Block buffer kernels: checksums, fill and compare for sector buffers
+ */
+
+#include <stdint.h>
+#include "blkutil.h"
+
+#define __BLK_ALIGNED(p)    ((((uintptr_t)(p)) & 3) == 0)
+
+// Bytes 0/2 and 1/3 of a word added into two 16-bit lanes, 510 per lane
+#define __BLK_LANES(w)      (((w) & 0x00FF00FFUL) + (((w) >> 8) & 0x00FF00FFUL))
+#define __BLK_SUM_WORDS     128     // 128 * 510 fits a 16-bit lane
+
+#define __BLK_FLETCHER_WORDS 179    // 358 halfwords before the sums can overflow
+#define __BLK_ADLER_BASE    65521UL
+#define __BLK_ADLER_NMAX    5552    // Bytes before the sums can overflow
+
+// CRC-16/CCITT (poly 0x1021, MSB first)
+const WORD Blk_Crc16_Table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+// CRC-32 (IEEE 802.3, reflected poly 0xEDB88320)
+const DWORD Blk_Crc32_Table[256] = {
+    0x00000000UL, 0x77073096UL, 0xEE0E612CUL, 0x990951BAUL, 0x076DC419UL, 0x706AF48FUL, 0xE963A535UL, 0x9E6495A3UL,
+    0x0EDB8832UL, 0x79DCB8A4UL, 0xE0D5E91EUL, 0x97D2D988UL, 0x09B64C2BUL, 0x7EB17CBDUL, 0xE7B82D07UL, 0x90BF1D91UL,
+    0x1DB71064UL, 0x6AB020F2UL, 0xF3B97148UL, 0x84BE41DEUL, 0x1ADAD47DUL, 0x6DDDE4EBUL, 0xF4D4B551UL, 0x83D385C7UL,
+    0x136C9856UL, 0x646BA8C0UL, 0xFD62F97AUL, 0x8A65C9ECUL, 0x14015C4FUL, 0x63066CD9UL, 0xFA0F3D63UL, 0x8D080DF5UL,
+    0x3B6E20C8UL, 0x4C69105EUL, 0xD56041E4UL, 0xA2677172UL, 0x3C03E4D1UL, 0x4B04D447UL, 0xD20D85FDUL, 0xA50AB56BUL,
+    0x35B5A8FAUL, 0x42B2986CUL, 0xDBBBC9D6UL, 0xACBCF940UL, 0x32D86CE3UL, 0x45DF5C75UL, 0xDCD60DCFUL, 0xABD13D59UL,
+    0x26D930ACUL, 0x51DE003AUL, 0xC8D75180UL, 0xBFD06116UL, 0x21B4F4B5UL, 0x56B3C423UL, 0xCFBA9599UL, 0xB8BDA50FUL,
+    0x2802B89EUL, 0x5F058808UL, 0xC60CD9B2UL, 0xB10BE924UL, 0x2F6F7C87UL, 0x58684C11UL, 0xC1611DABUL, 0xB6662D3DUL,
+    0x76DC4190UL, 0x01DB7106UL, 0x98D220BCUL, 0xEFD5102AUL, 0x71B18589UL, 0x06B6B51FUL, 0x9FBFE4A5UL, 0xE8B8D433UL,
+    0x7807C9A2UL, 0x0F00F934UL, 0x9609A88EUL, 0xE10E9818UL, 0x7F6A0DBBUL, 0x086D3D2DUL, 0x91646C97UL, 0xE6635C01UL,
+    0x6B6B51F4UL, 0x1C6C6162UL, 0x856530D8UL, 0xF262004EUL, 0x6C0695EDUL, 0x1B01A57BUL, 0x8208F4C1UL, 0xF50FC457UL,
+    0x65B0D9C6UL, 0x12B7E950UL, 0x8BBEB8EAUL, 0xFCB9887CUL, 0x62DD1DDFUL, 0x15DA2D49UL, 0x8CD37CF3UL, 0xFBD44C65UL,
+    0x4DB26158UL, 0x3AB551CEUL, 0xA3BC0074UL, 0xD4BB30E2UL, 0x4ADFA541UL, 0x3DD895D7UL, 0xA4D1C46DUL, 0xD3D6F4FBUL,
+    0x4369E96AUL, 0x346ED9FCUL, 0xAD678846UL, 0xDA60B8D0UL, 0x44042D73UL, 0x33031DE5UL, 0xAA0A4C5FUL, 0xDD0D7CC9UL,
+    0x5005713CUL, 0x270241AAUL, 0xBE0B1010UL, 0xC90C2086UL, 0x5768B525UL, 0x206F85B3UL, 0xB966D409UL, 0xCE61E49FUL,
+    0x5EDEF90EUL, 0x29D9C998UL, 0xB0D09822UL, 0xC7D7A8B4UL, 0x59B33D17UL, 0x2EB40D81UL, 0xB7BD5C3BUL, 0xC0BA6CADUL,
+    0xEDB88320UL, 0x9ABFB3B6UL, 0x03B6E20CUL, 0x74B1D29AUL, 0xEAD54739UL, 0x9DD277AFUL, 0x04DB2615UL, 0x73DC1683UL,
+    0xE3630B12UL, 0x94643B84UL, 0x0D6D6A3EUL, 0x7A6A5AA8UL, 0xE40ECF0BUL, 0x9309FF9DUL, 0x0A00AE27UL, 0x7D079EB1UL,
+    0xF00F9344UL, 0x8708A3D2UL, 0x1E01F268UL, 0x6906C2FEUL, 0xF762575DUL, 0x806567CBUL, 0x196C3671UL, 0x6E6B06E7UL,
+    0xFED41B76UL, 0x89D32BE0UL, 0x10DA7A5AUL, 0x67DD4ACCUL, 0xF9B9DF6FUL, 0x8EBEEFF9UL, 0x17B7BE43UL, 0x60B08ED5UL,
+    0xD6D6A3E8UL, 0xA1D1937EUL, 0x38D8C2C4UL, 0x4FDFF252UL, 0xD1BB67F1UL, 0xA6BC5767UL, 0x3FB506DDUL, 0x48B2364BUL,
+    0xD80D2BDAUL, 0xAF0A1B4CUL, 0x36034AF6UL, 0x41047A60UL, 0xDF60EFC3UL, 0xA867DF55UL, 0x316E8EEFUL, 0x4669BE79UL,
+    0xCB61B38CUL, 0xBC66831AUL, 0x256FD2A0UL, 0x5268E236UL, 0xCC0C7795UL, 0xBB0B4703UL, 0x220216B9UL, 0x5505262FUL,
+    0xC5BA3BBEUL, 0xB2BD0B28UL, 0x2BB45A92UL, 0x5CB36A04UL, 0xC2D7FFA7UL, 0xB5D0CF31UL, 0x2CD99E8BUL, 0x5BDEAE1DUL,
+    0x9B64C2B0UL, 0xEC63F226UL, 0x756AA39CUL, 0x026D930AUL, 0x9C0906A9UL, 0xEB0E363FUL, 0x72076785UL, 0x05005713UL,
+    0x95BF4A82UL, 0xE2B87A14UL, 0x7BB12BAEUL, 0x0CB61B38UL, 0x92D28E9BUL, 0xE5D5BE0DUL, 0x7CDCEFB7UL, 0x0BDBDF21UL,
+    0x86D3D2D4UL, 0xF1D4E242UL, 0x68DDB3F8UL, 0x1FDA836EUL, 0x81BE16CDUL, 0xF6B9265BUL, 0x6FB077E1UL, 0x18B74777UL,
+    0x88085AE6UL, 0xFF0F6A70UL, 0x66063BCAUL, 0x11010B5CUL, 0x8F659EFFUL, 0xF862AE69UL, 0x616BFFD3UL, 0x166CCF45UL,
+    0xA00AE278UL, 0xD70DD2EEUL, 0x4E048354UL, 0x3903B3C2UL, 0xA7672661UL, 0xD06016F7UL, 0x4969474DUL, 0x3E6E77DBUL,
+    0xAED16A4AUL, 0xD9D65ADCUL, 0x40DF0B66UL, 0x37D83BF0UL, 0xA9BCAE53UL, 0xDEBB9EC5UL, 0x47B2CF7FUL, 0x30B5FFE9UL,
+    0xBDBDF21CUL, 0xCABAC28AUL, 0x53B39330UL, 0x24B4A3A6UL, 0xBAD03605UL, 0xCDD70693UL, 0x54DE5729UL, 0x23D967BFUL,
+    0xB3667A2EUL, 0xC4614AB8UL, 0x5D681B02UL, 0x2A6F2B94UL, 0xB40BBE37UL, 0xC30C8EA1UL, 0x5A05DF1BUL, 0x2D02EF8DUL
+};
+
+DWORD Blk_Sum(const void *buf, WORD n)
+{
+    const BYTE *p = buf;
+    const DWORD *q;
+    DWORD sum = 0, lanes;
+    WORD k;
+
+    if(__BLK_ALIGNED(p)) {
+        q = (const DWORD *)p;
+        while(n >= 4) {
+            k = (n / 4 > __BLK_SUM_WORDS) ? __BLK_SUM_WORDS : n / 4;
+            n -= k * 4;
+            lanes = 0;
+            for(; k >= 4; k -= 4, q += 4)
+                lanes += __BLK_LANES(q[0]) + __BLK_LANES(q[1]) + __BLK_LANES(q[2]) + __BLK_LANES(q[3]);
+            for(; k; k--, q++)
+                lanes += __BLK_LANES(q[0]);
+            sum += (lanes & 0xFFFF) + (lanes >> 16);
+        }
+        p = (const BYTE *)q;
+    }
+    while(n--)
+        sum += *p++;
+    return(sum);
+}
+
+DWORD Blk_Fletcher32(const void *buf, WORD n)
+{
+    const BYTE *p = buf;
+    const DWORD *q;
+    DWORD s1 = 0xFFFF, s2 = 0xFFFF, w;
+    WORD k;
+
+    if(__BLK_ALIGNED(p)) {
+        q = (const DWORD *)p;
+        while(n >= 4) {
+            k = (n / 4 > __BLK_FLETCHER_WORDS) ? __BLK_FLETCHER_WORDS : n / 4;
+            n -= k * 4;
+            for(; k; k--) {
+                w = *q++;
+                s1 += w & 0xFFFF;
+                s2 += s1;
+                s1 += w >> 16;
+                s2 += s1;
+            }
+            s1 = (s1 & 0xFFFF) + (s1 >> 16);
+            s2 = (s2 & 0xFFFF) + (s2 >> 16);
+        }
+        p = (const BYTE *)q;
+    }
+    while(n) {
+        k = (n / 2 > 2 * __BLK_FLETCHER_WORDS) ? 2 * __BLK_FLETCHER_WORDS : n / 2;
+        if(k == 0) {
+            // Odd tail, high byte 0
+            s1 += *p;
+            s2 += s1;
+            n = 0;
+        }
+        n -= k * 2;
+        for(; k; k--, p += 2) {
+            s1 += p[0] | ((DWORD)p[1] << 8);
+            s2 += s1;
+        }
+        s1 = (s1 & 0xFFFF) + (s1 >> 16);
+        s2 = (s2 & 0xFFFF) + (s2 >> 16);
+    }
+    s1 = (s1 & 0xFFFF) + (s1 >> 16);
+    s2 = (s2 & 0xFFFF) + (s2 >> 16);
+    return((s2 << 16) | s1);
+}
+
+// x mod 65521 without a divide: 2^16 = 15 (mod 65521)
+DWORD Blk_Adler32_Mod(DWORD x)
+{
+    x = (x & 0xFFFF) + 15 * (x >> 16);
+    x = (x & 0xFFFF) + 15 * (x >> 16);
+    return((x >= __BLK_ADLER_BASE) ? x - __BLK_ADLER_BASE : x);
+}
+
+DWORD Blk_Adler32(DWORD adler, const void *buf, WORD n)
+{
+    const BYTE *p = buf;
+    DWORD a = adler & 0xFFFF, b = adler >> 16, w;
+    WORD k;
+
+    while(n) {
+        k = (n > __BLK_ADLER_NMAX) ? __BLK_ADLER_NMAX : n;
+        n -= k;
+        // One word load feeds four bytes
+        if(__BLK_ALIGNED(p)) {
+            for(; k >= 4; k -= 4, p += 4) {
+                w = *(const DWORD *)p;
+                a += w & 0xFF;          b += a;
+                a += (w >> 8) & 0xFF;   b += a;
+                a += (w >> 16) & 0xFF;  b += a;
+                a += w >> 24;           b += a;
+            }
+        }
+        for(; k; k--) {
+            a += *p++;
+            b += a;
+        }
+        a = Blk_Adler32_Mod(a);
+        b = Blk_Adler32_Mod(b);
+    }
+    return((b << 16) | a);
+}
+
+DWORD Blk_Crc16(DWORD crc, const void *buf, WORD n)
+{
+    const BYTE *p = buf;
+
+    while(n--)
+        crc = (WORD)(crc << 8) ^ Blk_Crc16_Table[(BYTE)(crc >> 8) ^ *p++];
+    return(crc);
+}
+
+DWORD Blk_Crc32(DWORD crc, const void *buf, WORD n)
+{
+    const BYTE *p = buf;
+
+    crc = ~crc;
+    while(n--)
+        crc = (crc >> 8) ^ Blk_Crc32_Table[(BYTE)crc ^ *p++];
+    return(~crc);
+}
+
+DWORD Blk_Check_Init(BYTE kind)
+{
+    switch(kind) {
+    case BLK_CK_CRC16:
+        return(0xFFFF);
+    case BLK_CK_ADLER32:
+        return(1);
+    default:
+        return(0);
+    }
+}
+
+DWORD Blk_Check(BYTE kind, DWORD ck, const void *buf, WORD n)
+{
+    switch(kind) {
+    case BLK_CK_SUM:
+        return(ck + Blk_Sum(buf, n));
+    case BLK_CK_CRC16:
+        return(Blk_Crc16(ck, buf, n));
+    case BLK_CK_CRC32:
+        return(Blk_Crc32(ck, buf, n));
+    case BLK_CK_ADLER32:
+        return(Blk_Adler32(ck, buf, n));
+    default:
+        return(ck);
+    }
+}
+
+void Blk_Fill(void *buf, BYTE val, WORD n)
+{
+    BYTE *p = buf;
+    DWORD *q, w = val * 0x01010101UL;
+
+    while(n && !__BLK_ALIGNED(p)) {
+        *p++ = val;
+        n--;
+    }
+    q = (DWORD *)p;
+    for(; n >= 16; n -= 16, q += 4) {
+        q[0] = w;
+        q[1] = w;
+        q[2] = w;
+        q[3] = w;
+    }
+    for(; n >= 4; n -= 4)
+        *q++ = w;
+    p = (BYTE *)q;
+    while(n--)
+        *p++ = val;
+}
+
+void Blk_Copy(void *dst, const void *src, WORD n)
+{
+    BYTE *p = dst;
+    const BYTE *r = src;
+    DWORD *q;
+    const DWORD *s;
+
+    if(__BLK_ALIGNED(p) && __BLK_ALIGNED(r)) {
+        q = (DWORD *)p;
+        s = (const DWORD *)r;
+        for(; n >= 16; n -= 16, q += 4, s += 4) {
+            q[0] = s[0];
+            q[1] = s[1];
+            q[2] = s[2];
+            q[3] = s[3];
+        }
+        for(; n >= 4; n -= 4)
+            *q++ = *s++;
+        p = (BYTE *)q;
+        r = (const BYTE *)s;
+    }
+    while(n--)
+        *p++ = *r++;
+}
+
+BOOL Blk_Equal(const void *a, const void *b, WORD n)
+{
+    const BYTE *p = a, *r = b;
+    const DWORD *q, *s;
+
+    if(__BLK_ALIGNED(p) && __BLK_ALIGNED(r)) {
+        q = (const DWORD *)p;
+        s = (const DWORD *)r;
+        for(; n >= 16; n -= 16, q += 4, s += 4)
+            if((q[0] ^ s[0]) | (q[1] ^ s[1]) | (q[2] ^ s[2]) | (q[3] ^ s[3]))
+                return(FALSE);
+        for(; n >= 4; n -= 4)
+            if(*q++ != *s++)
+                return(FALSE);
+        p = (const BYTE *)q;
+        r = (const BYTE *)s;
+    }
+    while(n--)
+        if(*p++ != *r++)
+            return(FALSE);
+    return(TRUE);
+}
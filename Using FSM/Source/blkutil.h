@@ -0,0 +1,109 @@
+#ifndef BLKUTIL_H
+#define BLKUTIL_H
+#include <integer.h>
+
+/*
+ * Block buffer kernels. Word-aligned buffers are processed 32 bits at a time
+ * (four words per loop pass); unaligned heads fall back to bytes since the
+ * Cortex-M0+ faults on unaligned word access. No division is used, the core
+ * has no divide instruction.
+ */
+
+// Check value kinds, for code that folds a check into its own data loop
+typedef enum {
+    BLK_CK_NONE = 0,
+    BLK_CK_SUM,         // Byte sum
+    BLK_CK_CRC16,       // CRC-16/CCITT, start 0xFFFF, no final XOR
+    BLK_CK_CRC32,       // CRC-32 (IEEE), as zlib crc32()
+    BLK_CK_ADLER32
+} BLK_CK;
+
+extern const WORD Blk_Crc16_Table[256];
+extern const DWORD Blk_Crc32_Table[256];
+
+/**
+ \brief Sum of all bytes, same result as a byte-by-byte loop.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Sum(const void *buf, WORD n);
+
+/**
+ \brief Fletcher-32 over little-endian 16-bit words, odd tail padded with 0.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Fletcher32(const void *buf, WORD n);
+
+/**
+ \brief Adler-32, can be continued across buffers.
+ \param adler 1 for a new checksum, or the result of the previous buffer.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Adler32(DWORD adler, const void *buf, WORD n);
+
+/**
+ \brief Reduce a partial Adler-32 sum modulo 65521, for producers that fold
+        bytes themselves (e.g. while they stream over SPI).
+ \param x Sum, any 32-bit value.
+ */
+DWORD Blk_Adler32_Mod(DWORD x);
+
+/**
+ \brief CRC-16/CCITT, can be continued across buffers.
+ \param crc 0xFFFF for a new CRC, or the result of the previous buffer.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Crc16(DWORD crc, const void *buf, WORD n);
+
+/**
+ \brief CRC-32 (IEEE), can be continued across buffers.
+ \param crc 0 for a new CRC, or the result of the previous buffer.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Crc32(DWORD crc, const void *buf, WORD n);
+
+/**
+ \brief Start value of a check.
+ \param kind BLK_CK_*.
+ */
+DWORD Blk_Check_Init(BYTE kind);
+
+/**
+ \brief Continue a check of any kind over a buffer.
+ \param kind BLK_CK_*, BLK_CK_NONE returns ck unchanged.
+ \param ck Value so far, from Blk_Check_Init to start.
+ \param buf Buffer.
+ \param n Length in bytes.
+ */
+DWORD Blk_Check(BYTE kind, DWORD ck, const void *buf, WORD n);
+
+/**
+ \brief Set every byte of a buffer.
+ \param buf Buffer.
+ \param val Byte value.
+ \param n Length in bytes.
+ */
+void Blk_Fill(void *buf, BYTE val, WORD n);
+
+/**
+ \brief Copy a buffer, word-wise when both are word aligned.
+ \param dst Destination, must not overlap src.
+ \param src Source.
+ \param n Length in bytes.
+ */
+void Blk_Copy(void *dst, const void *src, WORD n);
+
+/**
+ \brief Compare two buffers.
+ \param a First buffer.
+ \param b Second buffer.
+ \param n Length in bytes.
+ \return TRUE when equal.
+ */
+BOOL Blk_Equal(const void *a, const void *b, WORD n);
+
+#endif // BLKUTIL_H
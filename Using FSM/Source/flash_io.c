@@ -0,0 +1,70 @@
+/*
+ * On-chip flash erase and program, see flash_io.h
+ */
+
+#include "flash_io.h"
+#include <MKL25Z4.h>
+
+#define FTFA_CMD_PGM4   0x06    // Program longword
+#define FTFA_CMD_ERSSCR 0x09    // Erase flash sector
+
+// Start the command in FCCOB and wait for CCIF. Runs from RAM, the flash is
+// busy until the command ends. Thumb code of:
+//     movs r1, #0x80 / strb r1, [r0] / 1: ldrb r2, [r0] / tst r2, r1 / beq 1b / bx lr
+static uint16_t __Flash_Run[6] = {0x2180, 0x7001, 0x7802, 0x420A, 0xD0FC, 0x4770};
+
+static BOOL __Flash_Command (BYTE cmd, DWORD addr)
+{
+    uint32_t primask;
+
+    FTFA->FCCOB0 = cmd;
+    FTFA->FCCOB1 = (BYTE)(addr >> 16);
+    FTFA->FCCOB2 = (BYTE)(addr >> 8);
+    FTFA->FCCOB3 = (BYTE)addr;
+    // Vectors and handlers are in flash too
+    primask = __get_PRIMASK();
+    __disable_irq();
+    ((void (*)(volatile uint8_t *))((uintptr_t)__Flash_Run | 1))(&FTFA->FSTAT);
+    __set_PRIMASK(primask);
+    return((FTFA->FSTAT & (FTFA_FSTAT_ACCERR_MASK|FTFA_FSTAT_FPVIOL_MASK|FTFA_FSTAT_MGSTAT0_MASK)) ? FALSE : TRUE);
+}
+
+// Wait for an earlier command and clear its error flags
+static void __Flash_Ready (void)
+{
+    while(!(FTFA->FSTAT & FTFA_FSTAT_CCIF_MASK))
+        ;
+    FTFA->FSTAT = FTFA_FSTAT_ACCERR_MASK | FTFA_FSTAT_FPVIOL_MASK;
+}
+
+BOOL Flash_Erase(DWORD addr)
+{
+    __Flash_Ready();
+    return(__Flash_Command(FTFA_CMD_ERSSCR, addr));
+}
+
+BOOL Flash_Write(DWORD addr, const void *src, WORD n)
+{
+    const BYTE *s = (const BYTE *)src;
+    BYTE w[4], i;
+
+    for(; n; addr += 4) {
+        // Little-endian longword, FCCOB4 takes the most significant byte
+        for(i = 0; i != 4; i++) {
+            if(n) {
+                w[i] = *s++;
+                n--;
+            } else {
+                w[i] = 0xFF;
+            }
+        }
+        __Flash_Ready();
+        FTFA->FCCOB4 = w[3];
+        FTFA->FCCOB5 = w[2];
+        FTFA->FCCOB6 = w[1];
+        FTFA->FCCOB7 = w[0];
+        if(!__Flash_Command(FTFA_CMD_PGM4, addr))
+            return(FALSE);
+    }
+    return(TRUE);
+}
@@ -0,0 +1,72 @@
+/*
+ * Table-driven FSM engine
+ *
+ * A machine is a const table of states. Each step evaluates the guard of the
+ * current state; while it is FALSE the machine stays, parks the task on the
+ * state's wait events and checks the state timeout (a wheel timer started on
+ * entry, cancelled on exit, that wakes the machine with EV_TIMER). Once the guard passes the action runs
+ * and returns the next state. Debug pin pulses and step timing are done
+ * here, uniformly for every state of every machine; a step longer than the
+ * machine budget is counted per state and reported through FSM_Overrun().
+ */
+
+#include <MKL25Z4.h>
+#include "fsm.h"
+#include "sched.h"
+#include "timebase.h"
+#include "debug.h"
+
+__WEAK void FSM_Overrun(FSM_T *m, BYTE state, DWORD cycles)
+{
+    (void)m;
+    (void)state;
+    (void)cycles;
+}
+
+void FSM_Reset(FSM_T *m, BYTE state)
+{
+    TB_Timer_Cancel(&m->timeout);
+    m->state = state;
+}
+
+BYTE FSM_Step(FSM_T *m, void *ctx)
+{
+    const FSM_STATE_T *s = &m->table[m->state];
+    BYTE next;
+#ifdef FSM_TIMING
+    BYTE state = m->state;
+    DWORD t0 = TB_Cycles(), dt;
+#endif
+
+    PTB->PTOR = MASK(m->dbg);
+    if(s->timeout_us && !m->timeout.running && !m->timeout.fired)
+        TB_Timer_Start(&m->timeout, s->timeout_us, EV_TIMER, NULL, NULL);
+    // A state without action is a pure delay, left only through its timeout
+    if((s->guard && !s->guard(ctx)) || !s->action) {
+        if(TB_Timer_Expired(&m->timeout)) {
+            next = s->on_timeout;
+        } else {
+            next = FSM_STAY;
+            if(s->wait)
+                Sched_Wait(s->wait);
+        }
+    } else {
+        next = s->action(ctx);
+    }
+    if(next != FSM_STAY) {
+        TB_Timer_Cancel(&m->timeout);
+        m->state = next;
+    }
+#ifdef FSM_TIMING
+    dt = TB_Cycles() - t0;
+    m->stats[state].steps++;
+    if(dt > m->stats[state].max_cycles)
+        m->stats[state].max_cycles = dt;
+    if(m->budget_us && (dt > m->budget_us * (SystemCoreClock / 1000000UL))) {
+        m->stats[state].overruns++;
+        FSM_Overrun(m, state, dt);
+    }
+#endif
+    PTB->PTOR = MASK(m->dbg);
+    return(m->state);
+}
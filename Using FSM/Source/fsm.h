@@ -0,0 +1,80 @@
+#ifndef FSM_H
+#define FSM_H
+#include <stddef.h>
+#include <integer.h>
+#include "timebase.h"
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define FSM_TIMING                  // Per-state step count and longest step
+
+#define FSM_STAY    (0xFF)          // Action result: remain in the current state
+
+typedef BOOL (*FSM_GUARD)(void *ctx);
+typedef BYTE (*FSM_ACTION)(void *ctx);
+
+// One row of a state table, kept in flash
+typedef struct {
+    FSM_GUARD guard;    // Action runs only when TRUE, NULL: always
+    FSM_ACTION action;  // Returns the next state or FSM_STAY. NULL for pure delay states.
+    DWORD timeout_us;   // Wheel timer started on entry, 0: none. Posts EV_TIMER, checked while the guard is FALSE.
+    BYTE on_timeout;    // Next state when the guard stayed FALSE until the timeout
+    BYTE wait;          // Scheduler events to park on while the guard is FALSE
+} FSM_STATE_T;
+
+typedef struct {
+    DWORD steps;
+    DWORD max_cycles;   // Longest single step (core clocks)
+    DWORD overruns;     // Steps longer than the machine budget
+} FSM_STATE_STATS;
+
+typedef struct {
+    const FSM_STATE_T *table;
+    BYTE num;           // Rows in table
+    BYTE dbg;           // Debug pin pulsed around every step
+    BYTE state;
+    TB_TIMER timeout;   // Timeout of the current state
+    WORD budget_us;     // Longest allowed step, checked with FSM_TIMING
+#ifdef FSM_TIMING
+    FSM_STATE_STATS *stats;
+#endif
+} FSM_T;
+
+// Machine plus its per-state statistics, starting in state 0
+#ifdef FSM_TIMING
+#define FSM_DEFINE(name, table, dbg, budget_us) \
+    FSM_STATE_STATS name##_stats[sizeof(table) / sizeof((table)[0])]; \
+    FSM_T name = {table, sizeof(table) / sizeof((table)[0]), dbg, 0, {0}, budget_us, name##_stats}
+#else
+#define FSM_DEFINE(name, table, dbg, budget_us) \
+    FSM_T name = {table, sizeof(table) / sizeof((table)[0]), dbg, 0, {0}, budget_us}
+#endif
+
+// Build-time check, e.g. that the worst-case bytes of a step fit its budget
+#define FSM_STATIC_ASSERT(cond, name) typedef char fsm_assert_##name[(cond) ? 1 : -1]
+
+/**
+ \brief Run one step of a machine: guard, timeout check, action, transition.
+ \param m Machine.
+ \param ctx Passed to guard and action.
+ \return State after the step.
+ */
+BYTE FSM_Step(FSM_T *m, void *ctx);
+
+/**
+ \brief Called after a step that exceeded the machine budget. Weak, override to log.
+ \param m Machine.
+ \param state State that ran the step.
+ \param cycles Measured step time (core clocks).
+ */
+void FSM_Overrun(FSM_T *m, BYTE state, DWORD cycles);
+
+/**
+ \brief Force a state, cancelling a running timeout.
+ \param m Machine.
+ \param state New state.
+ */
+void FSM_Reset(FSM_T *m, BYTE state);
+
+#endif // FSM_H
@@ -5,11 +5,125 @@
 #include "sd_server.h"
 #include "LEDs.h"
 #include "debug.h"
+#include "power.h"
+#include "sched.h"
+#include "timebase.h"
+#include "blkutil.h"
+#include "blkpack.h"
 
 #define NUM_SECTORS_TO_READ (100)
+#define CONTROL_PERIOD_US (1000)
+
+// Sweep the SD data step size and record its cost, see bench_step[]
+// #define BENCH_STEP_SWEEP
+#define BENCH_SECTORS (50)
+// Encrypt the card data with AES-128 CTR, see SD_Set_Crypt and crypt_cycles
+// #define TEST_CRYPT
+// Log a synthetic sensor stream raw and packed once after init, see bench_log
+// #define BENCH_LOG
+#define LOG_ROWS (4000)      // Sample rows per run
+#define LOG_CH (3)           // Samples per row
+#define LOG_SECTOR (100000)  // First sector used by the log runs
+#define LOG_STEP_ROWS (16)   // Rows packed per task step
+#define LOG_ERASE (32)       // Sectors erased ahead of the last run, covers a packed run
+#define LOG_IDLE_US (250000) // Idle time from that erase request to the run
+#define TASK_CONTROL (0)   // Index of Task_Control in Tasks[]
+#define TASK_SERVER  (1)   // Index of Task_SD_Server in Tasks[]
 
 SD_DEV dev[1];          // SD device descriptor
-uint8_t buffer[512];    // Buffer for SD read or write data
+__ALIGNED(4) uint8_t buffer[512]; // Buffer for SD read or write data, word aligned for blkutil
+
+#ifdef BENCH_STEP_SWEEP
+typedef struct {
+	WORD bytes;             // Step size used (tuned value for the auto run)
+	DWORD us_per_sector;    // Read throughput
+	DWORD control_late_us;  // Worst release latency of Task_Control
+	DWORD server_max_us;    // Longest server step
+} BENCH_STEP;
+
+static const WORD bench_sizes[] = {1, 8, 32, 64, 128, 256, 514, 0}; // 0: auto
+BENCH_STEP bench_step[sizeof(bench_sizes)/sizeof(bench_sizes[0])];
+#endif
+
+#ifdef TEST_CRYPT
+BLK_CRYPT crypt;        // Card key, one context per SD device
+DWORD crypt_cycles;     // Keystream of one sector: SystemCoreClock*512/crypt_cycles bytes/s
+
+// Check the cipher against FIPS-197 C.1, time one sector of keystream
+// and key the card, before the tasks start. With BENCH_STEP_SWEEP the
+// sweep then measures encrypted reads.
+void Test_Crypt_Init(void) {
+	static const BYTE kat_key[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+	static const BYTE kat_in[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+	static const BYTE kat_out[16] = {0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30,
+		0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A};
+	static const BYTE nonce[8] = {'u', 'l', 'i', 'b', 'S', 'D', 0, 1}; // Test key and nonce only
+	BYTE rk[BLK_AES_RK_SIZE], out[BLK_AES_BLOCK];
+	DWORD t0;
+
+	Blk_Aes128_Key(rk, kat_key);
+	Blk_Aes128_Encrypt(rk, kat_in, out);
+	if (!Blk_Equal(out, kat_out, BLK_AES_BLOCK)) {
+		Control_RGB_LEDs(1, 0, 0); // Red: cipher broken
+		while (1)
+			;
+	}
+	Blk_Crypt_Init(&crypt, kat_key, nonce);
+	t0 = TB_Cycles();
+	Blk_Crypt_Stream(&crypt, 0, 0, BLK_CRYPT_SIZE);
+	crypt_cycles = TB_Cycles() - t0;
+	SD_Set_Crypt(dev, &crypt);
+}
+#endif
+
+#ifdef BENCH_LOG
+typedef struct {
+	DWORD sectors;      // Sectors written
+	DWORD cycles;       // CPU cycles to build them, source included
+	DWORD write_us;     // Time from write request to completion
+	DWORD erase_us;     // Time from erase request to completion, before the run
+} BENCH_LOG_RUN;
+// [0] raw rows, [1] packed with blkpack, [2] packed into sectors erased
+// while idle. Cycles per input byte: cycles / (LOG_ROWS * LOG_CH * 2)
+BENCH_LOG_RUN bench_log[3];
+
+// Accelerometer on a slowly vibrating mount: triangle waves on two axes,
+// gravity on the third, a few counts of noise on all
+static void Sensor_Row(SHORT *row, DWORD i, WORD *lfsr) {
+	WORD t = i & 511;
+	SHORT tri = (SHORT)((t < 256) ? t : 511 - t);
+	
+	*lfsr = (*lfsr >> 1) ^ (-(*lfsr & 1) & 0xB400);
+	row[0] = tri * 8 - 1024 + (*lfsr & 7) - 4;
+	row[1] = tri * 4 - 512 + ((*lfsr >> 3) & 3) - 2;
+	row[2] = 1000 + ((*lfsr >> 5) & 15) - 8;
+}
+
+// Append a row to the sector in buffer, FALSE when it is full
+static BOOL Log_Add(BOOL packed, BLK_PACK *pack, WORD *len, const SHORT *row) {
+	BYTE c;
+	
+	if (packed)
+		return Blk_Pack_Row(pack, row);
+	if (*len + 2 * LOG_CH > SD_PAYLOAD_SIZE)
+		return FALSE;
+	for (c = 0; c < LOG_CH; c++) {
+		buffer[(*len)++] = (BYTE)row[c];
+		buffer[(*len)++] = (BYTE)((WORD)row[c] >> 8);
+	}
+	return TRUE;
+}
+
+// Close the sector in buffer, ready to write
+static void Log_Close(BOOL packed, BLK_PACK *pack, WORD len) {
+	if (packed)
+		Blk_Pack_Finish(pack);
+	else
+		Blk_Fill(&buffer[len], 0, SD_PAYLOAD_SIZE - len);
+}
+#endif
 
 void Task_Makework(){
 	static int n=2;
@@ -33,20 +147,47 @@ void Task_Makework(){
 			// Done with approximating pi
 			done = 1; 
 		}
-	}	
+	} else {
+		Sched_Wait(0); // Nothing left to do
+	}
 	PTB->PCOR = MASK(DBG_7);
 	// clear task debug bit
 }
 
+void Task_Control(void) {
+	// Placeholder for the 1 ms control loop: sample, compute, actuate.
+	// Released by the scheduler every CONTROL_PERIOD_US regardless of SD activity.
+	static uint32_t ticks = 0;
+
+	PTB->PTOR = MASK(DBG_1);
+	ticks++;
+	PTB->PTOR = MASK(DBG_1);
+}
+
 void Task_Test_SD(void) {
 	// Write test data to given block (sector_num) in flash. 
 	// Read it back, compute simple checksum to confirm it is correct.
 	static enum {S_INIT, S_INIT_WAIT, S_TEST_READ, S_TEST_READ_WAIT, 
 		S_TEST_WRITE, S_TEST_WRITE_WAIT, S_TEST_VERIFY, S_TEST_VERIFY_WAIT,
+		S_BENCH_SET, S_BENCH_READ, S_BENCH_WAIT, S_LOG_FILL, S_LOG_WAIT, S_LOG_ERASE, S_LOG_IDLE,
 		S_ERROR} next_state = S_INIT;
-	static int i;
 	static DWORD sector_num = 0, read_sector_count=0; 
 	static uint32_t sum=0;
+#ifdef BENCH_STEP_SWEEP
+	static int b = 0, count;
+	static DWORD t0;
+#endif
+#ifdef BENCH_LOG
+	static SHORT row[LOG_CH];
+	static BLK_PACK pack;
+	static DWORD log_row = 0, log_sector = LOG_SECTOR, log_t0;
+	static WORD lfsr = 0xACE1, len = 0;
+	static BOOL held = FALSE; // held: row did not fit the last sector
+	static BYTE run = 0;      // Index into bench_log
+	static TB_TIMER idle;
+	DWORD c0;
+	int n;
+#endif
 	//	static char err_color_code = 0; // xxxxxRGB
 	PTB->PSOR = MASK(DBG_6);
 	switch (next_state) {
@@ -58,29 +199,43 @@ void Task_Test_SD(void) {
 				g_trans.Data = buffer;
 				// request SD card initialization
 				g_trans.Request = REQ_INIT;
+				Sched_Signal(EV_REQUEST);
 				next_state = S_INIT_WAIT;
+			} else {
+				Sched_Wait(EV_DONE);
 			}
 			break;
 		case S_INIT_WAIT:
 			if ((g_trans.Status == STAT_IDLE) && (g_trans.Request == REQ_NONE)) {
 				if (g_trans.ErrorCode == SD_OK) {
 					Control_RGB_LEDs(0, 1, 1); // Cyan: initialized OK
+#if defined(BENCH_LOG)
+					Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+					next_state = S_LOG_FILL;
+#elif defined(BENCH_STEP_SWEEP)
+					next_state = S_BENCH_SET;
+#else
 					next_state = S_TEST_READ;
+#endif
 				} else {
 					next_state = S_ERROR;
 				}
-			} // else keep waiting in this state, since server not done
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
 			break;
 		case S_TEST_READ:
 			// wait until SD server is idle
 			if (g_trans.Status == STAT_IDLE) {
 				// erase buffer
-				for (i=0; i<SD_BLK_SIZE; i++)
-					buffer[i] = 0;
+				Blk_Fill(buffer, 0, SD_BLK_SIZE);
 				// request SD card read
 				g_trans.Sector = sector_num;
 				g_trans.Request = REQ_READ;				
+				Sched_Signal(EV_REQUEST);
 				next_state = S_TEST_READ_WAIT;
+			} else {
+				Sched_Wait(EV_DONE);
 			}
 			break;
 		case S_TEST_READ_WAIT:
@@ -97,14 +252,15 @@ void Task_Test_SD(void) {
 				} else {
 					next_state = S_ERROR;
 				}
-			} // else keep waiting in this state, since server not done
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
 			break;
 		case S_TEST_WRITE:
 			// wait until SD server is idle
 			if (g_trans.Status == STAT_IDLE) {
 				// Initialize data buffer
-				for (i=0; i<SD_BLK_SIZE; i++)
-					buffer[i] = 0;
+				Blk_Fill(buffer, 0, SD_BLK_SIZE);
 				// Load sample data into buffer
 				*(uint64_t *)(&buffer[0]) = 0xFEEDDC0D;
 				*(uint64_t *)(&buffer[508]) = 0xACE0FC0D;
@@ -112,7 +268,10 @@ void Task_Test_SD(void) {
 				// request SD card write
 				g_trans.Sector = sector_num;
 				g_trans.Request = REQ_WRITE;				
+				Sched_Signal(EV_REQUEST);
 				next_state = S_TEST_WRITE_WAIT;
+			} else {
+				Sched_Wait(EV_DONE);
 			}
 			break;
 		case S_TEST_WRITE_WAIT:			
@@ -123,26 +282,29 @@ void Task_Test_SD(void) {
 				} else {
 					next_state = S_ERROR;
 				}
-			} // else keep waiting in this state, since server not done
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
 			break;
 		case S_TEST_VERIFY:
 			// wait until SD server is idle
 			if (g_trans.Status == STAT_IDLE) {
-				// erase buffer
-				for (i=0; i<SD_BLK_SIZE; i++)
-					buffer[i] = 0;
-				// request SD card read
+				// request SD card read, summed as it arrives
 				g_trans.Sector = sector_num;
+				g_trans.Check = BLK_CK_SUM;
 				g_trans.Request = REQ_READ;				
+				Sched_Signal(EV_REQUEST);
 				next_state = S_TEST_VERIFY_WAIT;
+			} else {
+				Sched_Wait(EV_DONE);
 			}
 			break;
 		case S_TEST_VERIFY_WAIT:
 			if ((g_trans.Status == STAT_IDLE) && (g_trans.Request == REQ_NONE)) {
 				if (g_trans.ErrorCode == SD_OK) { // Read was OK
 					Control_RGB_LEDs(0, 0, 1);// Blue: Read OK
-					for (i = 0, sum = 0; i < SD_BLK_SIZE; i++)
-						sum += buffer[i];			
+					sum = g_trans.Checksum;
+					g_trans.Check = BLK_CK_NONE;
 					if (sum == 0x0569) { // Checksum is OK
 						Control_RGB_LEDs(1, 1, 1); // White: Checksum OK
 						next_state = S_TEST_READ;
@@ -150,9 +312,145 @@ void Task_Test_SD(void) {
 					} else {
 						next_state = S_ERROR;
 					}
+				} else {
+					next_state = S_ERROR; // Server already retried
 				}
-			} // else keep waiting in this state, since server not done
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
+			break;
+#ifdef BENCH_STEP_SWEEP
+		case S_BENCH_SET:
+			if (g_trans.Status == STAT_IDLE) {
+				SD_Set_Step(dev, bench_sizes[b]);
+				Sched_Reset_Stats(TASK_CONTROL);
+				Sched_Reset_Stats(TASK_SERVER);
+				count = 0;
+				t0 = TB_Now_us();
+				next_state = S_BENCH_READ;
+			} else {
+				Sched_Wait(EV_DONE);
+			}
 			break;
+		case S_BENCH_READ:
+			if (g_trans.Status == STAT_IDLE) {
+				g_trans.Sector = sector_num + count;
+				g_trans.Request = REQ_READ;
+				Sched_Signal(EV_REQUEST);
+				next_state = S_BENCH_WAIT;
+			} else {
+				Sched_Wait(EV_DONE);
+			}
+			break;
+		case S_BENCH_WAIT:
+			if ((g_trans.Status == STAT_IDLE) && (g_trans.Request == REQ_NONE)) {
+				if (g_trans.ErrorCode != SD_OK) {
+					next_state = S_ERROR;
+				} else if (++count < BENCH_SECTORS) {
+					next_state = S_BENCH_READ;
+				} else {
+					bench_step[b].bytes = dev->step;
+					bench_step[b].us_per_sector = (TB_Now_us() - t0) / BENCH_SECTORS;
+					bench_step[b].control_late_us = Sched_Stats(TASK_CONTROL)->max_late_us;
+					bench_step[b].server_max_us = Sched_Stats(TASK_SERVER)->max_us;
+					if (++b < sizeof(bench_sizes)/sizeof(bench_sizes[0])) {
+						next_state = S_BENCH_SET;
+					} else {
+						SD_Set_Step(dev, SD_IO_STEP_BYTES); // back to the configured step
+						next_state = S_TEST_READ;
+					}
+				}
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
+			break;
+#endif
+#ifdef BENCH_LOG
+		case S_LOG_FILL:
+			if (g_trans.Status == STAT_IDLE) {
+				// Build the sector a few rows per step
+				c0 = TB_Cycles();
+				for (n = 0; n < LOG_STEP_ROWS; n++) {
+					if (!held) {
+						if (log_row == LOG_ROWS)
+							break;
+						Sensor_Row(row, log_row++, &lfsr);
+					}
+					held = !Log_Add(run != 0, &pack, &len, row);
+					if (held)
+						break;
+				}
+				bench_log[run].cycles += TB_Cycles() - c0;
+				if (held || (log_row == LOG_ROWS)) {
+					Log_Close(run != 0, &pack, len);
+					g_trans.Sector = log_sector++;
+					g_trans.Request = REQ_WRITE;
+					Sched_Signal(EV_REQUEST);
+					log_t0 = TB_Now_us();
+					next_state = S_LOG_WAIT;
+				}
+			} else {
+				Sched_Wait(EV_DONE);
+			}
+			break;
+		case S_LOG_WAIT:
+			if ((g_trans.Status == STAT_IDLE) && (g_trans.Request == REQ_NONE)) {
+				if (g_trans.ErrorCode != SD_OK) {
+					next_state = S_ERROR;
+					break;
+				}
+				bench_log[run].write_us += TB_Now_us() - log_t0;
+				bench_log[run].sectors++;
+				len = 0;
+				Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+				next_state = S_LOG_FILL;
+				if (!held && (log_row == LOG_ROWS)) {
+					log_row = 0;
+					lfsr = 0xACE1;
+					if (run == 0) { // Same stream again, packed
+						run = 1;
+					} else if (run == 1) { // Packed again, into an erased extent
+						run = 2;
+						next_state = S_LOG_ERASE;
+					} else {
+#ifdef BENCH_STEP_SWEEP
+						next_state = S_BENCH_SET;
+#else
+						next_state = S_TEST_READ;
+#endif
+					}
+				}
+			} else {
+				Sched_Wait(EV_DONE); // server not done
+			}
+			break;
+		case S_LOG_ERASE:
+			// The idle timer runs while the card erases
+			g_trans.Sector = log_sector;
+			g_trans.Count = LOG_ERASE;
+			g_trans.Request = REQ_ERASE;
+			Sched_Signal(EV_REQUEST);
+			log_t0 = TB_Now_us();
+			TB_Timer_Start(&idle, LOG_IDLE_US, EV_TIMER, NULL, NULL);
+			next_state = S_LOG_IDLE;
+			break;
+		case S_LOG_IDLE:
+			if ((g_trans.Status == STAT_IDLE) && (g_trans.Request == REQ_NONE)) {
+				if (g_trans.ErrorCode != SD_OK) {
+					next_state = S_ERROR;
+					break;
+				}
+				if (bench_log[2].erase_us == 0)
+					bench_log[2].erase_us = TB_Now_us() - log_t0;
+				if (TB_Timer_Expired(&idle))
+					next_state = S_LOG_FILL;
+				else
+					Sched_Wait(EV_TIMER);
+			} else {
+				Sched_Wait(EV_DONE | EV_TIMER);
+			}
+			break;
+#endif
 		default:
 		case S_ERROR:
 			Control_RGB_LEDs(1,0,0);
@@ -164,14 +462,24 @@ void Task_Test_SD(void) {
 	// clear task debug bit
 }
 
+// Period, relative deadline and per-step budget in us. With SCHED_EDF the
+// earliest deadline runs first; table order breaks ties and is the priority
+// order when EDF is disabled.
+const TASK_T Tasks[] = {
+	{Task_Control,   CONTROL_PERIOD_US, 500,   50},
+	{Task_SD_Server, 0,                 2000,  SD_IO_INIT_BUDGET_US},
+	{Task_Test_SD,   0,                 10000, 100},
+	{Task_Makework,  0,                 0,     100},  // background
+};
+
 void Scheduler(void) {
-	while (1) {
-		
-		Task_SD_Server();
-		Task_Test_SD();
-		Task_Makework();
-		
-	}
+	TB_Init();
+	Power_Init();
+#ifdef TEST_CRYPT
+	Test_Crypt_Init();
+#endif
+	Sched_Init(Tasks, sizeof(Tasks)/sizeof(Tasks[0]));
+	Sched_Run();
 }
 
 int main(void) {
@@ -0,0 +1,62 @@
+/*
+ * Idle-time power management for the FSM build
+ *
+ * The scheduler sleeps here when no task is ready. The card cannot interrupt,
+ * so the timebase SysTick (TB_TICK_HZ) signals EV_TICK to pace busy/token
+ * polls and deadline checks; SPI_Timer timeouts wake the core through the
+ * LPTMR interrupt and signal EV_TIMER.
+ */
+
+#include <MKL25Z4.h>
+#include "power.h"
+#include "sched.h"
+#include "timebase.h"
+
+static volatile DWORD __Power_Sleeps;
+static volatile uint64_t __Power_Asleep;   // SysTick counts (core clocks)
+
+// The wake interrupt only has to end WFI. Disable it but leave TCF set,
+// SPI_Timer_Status() tests the flag.
+void LPTMR0_IRQHandler(void) {
+    LPTMR0_CSR &= ~(LPTMR_CSR_TIE_MASK | LPTMR_CSR_TCF_MASK);
+    Sched_Signal(EV_TIMER);
+}
+
+void Power_Init(void)
+{
+    NVIC_ClearPendingIRQ(LPTMR0_IRQn);
+    NVIC_EnableIRQ(LPTMR0_IRQn);
+}
+
+void Power_Idle(void)
+{
+    DWORD before, after;
+
+    // Interrupts stay masked so none is serviced between the sample and WFI,
+    // a pending one still ends the sleep.
+    __disable_irq();
+    (void)SysTick->CTRL;                // Clear COUNTFLAG
+    before = SysTick->VAL;
+    __WFI();
+    after = SysTick->VAL;
+    if(SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+        __Power_Asleep += before + (SysTick->LOAD + 1 - after);
+    else
+        __Power_Asleep += before - after;
+    __Power_Sleeps++;
+    __enable_irq();
+}
+
+void Power_Get_Stats(POWER_STATS *st)
+{
+    uint64_t total;
+    DWORD clk = SystemCoreClock / 1000000UL;
+
+    __disable_irq();
+    total = (uint64_t)TB_Ticks() * (SysTick->LOAD + 1) + (SysTick->LOAD - SysTick->VAL);
+    st->sleeps = __Power_Sleeps;
+    st->asleep_us = __Power_Asleep / clk;
+    __enable_irq();
+    total /= clk;
+    st->awake_us = (total > st->asleep_us) ? (total - st->asleep_us) : 0;
+}
@@ -0,0 +1,34 @@
+#ifndef POWER_H
+#define POWER_H
+#include <integer.h>
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define POWER_IDLE_WFI              // Scheduler sleeps when no task is ready
+
+typedef struct {
+    DWORD sleeps;       // WFI entries
+    uint64_t asleep_us; // Time spent in WFI
+    uint64_t awake_us;  // Time spent running tasks and ISRs
+} POWER_STATS;
+
+/**
+ \brief Enable the LPTMR wake interrupt. The SysTick wake-up clock is the
+        timebase, start it first with TB_Init.
+ */
+void Power_Init(void);
+
+/**
+ \brief Sleep until the next interrupt: SysTick, LPTMR (SPI_Timer) or SPI.
+        Returns with interrupts enabled.
+ */
+void Power_Idle(void);
+
+/**
+ \brief Snapshot of the sleep accounting (energy proxy).
+ \param st Filled with the counters and asleep/awake time since TB_Init.
+ */
+void Power_Get_Stats(POWER_STATS *st);
+
+#endif // POWER_H
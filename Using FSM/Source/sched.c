@@ -0,0 +1,192 @@
+/*
+ * Event-driven cooperative scheduler for the FSM build
+ *
+ * Replaces calling every task on every pass. Each task either stays ready
+ * (it has more work) or parks itself on a set of events with Sched_Wait().
+ * Periodic tasks are released by the time base instead. Only ready tasks
+ * are dispatched; with SCHED_EDF the one with the earliest absolute deadline
+ * runs first, otherwise the lowest table index.
+ *
+ * Each step of an event task gets a fresh deadline when it becomes ready, so
+ * a long multi-step job (a sector transfer) cannot build up urgency and
+ * starve a periodic task. Since tasks are never preempted, the release
+ * jitter of a periodic task is bounded by the longest step of any other
+ * task; budget_us declares that step length and overruns are reported.
+ */
+
+#include <MKL25Z4.h>
+#include "sched.h"
+#include "power.h"
+#include "timebase.h"
+
+static const TASK_T *__Sched_Task;
+static BYTE __Sched_Num;
+static BYTE __Sched_Current;
+static BOOL __Sched_Parked;
+static volatile DWORD __Sched_Ready;                // One bit per task
+static DWORD __Sched_Dated;                         // Ready tasks with a deadline assigned
+static volatile BYTE __Sched_Wait[SCHED_MAX_TASKS]; // Events each task waits for
+static volatile BYTE __Sched_Pend[SCHED_MAX_TASKS]; // Events seen since the task was dispatched
+static DWORD __Sched_Deadline[SCHED_MAX_TASKS];     // Absolute (us)
+static DWORD __Sched_Release[SCHED_MAX_TASKS];      // Next release of periodic tasks (us)
+static TASK_STATS __Sched_Stats[SCHED_MAX_TASKS];
+
+// Event task without a deadline, runs only when nothing dated is ready
+#define __SCHED_BACKGROUND(t) (!(t)->period_us && !(t)->deadline_us)
+
+__WEAK void Sched_Overrun(BYTE id, DWORD us)
+{
+    (void)id;
+    (void)us;
+}
+
+void Sched_Init(const TASK_T *tasks, BYTE n)
+{
+    DWORD now = TB_Now_us();
+    BYTE i;
+
+    __Sched_Task = tasks;
+    __Sched_Num = (n < SCHED_MAX_TASKS) ? n : SCHED_MAX_TASKS;
+    __Sched_Ready = 0;
+    __Sched_Dated = 0;
+    for(i = 0; i < __Sched_Num; i++) {
+        __Sched_Wait[i] = 0;
+        if(tasks[i].period_us)
+            __Sched_Release[i] = now + tasks[i].period_us;
+        else
+            __Sched_Ready |= 1UL << i;
+    }
+}
+
+const TASK_STATS *Sched_Stats(BYTE id)
+{
+    return(&__Sched_Stats[id]);
+}
+
+void Sched_Reset_Stats(BYTE id)
+{
+    static const TASK_STATS none;
+
+    __Sched_Stats[id] = none;
+}
+
+void Sched_Wait(BYTE events)
+{
+    __Sched_Wait[__Sched_Current] |= events;
+    __Sched_Parked = TRUE;
+}
+
+void Sched_Signal(BYTE events)
+{
+    uint32_t pm = __get_PRIMASK();
+    BYTE i;
+
+    __disable_irq();
+    for(i = 0; i < __Sched_Num; i++) {
+        __Sched_Pend[i] |= events;
+        if(__Sched_Wait[i] & events)
+            __Sched_Ready |= 1UL << i;
+    }
+    __set_PRIMASK(pm);
+}
+
+// Release due periodic tasks and date newly ready event tasks
+static void __Sched_Update(DWORD now)
+{
+    const TASK_T *t;
+    DWORD bit;
+    BYTE i;
+
+    for(i = 0; i < __Sched_Num; i++) {
+        t = &__Sched_Task[i];
+        bit = 1UL << i;
+        if(t->period_us) {
+            if((LONG)(now - __Sched_Release[i]) >= 0) {
+                if(__Sched_Ready & bit)
+                    __Sched_Stats[i].misses++;
+                __Sched_Ready |= bit;
+                __Sched_Dated |= bit;
+                __Sched_Deadline[i] = __Sched_Release[i] + (t->deadline_us ? t->deadline_us : t->period_us);
+                __Sched_Release[i] += t->period_us;
+            }
+        } else if((__Sched_Ready & bit) && !(__Sched_Dated & bit)) {
+            __Sched_Dated |= bit;
+            __Sched_Deadline[i] = now + t->deadline_us;
+        }
+    }
+}
+
+// Next task to dispatch from a non-empty ready mask
+static BYTE __Sched_Pick(DWORD ready)
+{
+    BYTE i, best;
+
+    for(best = 0; !(ready & (1UL << best)); best++)
+        ;
+#ifdef SCHED_EDF
+    for(i = best + 1; i < __Sched_Num; i++) {
+        if(!(ready & (1UL << i)) || __SCHED_BACKGROUND(&__Sched_Task[i]))
+            continue;
+        if(__SCHED_BACKGROUND(&__Sched_Task[best]))
+            best = i;
+        else if((LONG)(__Sched_Deadline[i] - __Sched_Deadline[best]) < 0)
+            best = i;
+    }
+#else
+    (void)i;
+#endif
+    return(best);
+}
+
+void Sched_Run(void)
+{
+    TASK_STATS *st;
+    DWORD ready, start, dt;
+    BYTE i;
+
+    while(1) {
+        __disable_irq();
+        __Sched_Update(TB_Now_us());
+        ready = __Sched_Ready;
+        if(ready == 0) {
+#ifdef POWER_IDLE_WFI
+            Power_Idle();       // Returns with interrupts enabled
+#else
+            __enable_irq();
+#endif
+            continue;
+        }
+        i = __Sched_Pick(ready);
+        __Sched_Ready &= ~(1UL << i);
+        __Sched_Dated &= ~(1UL << i);
+        __Sched_Wait[i] = 0;
+        __Sched_Pend[i] = 0;
+        __enable_irq();
+
+        st = &__Sched_Stats[i];
+        start = TB_Now_us();
+        if(__Sched_Task[i].period_us) {
+            // Release time is one period before the next one
+            dt = start - (__Sched_Release[i] - __Sched_Task[i].period_us);
+            if(dt > st->max_late_us)
+                st->max_late_us = dt;
+        }
+        __Sched_Current = i;
+        __Sched_Parked = FALSE;
+        __Sched_Task[i].fn();
+        dt = TB_Now_us() - start;
+        st->runs++;
+        if(dt > st->max_us)
+            st->max_us = dt;
+        if(__Sched_Task[i].budget_us && (dt > __Sched_Task[i].budget_us)) {
+            st->overruns++;
+            Sched_Overrun(i, dt);
+        }
+
+        __disable_irq();
+        // Event task still has work, or an awaited event fired while it was running
+        if(!__Sched_Task[i].period_us && (!__Sched_Parked || (__Sched_Pend[i] & __Sched_Wait[i])))
+            __Sched_Ready |= 1UL << i;
+        __enable_irq();
+    }
+}
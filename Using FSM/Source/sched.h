@@ -0,0 +1,80 @@
+#ifndef SCHED_H
+#define SCHED_H
+#include <integer.h>
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define SCHED_MAX_TASKS (8)
+#define SCHED_EDF                   // Earliest deadline first, else table order
+
+// Wake events. A waiting task becomes ready when any event in its mask is signalled.
+#define EV_TICK     (0x01)  // SysTick (power.c), paces card busy/token polling
+#define EV_TIMER    (0x02)  // Wheel timer expired (state timeout, backoff) or LPTMR compare
+#define EV_REQUEST  (0x04)  // Transaction posted to the SD server
+#define EV_DONE     (0x08)  // SD server finished a transaction
+
+typedef void (*TASK_FN)(void);
+
+typedef struct {
+    TASK_FN fn;
+    DWORD period_us;    // Released every period, 0 for event-driven tasks
+    DWORD deadline_us;  // Relative to release/ready, 0: period, or background if aperiodic
+    DWORD budget_us;    // Longest allowed single step, 0 if unchecked
+} TASK_T;
+
+typedef struct {
+    DWORD runs;
+    DWORD overruns;     // Steps longer than budget_us
+    DWORD misses;       // Periodic releases that found the previous one still pending
+    DWORD max_us;       // Longest step
+    DWORD max_late_us;  // Longest release-to-start delay of a periodic task
+} TASK_STATS;
+
+/**
+ \brief Register the tasks. Table order breaks ties, index 0 first.
+ \param tasks Task table, must stay valid.
+ \param n Number of tasks (up to SCHED_MAX_TASKS). Event tasks start ready,
+          periodic tasks are first released one period later.
+ */
+void Sched_Init(const TASK_T *tasks, BYTE n);
+
+/**
+ \brief Dispatch ready tasks forever, sleeping when none is ready.
+ */
+void Sched_Run(void);
+
+/**
+ \brief Park the running task until one of the events occurs. An event task
+        that returns without calling this stays ready and runs again.
+        Periodic tasks run once per release and do not need it.
+ \param events Event mask, 0 to never run again.
+ */
+void Sched_Wait(BYTE events);
+
+/**
+ \brief Signal events. Safe from tasks and ISRs.
+ \param events Event mask.
+ */
+void Sched_Signal(BYTE events);
+
+/**
+ \brief Timing statistics of a task.
+ \param id Index in the task table.
+ */
+const TASK_STATS *Sched_Stats(BYTE id);
+
+/**
+ \brief Clear the timing statistics of a task, e.g. between benchmark runs.
+ \param id Index in the task table.
+ */
+void Sched_Reset_Stats(BYTE id);
+
+/**
+ \brief Called after a step that exceeded its budget. Weak, override to log.
+ \param id Index in the task table.
+ \param us Measured step time.
+ */
+void Sched_Overrun(BYTE id, DWORD us);
+
+#endif // SCHED_H
@@ -15,7 +15,12 @@
 #include "sd_io.h"
 #include <MKL25Z4.h>
 #include "debug.h"
+#include "blkutil.h"
+#include "flash_io.h"
 #include "sd_server.h"
+#include "sched.h"
+#include "fsm.h"
+#include "timebase.h"
 
 /* Results of SD functions */
 char SD_Errors[7][8] = {
@@ -28,16 +33,13 @@ char SD_Errors[7][8] = {
     "NORESP"       /* 6: No response           */
 };
 
+/* Last command response and data token, kept for SD_Classify */
+static BYTE __SD_Last_R1;
+static BYTE __SD_Last_Token;
+
 /******************************************************************************
  Private Methods Prototypes - Direct work with SD card
 ******************************************************************************/
-
-/**
-    \brief Simple function to calculate power of two.
-    \param e Exponent.
-    \return Math function result.
-*/
-DWORD __SD_Power_Of_Two(BYTE e);
 FSM Read;
 FSM Write;
 FSM Init;
@@ -67,23 +69,121 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg);
 
 /**
     \brief Get the total numbers of sectors in SD card.
-    \param dev Device descriptor.
+    \param dev Device descriptor, with the CSD already read.
     \return Quantity of sectors. Zero if fail.
  */
 DWORD __SD_Sectors (SD_DEV *dev);
 
+/**
+    \brief Card address of a sector for SDHC and SDXC: the sector number.
+    \param sector Sector number.
+    \return Argument of the block commands.
+ */
+DWORD __SD_Addr_Block (DWORD sector);
+
+/**
+    \brief Card address of a sector for SDSC and MMC: the byte offset.
+    \param sector Sector number.
+    \return Argument of the block commands.
+ */
+DWORD __SD_Addr_Byte (DWORD sector);
+
+/**
+    \brief Take CSD, SCR and SD Status from the cached record if the CID and
+           OCR read at init are those of the cached card.
+    \param dev Device descriptor, with CID and OCR read.
+    \return TRUE on a match, dev->info is then decoded.
+ */
+BOOL __SD_Cache_Match (SD_DEV *dev);
+
+/**
+    \brief Store the registers of a freshly read card.
+    \param dev Device descriptor, with all registers read.
+    \param ssr SD Status.
+    \param valid SD_REG_SCR and SD_REG_SSR if read.
+ */
+void __SD_Cache_Refresh (SD_DEV *dev, const BYTE *ssr, BYTE valid);
+
+/**
+    \brief Single poll for the end of a deferred write.
+    \param dev Device descriptor.
+    \return SD_OK when ready, SD_BUSY while programming, SD_ERROR on timeout.
+ */
+SDRESULTS __SD_Poll_Busy (SD_DEV *dev);
+
+/**
+    \brief Decode TRAN_SPEED, the max clock in default speed mode.
+    \param dev Device descriptor, with the CSD already read.
+    \return Max clock the card supports (Hz).
+ */
+DWORD __SD_Tran_Speed (SD_DEV *dev);
+
+/**
+    \brief Start dev->info over with the decoded CID and CSD. SCR and SD
+           Status follow from their init states.
+    \param dev Device descriptor, with CID and CSD read.
+ */
+void __SD_Info_Ids (SD_DEV *dev);
+
+/**
+    \brief Run the data clock as fast as card, MCU and limit allow.
+    \param dev Device descriptor.
+ */
+void __SD_Set_Clock (SD_DEV *dev);
+
+#ifdef SD_IO_TRAILER
+/**
+    \brief Fill a sector trailer with the next sequence number and check value.
+    \param dev Device descriptor.
+    \param tr SD_TRAILER_SIZE bytes after the payload.
+    \param adler Adler-32 of the payload.
+    \param sector Sector the block is written to.
+ */
+void __SD_Tag_Build (SD_DEV *dev, BYTE *tr, DWORD adler, DWORD sector);
+
+/**
+    \brief Check a received sector trailer.
+    \param dev Device descriptor, last_seq is updated on success.
+    \param tr SD_TRAILER_SIZE bytes after the payload.
+    \param adler Adler-32 of the payload as received.
+    \param sector Sector the block was read from.
+    \return SD_OK, or SD_CORRUPT for a torn, misdirected or untagged block.
+ */
+SDRESULTS __SD_Tag_Verify (SD_DEV *dev, const BYTE *tr, DWORD adler, DWORD sector);
+
+/**
+    \brief Claim the next SD_IO_SEQ_RESERVE trailer sequences in the card
+           record, continuing from the highest number claimed before.
+    \param dev Device descriptor, seq and seq_limit are updated.
+ */
+void __SD_Seq_Claim (SD_DEV *dev);
+#endif
+
+/**
+    \brief Advance the trailer sequence after an accepted write.
+    \param dev Device descriptor.
+ */
+void __SD_Seq_Next (SD_DEV *dev);
+
+/**
+    \brief Limit a data step to 1..514 bytes (block plus CRC).
+    \param n Requested bytes.
+    \return Bytes per step.
+ */
+WORD __SD_Step_Clamp (DWORD n);
+
+/**
+    \brief Resize an auto-tuned data step from the time the last one took.
+    \param dev Device descriptor.
+    \param cycles Core clocks the step took.
+    \param n Bytes moved in the step.
+ */
+void __SD_Step_Tune (SD_DEV *dev, DWORD cycles, WORD n);
+
 /******************************************************************************
  Private Methods - Direct work with SD card
 ******************************************************************************/
 
-DWORD __SD_Power_Of_Two(BYTE e)
-{
-    DWORD partial = 1;
-    BYTE idx;
-    for(idx=0; idx!=e; idx++) partial *= 2;
-    return(partial);
-}
-
 inline void __SD_Assert(void){
     SPI_CS_Low();
 }
@@ -99,7 +199,7 @@ void __SD_Speed_Transfer(BYTE throttle) {
 
 BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
 {
-    BYTE crc, res;
+    BYTE crc, res, n;
 	// ACMD«n» is the command sequense of CMD55-CMD«n»
     if(cmd & 0x80) {
         cmd &= 0x7F;
@@ -130,12 +230,13 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
     SPI_RW(crc);
 
     // Receive command response
-    // Wait for a valid response in timeout of 5 milliseconds
-    SPI_Timer_On(5);
+    // The card answers within NCR bytes. Counting bytes keeps the call bounded
+    // and leaves SPI_Timer to the state that is waiting on the card.
+    n = SD_IO_NCR_MAX;
     do {
         res = SPI_RW(0xFF);
-    } while((res & 0x80)&&(SPI_Timer_Status()==TRUE));
-    SPI_Timer_Off();
+    } while((res & 0x80)&&(--n));
+    __SD_Last_R1 = res;
 		
     
 		// Return with the response value
@@ -144,521 +245,1243 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
 
 DWORD __SD_Sectors (SD_DEV *dev)
 {
-    BYTE csd[16];
-    BYTE idx;
-    DWORD ss = 0;
-    WORD C_SIZE = 0;
-    BYTE C_SIZE_MULT = 0;
-    BYTE READ_BL_LEN = 0;
-    if(__SD_Send_Cmd(CMD9, 0)==0) 
-    {
-        // Wait for response
-        while (SPI_RW(0xFF) == 0xFF);
-        for (idx=0; idx!=16; idx++) 
-					csd[idx] = SPI_RW(0xFF);
-        // Dummy CRC
-        SPI_RW(0xFF);
-        SPI_RW(0xFF);
-        SPI_Release();
-        if(dev->cardtype & SDCT_SD1)
-        {
-            ss = csd[0];
-            // READ_BL_LEN[83:80]: max. read data block length
-            READ_BL_LEN = (csd[5] & 0x0F);
-            // C_SIZE [73:62]
-            C_SIZE = (csd[6] & 0x03);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[7]);
-            C_SIZE <<= 2;
-            C_SIZE |= ((csd[8] >> 6) & 0x03);
-            // C_SIZE_MULT [49:47]
-            C_SIZE_MULT = (csd[9] & 0x03);
-            C_SIZE_MULT <<= 1;
-            C_SIZE_MULT |= ((csd[10] >> 7) & 0x01);
-        }
-        else if(dev->cardtype & SDCT_SD2)
-        {
-						// READ_BL_LEN = 9;
-            // C_SIZE [69:48]
-            C_SIZE = (csd[7] & 0x3F);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[8] & 0xFF);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[9] & 0xFF);
-            C_SIZE_MULT = 8; // AD changed
-        }
-        ss = (C_SIZE + 1);
-        ss *= __SD_Power_Of_Two(C_SIZE_MULT + 2);
-        ss *= __SD_Power_Of_Two(READ_BL_LEN);
-        // ss /= SD_BLK_SIZE; ?? Bug in original code?
+    SD_CSD_INFO csd;
+
+    // The layout follows CSD_STRUCTURE, not the card type: SDSC cards of
+    // version 2 keep the version 1 CSD
+    return(SD_Reg_Csd(dev->csd, &csd) ? csd.sectors : 0);
+}
+
+DWORD __SD_Addr_Block (DWORD sector)
+{
+    return(sector);
+}
+
+DWORD __SD_Addr_Byte (DWORD sector)
+{
+    return(sector * SD_BLK_SIZE);
+}
+
+// Byte sum of a record up to its check field
+static WORD __SD_Cache_Sum (const SD_CACHE *rec)
+{
+    return((WORD)Blk_Sum(rec, (WORD)((const BYTE *)&rec->check - (const BYTE *)rec)));
+}
+
+BOOL __SD_Cache_Match (SD_DEV *dev)
+{
+#ifdef SD_IO_FAST_INIT
+    SD_CACHE rec;
+
+    if(!SD_Cache_Load(&rec) || (rec.magic != SD_CACHE_MAGIC) || (rec.check != __SD_Cache_Sum(&rec)))
+        return(FALSE);
+    if((rec.cardtype != dev->cardtype) || !Blk_Equal(rec.cid, dev->cid, 16) || !Blk_Equal(rec.ocr, dev->ocr, 4))
+        return(FALSE);
+    Blk_Copy(dev->csd, rec.csd, 16);
+    Blk_Copy(dev->scr, rec.scr, SD_SCR_SIZE);
+    __SD_Info_Ids(dev);
+    if(rec.valid & SD_REG_SCR) {
+        SD_Reg_Scr(dev->scr, &dev->info.scr);
+        dev->info.valid |= SD_REG_SCR;
+    }
+    if(rec.valid & SD_REG_SSR) {
+        SD_Reg_Ssr(rec.ssr, &dev->info.ssr);
+        dev->info.valid |= SD_REG_SSR;
+    }
+    dev->warm = TRUE;
+    return(TRUE);
+#else
+    return(FALSE);
+#endif
+}
+
+void __SD_Cache_Refresh (SD_DEV *dev, const BYTE *ssr, BYTE valid)
+{
+    SD_CACHE rec;
+    DWORD seq = dev->seq_limit;
 
-        return (ss);
-    } else return (0); // Error
+    // The claimed trailer sequences carry over to the new card's record
+    if(SD_Cache_Load(&rec) && (rec.magic == SD_CACHE_MAGIC) && (rec.check == __SD_Cache_Sum(&rec))
+       && (rec.seq > seq))
+        seq = rec.seq;
+    Blk_Fill(&rec, 0, sizeof(rec));
+    rec.magic = SD_CACHE_MAGIC;
+    rec.cardtype = dev->cardtype;
+    rec.valid = valid;
+    Blk_Copy(rec.cid, dev->cid, 16);
+    Blk_Copy(rec.csd, dev->csd, 16);
+    Blk_Copy(rec.ocr, dev->ocr, 4);
+    Blk_Copy(rec.scr, dev->scr, SD_SCR_SIZE);
+    Blk_Copy(rec.ssr, ssr, SD_SSR_SIZE);
+    rec.seq = seq;
+    rec.check = __SD_Cache_Sum(&rec);
+    SD_Cache_Store(&rec);
+}
+
+void __SD_Info_Ids (SD_DEV *dev)
+{
+    Blk_Fill(&dev->info, 0, sizeof(dev->info));
+    if(SD_Reg_Csd(dev->csd, &dev->info.csd))
+        dev->info.valid |= SD_REG_CSD;
+    SD_Reg_Cid(dev->cid, &dev->info.cid);
+    dev->info.valid |= SD_REG_CID;
+}
+
+DWORD __SD_Tran_Speed (SD_DEV *dev)
+{
+    // TRAN_SPEED [103:96]: time value x transfer rate unit
+    static const BYTE tv[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    static const DWORD unit[4] = {10000UL, 100000UL, 1000000UL, 10000000UL};
+
+    return(tv[(dev->csd[3] >> 3) & 0x0F] * unit[dev->csd[3] & 0x03]);
+}
+
+void __SD_Set_Clock (SD_DEV *dev)
+{
+    DWORD hz;
+
+    if(dev->clock_limit == 0)
+        dev->clock_limit = SD_IO_MAX_CLOCK;
+    hz = (dev->card_clock < dev->clock_limit) ? dev->card_clock : dev->clock_limit;
+    dev->clock = SPI_Freq_Set(hz);
+    if(dev->step_auto)
+        dev->step = __SD_Step_Clamp((SD_IO_STEP_BUDGET_US * (dev->clock / 1000000UL)) / 16);
+}
+
+WORD __SD_Step_Clamp (DWORD n)
+{
+    if(n == 0)
+        return(1);
+    return((n > SD_BLK_SIZE + 2) ? SD_BLK_SIZE + 2 : (WORD)n);
+}
+
+void __SD_Step_Tune (SD_DEV *dev, DWORD cycles, WORD n)
+{
+    DWORD cpb;
+
+    // Only full chunks are representative
+    if(!dev->step_auto || (n < dev->step))
+        return;
+    cpb = cycles / n;
+    if(cpb == 0)
+        cpb = 1;
+    // Move halfway, a single step can be stretched by an interrupt
+    dev->step = __SD_Step_Clamp((dev->step + (SD_IO_STEP_BUDGET_US * (SystemCoreClock / 1000000UL)) / cpb) / 2);
+}
+
+#ifdef SD_IO_CACHE_FLASH
+/* Default record store: records appended to the reserved flash sector, which
+   is erased once they fill it. The last one written is current. */
+#define SD_CACHE_SLOT   ((sizeof(SD_CACHE) + 3) & ~3UL)
+#define SD_CACHE_SLOTS  (FLASH_SECTOR_SIZE / SD_CACHE_SLOT)
+
+static const SD_CACHE *__SD_Cache_Slot (BYTE i)
+{
+    return((const SD_CACHE *)(FLASH_STORE + i * SD_CACHE_SLOT));
+}
+
+__WEAK BOOL SD_Cache_Load (SD_CACHE *rec)
+{
+    BYTE i;
+
+    // Erased slots read 0xFFFF as magic
+    for(i = 0; (i != SD_CACHE_SLOTS) && (__SD_Cache_Slot(i)->magic != 0xFFFF); i++)
+        ;
+    if(i == 0)
+        return(FALSE);
+    Blk_Copy(rec, __SD_Cache_Slot(i - 1), sizeof(SD_CACHE));
+    return(TRUE);
+}
+
+__WEAK void SD_Cache_Store (const SD_CACHE *rec)
+{
+    BYTE i;
+
+    for(i = 0; (i != SD_CACHE_SLOTS) && (__SD_Cache_Slot(i)->magic != 0xFFFF); i++)
+        ;
+    if(i == SD_CACHE_SLOTS) {
+        if(!Flash_Erase(FLASH_STORE))
+            return;
+        i = 0;
+    }
+    Flash_Write(FLASH_STORE + i * SD_CACHE_SLOT, rec, sizeof(SD_CACHE));
+}
+#else
+/* Default record store: survives while the MCU stays powered */
+static SD_CACHE __SD_Cache;
+static BOOL __SD_Cache_Valid;
+
+__WEAK BOOL SD_Cache_Load (SD_CACHE *rec)
+{
+    if(!__SD_Cache_Valid)
+        return(FALSE);
+    *rec = __SD_Cache;
+    return(TRUE);
+}
+
+__WEAK void SD_Cache_Store (const SD_CACHE *rec)
+{
+    __SD_Cache = *rec;
+    __SD_Cache_Valid = TRUE;
+}
+#endif
+
+SDRESULTS __SD_Poll_Busy (SD_DEV *dev)
+{
+    DWORD ms;
+
+    if(!dev->busy)
+        return(SD_OK);
+    // The card holds DO low while programming
+    __SD_Assert();
+    if(SPI_RW(0xFF) != 0) {
+        dev->busy = FALSE;
+        TB_Cancel(&dev->busy_until);
+        return(SD_OK);
+    }
+    // Still programming: arm the timeout on the first miss, then chunk by
+    // chunk while busy_ms has time left. A whole erase limit can exceed
+    // what the microsecond deadline holds.
+    if(!dev->busy_until.armed || (dev->busy_ms && TB_Expired(&dev->busy_until))) {
+        ms = (dev->busy_ms > SD_IO_BUSY_CHUNK_MS) ? SD_IO_BUSY_CHUNK_MS : dev->busy_ms;
+        dev->busy_ms -= ms;
+        TB_Arm(&dev->busy_until, TB_MS(ms));
+    } else if(TB_Expired(&dev->busy_until)) {
+        dev->busy = FALSE;
+        TB_Cancel(&dev->busy_until);
+        return(SD_ERROR);
+    }
+    return(SD_BUSY);
+}
+
+#ifdef SD_IO_TRAILER
+static void __SD_Put32 (BYTE *p, DWORD v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+static DWORD __SD_Get32 (const BYTE *p)
+{
+    return((DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24));
+}
+
+// Continue the payload Adler-32 over sequence number and sector, so a block
+// that landed at the wrong address fails the check too
+static DWORD __SD_Tag_Check (DWORD adler, DWORD seq, DWORD sector)
+{
+    BYTE b[8];
+
+    __SD_Put32(&b[0], seq);
+    __SD_Put32(&b[4], sector);
+    return(Blk_Adler32(adler, b, 8));
+}
+
+void __SD_Tag_Build (SD_DEV *dev, BYTE *tr, DWORD adler, DWORD sector)
+{
+    __SD_Put32(&tr[0], dev->seq);
+    __SD_Put32(&tr[4], __SD_Tag_Check(adler, dev->seq, sector));
+}
+
+SDRESULTS __SD_Tag_Verify (SD_DEV *dev, const BYTE *tr, DWORD adler, DWORD sector)
+{
+    DWORD seq = __SD_Get32(&tr[0]);
+
+    if(__SD_Get32(&tr[4]) != __SD_Tag_Check(adler, seq, sector))
+        return(SD_CORRUPT);
+    dev->last_seq = seq;
+    return(SD_OK);
+}
+
+// The sequence lives in RAM, so a reset would start it over and reuse
+// numbers already on the card. The record holds the end of the claimed
+// range instead: one record write per SD_IO_SEQ_RESERVE writes, and a
+// boot continues past every number it may have handed out.
+void __SD_Seq_Claim (SD_DEV *dev)
+{
+    SD_CACHE rec;
+
+    if(!SD_Cache_Load(&rec) || (rec.magic != SD_CACHE_MAGIC) || (rec.check != __SD_Cache_Sum(&rec))) {
+        // No record to keep the range in: claim in RAM only
+        dev->seq_limit = dev->seq + SD_IO_SEQ_RESERVE;
+        return;
+    }
+    // Remount within the range claimed by this boot: nothing to write
+    if((rec.seq == dev->seq_limit) && (dev->seq < dev->seq_limit))
+        return;
+    if(dev->seq < rec.seq)
+        dev->seq = rec.seq;
+    rec.seq = dev->seq + SD_IO_SEQ_RESERVE;
+    rec.check = __SD_Cache_Sum(&rec);
+    SD_Cache_Store(&rec);
+    dev->seq_limit = rec.seq;
+}
+#endif
+
+void __SD_Seq_Next (SD_DEV *dev)
+{
+    dev->seq++;
+#ifdef SD_IO_TRAILER
+    if(dev->seq == dev->seq_limit)
+        __SD_Seq_Claim(dev);
+#endif
+}
+
+// Build some keystream while waiting on the card
+static void __SD_Crypt_Fill (SD_DEV *dev, DWORD sector)
+{
+    if(dev->crypt)
+        Blk_Crypt_Fill(dev->crypt, sector, SD_IO_CRYPT_FILL);
+}
+
+// Keystream for bytes ofs..ofs+n-1 of a sector, NULL without a key
+static const BYTE *__SD_Crypt_Stream (SD_DEV *dev, DWORD sector, WORD ofs, WORD n)
+{
+    if(!dev->crypt)
+        return(NULL);
+    return(Blk_Crypt_Stream(dev->crypt, sector, ofs, n) + ofs);
 }
 
 /******************************************************************************
  Public Methods - Direct work with SD card
 ******************************************************************************/
 
+// Mark a Read/Write/Init request complete for the server
+static void __SD_Fsm_Done (FSM *f, SDRESULTS res)
+{
+    f->Status_fsm = STAT_IDLE;
+    f->ErrorCode_fsm = res;
+    f->Start_fsm = 1;
+}
+
+/* Card initialization: state table */
+
+#ifdef SD_IO_FAST_INIT
+#define SD_IO_POWERUP_US TB_MS(SD_IO_POWERUP_WAIT) // S3 polls CMD0 for readiness
+#else
+#define SD_IO_POWERUP_US TB_MS(500)
+#endif
+
+// Longest init step: an ACMD (CMD55 + command) at the identification clock
+FSM_STATIC_ASSERT((2UL * SD_IO_CMD_BYTES * 8 * 1000000UL) / SPI_LOW_FREQ <= SD_IO_INIT_BUDGET_US, init_cmd_fits_budget);
+FSM_STATIC_ASSERT(((SD_IO_INIT_CHUNK + 2UL) * 8 * 1000000UL) / SPI_LOW_FREQ <= SD_IO_INIT_BUDGET_US, init_chunk_fits_budget);
+FSM_STATIC_ASSERT((SPI_RELEASE_STEP * 8UL * 1000000UL) / SPI_LOW_FREQ <= SD_IO_INIT_BUDGET_US, release_fits_budget);
+
+typedef struct {
+    SD_DEV *dev;
+    BYTE cmd, ct, ocr[4];
+    BYTE trys;
+    BOOL spi;           // SPI_Init still to be done
+    BYTE *buf;          // Register read destination
+    BYTE len, idx;      // Register length and bytes already read
+    BYTE tkn;
+    BYTE after;         // State entered once the register read has finished
+    BOOL ok;            // Register read succeeded
+    WORD release;       // Bytes left for the bounded release
+#ifdef SD_IO_HIGH_SPEED
+    BYTE sw[64];        // CMD6 switch status
+#endif
+    BYTE ssr[SD_SSR_SIZE]; // SD Status, decoded into dev->info
+} SD_INIT_CTX;
+
+enum {IN_START, IN_POWERUP, IN_CMD0, IN_CMD8, IN_R7, IN_V2_WAIT, IN_OCR,
+      IN_V1, IN_V1_WAIT, IN_V1_FAIL, IN_V1_SETUP, IN_MOUNT, IN_CID, IN_CSD,
+      IN_SWITCH, IN_CLOCK, IN_SCR, IN_SSR, IN_REG_TOKEN, IN_REG_DATA, IN_REG_RELEASE,
+      IN_END, IN_FINISH};
+
+// Start a register read (data block of len bytes), continue in state after
+static BYTE __SD_In_Reg (SD_INIT_CTX *c, BYTE cmd, DWORD arg, BYTE *buf, BYTE len, BYTE after)
+{
+    c->buf = buf;
+    c->len = len;
+    c->idx = 0;
+    c->after = after;
+    c->ok = FALSE;
+    c->release = SD_BLK_SIZE;
+    if(__SD_Send_Cmd(cmd, arg) != 0)
+        return(IN_REG_RELEASE);
+    // ACMD13 answers R2, the second byte is more card status
+    if(cmd == ACMD13)
+        SPI_RW(0xFF);
+    return(IN_REG_TOKEN);
+}
+
+// Pure delay: the state is left through its timeout
+static BOOL __SD_In_Never (void *p)
+{
+    return(FALSE);
+}
+
+static BYTE __SD_In_Start (void *p)
+{
+    SD_INIT_CTX *c = p;
+    BYTE idx;
+
+    Init.Status_fsm = STAT_BUSY;
+    Init.Start_fsm = 0;
+    if((c->trys == SD_INIT_TRYS)||(c->ct))
+        return(c->ct ? IN_MOUNT : IN_END);
+    // Initialize SPI for use with the memory card, once per SD_Init
+    if(c->spi) {
+        SPI_Init();
+        c->spi = FALSE;
+    }
+    SPI_CS_High();
+    SPI_Freq_Low();
+    c->trys++;
+    // 80 dummy clocks
+    for(idx = 0; idx != 10; idx++)
+        SPI_RW(0xFF);
+    c->dev->mount = FALSE;
+    for(idx = 0; idx < 4; idx++)
+        c->dev->ocr[idx] = 0;
+    return(IN_POWERUP);
+}
+
+static BOOL __SD_In_Idle (void *p)
+{
+    return((__SD_Send_Cmd(CMD0, 0) == 1) ? TRUE : FALSE);
+}
+
+static BYTE __SD_In_Cmd8 (void *p)
+{
+    return(IN_CMD8);
+}
+
+static BYTE __SD_In_Version (void *p)
+{
+    // SD version 2?
+    return((__SD_Send_Cmd(CMD8, 0x1AA) == 1) ? IN_R7 : IN_V1);
+}
+
+static BYTE __SD_In_R7 (void *p)
+{
+    SD_INIT_CTX *c = p;
+    BYTE n;
+
+    // Get trailing return value of R7 resp
+    for(n = 0; n < 4; n++)
+        c->ocr[n] = SPI_RW(0xFF);
+    // VDD range of 2.7-3.6V is OK?
+    if((c->ocr[2] == 0x01)&&(c->ocr[3] == 0xAA))
+        return(IN_V2_WAIT);
+    return(IN_START);
+}
+
+static BOOL __SD_In_V2_Ready (void *p)
+{
+    // Wait for leaving idle state (ACMD41 with HCS bit)
+    __SD_Speed_Transfer(HIGH);
+    return((__SD_Send_Cmd(ACMD41, 1UL << 30) == 0) ? TRUE : FALSE);
+}
+
+static BYTE __SD_In_Ocr_Cmd (void *p)
+{
+    return(IN_OCR);
+}
+
+static BYTE __SD_In_Ocr (void *p)
+{
+    SD_INIT_CTX *c = p;
+    BYTE n;
+
+    // CCS in the OCR?
+    if(__SD_Send_Cmd(CMD58, 0) == 0) {
+        for(n = 0; n < 4; n++)
+            c->dev->ocr[n] = c->ocr[n] = SPI_RW(0xFF);
+        // SD version 2?
+        c->ct = (c->ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
+    }
+    return(IN_START);
+}
+
+static BYTE __SD_In_V1 (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    // SD version 1 or MMC?
+    if(__SD_Send_Cmd(ACMD41, 0) <= 1) {
+        // SD version 1
+        c->ct = SDCT_SD1;
+        c->cmd = ACMD41;
+    } else {
+        // MMC version 3
+        c->ct = SDCT_MMC;
+        c->cmd = CMD1;
+    }
+    return(IN_V1_WAIT);
+}
+
+static BOOL __SD_In_V1_Ready (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    // Wait for leaving idle state
+    return((__SD_Send_Cmd(c->cmd, 0) == 0) ? TRUE : FALSE);
+}
+
+static BYTE __SD_In_V1_Setup_Cmd (void *p)
+{
+    return(IN_V1_SETUP);
+}
+
+static BYTE __SD_In_V1_Fail (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    c->ct = 0;
+    return(IN_START);
+}
+
+static BYTE __SD_In_V1_Setup (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    if(__SD_Send_Cmd(CMD59, 0))
+        c->ct = 0;   // Deactivate CRC check (default)
+    if(__SD_Send_Cmd(CMD16, 512))
+        c->ct = 0;   // Set R/W block length to 512 bytes
+    return(IN_START);
+}
+
+static BYTE __SD_In_Mount (void *p)
+{
+    SD_INIT_CTX *c = p;
+    SD_DEV *dev = c->dev;
+
+    dev->cardtype = c->ct;
+    dev->addr = (c->ct & SDCT_BLOCK) ? __SD_Addr_Block : __SD_Addr_Byte;
+    dev->mount = TRUE;
+    dev->warm = FALSE;
+    dev->busy = FALSE;
+    TB_Cancel(&dev->busy_until);
+    dev->debug.read = 0;
+    dev->debug.write = 0;
+    // Keep a step size chosen by the application across re-inits
+    if(dev->step == 0)
+        SD_Set_Step(dev, SD_IO_STEP_BYTES);
+    return(__SD_In_Reg(c, CMD10, 0, dev->cid, 16, IN_CID));
+}
+
+static BYTE __SD_In_Cid (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    if(!c->ok) {
+        c->ct = 0;
+        return(IN_END);
+    }
+    // Same card as last boot? Then none of its registers can have changed:
+    // no CSD, SCR or SD Status read and no CMD6 probe.
+    if(__SD_Cache_Match(c->dev)) {
+        c->dev->last_sector = __SD_Sectors(c->dev) - 1;
+        // CMD0 left the card in default speed mode, faster than SPI_MAX_FREQ
+        c->dev->card_clock = __SD_Tran_Speed(c->dev);
+        __SD_Set_Clock(c->dev);
+        return(IN_END);
+    }
+    return(__SD_In_Reg(c, CMD9, 0, c->dev->csd, 16, IN_CSD));
+}
+
+static BYTE __SD_In_Csd (void *p)
+{
+    SD_INIT_CTX *c = p;
+    DWORD sectors;
+
+    sectors = c->ok ? __SD_Sectors(c->dev) : 0;
+    if(sectors == 0) {
+        c->ct = 0; // No usable identity, do not mount
+        return(IN_END);
+    }
+    c->dev->last_sector = sectors - 1;
+    return(IN_SWITCH);
+}
+
+static BYTE __SD_In_Switch (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    c->dev->card_clock = __SD_Tran_Speed(c->dev);
+#ifdef SD_IO_HIGH_SPEED
+    // Switch function needs SD v2 and command class 10 (CCC bit 10)
+    if((c->dev->cardtype & SDCT_SD2) && (c->dev->csd[4] & 0x40)) {
+        // Mode 1, group 1 function 1 (high speed), other groups unchanged
+        return(__SD_In_Reg(c, CMD6, 0x80FFFFF1, c->sw, 64, IN_CLOCK));
+    }
+#endif
+    c->ok = FALSE;
+    return(IN_CLOCK);
+}
+
+static BYTE __SD_In_Clock (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+#ifdef SD_IO_HIGH_SPEED
+    // Function selected for group 1 [379:376]
+    if(c->ok && (c->buf == c->sw) && ((c->sw[16] & 0x0F) == 1))
+        c->dev->card_clock = 50000000UL;
+#endif
+    __SD_Set_Clock(c->dev); // High speed transfer
+    __SD_Info_Ids(c->dev);
+    Blk_Fill(c->ssr, 0, SD_SSR_SIZE);
+    // Application commands of SD cards only
+    if(!(c->dev->cardtype & SDCT_SDC)) {
+        __SD_Cache_Refresh(c->dev, c->ssr, 0);
+        return(IN_END);
+    }
+    return(__SD_In_Reg(c, ACMD51, 0, c->dev->scr, SD_SCR_SIZE, IN_SCR));
+}
+
+static BYTE __SD_In_Scr (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    if(c->ok) {
+        SD_Reg_Scr(c->dev->scr, &c->dev->info.scr);
+        c->dev->info.valid |= SD_REG_SCR;
+    }
+    return(__SD_In_Reg(c, ACMD13, 0, c->ssr, SD_SSR_SIZE, IN_SSR));
+}
+
+static BYTE __SD_In_Ssr (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    if(c->ok) {
+        SD_Reg_Ssr(c->ssr, &c->dev->info.ssr);
+        c->dev->info.valid |= SD_REG_SSR;
+    }
+    __SD_Cache_Refresh(c->dev, c->ssr, c->dev->info.valid & (SD_REG_SCR | SD_REG_SSR));
+    return(IN_END);
+}
+
+static BOOL __SD_In_Token_Ready (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    c->tkn = SPI_RW(0xFF);
+    return((c->tkn != 0xFF) ? TRUE : FALSE);
+}
+
+static BYTE __SD_In_Token (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    return((c->tkn == 0xFE) ? IN_REG_DATA : IN_REG_RELEASE);
+}
+
+static BYTE __SD_In_Data (void *p)
+{
+    SD_INIT_CTX *c = p;
+    BYTE n;
+
+    // A bounded chunk per step, the clock may still be the slow one
+    for(n = SD_IO_INIT_CHUNK; n && (c->idx != c->len); n--)
+        c->buf[c->idx++] = SPI_RW(0xFF);
+    if(c->idx != c->len)
+        return(FSM_STAY);
+    // Dummy CRC
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    c->ok = TRUE;
+    return(IN_REG_RELEASE);
+}
+
+static BOOL __SD_In_Released (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    return(SPI_Release_Step(&c->release));
+}
+
+static BYTE __SD_In_Reg_Done (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    return(c->after);
+}
+
+static BYTE __SD_In_End (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    c->release = SD_BLK_SIZE;
+    return(IN_FINISH);
+}
+
+static BYTE __SD_In_Finish (void *p)
+{
+    SD_INIT_CTX *c = p;
+
+    if(!c->ct)
+        c->dev->mount = FALSE;
+#ifdef SD_IO_TRAILER
+    else
+        __SD_Seq_Claim(c->dev);
+#endif
+    __SD_Fsm_Done(&Init, c->ct ? SD_OK : SD_NOINIT);
+    Init.set_fsm = 0;
+    return(IN_START);
+}
+
+static const FSM_STATE_T __SD_Init_Table[] = {
+    // guard              action                timeout           on_timeout      wait
+    {NULL,                __SD_In_Start,        0,                0,              0},                  // IN_START
+    {__SD_In_Never,       NULL,                 SD_IO_POWERUP_US, IN_CMD0,        EV_TIMER},           // IN_POWERUP
+    {__SD_In_Idle,        __SD_In_Cmd8,         TB_MS(500),       IN_START,       0},                  // IN_CMD0
+    {NULL,                __SD_In_Version,      0,                0,              0},                  // IN_CMD8
+    {NULL,                __SD_In_R7,           0,                0,              0},                  // IN_R7
+    {__SD_In_V2_Ready,    __SD_In_Ocr_Cmd,      TB_MS(1000),      IN_START,       0},                  // IN_V2_WAIT
+    {NULL,                __SD_In_Ocr,          0,                0,              0},                  // IN_OCR
+    {NULL,                __SD_In_V1,           0,                0,              0},                  // IN_V1
+    {__SD_In_V1_Ready,    __SD_In_V1_Setup_Cmd, TB_MS(250),       IN_V1_FAIL,     0},                  // IN_V1_WAIT
+    {NULL,                __SD_In_V1_Fail,      0,                0,              0},                  // IN_V1_FAIL
+    {NULL,                __SD_In_V1_Setup,     0,                0,              0},                  // IN_V1_SETUP
+    {NULL,                __SD_In_Mount,        0,                0,              0},                  // IN_MOUNT
+    {NULL,                __SD_In_Cid,          0,                0,              0},                  // IN_CID
+    {NULL,                __SD_In_Csd,          0,                0,              0},                  // IN_CSD
+    {NULL,                __SD_In_Switch,       0,                0,              0},                  // IN_SWITCH
+    {NULL,                __SD_In_Clock,        0,                0,              0},                  // IN_CLOCK
+    {NULL,                __SD_In_Scr,          0,                0,              0},                  // IN_SCR
+    {NULL,                __SD_In_Ssr,          0,                0,              0},                  // IN_SSR
+    {__SD_In_Token_Ready, __SD_In_Token,        TB_MS(100),       IN_REG_RELEASE, EV_TICK | EV_TIMER}, // IN_REG_TOKEN
+    {NULL,                __SD_In_Data,         0,                0,              0},                  // IN_REG_DATA
+    {__SD_In_Released,    __SD_In_Reg_Done,     0,                0,              0},                  // IN_REG_RELEASE
+    {NULL,                __SD_In_End,          0,                0,              0},                  // IN_END
+    {__SD_In_Released,    __SD_In_Finish,       0,                0,              0},                  // IN_FINISH
+};
+FSM_DEFINE(SD_Init_Machine, __SD_Init_Table, DBG_4, SD_IO_INIT_BUDGET_US);
+static SD_INIT_CTX __SD_Init_Ctx;
+
+static SDRESULTS __SD_Init_Step(SD_DEV *dev, BOOL spi)
+{
+    if(Init.set_fsm == 1) {
+        __SD_Init_Ctx.ct = 0;
+        __SD_Init_Ctx.trys = 0;
+        __SD_Init_Ctx.spi = spi;
+        Init.set_fsm++;
+    }
+    __SD_Init_Ctx.dev = dev;
+    FSM_Step(&SD_Init_Machine, &__SD_Init_Ctx);
+    return((Init.Start_fsm == 1) ? Init.ErrorCode_fsm : SD_BUSY);
+}
+
 SDRESULTS SD_Init(SD_DEV *dev)
 {
-    static BYTE n, cmd, ct, ocr[4];
-    static BYTE idx;
-    static BYTE init_trys;
-		static enum {S1,S2,S3,S4,S5,S6,S7,S8,S9,S10,S11,S12,S13} next_state = S1;
-		if (Init.set_fsm==1)
-		{
-			ct=0;
-			init_trys=0;
-			Init.set_fsm++;
-		}
-		//PTB->PSOR = MASK(DBG_4);
-		switch(next_state)
-		{
-			case S1:	PTB->PTOR = MASK(DBG_4);
-								if((init_trys!=SD_INIT_TRYS)&&(!ct))
-								{	
-									SPI_Init();// Initialize SPI for use with the memory card
-									SPI_CS_High();
-									SPI_Freq_Low();
-									next_state=S2;
-									init_trys++;
-									Init.Status_fsm=STAT_BUSY;
-									Init.Start_fsm=0;
-									// 80 dummy clocks
-									for(idx = 0; idx != 10; idx++) 
-										SPI_RW(0xFF);
-									SPI_Timer_On(500);
-								}
-								else
-								{
-									Init.Status_fsm=STAT_BUSY;
-									Init.Start_fsm=0;
-									next_state=S11;
-								}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			
-			case S2:  
-							PTB->PTOR = MASK(DBG_4);
-							if(SPI_Timer_Status()==TRUE)
-							{
-								next_state=S2;
-								//PTB->PTOR = MASK(DBG_4);
-								//PTB->PTOR = MASK(DBG_4);
-							}
-							else
-							{
-								SPI_Timer_Off();
-								dev->mount = FALSE;
-								next_state=S3;
-								SPI_Timer_On(500);
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S3:				
-							PTB->PTOR = MASK(DBG_4);
-							if ((__SD_Send_Cmd(CMD0, 0) != 1)&&(SPI_Timer_Status()==TRUE))
-							{
-								next_state=S3;
-								//PTB->PTOR = MASK(DBG_4);
-								//PTB->PTOR = MASK(DBG_4);
-							}
-							else
-							{
-								next_state=S4;
-								SPI_Timer_Off();
-							}
-							break;
-							PTB->PTOR = MASK(DBG_4);
-			case S4:
-							PTB->PTOR = MASK(DBG_4);
-				      // Idle state
-							if (__SD_Send_Cmd(CMD0, 0) == 1) 
-							{
-								next_state=S5;
-							}
-							else
-							{
-								next_state=S1;
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S5:
-							PTB->PTOR = MASK(DBG_4);
-							// SD version 2?
-							if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) 
-							{
-								next_state=S7;
-							}
-							else
-							{
-								next_state=S6;
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S6:
-							PTB->PTOR = MASK(DBG_4);
-							// SD version 1 or MMC?
-              if (__SD_Send_Cmd(ACMD41, 0) <= 1)
-              {
-                // SD version 1
-                ct = SDCT_SD1; 
-                cmd = ACMD41;
-              }
-							else 
-							{
-								// MMC version 3
-                ct = SDCT_MMC; 
-                cmd = CMD1;
-              }
-                // Wait for leaving idle state
-              SPI_Timer_On(250);
-              while((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(cmd, 0))) 
-							{
-									//PTB->PTOR = MASK(DBG_4);
-									//PTB->PTOR = MASK(DBG_4);
-							}
-              SPI_Timer_Off();
-              if(SPI_Timer_Status()==FALSE) 
-							ct = 0;
-              if(__SD_Send_Cmd(CMD59, 0))   
-							ct = 0;   // Deactivate CRC check (default)
-              if(__SD_Send_Cmd(CMD16, 512)) 
-							ct = 0;   // Set R/W block length to 512 bytes
-							next_state=S1;
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S7:
-							PTB->PTOR = MASK(DBG_4);
-							// Get trailing return value of R7 resp
-							for (n = 0; n < 4; n++) 
-								ocr[n] = SPI_RW(0xFF);
-								// VDD range of 2.7-3.6V is OK?  
-              if ((ocr[2] == 0x01)&&(ocr[3] == 0xAA))
-              {
-								// Wait for leaving idle state (ACMD41 with HCS bit)...
-                SPI_Timer_On(1000);
-								next_state=S8;
-							}
-							else
-							{
-								next_state=S1;
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S8:
-							PTB->PTOR = MASK(DBG_4);
-							__SD_Speed_Transfer(HIGH);
-							if ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(ACMD41, 1UL << 30)))
-							{
-											next_state=S8;
-											//PTB->PTOR = MASK(DBG_4);
-											//PTB->PTOR = MASK(DBG_4);
-							}
-							else 
-							{
-								next_state=S9;
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S9:
-							PTB->PTOR = MASK(DBG_4);
-							SPI_Timer_Off(); 
-              // CCS in the OCR? 
-							// AGD: Delete SPI_Timer_Status call?
-							if ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(CMD58, 0) == 0))
-              {
-								next_state=S10;
-							}
-							else
-							{
-								next_state=S1;								
-							}
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S10:
-							PTB->PTOR = MASK(DBG_4);
-							for (n = 0; n < 4; n++) 
-								ocr[n] = SPI_RW(0xFF);
-              // SD version 2?
-              ct = (ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
-							next_state=S1;
-							PTB->PTOR = MASK(DBG_4);
-							break;
-      case S11:
-							PTB->PTOR = MASK(DBG_4);
-							if(ct) 
-							{
-								dev->cardtype = ct;
-								dev->mount = TRUE;
-								dev->last_sector = __SD_Sectors(dev) - 1;
-								dev->debug.read = 0;
-								dev->debug.write = 0;
-								//__SD_Speed_Transfer(HIGH);
-								// High speed transfer
-							}
-							next_state=S12;
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			case S12:
-							PTB->PTOR = MASK(DBG_4);
-							SPI_Release();
-							Init.Status_fsm=STAT_IDLE;
-							Init.ErrorCode_fsm=ct ? SD_OK : SD_NOINIT;
-							Init.Start_fsm=1;
-							Init.set_fsm=0;
-							next_state=S1;
-							PTB->PTOR = MASK(DBG_4);
-							break;
-			default:
-							Init.Status_fsm=STAT_IDLE;
-							next_state=S1;
-							break;
-		}
-		PTB->PCOR = MASK(DBG_4);
-	}
-
-#pragma push
-#pragma diag_suppress 1441
+    return(__SD_Init_Step(dev, TRUE));
+}
+
+SDRESULTS SD_Reinit(SD_DEV *dev)
+{
+    return(__SD_Init_Step(dev, FALSE));
+}
+
 void SD_Read_FSM(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
 {
-    static SDRESULTS res;
-    static BYTE tkn, data;
-    static WORD byte_num;
-		static void *temp;
-		static enum {S1,S2,S3,S4,S5} next_state = S1;
-		//PTB->PSOR = MASK(DBG_2);
-    switch(next_state)
-		{	
-			case S1:PTB->PTOR = MASK(DBG_2);
-							if (Read.Status_fsm==STAT_IDLE)
-							{
-							res = SD_ERROR;
-							temp=dat;
-							if ((sector > dev->last_sector)||(cnt == 0)) 
-							{	
-								next_state= S1;
-								Read.Start_fsm=1;
-								Read.ErrorCode_fsm=SD_PARERR;
-								break;
-							}		
-							// Convert sector number to byte address (sector * SD_BLK_SIZE)
-							// if (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE) == 0) { // Only for SDSC
-							if (__SD_Send_Cmd(CMD17, sector ) == 0)		// Only for SDHC or SDXC   
-							{
-								SPI_Timer_On(100);// Wait for data packet (timeout of 100ms)
-								Read.Status_fsm=STAT_BUSY;
-								Read.Start_fsm=0;
-								next_state=S2;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-							else
-							{
-								Read.Start_fsm=0;
-								Read.Status_fsm=STAT_BUSY;
-								next_state=S5;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-							}
-			case S2:
-							PTB->PTOR = MASK(DBG_2);
-							tkn = SPI_RW(0xFF);
-							//PTB->PTOR = MASK(DBG_2);
-							//PTB->PTOR = MASK(DBG_2);		
-							if ((tkn==0xFF)&&(SPI_Timer_Status()==TRUE))
-							{
-								next_state=S2;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-							else
-							{
-								next_state=S3;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-			case S3:  
-							PTB->PTOR = MASK(DBG_2);
-							SPI_Timer_Off();
-							// Token of single block?
-							if(tkn==0xFE) { // AGD: Loop fusion to simplify FSM formation
-								byte_num = 0;
-								next_state = S4;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-							else
-							{
-								next_state= S5;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-			case S4:
-							/*do
-							{*/
-							PTB->PTOR = MASK(DBG_2);
-							data = SPI_RW(0xff);
-							if ((byte_num >= ofs) && (byte_num < ofs+cnt))
-							{
-               *(BYTE*)temp = data;
-               ((BYTE *) temp)++;
-							}
-							//}else discard bytes before and after data
-						  if (++byte_num < SD_BLK_SIZE + 2 )//; // 512 byte block + 2 byte CRC
-							{
-								next_state= S4;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-							else
-							{
-								res = SD_OK;
-								next_state = S5;
-								PTB->PTOR = MASK(DBG_2);
-								break;
-							}
-			
-			case S5:
-							PTB->PTOR = MASK(DBG_2);
-							SPI_Release();
-							dev->debug.read++;
-							next_state=S1;
-							Read.Status_fsm=STAT_IDLE;
-							Read.ErrorCode_fsm=res;
-							Read.Start_fsm=1;
-							PTB->PTOR = MASK(DBG_2);
-							break;
-			default:next_state=S1;
-							Read.Status_fsm=STAT_IDLE;
-							break;
-				}
-		PTB->PCOR = MASK(DBG_2);
-			}
-#pragma pop
+    SD_RANGE rng;
+
+    rng.dat = dat;
+    rng.ofs = ofs;
+    rng.cnt = cnt;
+    SD_Read_Ranges_FSM(dev, sector, &rng, 1);
+}
+
+/* Single block read: state table */
+
+// A fixed step must fit the budget even at the fastest clock
+FSM_STATIC_ASSERT((SD_IO_STEP_BYTES * 8UL * 1000000UL) / SPI_MAX_FREQ <= SD_IO_STEP_BUDGET_US, step_fits_budget);
+
+typedef struct {
+    SD_DEV *dev;
+    DWORD sector;
+    const SD_RANGE *rng;    // Caller windows, copied and checked on start
+    BYTE n;
+    SDRESULTS res;
+    BYTE tkn;
+    BYTE *dst;
+    WORD remain, pos;
+    WORD release;           // Bytes left for the bounded release
+    BYTE r, nrng;
+    BYTE kind;              // BLK_CK_* folded over a whole block for the caller
+    DWORD *ck_out;          // Receives that check value
+    BOOL tagged;            // Whole block, checked against its trailer
+    DWORD ck;               // Check value so far
+    SD_RANGE ranges[SD_IO_MAX_RANGES];
+} SD_READ_CTX;
+
+enum {RD_START, RD_TOKEN, RD_GAP, RD_COPY, RD_RELEASE};
+
+static BYTE __SD_Rd_Start (void *p)
+{
+    SD_READ_CTX *c = p;
+    SDRESULTS res;
+
+    // Windows must be non-empty, ascending and inside the block
+    for(c->r = 0, c->pos = 0; (c->r < c->n)&&(c->n <= SD_IO_MAX_RANGES); c->r++) {
+        if((c->rng[c->r].cnt == 0)||(c->rng[c->r].ofs < c->pos)||(c->rng[c->r].ofs + c->rng[c->r].cnt > SD_BLK_SIZE))
+            break;
+        c->ranges[c->r] = c->rng[c->r];
+        c->pos = c->rng[c->r].ofs + c->rng[c->r].cnt;
+    }
+    if((c->sector > c->dev->last_sector)||(c->n == 0)||(c->r != c->n)) {
+        __SD_Fsm_Done(&Read, SD_PARERR);
+        return(FSM_STAY);
+    }
+    c->nrng = c->n;
+    Read.Start_fsm = 0;
+    // Card still programming the last write? Poll once per call.
+    res = __SD_Poll_Busy(c->dev);
+    if(res == SD_BUSY) {
+        __SD_Crypt_Fill(c->dev, c->sector);
+        Sched_Wait(EV_TICK);
+        return(FSM_STAY);
+    } else if(res != SD_OK) {
+        __SD_Fsm_Done(&Read, SD_BUSY);
+        return(FSM_STAY);
+    }
+    Read.Status_fsm = STAT_BUSY;
+    c->res = SD_ERROR;
+    c->release = SD_BLK_SIZE;
+    if(__SD_Send_Cmd(CMD17, c->dev->addr(c->sector)) == 0)
+        return(RD_TOKEN);
+    return(RD_RELEASE);
+}
+
+static BOOL __SD_Rd_Token_Ready (void *p)
+{
+    SD_READ_CTX *c = p;
+
+    c->tkn = SPI_RW(0xFF);
+    __SD_Last_Token = c->tkn;
+    if(c->tkn != 0xFF)
+        return(TRUE);
+    // The card is looking the block up
+    __SD_Crypt_Fill(c->dev, c->sector);
+    return(FALSE);
+}
+
+static BYTE __SD_Rd_Token (void *p)
+{
+    SD_READ_CTX *c = p;
+
+    c->release = SD_BLK_SIZE;
+    // Token of single block?
+    if(c->tkn != 0xFE)
+        return(RD_RELEASE);
+    // Gap ahead of the first window, then alternate between RD_GAP and RD_COPY
+    c->r = 0;
+    c->pos = 0;
+#ifdef SD_IO_TRAILER
+    // A caller check covers the trailer as plain data instead
+    c->tagged = (!c->kind&&(c->nrng == 1)&&(c->ranges[0].ofs == 0)&&(c->ranges[0].cnt == SD_BLK_SIZE)) ? TRUE : FALSE;
+#else
+    c->tagged = FALSE;
+#endif
+    c->ck = Blk_Check_Init(c->tagged ? BLK_CK_ADLER32 : c->kind);
+    c->remain = c->ranges[0].ofs;
+    c->dst = (BYTE *)c->ranges[0].dat;
+    if(c->remain)
+        return(RD_GAP);
+    c->remain = c->ranges[0].cnt;
+    return(RD_COPY);
+}
+
+static BYTE __SD_Rd_Gap (void *p)
+{
+    SD_READ_CTX *c = p;
+    WORD n = (c->remain < c->dev->step) ? c->remain : c->dev->step;
+    DWORD t0 = TB_Cycles();
+
+    // Discard a chunk of a gap, no offset compare needed
+    SPI_Skip(n);
+    __SD_Step_Tune(c->dev, TB_Cycles() - t0, n);
+    c->remain -= n;
+    if(c->remain)
+        return(FSM_STAY);
+    if(c->r < c->nrng) {
+        c->remain = c->ranges[c->r].cnt;
+        c->dst = (BYTE *)c->ranges[c->r].dat;
+        return(RD_COPY);
+    }
+    // 512 byte block + 2 byte CRC all clocked
+    c->res = SD_OK;
+#ifdef SD_IO_TRAILER
+    if(c->tagged)
+        c->res = __SD_Tag_Verify(c->dev, (BYTE *)c->ranges[0].dat + SD_PAYLOAD_SIZE, c->ck, c->sector);
+#endif
+    if(c->kind)
+        *c->ck_out = c->ck;
+    c->release = SD_BLK_SIZE;
+    return(RD_RELEASE);
+}
+
+static BYTE __SD_Rd_Copy (void *p)
+{
+    SD_READ_CTX *c = p;
+    WORD n = (c->remain < c->dev->step) ? c->remain : c->dev->step;
+    const BYTE *ks;
+    DWORD t0 = TB_Cycles();
+
+    // Copy a chunk of the current window. A tagged block folds its payload
+    // into the check value on the way, up to the trailer; a caller check
+    // folds every byte. A keyed device decrypts in the same loop, keystream
+    // not built during the token wait is built here, inside the timed step.
+    if(c->tagged && (c->remain > SD_TRAILER_SIZE) && (n > c->remain - SD_TRAILER_SIZE))
+        n = c->remain - SD_TRAILER_SIZE;
+    ks = __SD_Crypt_Stream(c->dev, c->sector, c->ranges[c->r].ofs + c->ranges[c->r].cnt - c->remain, n);
+    if(c->tagged && (c->remain > SD_TRAILER_SIZE))
+        c->ck = SPI_Read_Check(c->dst, ks, n, BLK_CK_ADLER32, c->ck);
+    else if(c->kind)
+        c->ck = SPI_Read_Check(c->dst, ks, n, c->kind, c->ck);
+    else
+        SPI_Read_Xor(c->dst, ks, n);
+    __SD_Step_Tune(c->dev, TB_Cycles() - t0, n);
+    c->dst += n;
+    c->remain -= n;
+    if(c->remain)
+        return(FSM_STAY);
+    c->pos = c->ranges[c->r].ofs + c->ranges[c->r].cnt;
+    if(++c->r < c->nrng)
+        c->remain = c->ranges[c->r].ofs - c->pos;
+    else
+        c->remain = SD_BLK_SIZE + 2 - c->pos;
+    if(c->remain)
+        return(RD_GAP);
+    // Adjacent window, keep copying
+    c->remain = c->ranges[c->r].cnt;
+    c->dst = (BYTE *)c->ranges[c->r].dat;
+    return(FSM_STAY);
+}
+
+static BOOL __SD_Rd_Released (void *p)
+{
+    SD_READ_CTX *c = p;
+
+    return(SPI_Release_Step(&c->release));
+}
+
+static BYTE __SD_Rd_Release (void *p)
+{
+    SD_READ_CTX *c = p;
+
+    c->dev->debug.read++;
+    c->dev->errors.ops++;
+    __SD_Fsm_Done(&Read, c->res);
+    return(RD_START);
+}
+
+static const FSM_STATE_T __SD_Read_Table[] = {
+    // guard              action           timeout     on_timeout  wait
+    {NULL,                __SD_Rd_Start,   0,          0,          0},
+    {__SD_Rd_Token_Ready, __SD_Rd_Token,   TB_MS(100), RD_RELEASE, EV_TICK | EV_TIMER},
+    {NULL,                __SD_Rd_Gap,     0,          0,          0},
+    {NULL,                __SD_Rd_Copy,    0,          0,          0},
+    {__SD_Rd_Released,    __SD_Rd_Release, 0,          0,          0},
+};
+FSM_DEFINE(SD_Read_Machine, __SD_Read_Table, DBG_2, SD_IO_STEP_BUDGET_US);
+static SD_READ_CTX __SD_Read_Ctx;
+
+static void __SD_Read_Step(SD_DEV *dev, DWORD sector, const SD_RANGE *rng, BYTE n, BYTE kind, DWORD *ck)
+{
+    __SD_Read_Ctx.dev = dev;
+    __SD_Read_Ctx.sector = sector;
+    __SD_Read_Ctx.rng = rng;
+    __SD_Read_Ctx.n = n;
+    __SD_Read_Ctx.kind = kind;
+    __SD_Read_Ctx.ck_out = ck;
+    FSM_Step(&SD_Read_Machine, &__SD_Read_Ctx);
+}
+
+void SD_Read_Ranges_FSM(SD_DEV *dev, DWORD sector, const SD_RANGE *rng, BYTE n)
+{
+    __SD_Read_Step(dev, sector, rng, n, BLK_CK_NONE, NULL);
+}
+
+void SD_Read_Check_FSM(SD_DEV *dev, void *dat, DWORD sector, BYTE kind, DWORD *ck)
+{
+    SD_RANGE rng;
+
+    rng.dat = dat;
+    rng.ofs = 0;
+    rng.cnt = SD_BLK_SIZE;
+    __SD_Read_Step(dev, sector, &rng, 1, (ck != NULL) ? kind : BLK_CK_NONE, ck);
+}
+
+/* Single block write: state table */
+
+typedef struct {
+    SD_DEV *dev;
+    BYTE *dat;
+    DWORD sector;
+    WORD idx;
+    BYTE line;
+    DWORD adler;            // Payload check value so far
+} SD_WRITE_CTX;
+
+enum {WR_START, WR_DATA, WR_RESP, WR_BUSY, WR_END};
+
+static BYTE __SD_Wr_Start (void *p)
+{
+    SD_WRITE_CTX *c = p;
+    SDRESULTS res;
+
+    // Query invalid?
+    if(c->sector > c->dev->last_sector) {
+        __SD_Fsm_Done(&Write, SD_PARERR);
+        return(FSM_STAY);
+    }
+    Write.Start_fsm = 0;
+    // Card still programming the last write? Poll once per call.
+    res = __SD_Poll_Busy(c->dev);
+    if(res == SD_BUSY) {
+        __SD_Crypt_Fill(c->dev, c->sector);
+        Sched_Wait(EV_TICK);
+        return(FSM_STAY);
+    } else if(res != SD_OK) {
+        __SD_Fsm_Done(&Write, SD_BUSY);
+        return(FSM_STAY);
+    }
+    if(__SD_Send_Cmd(CMD24, c->dev->addr(c->sector)) != 0) {
+        __SD_Fsm_Done(&Write, SD_ERROR);
+        return(FSM_STAY);
+    }
+    // Send token (single block write)
+    SPI_RW(0xFE);
+    c->idx = 0;
+    c->adler = 1;
+    Write.Status_fsm = STAT_BUSY;
+    return(WR_DATA);
+}
+
+static BYTE __SD_Wr_Data (void *p)
+{
+    SD_WRITE_CTX *c = p;
+    WORD n = SD_BLK_SIZE - c->idx;
+    const BYTE *ks;
+    DWORD t0 = TB_Cycles();
+
+    if(n > c->dev->step)
+        n = c->dev->step;
+#ifdef SD_IO_TRAILER
+    if((c->idx < SD_PAYLOAD_SIZE) && (n > SD_PAYLOAD_SIZE - c->idx))
+        n = SD_PAYLOAD_SIZE - c->idx;
+#endif
+    // A keyed device encrypts on the way out, dat keeps the plain data
+    ks = __SD_Crypt_Stream(c->dev, c->sector, c->idx, n);
+#ifdef SD_IO_TRAILER
+    // Fold the payload into the check value, stamp the trailer once it is
+    // out and send the trailer like the rest of the block
+    if(c->idx < SD_PAYLOAD_SIZE) {
+        c->adler = SPI_Write_Adler(&c->dat[c->idx], ks, n, c->adler);
+        if(c->idx + n == SD_PAYLOAD_SIZE)
+            __SD_Tag_Build(c->dev, &c->dat[SD_PAYLOAD_SIZE], c->adler, c->sector);
+    } else
+#endif
+    SPI_Write_Xor(&c->dat[c->idx], ks, n);
+    __SD_Step_Tune(c->dev, TB_Cycles() - t0, n);
+    c->idx += n;
+    if(c->idx != SD_BLK_SIZE)
+        return(FSM_STAY);
+    return(WR_RESP);
+}
+
+static BYTE __SD_Wr_Resp (void *p)
+{
+    SD_WRITE_CTX *c = p;
+
+    /* Dummy CRC */
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    // If not accepted, returns the reject error
+    __SD_Last_Token = SPI_RW(0xFF) & 0x1F;
+    if(__SD_Last_Token != 0x05) {
+        __SD_Fsm_Done(&Write, SD_REJECT);
+        return(WR_START);
+    }
+    __SD_Seq_Next(c->dev);
+#ifdef SD_IO_WRITE_DEFER_BUSY
+    // Let the card program in the background, the next
+    // command polls the busy state
+    c->dev->busy = TRUE;
+    c->dev->busy_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+    TB_Cancel(&c->dev->busy_until);
+    c->dev->debug.write++;
+    c->dev->errors.ops++;
+    __SD_Fsm_Done(&Write, SD_OK);
+    return(WR_START);
+#else
+    // Waits until finish of data programming with a timeout
+    return(WR_BUSY);
+#endif
+}
+
+static BOOL __SD_Wr_Ready (void *p)
+{
+    SD_WRITE_CTX *c = p;
+
+    c->line = SPI_RW(0xFF);
+    return((c->line != 0) ? TRUE : FALSE);
+}
+
+static BYTE __SD_Wr_End (void *p)
+{
+    SD_WRITE_CTX *c = p;
+
+    c->dev->debug.write++;
+    c->dev->errors.ops++;
+    __SD_Fsm_Done(&Write, (c->line == 0) ? SD_BUSY : SD_OK);
+    return(WR_START);
+}
+
+static const FSM_STATE_T __SD_Write_Table[] = {
+    // guard        action         timeout                          on_timeout wait
+    {NULL,          __SD_Wr_Start, 0,                               0,         0},
+    {NULL,          __SD_Wr_Data,  0,                               0,         0},
+    {NULL,          __SD_Wr_Resp,  0,                               0,         0},
+    {__SD_Wr_Ready, __SD_Wr_End,   TB_MS(SD_IO_WRITE_TIMEOUT_WAIT), WR_END,    EV_TICK | EV_TIMER},
+    {NULL,          __SD_Wr_End,   0,                               0,         0},
+};
+FSM_DEFINE(SD_Write_Machine, __SD_Write_Table, DBG_3, SD_IO_STEP_BUDGET_US);
+static SD_WRITE_CTX __SD_Write_Ctx;
 
 void SD_Write_FSM(SD_DEV *dev, void *dat, DWORD sector)
 {
-    static WORD idx;
-    static BYTE line;
-		static enum {S1,S2,S3,S4,S5} next_state = S1;
-		//PTB->PSOR = MASK(DBG_3);
-
-		// Query invalid?
-		switch(next_state)
-		{
-			case S1:
-							PTB->PTOR = MASK(DBG_3);
-							if (Write.Status_fsm==STAT_IDLE)
-							{
-								if(sector > dev->last_sector)
-								{
-									next_state=S1;
-									Write.Status_fsm=STAT_IDLE;
-									Write.Start_fsm=1;
-									Write.ErrorCode_fsm=SD_PARERR;
-									break;
-								}
-								// Convert sector number to bytes address (sector * SD_BLK_SIZE)
-								//    if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)==0) { // Only for SDSC
-								if(__SD_Send_Cmd(CMD24, sector)==0) 
-								{ // Only for SDHC or SDXC   
-									// Send token (single block write)
-									SPI_RW(0xFE);// Send block data
-									next_state=S2;
-									idx=0;
-									Write.Status_fsm=STAT_BUSY;
-								}
-								else
-								{
-									next_state=S1;
-									Write.Start_fsm=1;
-									Write.Status_fsm=STAT_IDLE;
-									Write.ErrorCode_fsm=SD_ERROR;
-								}
-								PTB->PTOR = MASK(DBG_3);
-								break;
-							}
-			case S2:
-							PTB->PTOR = MASK(DBG_3);
-							SPI_RW(*((BYTE*)dat + idx));
-							idx++;
-							if (idx!=SD_BLK_SIZE)
-							{
-								next_state=S2;
-							}	
-							else
-							{
-								next_state=S3;
-							}
-							PTB->PTOR = MASK(DBG_3);
-							break;
-							
-			case S3:	
-							PTB->PTOR = MASK(DBG_3);
-							/* Dummy CRC */
-							SPI_RW(0xFF);
-							SPI_RW(0xFF);
-							// If not accepted, returns the reject error
-							if((SPI_RW(0xFF) & 0x1F) != 0x05) 
-							{
-								next_state=S1;
-								Write.Start_fsm=1;
-								Write.ErrorCode_fsm=SD_REJECT;
-								Write.Status_fsm=STAT_IDLE;
-								PTB->PTOR = MASK(DBG_3);
-								break;
-							}		
-							// Waits until finish of data programming with a timeout
-							SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
-							next_state=S4;
-							PTB->PTOR = MASK(DBG_3);
-							break;
-			
-			case S4:
-							PTB->PTOR = MASK(DBG_3);
-							line = SPI_RW(0xFF);
-							//PTB->PTOR = MASK(DBG_3);
-							//PTB->PTOR = MASK(DBG_3);
-							if ((line==0)&&(SPI_Timer_Status()==TRUE))
-							{
-								next_state=S4;
-							}
-							else
-							{
-								next_state=S5;
-							}
-							PTB->PTOR = MASK(DBG_3);
-							break;
-							//PTB->PTOR = MASK(DBG_3);
-			case S5:
-							SPI_Timer_Off();
-							dev->debug.write++;
-							//PTB->PTOR = MASK(DBG_3);
-							//PTB->PCOR = MASK(DBG_3);
-							next_state=S1;
-							if(line==0)
-							{
-								Write.Status_fsm=STAT_IDLE;
-								Write.ErrorCode_fsm=SD_BUSY;
-								Write.Start_fsm=1;
-							}	
-							else 
-							{
-								Write.Status_fsm=STAT_IDLE;
-								Write.ErrorCode_fsm=SD_OK;
-								Write.Start_fsm=1;
-							}
-							PTB->PTOR = MASK(DBG_3);
-							break;
-			default:
-							Write.Status_fsm=STAT_IDLE;
-							next_state=S1;
-							break;
-			}
-		PTB->PCOR = MASK(DBG_3);
+    __SD_Write_Ctx.dev = dev;
+    __SD_Write_Ctx.dat = (BYTE *)dat;
+    __SD_Write_Ctx.sector = sector;
+    FSM_Step(&SD_Write_Machine, &__SD_Write_Ctx);
+}
+
+void SD_Set_Step(SD_DEV *dev, WORD bytes)
+{
+    dev->step_auto = (bytes == 0) ? TRUE : FALSE;
+    if(dev->step_auto)
+        dev->step = __SD_Step_Clamp((SD_IO_STEP_BUDGET_US * (dev->clock / 1000000UL)) / 16);
+    else
+        dev->step = __SD_Step_Clamp(bytes);
+}
+
+void SD_Set_Crypt(SD_DEV *dev, BLK_CRYPT *crypt)
+{
+    dev->crypt = crypt;
+}
+
+SDRESULTS SD_Erase(SD_DEV *dev, DWORD first, DWORD last)
+{
+    SDRESULTS res;
+    WORD left;
+    DWORD ms;
+
+    if((first > last)||(last > dev->last_sector))
+        return(SD_PARERR);
+    // CSD CCC class 5 (erase), bit 1 of CSD byte 4
+    if(!(dev->csd[4] & 0x02))
+        return(SD_REJECT);
+    // Card still programming the last write? Poll once per call.
+    res = __SD_Poll_Busy(dev);
+    if(res != SD_OK)
+        return(res);
+    if((__SD_Send_Cmd(CMD32, dev->addr(first)) != 0)||(__SD_Send_Cmd(CMD33, dev->addr(last)) != 0)
+            ||(__SD_Send_Cmd(CMD38, 0) != 0)) {
+        left = SPI_RELEASE_STEP;
+        SPI_Release_Step(&left);
+        return(SD_ERROR);
+    }
+    // R1b: the card erases in the background, the next command polls
+    // the busy state
+    dev->busy = TRUE;
+    // The SD Status tells how long the AUs of the range may take
+    ms = SD_Reg_Erase_Ms(&dev->info.ssr, last - first + 1);
+    if(ms < SD_IO_ERASE_TIMEOUT_WAIT)
+        ms = SD_IO_ERASE_TIMEOUT_WAIT;
+    dev->busy_ms = ms;
+    TB_Cancel(&dev->busy_until);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Get_Status(SD_DEV *dev, WORD *st)
+{
+    BYTE r1;
+    WORD left;
+
+    // Runs inside a server step: release at most one bounded chunk,
+    // the next command deselects the card anyway
+    left = SPI_RELEASE_STEP;
+    r1 = __SD_Send_Cmd(CMD13, 0);
+    if(r1 & 0x80) {
+        SPI_Release_Step(&left);
+        return(SD_NORESPONSE);
+    }
+    // R2: R1 followed by a second status byte
+    *st = ((WORD)r1 << 8) | SPI_RW(0xFF);
+    dev->status = *st;
+    SPI_Release_Step(&left);
+    return(SD_OK);
+}
+
+SD_ERRCLASS SD_Classify(SD_DEV *dev, SDRESULTS res)
+{
+    BYTE r1, r2, tkn;
+    WORD st;
+    DWORD idx;
+    SD_ERRCLASS ec;
+
+    if(res == SD_OK)
+        return(SD_EC_NONE);
+    // Keep the failing command's response, SEND_STATUS overwrites it
+    r1 = __SD_Last_R1;
+    tkn = __SD_Last_Token;
+    if(res == SD_PARERR) {
+        ec = SD_EC_ADDRESS;
+    } else if(res == SD_CORRUPT) {
+        // The card reported success, treat as a transfer error worth a re-read
+        ec = SD_EC_CRC;
+    } else if(SD_Get_Status(dev, &st) != SD_OK) {
+        ec = SD_EC_TIMEOUT;
+    } else if((st >> 8) & R1_IDLE) {
+        ec = SD_EC_RESET;
+    } else if((res == SD_NOINIT)||(res == SD_NORESPONSE)||(r1 & 0x80)) {
+        ec = SD_EC_TIMEOUT;
+    } else if(res == SD_REJECT) {
+        // Data response token: 0x0B CRC error, 0x0D write error
+        ec = (tkn == 0x0B) ? SD_EC_CRC : SD_EC_CARD;
+    } else {
+        // Error bits of the failed command and the sticky status bits
+        r1 |= (BYTE)(st >> 8);
+        r2 = (BYTE)st;
+        if(r1 & R1_CRC_ERR)
+            ec = SD_EC_CRC;
+        else if((r1 & (R1_ADDRESS_ERR|R1_PARAM_ERR))||(r2 & (R2_OUT_OF_RANGE|R2_WP_VIOLATION)))
+            ec = SD_EC_ADDRESS;
+        else if((r1 & (R1_ERASE_RESET|R1_ERASE_SEQ))||(r2 & (R2_ERASE_PARAM|R2_LOCK_FAILED)))
+            ec = SD_EC_ERASE;
+        else if(r2 & (R2_ERROR|R2_CC_ERROR|R2_ECC_FAILED))
+            ec = SD_EC_CARD;
+        else if((res == SD_ERROR)&&(tkn != 0xFF)&&(tkn != 0xFE))
+            // Data error token: out of range, card ECC, CC error or error
+            ec = (tkn & 0x08) ? SD_EC_ADDRESS : SD_EC_CARD;
+        else
+            // No data token in time or busy timeout, card state unknown
+            ec = SD_EC_TIMEOUT;
+    }
+    dev->errors.count[ec]++;
+    // A burst of transfer errors usually means the bus is too fast for
+    // the wiring or the card: halve the clock
+    if((ec == SD_EC_CRC)||(ec == SD_EC_TIMEOUT)) {
+        // DWORD difference, right across a wrap of errors.ops
+        idx = dev->errors.ops - dev->err_ops;
+        dev->err_ops = dev->errors.ops;
+        dev->err_burst = (idx < SD_IO_ERR_WINDOW) ? dev->err_burst + 1 : 1;
+        if((dev->err_burst >= SD_IO_ERR_BURST) && (dev->clock > SPI_MAX_FREQ/64)) {
+            dev->err_burst = 0;
+            dev->clock_limit = dev->clock / 2;
+            __SD_Set_Clock(dev);
+        }
+    }
+    return(ec);
 }
 
 SDRESULTS SD_Status(SD_DEV *dev)
@@ -0,0 +1,177 @@
+/*
+ * SD card register decoders, see sd_reg.h
+ */
+
+#include "sd_reg.h"
+
+// AU_SIZE and UHS_AU_SIZE codes in 512 byte sectors (16 KB .. 64 MB)
+static const DWORD __SD_Au_Sectors[16] = {0, 32, 64, 128, 256, 512, 1024, 2048,
+    4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072};
+
+/**
+    \brief Field [msb:msb-n+1] of a register sent most significant byte first.
+    \param reg Register bytes.
+    \param width Register size in bits.
+    \param msb Highest bit of the field.
+    \param n Field width, 32 at most.
+    \return Field value.
+ */
+static DWORD __SD_Bits (const BYTE *reg, WORD width, WORD msb, BYTE n)
+{
+    DWORD v = 0;
+    WORD pos;
+
+    for(pos = width - 1 - msb; n; n--, pos++)
+        v = (v << 1) | ((reg[pos >> 3] >> (7 - (pos & 7))) & 1);
+    return(v);
+}
+
+#define CSD(msb, n)     __SD_Bits(raw, 128, msb, n)
+#define CID(msb, n)     __SD_Bits(raw, 128, msb, n)
+#define SCR(msb, n)     __SD_Bits(raw, 64, msb, n)
+#define SSR(msb, n)     __SD_Bits(raw, 512, msb, n)
+
+BOOL SD_Reg_Csd(const BYTE *raw, SD_CSD_INFO *csd)
+{
+    // TRAN_SPEED [103:96]: time value x transfer rate unit
+    static const BYTE tv[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    static const DWORD unit[4] = {10000UL, 100000UL, 1000000UL, 10000000UL};
+    BYTE shift;
+
+    csd->structure = (BYTE)CSD(127, 2);
+    csd->taac = (BYTE)CSD(119, 8);
+    csd->nsac = (BYTE)CSD(111, 8);
+    csd->tran_speed = tv[CSD(102, 4)] * unit[CSD(98, 3) & 0x03];
+    csd->ccc = (WORD)CSD(95, 12);
+    csd->read_bl_len = (BYTE)CSD(83, 4);
+    csd->read_bl_partial = (BOOL)CSD(79, 1);
+    csd->write_blk_misalign = (BOOL)CSD(78, 1);
+    csd->read_blk_misalign = (BOOL)CSD(77, 1);
+    csd->dsr_imp = (BOOL)CSD(76, 1);
+    // MMC keeps its erase group fields in [46:37], read here as the SD ones
+    csd->erase_blk_en = (BOOL)CSD(46, 1);
+    csd->sector_size = (BYTE)CSD(45, 7);
+    csd->wp_grp_size = (BYTE)CSD(38, 7);
+    csd->wp_grp_enable = (BOOL)CSD(31, 1);
+    csd->r2w_factor = (BYTE)CSD(28, 3);
+    csd->write_bl_len = (BYTE)CSD(25, 4);
+    csd->write_bl_partial = (BOOL)CSD(21, 1);
+    csd->file_format = (BYTE)((CSD(15, 1) << 2) | CSD(11, 2));
+    csd->copy = (BOOL)CSD(14, 1);
+    csd->perm_write_protect = (BOOL)CSD(13, 1);
+    csd->tmp_write_protect = (BOOL)CSD(12, 1);
+    // SECTOR_SIZE counts write blocks of 2^WRITE_BL_LEN bytes
+    csd->erase_sectors = csd->erase_blk_en ? 1 : (DWORD)csd->sector_size + 1;
+    if(!csd->erase_blk_en && (csd->write_bl_len > 9) && (csd->write_bl_len < 12))
+        csd->erase_sectors <<= csd->write_bl_len - 9;
+    csd->c_size_mult = 0;
+    csd->sectors = 0;
+    switch(csd->structure) {
+        case 0:
+            // (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks of 2^READ_BL_LEN bytes
+            csd->c_size = CSD(73, 12);
+            csd->c_size_mult = (BYTE)CSD(49, 3);
+            if(csd->read_bl_len < 9)
+                return(FALSE);
+            shift = csd->c_size_mult + 2 + csd->read_bl_len - 9;
+            csd->sectors = (csd->c_size + 1) << shift;
+            return(TRUE);
+        case 1:
+        case 2:
+            // 512 KB units, C_SIZE 22 bits in version 2, 28 in version 3
+            csd->c_size = (csd->structure == 1) ? CSD(69, 22) : CSD(75, 28);
+            csd->sectors = (csd->c_size < 0x3FFFFFUL) ? (csd->c_size + 1) << 10 : 0xFFFFFFFFUL;
+            return(TRUE);
+        default:
+            csd->c_size = 0;
+            return(FALSE);
+    }
+}
+
+void SD_Reg_Cid(const BYTE *raw, SD_CID_INFO *cid)
+{
+    BYTE n;
+
+    cid->mid = (BYTE)CID(127, 8);
+    // OID [119:104] and PNM [103:64], ASCII
+    for(n = 0; n < 2; n++)
+        cid->oid[n] = (char)raw[1 + n];
+    cid->oid[2] = '\0';
+    for(n = 0; n < 5; n++)
+        cid->pnm[n] = (char)raw[3 + n];
+    cid->pnm[5] = '\0';
+    cid->prv = (BYTE)CID(63, 8);
+    cid->psn = CID(55, 32);
+    cid->year = (WORD)(2000 + CID(19, 8));
+    cid->month = (BYTE)CID(11, 4);
+}
+
+void SD_Reg_Scr(const BYTE *raw, SD_SCR_INFO *scr)
+{
+    BYTE specx;
+
+    scr->structure = (BYTE)SCR(63, 4);
+    scr->erase_value = SCR(55, 1) ? 0xFF : 0x00;
+    scr->security = (BYTE)SCR(54, 3);
+    scr->bus_widths = (BYTE)SCR(51, 4);
+    scr->ex_security = (BYTE)SCR(46, 4);
+    scr->cmd_support = (BYTE)SCR(35, 4);
+    // SD_SPEC [59:56], then SD_SPEC3 [47], SD_SPEC4 [42], SD_SPECX [41:38]
+    switch(SCR(59, 4)) {
+        case 0:
+            scr->spec = 10;
+            break;
+        case 1:
+            scr->spec = 11;
+            break;
+        default:
+            specx = (BYTE)SCR(41, 4);
+            if(!SCR(47, 1))
+                scr->spec = 20;
+            else if(specx)
+                scr->spec = 40 + 10 * specx;
+            else
+                scr->spec = SCR(42, 1) ? 40 : 30;
+            break;
+    }
+}
+
+void SD_Reg_Ssr(const BYTE *raw, SD_SSR_INFO *ssr)
+{
+    static const BYTE speed_class[5] = {0, 2, 4, 6, 10};
+    BYTE sc;
+
+    ssr->bus_width = (BYTE)SSR(511, 2);
+    ssr->secured = (BOOL)SSR(509, 1);
+    ssr->card_type = (WORD)SSR(495, 16);
+    ssr->protected_area = SSR(479, 32);
+    sc = (BYTE)SSR(447, 8);
+    ssr->speed_class = (sc < 5) ? speed_class[sc] : 0;
+    ssr->perf_move = (BYTE)SSR(439, 8);
+    ssr->au_sectors = __SD_Au_Sectors[SSR(431, 4)];
+    ssr->erase_size = (WORD)SSR(423, 16);
+    ssr->erase_timeout = (BYTE)SSR(407, 6);
+    ssr->erase_offset = (BYTE)SSR(401, 2);
+    ssr->uhs_grade = (BYTE)SSR(399, 4);
+    ssr->uhs_au_sectors = __SD_Au_Sectors[SSR(395, 4)];
+    ssr->video_class = (BYTE)SSR(391, 8);
+    ssr->vsc_au_mb = (WORD)SSR(377, 10);
+    ssr->app_class = (BYTE)SSR(339, 4);
+    ssr->perf_enhance = (BYTE)SSR(335, 8);
+    ssr->discard = (BOOL)SSR(313, 1);
+    ssr->fule = (BOOL)SSR(312, 1);
+}
+
+DWORD SD_Reg_Erase_Ms(const SD_SSR_INFO *ssr, DWORD sectors)
+{
+    DWORD au;
+
+    if((ssr->erase_size == 0)||(ssr->erase_timeout == 0)||(ssr->au_sectors == 0))
+        return(0);
+    // Every AU the range touches, whole or not
+    au = (sectors + ssr->au_sectors - 1) / ssr->au_sectors;
+    // 63 s x 65535 AUs still fits a DWORD in ms
+    if(au > 0xFFFF)
+        au = 0xFFFF;
+    return((ssr->erase_timeout * 1000UL * au) / ssr->erase_size + ssr->erase_offset * 1000UL);
+}
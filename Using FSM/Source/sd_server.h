@@ -4,7 +4,7 @@
 #include "sd_io.h"
 
 // request types
-typedef enum {REQ_NONE, REQ_INIT, REQ_READ, REQ_WRITE} SDS_REQ_T;
+typedef enum {REQ_NONE, REQ_INIT, REQ_READ, REQ_WRITE, REQ_ERASE} SDS_REQ_T;
 // status and results
 typedef enum {STAT_IDLE, STAT_BUSY} SDS_STATUS_T;
 	
@@ -13,12 +13,15 @@ typedef struct { // SD Server Transaction Data
 	SD_DEV * Device;
 	uint8_t * Data;
 	uint32_t Sector;
+	uint32_t Count;			// REQ_ERASE: sectors from Sector on
+	BYTE Check;				// REQ_READ: BLK_CK_* folded into the transfer, BLK_CK_NONE: none
+	DWORD Checksum;			// ... its value once the read is done
 	SDS_STATUS_T Status;
 	SDRESULTS ErrorCode;
 } SDS_TD_T ;
 
 // States for SD Server FSM
-typedef enum {S_IDLE, S_INIT, S_READ, S_WRITE, S_ERROR} SDS_STATE_T; 
+typedef enum {S_IDLE, S_INIT, S_READ, S_WRITE, S_ERROR, S_BACKOFF, S_REINIT, S_ERASE} SDS_STATE_T; 
 typedef struct { // SD Server Transaction Data
 	SDS_STATUS_T Status_fsm;
 	SDRESULTS ErrorCode_fsm;
@@ -37,10 +40,17 @@ void Task_SD_Server(void);
 To request service...
 1. Requesting task R waits until Status == STAT_IDLE and Request == REQ_NONE
 2. R sets up transaction information Device,Data,Sector. 
-3. R requests requests transaction by setting Request to REQ_INIT, REQ_READ, or REQ_WRITE.
+3. R requests requests transaction by setting Request to REQ_INIT, REQ_READ, REQ_WRITE or REQ_ERASE.
+   For a read R may set Check to get Checksum of the data without a second pass over it.
+   An erase covers Count sectors from Sector; it is done once the card has started it,
+   the card keeps erasing in the background while R fills its next buffers.
 4. (Let other tasks run. When server accepts and copies request, it sets Request=REQ_NONE and Status to STAT_BUSY 
 5. R determines transaction is done by polling for g_trans.Status==STAT_IDLE and g_trans.Request==REQ_NONE
 
+A failed read or write is retried up to SD_IO_RETRIES times with exponential backoff,
+re-initializing the card first when it stopped answering. The request stays STAT_BUSY
+meanwhile, so R only sees the final result.
+
 */
 
 
@@ -11,6 +11,7 @@
 #include "spi_io.h"
 #include <MKL25Z4.h>
 #include "debug.h"
+#include "blkutil.h"
 
 /******************************************************************************
  Module Public Functions - Low level SPI control functions
@@ -75,11 +76,153 @@ BYTE SPI_RW (BYTE d) {
     return((BYTE)(SPI1_D));
 }
 
+void SPI_Skip (WORD n) {
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = 0xFF;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+void SPI_Write (const BYTE *src, WORD n) {
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = *src++;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+void SPI_Read (BYTE *dst, WORD n) {
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = 0xFF;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        *dst++ = (BYTE)SPI1_D;
+    }
+}
+
+// One received byte, clocked with 0xFF
+__STATIC_INLINE BYTE __SPI_Rx (void) {
+    while(!(SPI1_S & SPI_S_SPTEF_MASK))
+		;
+    SPI1_D = 0xFF;
+    while(!(SPI1_S & SPI_S_SPRF_MASK))
+		;
+    return((BYTE)SPI1_D);
+}
+
+void SPI_Read_Xor (BYTE *dst, const BYTE *ks, WORD n) {
+    if (!ks) {
+        SPI_Read(dst, n);
+        return;
+    }
+    while (n--)
+        *dst++ = __SPI_Rx() ^ *ks++;
+}
+
+void SPI_Write_Xor (const BYTE *src, const BYTE *ks, WORD n) {
+    if (!ks) {
+        SPI_Write(src, n);
+        return;
+    }
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = *src++ ^ *ks++;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+}
+
+DWORD SPI_Read_Check (BYTE *dst, const BYTE *ks, WORD n, BYTE kind, DWORD ck) {
+    DWORD a, b;
+    BYTE d;
+
+    // One loop per kind keeps the kind test out of the byte loop. Keystream
+    // XOR and fold fit in the time the next byte takes to shift.
+    switch (kind) {
+    case BLK_CK_SUM:
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck += d;
+        }
+        break;
+    case BLK_CK_CRC16:
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck = (WORD)(ck << 8) ^ Blk_Crc16_Table[(BYTE)(ck >> 8) ^ d];
+        }
+        break;
+    case BLK_CK_CRC32:
+        ck = ~ck;
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            ck = (ck >> 8) ^ Blk_Crc32_Table[(BYTE)ck ^ d];
+        }
+        ck = ~ck;
+        break;
+    case BLK_CK_ADLER32:
+        a = ck & 0xFFFF;
+        b = ck >> 16;
+        while (n--) {
+            d = __SPI_Rx() ^ (ks ? *ks++ : 0);
+            *dst++ = d;
+            a += d;
+            b += a;
+        }
+        ck = (Blk_Adler32_Mod(b) << 16) | Blk_Adler32_Mod(a);
+        break;
+    default:
+        SPI_Read_Xor(dst, ks, n);
+        break;
+    }
+    return(ck);
+}
+
+DWORD SPI_Write_Adler (const BYTE *src, const BYTE *ks, WORD n, DWORD adler) {
+    DWORD a = adler & 0xFFFF, b = adler >> 16;
+
+    while (n--) {
+        while(!(SPI1_S & SPI_S_SPTEF_MASK))
+			;
+        SPI1_D = *src ^ (ks ? *ks++ : 0);
+        a += *src++;
+        b += a;
+        while(!(SPI1_S & SPI_S_SPRF_MASK))
+			;
+        (void)SPI1_D;
+    }
+    return((Blk_Adler32_Mod(b) << 16) | Blk_Adler32_Mod(a));
+}
+
 void SPI_Release (void) {
     WORD idx;
     for (idx=512; idx && (SPI_RW(0xFF)!=0xFF); idx--);
 }
 
+BOOL SPI_Release_Step (WORD *left) {
+    BYTE n;
+    for (n=SPI_RELEASE_STEP; n && *left; n--) {
+        (*left)--;
+        if (SPI_RW(0xFF)==0xFF) {
+            *left = 0;
+        }
+    }
+    return (*left ? FALSE : TRUE);
+}
+
 inline void SPI_CS_Low (void) {
     GPIOE_PDOR &= ~(1 << 4); //CS LOW
 }
@@ -89,21 +232,44 @@ inline void SPI_CS_High (void){
 }
 
 inline void SPI_Freq_High (void) {
-		SPI1_BR = 0x01; 
+		SPI_Freq_Set(SPI_MAX_FREQ);
 }	
 
 inline void SPI_Freq_Low (void) {
     SPI1_BR = 0x44; // 48MHz / 160 = 300kHz
 }
 
+DWORD SPI_Freq_Set (DWORD hz) {
+    BYTE sppr, spr, br;
+    DWORD div, best;
+
+    // SCK = SystemCoreClock / ((SPPR+1) * 2^(SPR+1)), pick the smallest divisor
+    // that keeps SCK at or below the limit
+    if (hz > SPI_MAX_FREQ)
+        hz = SPI_MAX_FREQ;
+    best = 0;
+    br = 0x78;                          // Slowest: 48MHz / (8 * 512) = 48MHz / 4096
+    for (sppr = 0; sppr != 8; sppr++) {
+        for (spr = 0; spr != 9; spr++) {
+            div = (DWORD)(sppr + 1) << (spr + 1);
+            if ((SystemCoreClock / div <= hz) && (SystemCoreClock / div > best)) {
+                best = SystemCoreClock / div;
+                br = (sppr << 4) | spr;
+            }
+        }
+    }
+    SPI1_BR = br;
+    return (best ? best : SystemCoreClock / 4096);
+}
+
 void SPI_Timer_On (WORD ms) {
     SIM_SCGC5 |= SIM_SCGC5_LPTMR_MASK;  // Make sure clock is enabled
     LPTMR0_CSR = 0;                     // Reset LPTMR settings
     LPTMR0_CMR = ms;                    // Set compare value (in ms)
     // Use 1kHz LPO with no prescaler
     LPTMR0_PSR = LPTMR_PSR_PCS(1) | LPTMR_PSR_PBYP_MASK;
-    // Start the timer and wait for it to reach the compare value
-    LPTMR0_CSR = LPTMR_CSR_TEN_MASK;
+    // Start the timer, the compare interrupt wakes a sleeping scheduler
+    LPTMR0_CSR = LPTMR_CSR_TEN_MASK | LPTMR_CSR_TIE_MASK;
 }
 
 inline BOOL SPI_Timer_Status (void) {
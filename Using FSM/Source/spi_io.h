@@ -11,6 +11,10 @@
 
 #include "integer.h"        /* Type redefinition for portability */
 
+#define SPI_MAX_FREQ    12000000UL  /* Fastest SCK SPI1 supports as master */
+#define SPI_LOW_FREQ    300000UL    /* Identification clock set by SPI_Freq_Low */
+#define SPI_RELEASE_STEP 8          /* Bytes clocked per SPI_Release_Step call */
+
 
 /******************************************************************************
  Public methods
@@ -28,11 +32,75 @@ void SPI_Init (void);
  */
 BYTE SPI_RW (BYTE d);
 
+/**
+    \brief Clock in and discard bytes.
+    \param n Number of bytes to discard.
+ */
+void SPI_Skip (WORD n);
+
+/**
+    \brief Clock in a run of bytes.
+    \param dst Destination buffer.
+    \param n Number of bytes to read.
+ */
+void SPI_Read (BYTE *dst, WORD n);
+
+/**
+    \brief Clock in a run of bytes, XORing a keystream into them on the way.
+    \param dst Destination buffer.
+    \param ks Keystream, one byte per data byte, NULL to read them as they are.
+    \param n Number of bytes to read.
+ */
+void SPI_Read_Xor (BYTE *dst, const BYTE *ks, WORD n);
+
+/**
+    \brief Clock in a run of bytes, folding them into a check value on the way.
+    \param dst Destination buffer.
+    \param ks Keystream XORed in before the fold, or NULL.
+    \param n Number of bytes to read, at most 5552 for Adler-32.
+    \param kind BLK_CK_* (blkutil.h).
+    \param ck Running check value, Blk_Check_Init(kind) to start.
+    \return Updated check value.
+ */
+DWORD SPI_Read_Check (BYTE *dst, const BYTE *ks, WORD n, BYTE kind, DWORD ck);
+
+/**
+    \brief Clock out a run of bytes, folding them into an Adler-32 on the way.
+    \param src Source buffer, folded as it is.
+    \param ks Keystream XORed into what goes out, or NULL.
+    \param n Number of bytes to write, at most 5552.
+    \param adler Running Adler-32, 1 to start.
+    \return Updated Adler-32.
+ */
+DWORD SPI_Write_Adler (const BYTE *src, const BYTE *ks, WORD n, DWORD adler);
+
+/**
+    \brief Clock out a run of bytes, discarding what arrives.
+    \param src Source buffer.
+    \param n Number of bytes to write.
+ */
+void SPI_Write (const BYTE *src, WORD n);
+
+/**
+    \brief Clock out a run of bytes XORed with a keystream, source unchanged.
+    \param src Source buffer.
+    \param ks Keystream, one byte per data byte, NULL to send them as they are.
+    \param n Number of bytes to write.
+ */
+void SPI_Write_Xor (const BYTE *src, const BYTE *ks, WORD n);
+
 /**
     \brief Flush of SPI buffer.
  */
 void SPI_Release (void);
 
+/**
+    \brief Bounded, resumable flush of SPI buffer.
+    \param left Bytes still allowed for this release, SD_BLK_SIZE to start one.
+    \return TRUE once the card has released DO or the allowance is used up.
+ */
+BOOL SPI_Release_Step (WORD *left);
+
 /**
     \brief Selecting function in SPI terms, associated with SPI module.
  */
@@ -53,6 +121,13 @@ void SPI_Freq_High (void);
  */
 void SPI_Freq_Low (void);
 
+/**
+    \brief Setting the fastest SPI clock not above a limit.
+    \param hz Upper limit in Hz.
+    \return Clock achieved in Hz.
+ */
+DWORD SPI_Freq_Set (DWORD hz);
+
 /**
     \brief Start a non-blocking timer.
     \param ms Milliseconds.
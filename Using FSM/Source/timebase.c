@@ -0,0 +1,183 @@
+/*
+ * Microsecond timebase for the FSM build
+ *
+ * SysTick runs free at TB_TICK_HZ; the tick count plus the current SysTick
+ * value give a core clock and a microsecond clock. Timeouts are software
+ * deadlines on that clock instead of the single 1 ms LPTMR compare, so any
+ * number of machines and drivers can time out independently and with
+ * sub-millisecond resolution. A waiting task parks on EV_TICK and tests its
+ * deadline when woken.
+ *
+ * Timers that must wake their owner instead of being polled live on a
+ * hierarchical wheel: TB_WHEEL_LEVELS levels of 2^TB_WHEEL_BITS slots, each
+ * slot a list of timers. Start and cancel are O(1) list operations. The tick
+ * interrupt expires the current level 0 slot and, whenever a level wraps,
+ * re-sorts one slot of the next level down into finer slots.
+ */
+
+#include <MKL25Z4.h>
+#include "timebase.h"
+#include "sched.h"
+
+#define __TB_SLOTS      (1UL << TB_WHEEL_BITS)
+#define __TB_MASK       (__TB_SLOTS - 1)
+#define __TB_RANGE      (1UL << (TB_WHEEL_BITS * TB_WHEEL_LEVELS))
+#define __TB_TICK_US    (1000000UL / TB_TICK_HZ)
+
+static volatile DWORD __TB_Ticks;
+static TB_TIMER *__TB_Wheel[TB_WHEEL_LEVELS][__TB_SLOTS];
+
+// File a timer into the slot matching its distance from now. IRQs masked.
+static void __TB_Wheel_Add(TB_TIMER *t)
+{
+    DWORD delta = t->expires - __TB_Ticks;
+    DWORD at = t->expires;
+    BYTE lvl = 0;
+
+    // Beyond the top level: park in its farthest slot and re-cascade later
+    if(delta >= __TB_RANGE)
+        at = __TB_Ticks + __TB_RANGE - 1;
+    while((lvl < TB_WHEEL_LEVELS - 1) && ((at - __TB_Ticks) >= (__TB_SLOTS << (TB_WHEEL_BITS * lvl))))
+        lvl++;
+    t->pprev = &__TB_Wheel[lvl][(at >> (TB_WHEEL_BITS * lvl)) & __TB_MASK];
+    t->next = *t->pprev;
+    if(t->next)
+        t->next->pprev = &t->next;
+    *t->pprev = t;
+}
+
+// IRQs masked
+static void __TB_Unlink(TB_TIMER *t)
+{
+    *t->pprev = t->next;
+    if(t->next)
+        t->next->pprev = t->pprev;
+}
+
+// Re-file the current slot of a coarse level
+static void __TB_Cascade(BYTE lvl)
+{
+    DWORD idx = (__TB_Ticks >> (TB_WHEEL_BITS * lvl)) & __TB_MASK;
+    TB_TIMER *t = __TB_Wheel[lvl][idx], *next;
+
+    __TB_Wheel[lvl][idx] = NULL;
+    for(; t; t = next) {
+        next = t->next;
+        __TB_Wheel_Add(t);
+    }
+}
+
+void SysTick_Handler(void) {
+    TB_TIMER *t, *next;
+    BYTE lvl;
+
+    __TB_Ticks++;
+    for(lvl = 1; (lvl < TB_WHEEL_LEVELS) && !((__TB_Ticks >> (TB_WHEEL_BITS * (lvl - 1))) & __TB_MASK); lvl++)
+        __TB_Cascade(lvl);
+    t = __TB_Wheel[0][__TB_Ticks & __TB_MASK];
+    __TB_Wheel[0][__TB_Ticks & __TB_MASK] = NULL;
+    for(; t; t = next) {
+        next = t->next;
+        t->running = FALSE;
+        t->fired = TRUE;
+        if(t->events)
+            Sched_Signal(t->events);
+        if(t->cb)
+            t->cb(t->arg);
+    }
+    Sched_Signal(EV_TICK);
+}
+
+void TB_Init(void)
+{
+    __TB_Ticks = 0;
+    SysTick_Config(SystemCoreClock / TB_TICK_HZ);
+}
+
+// Consistent tick count and SysTick value, also when a wrap is still pending
+static void __TB_Sample(DWORD *ticks, DWORD *val)
+{
+    uint32_t pm = __get_PRIMASK();
+
+    __disable_irq();
+    *ticks = __TB_Ticks;
+    *val = SysTick->VAL;
+    if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+        (*ticks)++;
+        *val = SysTick->VAL;
+    }
+    __set_PRIMASK(pm);
+}
+
+DWORD TB_Cycles(void)
+{
+    DWORD ticks, val;
+
+    __TB_Sample(&ticks, &val);
+    return(ticks * (SysTick->LOAD + 1) + (SysTick->LOAD - val));
+}
+
+DWORD TB_Now_us(void)
+{
+    DWORD ticks, val;
+
+    __TB_Sample(&ticks, &val);
+    return(ticks * (1000000UL / TB_TICK_HZ) + (SysTick->LOAD - val) / (SystemCoreClock / 1000000UL));
+}
+
+DWORD TB_Ticks(void)
+{
+    return(__TB_Ticks);
+}
+
+void TB_Arm(TB_DEADLINE *d, DWORD us)
+{
+    d->due = TB_Now_us() + us;
+    d->armed = TRUE;
+}
+
+BOOL TB_Expired(const TB_DEADLINE *d)
+{
+    // Signed difference keeps the compare valid across the clock wrap
+    return((d->armed && ((LONG)(TB_Now_us() - d->due) >= 0)) ? TRUE : FALSE);
+}
+
+void TB_Cancel(TB_DEADLINE *d)
+{
+    d->armed = FALSE;
+}
+
+void TB_Timer_Start(TB_TIMER *t, DWORD us, BYTE events, TB_CALLBACK cb, void *arg)
+{
+    uint32_t pm = __get_PRIMASK();
+
+    __disable_irq();
+    if(t->running)
+        __TB_Unlink(t);
+    t->cb = cb;
+    t->arg = arg;
+    t->events = events;
+    t->fired = FALSE;
+    t->running = TRUE;
+    // A partial tick is already gone: one extra tick guarantees the minimum
+    t->expires = __TB_Ticks + us / __TB_TICK_US + 1;
+    __TB_Wheel_Add(t);
+    __set_PRIMASK(pm);
+}
+
+void TB_Timer_Cancel(TB_TIMER *t)
+{
+    uint32_t pm = __get_PRIMASK();
+
+    __disable_irq();
+    if(t->running)
+        __TB_Unlink(t);
+    t->running = FALSE;
+    t->fired = FALSE;
+    __set_PRIMASK(pm);
+}
+
+BOOL TB_Timer_Expired(const TB_TIMER *t)
+{
+    return(t->fired);
+}
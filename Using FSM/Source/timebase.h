@@ -0,0 +1,100 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+#include <stddef.h>
+#include <integer.h>
+
+/******************************************************************************
+ Configurations
+******************************************************************************/
+#define TB_TICK_HZ      (10000)     // SysTick rate: deadline check granularity and poll pacing
+#define TB_WHEEL_BITS   (5)         // Slots per wheel level = 2^bits
+#define TB_WHEEL_LEVELS (3)         // Levels, range = 2^(bits*levels) ticks (3.2 s), longer timers re-cascade
+
+#define TB_MS(ms)       ((DWORD)(ms) * 1000UL)  // Milliseconds to timebase microseconds
+
+typedef void (*TB_CALLBACK)(void *arg);
+
+// Software deadline. Any number can run at once, each owner polls its own.
+typedef struct {
+    DWORD due;          // Absolute time (us)
+    BOOL armed;
+} TB_DEADLINE;
+
+/**
+ \brief Start the free-running SysTick timebase. EV_TICK is signalled every tick.
+ */
+void TB_Init(void);
+
+/**
+ \brief Free-running core clock counter.
+ \return Core clocks since TB_Init, wraps after about 89 s at 48 MHz.
+ */
+DWORD TB_Cycles(void);
+
+/**
+ \brief Free-running microsecond clock.
+ \return Microseconds since TB_Init, wraps after about 71 minutes.
+ */
+DWORD TB_Now_us(void);
+
+/**
+ \brief Number of SysTick periods since TB_Init.
+ */
+DWORD TB_Ticks(void);
+
+/**
+ \brief Arm a deadline relative to now.
+ \param d Deadline.
+ \param us Time from now, below half the clock wrap.
+ */
+void TB_Arm(TB_DEADLINE *d, DWORD us);
+
+/**
+ \brief Test an armed deadline.
+ \param d Deadline.
+ \return TRUE once the deadline has passed, FALSE while running or not armed.
+ */
+BOOL TB_Expired(const TB_DEADLINE *d);
+
+/**
+ \brief Disarm a deadline.
+ \param d Deadline.
+ */
+void TB_Cancel(TB_DEADLINE *d);
+
+// Timer wheel entry. Expires in the SysTick interrupt, then posts its events
+// and calls its callback. Owned by the caller, must stay valid while running.
+typedef struct TB_TIMER {
+    struct TB_TIMER *next;
+    struct TB_TIMER **pprev;    // Link pointing at this timer, for O(1) cancel
+    DWORD expires;              // Tick
+    TB_CALLBACK cb;             // Runs in the SysTick interrupt, NULL: none
+    void *arg;
+    BYTE events;                // Posted with Sched_Signal on expiry, 0: none
+    volatile BOOL running;
+    volatile BOOL fired;        // Expired since the last start
+} TB_TIMER;
+
+/**
+ \brief Start (or restart) a wheel timer. O(1).
+ \param t Timer.
+ \param us Minimum time to expiry, rounded up to whole ticks.
+ \param events Scheduler events posted on expiry, e.g. EV_TIMER.
+ \param cb Callback run in the SysTick interrupt on expiry, or NULL.
+ \param arg Passed to cb.
+ */
+void TB_Timer_Start(TB_TIMER *t, DWORD us, BYTE events, TB_CALLBACK cb, void *arg);
+
+/**
+ \brief Stop a timer and clear its expired flag. O(1).
+ \param t Timer.
+ */
+void TB_Timer_Cancel(TB_TIMER *t);
+
+/**
+ \brief Test whether a timer expired since it was started.
+ \param t Timer.
+ */
+BOOL TB_Timer_Expired(const TB_TIMER *t);
+
+#endif // TIMEBASE_H
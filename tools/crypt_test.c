@@ -0,0 +1,143 @@
+/*
+ * AES-128 and sector CTR checks, and keystream throughput
+ *
+ * - Known answers of the block cipher: FIPS-197 appendices B and C.1.
+ * - Counter mode vectors for the blkcrypt.h counter layout (nonce, sector,
+ *   block index), computed independently with
+ *     printf <nonce><sector><block> | xxd -r -p | openssl enc -aes-128-ecb -K <key> -nopad
+ * - The keystream on the data path: a sector written through SD_Write with
+ *   a key set must reach the simulated card as plaintext XOR those vectors,
+ *   and SD_Read must return the plaintext.
+ * - Throughput of Blk_Crypt_Stream on this machine, whole sectors.
+ *
+ * Build and run from the repository root:
+ *   S="Using CMSIS-RTOS v2 RTX5/Source"
+ *   cc -std=gnu99 -fgnu89-inline -O2 -Itools/host -I"$S" -o crypt_test tools/crypt_test.c \
+ *      tools/host/sdsim.c "$S/sd_io.c" "$S/sd_reg.c" "$S/blkutil.c" "$S/blkcrypt.c"
+ *   ./crypt_test
+ * Exit status 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sd_io.h"
+#include "blkcrypt.h"
+#include "sdsim.h"
+
+#define BENCH_SECTORS 20000
+
+typedef struct {
+    BYTE key[16], in[16], out[16];
+} AES_KAT;
+
+static const AES_KAT aes_kat[] = {
+    // FIPS-197 appendix B
+    {{0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c},
+     {0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34},
+     {0x39, 0x25, 0x84, 0x1d, 0x02, 0xdc, 0x09, 0xfb, 0xdc, 0x11, 0x85, 0x97, 0x19, 0x6a, 0x0b, 0x32}},
+    // FIPS-197 appendix C.1
+    {{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f},
+     {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff},
+     {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a}},
+};
+
+// Key of appendix B, nonce f0..f7, sector 0x00012345
+static const BYTE ctr_key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const BYTE ctr_nonce[8] = {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7};
+#define CTR_SECTOR 0x00012345UL
+
+typedef struct {
+    BYTE block;             // AES block within the sector
+    BYTE ks[16];
+} CTR_KAT;
+
+static const CTR_KAT ctr_kat[] = {
+    {0,  {0xe9, 0x05, 0x55, 0x79, 0x1a, 0xbf, 0xc5, 0xf1, 0x69, 0x15, 0x13, 0xc0, 0x7e, 0x9f, 0xd6, 0x5b}},
+    {1,  {0xb9, 0x63, 0x70, 0x53, 0x8e, 0xe6, 0x1b, 0x42, 0x18, 0x76, 0x0b, 0x15, 0xb4, 0x97, 0x95, 0x92}},
+    {31, {0x17, 0xec, 0x80, 0x58, 0x77, 0xd8, 0x9b, 0xd4, 0xe4, 0x0a, 0x9c, 0x7c, 0xa1, 0xfa, 0x30, 0x4b}},
+};
+
+#define NUM(a) (sizeof(a) / sizeof((a)[0]))
+
+static int fails;
+
+static void check(int ok, const char *what)
+{
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        fails++;
+    }
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+int main(void)
+{
+    static BLK_CRYPT crypt;
+    static SD_DEV dev;
+    BYTE rk[BLK_AES_RK_SIZE], out[16], pt[SD_BLK_SIZE], back[SD_BLK_SIZE];
+    const BYTE *ks, *card;
+    double t;
+    DWORD s, i;
+    BYTE sum = 0;
+
+    for(i = 0; i < NUM(aes_kat); i++) {
+        Blk_Aes128_Key(rk, aes_kat[i].key);
+        Blk_Aes128_Encrypt(rk, aes_kat[i].in, out);
+        check(!memcmp(out, aes_kat[i].out, 16), "AES-128 known answer");
+    }
+    printf("AES-128: %u known answers\n", (unsigned)NUM(aes_kat));
+
+    Blk_Crypt_Init(&crypt, ctr_key, ctr_nonce);
+    // Partial range first: only the blocks it covers are built
+    ks = Blk_Crypt_Stream(&crypt, CTR_SECTOR, 20, 8);
+    check(crypt.valid == 0x2, "keystream built for the range only");
+    check(!memcmp(&ks[16], ctr_kat[1].ks, 16), "CTR keystream of a range");
+    while(!Blk_Crypt_Fill(&crypt, CTR_SECTOR, 3))
+        ;
+    for(i = 0; i < NUM(ctr_kat); i++)
+        check(!memcmp(&crypt.ks[16 * ctr_kat[i].block], ctr_kat[i].ks, 16), "CTR keystream block");
+    printf("CTR: %u keystream blocks\n", (unsigned)NUM(ctr_kat));
+
+    // Data path: ciphertext on the card, plaintext back
+    Sim_Card_Init(&Sim_Default, FALSE);
+    check(SD_Init(&dev) == SD_OK, "SD_Init");
+    for(i = 0; i < SD_BLK_SIZE; i++)
+        pt[i] = (BYTE)i;
+    Blk_Crypt_Init(&crypt, ctr_key, ctr_nonce);
+    SD_Set_Crypt(&dev, &crypt);
+    check(SD_Write(&dev, pt, CTR_SECTOR & 0x3FFF) == SD_OK, "SD_Write");
+    check(SD_Sync(&dev) == SD_OK, "SD_Sync");
+    card = Sim_Sector(CTR_SECTOR & 0x3FFF);
+    // The simulated card is smaller: the keystream follows the sector written
+    ks = Blk_Crypt_Stream(&crypt, CTR_SECTOR & 0x3FFF, 0, SD_BLK_SIZE);
+    for(i = 0; (i < SD_BLK_SIZE) && (card[i] == (pt[i] ^ ks[i])); i++)
+        ;
+    check(i == SD_BLK_SIZE, "ciphertext on the card");
+    check(memcmp(card, pt, SD_BLK_SIZE) != 0, "no plaintext on the card");
+    check(SD_Read(&dev, back, CTR_SECTOR & 0x3FFF, 0, SD_BLK_SIZE) == SD_OK, "SD_Read");
+    check(!memcmp(back, pt, SD_BLK_SIZE), "plaintext read back");
+    // Whole sector keystream of the vector sector, beyond the simulated card
+    ks = Blk_Crypt_Stream(&crypt, CTR_SECTOR, 0, SD_BLK_SIZE);
+    check(!memcmp(&ks[16 * 31], ctr_kat[2].ks, 16), "CTR keystream of a whole sector");
+    printf("data path: ciphertext on the card, plaintext back\n");
+
+    // Throughput: a fresh sector per call, so every block is encrypted
+    t = seconds();
+    for(s = 0; s < BENCH_SECTORS; s++)
+        sum ^= Blk_Crypt_Stream(&crypt, s, 0, SD_BLK_SIZE)[s & 511];
+    t = seconds() - t;
+    printf("keystream: %.1f MB/s, %.2f us per sector on this machine (%02x)\n",
+           BENCH_SECTORS * (double)SD_BLK_SIZE / t / 1e6, t / BENCH_SECTORS * 1e6, sum);
+
+    printf(fails ? "FAILED\n" : "OK\n");
+    return(fails ? 1 : 0);
+}
@@ -0,0 +1,116 @@
+/*
+ * Pre-erase against plain overwrite, on the simulated card
+ *
+ * The RTX driver (sd_io.c) runs against tools/host/sdsim.c. A card full of
+ * old data takes the same run of sectors twice: written over as it is, then
+ * erased with SD_Erase first and left idle, as the log bench does between
+ * its runs. Reports simulated time and block rewrites per run, checks the
+ * data read back and that erased sectors read as erased. Last, erases the
+ * whole card with a busy limit beyond 16 bits to check it is kept as it is
+ * and waited out in chunks.
+ *
+ * Build and run from the repository root:
+ *   S="Using CMSIS-RTOS v2 RTX5/Source"
+ *   cc -std=gnu99 -fgnu89-inline -Itools/host -I"$S" -o erase_sim tools/erase_sim.c \
+ *      tools/host/sdsim.c "$S/sd_io.c" "$S/sd_reg.c" "$S/blkutil.c" "$S/blkcrypt.c"
+ *   ./erase_sim
+ * Exit status 1 if a check fails or pre-erase is not faster.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sd_io.h"
+#include "sdsim.h"
+
+#define RUN_SECTORS 32      // As LOG_ERASE in main.c
+#define RUN_IDLE_MS 250     // As LOG_IDLE_MS
+#define RUN_PLAIN   4096    // First sector of the overwritten run
+#define RUN_ERASED  8192    // ...and of the pre-erased one
+
+static SD_DEV dev;
+static BYTE buf[SD_BLK_SIZE];
+static int fails;
+
+static void check(int ok, const char *what)
+{
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        fails++;
+    }
+}
+
+// Write a run sector by sector as SDS_Write does, then sync. Returns the
+// simulated time in us.
+static DWORD write_run(DWORD first)
+{
+    uint64_t t0 = Sim_Now_us();
+    DWORD s;
+
+    for(s = first; s < first + RUN_SECTORS; s++) {
+        memset(buf, (BYTE)(s ^ 0xA5), sizeof(buf));
+        check(SD_Write(&dev, buf, s) == SD_OK, "SD_Write");
+    }
+    check(SD_Sync(&dev) == SD_OK, "SD_Sync after the run");
+    return((DWORD)(Sim_Now_us() - t0));
+}
+
+static void verify_run(DWORD first)
+{
+    DWORD s;
+
+    for(s = first; s < first + RUN_SECTORS; s++) {
+        check(SD_Read(&dev, buf, s, 0, SD_BLK_SIZE) == SD_OK, "SD_Read");
+        check((buf[0] == (BYTE)(s ^ 0xA5)) && (buf[SD_BLK_SIZE - 1] == (BYTE)(s ^ 0xA5)), "data read back");
+    }
+}
+
+int main(void)
+{
+    DWORD plain_us, erased_us, plain_merges, erased_merges, s, ms;
+
+    Sim_Card_Init(&Sim_Default, TRUE);
+    if(SD_Init(&dev) != SD_OK) {
+        printf("FAIL: SD_Init\n");
+        return(1);
+    }
+    printf("card: %lu sectors, SPI %lu Hz, AU %lu sectors\n", (unsigned long)(dev.last_sector + 1),
+           (unsigned long)dev.clock, (unsigned long)dev.info.ssr.au_sectors);
+
+    Sim_Stats_Reset();
+    plain_us = write_run(RUN_PLAIN);
+    plain_merges = Sim_Stats.merges;
+
+    check(SD_Erase(&dev, RUN_ERASED, RUN_ERASED + RUN_SECTORS - 1) == SD_OK, "SD_Erase");
+    Sim_Idle(RUN_IDLE_MS * 1000UL);
+    check(SD_Sync(&dev) == SD_OK, "SD_Sync after the erase");
+    for(s = RUN_ERASED; s < RUN_ERASED + RUN_SECTORS; s++) {
+        check(Sim_Erased(s), "erase state");
+        check(SD_Read(&dev, buf, s, 0, SD_BLK_SIZE) == SD_OK, "SD_Read of an erased sector");
+        check((buf[0] == Sim_Default.erased) && (buf[SD_BLK_SIZE - 1] == Sim_Default.erased), "erased value");
+    }
+    Sim_Stats_Reset();
+    erased_us = write_run(RUN_ERASED);
+    erased_merges = Sim_Stats.merges;
+
+    verify_run(RUN_PLAIN);
+    verify_run(RUN_ERASED);
+
+    printf("run         us/run  us/sector  block rewrites\n");
+    printf("overwrite %8lu %10lu %15lu\n", (unsigned long)plain_us, (unsigned long)(plain_us / RUN_SECTORS),
+           (unsigned long)plain_merges);
+    printf("pre-erased%8lu %10lu %15lu\n", (unsigned long)erased_us, (unsigned long)(erased_us / RUN_SECTORS),
+           (unsigned long)erased_merges);
+    check(erased_us < plain_us, "pre-erased run faster");
+
+    // Busy limit of a whole card erase with small AUs: far beyond 65535 ms
+    dev.info.ssr.au_sectors = 16;
+    ms = SD_Reg_Erase_Ms(&dev.info.ssr, dev.last_sector + 1);
+    check(SD_Erase(&dev, 0, dev.last_sector) == SD_OK, "SD_Erase of the card");
+    printf("card erase: busy limit %lu ms, kept %lu ms\n", (unsigned long)ms, (unsigned long)dev.busy_ms);
+    check((ms > 0xFFFF) && (dev.busy_ms == ms), "busy limit kept beyond 16 bits");
+    check(SD_Sync(&dev) == SD_OK, "SD_Sync after the card erase");
+    check(Sim_Erased(0) && Sim_Erased(dev.last_sector), "card erased");
+
+    printf(fails ? "FAILED\n" : "OK\n");
+    return(fails ? 1 : 0);
+}
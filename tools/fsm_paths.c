@@ -0,0 +1,427 @@
+/*
+ * Host check of the FSM state tables
+ *
+ * Reads the sources of the FSM variant, finds every FSM_STATE_T table and
+ * the enum naming its states, and derives the transitions of each state
+ * from the source: the states named in its action, in the local functions
+ * and tables the action uses, and its on_timeout entry. Then lists per
+ * machine the reachable states, the dead ends (reachable, no way out) and
+ * the timeout edges.
+ *
+ * The transitions are an over-approximation: every state an action names
+ * counts as a possible next state. An action that returns a state held in
+ * its context (e.g. the register read returning to c->after) is reported as
+ * dynamic; the states it can return are named by its callers anyway.
+ *
+ * Build and run from the repository root:
+ *   cc -std=c99 -Wall -o fsm_paths tools/fsm_paths.c
+ *   ./fsm_paths
+ * With no arguments the Init, Read and Write tables of sd_io.c are read.
+ * Other sources are passed as arguments, with the headers of their enums:
+ *   ./fsm_paths "Using FSM/Source/SD_Server.c" "Using FSM/Source/sd_server.h"
+ * Exit status 1 when a machine has a dead end or an unreachable state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_TOKENS  60000
+#define MAX_ENUMS   32
+#define MAX_STATES  48
+#define MAX_DEFS    512
+#define TOKEN_LEN   48
+
+static const char *default_files[] = {
+    "Using FSM/Source/sd_io.c",
+};
+
+typedef struct {
+    char text[TOKEN_LEN];
+} TOKEN;
+
+typedef struct {
+    int num;
+    char name[MAX_STATES][TOKEN_LEN];
+} ENUM_T;
+
+typedef struct {
+    char name[TOKEN_LEN];
+    int open, close;            // Braced body, token indexes
+} DEF_T;
+
+typedef struct {
+    char guard[TOKEN_LEN], action[TOKEN_LEN];
+    char timeout[TOKEN_LEN * 2], on_timeout[TOKEN_LEN];
+} ROW_T;
+
+static TOKEN tok[MAX_TOKENS];
+static int ntok;
+static ENUM_T enums[MAX_ENUMS];
+static int nenums;
+static DEF_T defs[MAX_DEFS];
+static int ndefs;
+
+static int is(int i, const char *s)
+{
+    return((i >= 0) && (i < ntok) && !strcmp(tok[i].text, s));
+}
+
+static int is_ident(int i)
+{
+    return(isalpha((unsigned char)tok[i].text[0]) || (tok[i].text[0] == '_'));
+}
+
+// Split a source file into identifiers, numbers and single punctuators.
+// Comments, literals and preprocessor lines are dropped.
+static void tokenize(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char *s, *p;
+    long n;
+    int bol = 1;
+
+    if(f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    s = malloc(n + 1);
+    if((s == NULL) || (fread(s, 1, n, f) != (size_t)n)) {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(2);
+    }
+    s[n] = 0;
+    fclose(f);
+    for(p = s; *p; ) {
+        if(*p == '\n') {
+            bol = 1;
+            p++;
+        } else if(isspace((unsigned char)*p)) {
+            p++;
+        } else if(bol && (*p == '#')) {
+            // Directive, with its continuation lines
+            while(*p && (*p != '\n' || p[-1] == '\\'))
+                p++;
+        } else if((p[0] == '/') && (p[1] == '/')) {
+            while(*p && (*p != '\n'))
+                p++;
+        } else if((p[0] == '/') && (p[1] == '*')) {
+            for(p += 2; *p && !((p[0] == '*') && (p[1] == '/')); p++)
+                ;
+            if(*p)
+                p += 2;
+        } else if((*p == '"') || (*p == '\'')) {
+            char q = *p++;
+
+            while(*p && (*p != q)) {
+                if((*p == '\\') && p[1])
+                    p++;
+                p++;
+            }
+            if(*p)
+                p++;
+            bol = 0;
+        } else {
+            int len = 1;
+
+            if(isalnum((unsigned char)*p) || (*p == '_'))
+                for(len = 0; isalnum((unsigned char)p[len]) || (p[len] == '_'); len++)
+                    ;
+            if(ntok == MAX_TOKENS) {
+                fprintf(stderr, "too many tokens\n");
+                exit(2);
+            }
+            memcpy(tok[ntok].text, p, (len < TOKEN_LEN) ? len : TOKEN_LEN - 1);
+            tok[ntok].text[(len < TOKEN_LEN) ? len : TOKEN_LEN - 1] = 0;
+            ntok++;
+            p += len;
+            bol = 0;
+        }
+    }
+    free(s);
+}
+
+// Index of the token closing the bracket opened at i
+static int match(int i)
+{
+    const char *o = tok[i].text, *c = is(i, "{") ? "}" : is(i, "(") ? ")" : "]";
+    int depth = 0;
+
+    for(; i < ntok; i++) {
+        if(!strcmp(tok[i].text, o))
+            depth++;
+        else if(!strcmp(tok[i].text, c) && (--depth == 0))
+            return(i);
+    }
+    return(ntok - 1);
+}
+
+// Enums and top-level braced definitions (functions and initialized tables)
+static void scan(void)
+{
+    int i, j, depth = 0;
+
+    for(i = 0; i < ntok; i++) {
+        if(is(i, "enum") && (is(i + 1, "{") || is(i + 2, "{")) && (nenums < MAX_ENUMS)) {
+            ENUM_T *e = &enums[nenums++];
+            int open = is(i + 1, "{") ? i + 1 : i + 2, close = match(open);
+
+            e->num = 0;
+            for(j = open + 1; j < close; j++) {
+                if(is_ident(j) && (is(j - 1, "{") || is(j - 1, ",")) && (e->num < MAX_STATES))
+                    strcpy(e->name[e->num++], tok[j].text);
+            }
+        }
+        if(is(i, "{")) {
+            if(depth == 0 && ndefs < MAX_DEFS) {
+                // Name: identifier before "(...) {" or before "[...] = {"
+                for(j = i - 1; j > 0 && !is(j, ";") && !is(j, "}"); j--) {
+                    if(is_ident(j) && (is(j + 1, "(") || is(j + 1, "["))) {
+                        strcpy(defs[ndefs].name, tok[j].text);
+                        defs[ndefs].open = i;
+                        defs[ndefs].close = match(i);
+                        ndefs++;
+                        break;
+                    }
+                }
+            }
+            depth++;
+        } else if(is(i, "}")) {
+            depth--;
+        }
+    }
+}
+
+static DEF_T *find_def(const char *name)
+{
+    int i;
+
+    for(i = 0; i < ndefs; i++) {
+        if(!strcmp(defs[i].name, name))
+            return(&defs[i]);
+    }
+    return(NULL);
+}
+
+static int state_of(const ENUM_T *e, const char *name)
+{
+    int i;
+
+    for(i = 0; i < e->num; i++) {
+        if(!strcmp(e->name[i], name))
+            return(i);
+    }
+    return(-1);
+}
+
+// States of e named in a definition and, transitively, in the local
+// definitions it uses. seen[] guards against recursion.
+static void collect(const ENUM_T *e, const DEF_T *d, char *next, char *seen)
+{
+    int i, s;
+    DEF_T *u;
+
+    seen[d - defs] = 1;
+    for(i = d->open + 1; i < d->close; i++) {
+        if(!is_ident(i))
+            continue;
+        s = state_of(e, tok[i].text);
+        if(s >= 0)
+            next[s] = 1;
+        else if(((u = find_def(tok[i].text)) != NULL) && !seen[u - defs])
+            collect(e, u, next, seen);
+    }
+}
+
+// An action returning neither a state, FSM_STAY nor a local call: the next
+// state comes from its context
+static int dynamic(const ENUM_T *e, const DEF_T *d)
+{
+    int i, j, named;
+
+    for(i = d->open + 1; i < d->close; i++) {
+        if(!is(i, "return"))
+            continue;
+        for(named = 0, j = i + 1; (j < d->close) && !is(j, ";"); j++) {
+            if(is_ident(j) && ((state_of(e, tok[j].text) >= 0) || is(j, "FSM_STAY") || find_def(tok[j].text)))
+                named = 1;
+        }
+        if(!named)
+            return(1);
+    }
+    return(0);
+}
+
+// Copy tokens [a, b) into dst, space-separated where identifiers meet
+static void join(char *dst, size_t size, int a, int b)
+{
+    dst[0] = 0;
+    for(; a < b; a++) {
+        if(dst[0] && is_ident(a) && isalnum((unsigned char)dst[strlen(dst) - 1]))
+            strncat(dst, " ", size - strlen(dst) - 1);
+        strncat(dst, tok[a].text, size - strlen(dst) - 1);
+    }
+}
+
+static int parse_rows(int open, ROW_T *row, int max)
+{
+    int i = open + 1, n = 0, f, start, end;
+
+    while((i < ntok) && is(i, "{") && (n < max)) {
+        end = match(i);
+        memset(&row[n], 0, sizeof(row[n]));
+        for(f = 0, start = i + 1; f < 5; f++) {
+            int j;
+
+            for(j = start; j < end && !is(j, ","); j++) {
+                if(is(j, "("))
+                    j = match(j);
+            }
+            if(f == 0)
+                join(row[n].guard, TOKEN_LEN, start, j);
+            else if(f == 1)
+                join(row[n].action, TOKEN_LEN, start, j);
+            else if(f == 2)
+                join(row[n].timeout, sizeof(row[n].timeout), start, j);
+            else if(f == 3)
+                join(row[n].on_timeout, TOKEN_LEN, start, j);
+            start = j + 1;
+        }
+        n++;
+        i = end + 1;
+        if(is(i, ","))
+            i++;
+    }
+    return(n);
+}
+
+// Enum with as many members as the table has rows, most named by its actions
+static const ENUM_T *table_enum(const ROW_T *row, int n)
+{
+    const ENUM_T *best = NULL;
+    int best_score = -1, k, s, score;
+    char next[MAX_STATES], seen[MAX_DEFS];
+    DEF_T *d;
+
+    for(k = 0; k < nenums; k++) {
+        if(enums[k].num != n)
+            continue;
+        for(score = 0, s = 0; s < n; s++) {
+            if(state_of(&enums[k], row[s].on_timeout) >= 0)
+                score++;
+            if((d = find_def(row[s].action)) == NULL)
+                continue;
+            memset(next, 0, sizeof(next));
+            memset(seen, 0, sizeof(seen));
+            collect(&enums[k], d, next, seen);
+            score += (memchr(next, 1, n) != NULL);
+        }
+        if(score > best_score) {
+            best = &enums[k];
+            best_score = score;
+        }
+    }
+    return(best);
+}
+
+static int report(const char *table, const ROW_T *row, int n)
+{
+    const ENUM_T *e = table_enum(row, n);
+    char next[MAX_STATES][MAX_STATES], dyn[MAX_STATES], reach[MAX_STATES], seen[MAX_DEFS];
+    int s, t, changed, dead = 0, lost = 0, to;
+    DEF_T *d;
+
+    if(e == NULL) {
+        printf("%s: no enum with %d members, skipped\n\n", table, n);
+        return(0);
+    }
+    memset(next, 0, sizeof(next));
+    memset(dyn, 0, sizeof(dyn));
+    for(s = 0; s < n; s++) {
+        if((d = find_def(row[s].action)) != NULL) {
+            memset(seen, 0, sizeof(seen));
+            collect(e, d, next[s], seen);
+            dyn[s] = dynamic(e, d);
+        }
+        to = state_of(e, row[s].on_timeout);
+        if(strcmp(row[s].timeout, "0") && (to >= 0))
+            next[s][to] = 1;
+    }
+    // Reachable from state 0, where every machine starts
+    memset(reach, 0, sizeof(reach));
+    reach[0] = 1;
+    do {
+        changed = 0;
+        for(s = 0; s < n; s++) {
+            for(t = 0; reach[s] && t < n; t++) {
+                if(next[s][t] && !reach[t])
+                    reach[t] = changed = 1;
+            }
+        }
+    } while(changed);
+
+    printf("%s (%d states)\n", table, n);
+    for(s = 0; s < n; s++) {
+        printf("  %-16s", e->name[s]);
+        if(!strcmp(row[s].action, "NULL"))
+            printf(" [no action]");
+        for(t = 0; t < n; t++) {
+            if(next[s][t] && (t != s))
+                printf(" %s", e->name[t]);
+        }
+        if(dyn[s])
+            printf(" [dynamic]");
+        printf("\n");
+    }
+    printf("  timeout edges:\n");
+    for(s = 0; s < n; s++) {
+        if(strcmp(row[s].timeout, "0"))
+            printf("    %s -(%s)-> %s\n", e->name[s], row[s].timeout, row[s].on_timeout);
+    }
+    printf("  unreachable:");
+    for(s = 0; s < n; s++) {
+        if(!reach[s]) {
+            printf(" %s", e->name[s]);
+            lost++;
+        }
+    }
+    printf(lost ? "\n" : " none\n");
+    printf("  dead ends:");
+    for(s = 0; s < n; s++) {
+        for(t = 0; (t < n) && !(next[s][t] && t != s); t++)
+            ;
+        if(reach[s] && (t == n) && !dyn[s]) {
+            printf(" %s", e->name[s]);
+            dead++;
+        }
+    }
+    printf(dead ? "\n\n" : " none\n\n");
+    return(dead || lost);
+}
+
+int main(int argc, char **argv)
+{
+    ROW_T row[MAX_STATES];
+    int i, n, bad = 0;
+
+    if(argc > 1) {
+        for(i = 1; i < argc; i++)
+            tokenize(argv[i]);
+    } else {
+        for(i = 0; i < (int)(sizeof(default_files) / sizeof(default_files[0])); i++)
+            tokenize(default_files[i]);
+    }
+    scan();
+    for(i = 0; i + 4 < ntok; i++) {
+        // FSM_STATE_T name [ ] = {
+        if(is(i, "FSM_STATE_T") && is(i + 2, "[") && is(i + 3, "]") && is(i + 4, "=") && is(i + 5, "{")) {
+            n = parse_rows(i + 5, row, MAX_STATES);
+            bad |= report(tok[i + 1].text, row, n);
+        }
+    }
+    return(bad);
+}
@@ -0,0 +1,32 @@
+/*
+ * Host stand-in for the KL25Z device header
+ *
+ * Only what the portable driver sources (sd_io.c, sd_reg.c, blk*.c,
+ * SD_Server.c) touch when built on the development machine against the
+ * simulated card of sdsim.c: the debug port, the core clock and the CMSIS
+ * attribute and interrupt helpers.
+ */
+
+#ifndef MKL25Z4_H_HOST
+#define MKL25Z4_H_HOST
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t PDOR, PSOR, PCOR, PTOR, PDIR, PDDR;
+} GPIO_Type;
+
+extern GPIO_Type *PTB;          // Debug pins, written and ignored
+extern uint32_t SystemCoreClock;
+
+#define __WEAK          __attribute__((weak))
+#define __ALIGNED(x)    __attribute__((aligned(x)))
+#define __STATIC_INLINE static inline
+
+static inline uint32_t __get_PRIMASK(void) { return(0); }
+static inline void __set_PRIMASK(uint32_t pm) { (void)pm; }
+static inline void __disable_irq(void) { }
+static inline void __enable_irq(void) { }
+static inline void __NOP(void) { }
+
+#endif // MKL25Z4_H_HOST
@@ -0,0 +1,80 @@
+/*
+ * Host stand-in for the CMSIS-RTOS2 API
+ *
+ * The kernel time functions run on the simulated clock of sdsim.c, so a
+ * driver wait costs simulated time only. Threads, flags and queues are the
+ * single-threaded minimum the host programs need: a program drives the
+ * server functions directly instead of starting its thread.
+ */
+
+#ifndef CMSIS_OS2_H_HOST
+#define CMSIS_OS2_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void *osThreadId_t;
+typedef void *osMessageQueueId_t;
+typedef void (*osThreadFunc_t)(void *argument);
+
+typedef enum {
+    osOK = 0,
+    osError = -1,
+    osErrorTimeout = -2,
+    osErrorResource = -3,
+    osErrorParameter = -4
+} osStatus_t;
+
+typedef enum {
+    osPriorityLow = 8,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48
+} osPriority_t;
+
+typedef struct {
+    const char *name;
+    uint32_t attr_bits;
+    void *cb_mem;
+    uint32_t cb_size;
+    void *stack_mem;
+    uint32_t stack_size;
+    osPriority_t priority;
+    uint32_t tz_module;
+    uint32_t reserved;
+} osThreadAttr_t;
+
+typedef struct {
+    const char *name;
+    uint32_t attr_bits;
+    void *cb_mem;
+    uint32_t cb_size;
+    void *mq_mem;
+    uint32_t mq_size;
+} osMessageQueueAttr_t;
+
+#define osWaitForever   0xFFFFFFFFU
+#define osFlagsWaitAny  0x00000000U
+#define osFlagsWaitAll  0x00000001U
+#define osFlagsNoClear  0x00000002U
+#define osFlagsError    0x80000000U
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+
+uint32_t osKernelGetTickCount(void);
+uint32_t osKernelGetTickFreq(void);
+uint32_t osKernelGetSysTimerCount(void);
+uint32_t osKernelGetSysTimerFreq(void);
+osStatus_t osDelay(uint32_t ticks);
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr);
+osThreadId_t osThreadGetId(void);
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout);
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr);
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout);
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout);
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id);
+
+#endif // CMSIS_OS2_H_HOST
@@ -0,0 +1,761 @@
+/*
+ * Simulated SD card for host programs, see sdsim.h
+ *
+ * Provides, for a host build of the RTX driver sources: spi_io.h, the kernel
+ * time functions and minimal threads, flags and queues of cmsis_os2.h, the
+ * globals the sources expect from main.c and the startup code, and a RAM
+ * store for the card identity cache in place of the reserved flash sector.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <MKL25Z4.h>
+#include "cmsis_os2.h"
+#include "spi_io.h"
+#include "sd_io.h"
+#include "blkutil.h"
+#include "flash_io.h"
+#include "sdsim.h"
+
+#define SIM_SYSTIMER_HZ 48000000UL  // Core clock, the RTX system timer
+#define SIM_LOW_HZ      375000UL    // SPI_Freq_Low
+#define SIM_STOP_US     10          // Busy after a stop token or CMD12
+#define SIM_STUFF       0x3F        // Byte after CMD12, looks like an R1
+#define SIM_NONE        0xFFFFFFFFUL
+
+enum {RX_CMD, RX_TOKEN, RX_DATA};
+enum {WR_NONE, WR_SINGLE, WR_MULTI};
+
+const SIM_CARD Sim_Default = {
+    32768,      // 16 MiB
+    64,         // 32 KiB erase blocks
+    200,        // prog_us
+    4000,       // merge_us
+    2000,       // erase_us
+    100,        // access_us
+    0x00        // erased
+};
+SIM_STATS Sim_Stats;
+
+// Expected from main.c and the startup code
+uint32_t tick_freq = 1000;
+uint32_t SystemCoreClock = SIM_SYSTIMER_HZ;
+static GPIO_Type sim_ptb;
+GPIO_Type *PTB = &sim_ptb;
+
+static SIM_CARD card;
+static BYTE *mem;               // Card content
+static BYTE *clean;             // Per sector: erased since its last program
+static uint64_t now_ns;
+static DWORD sck_hz = SIM_LOW_HZ;
+static uint64_t timer_end_ns;   // SPI_Timer_On
+
+// Card side of the bus
+static struct {
+    BOOL cs;
+    BOOL idle;
+    BOOL app;                   // Last command was CMD55
+    BYTE inits;                 // ACMD41 calls since CMD0
+    BYTE cmd[6], cmd_n;
+    BYTE rx;                    // RX_*
+    BYTE out[SD_BLK_SIZE + 16];
+    WORD out_pos, out_n;
+    uint64_t busy_until;        // DO held low until then
+    DWORD read;                 // Sector of a pending read, SIM_NONE: none
+    uint64_t read_at;           // ...sent once access_us has passed
+    BOOL stream;                // CMD18: read on until CMD12
+    BYTE wr;                    // WR_*
+    DWORD wr_sector;
+    BYTE wr_buf[SD_BLK_SIZE + 2];
+    WORD wr_n;
+    DWORD pre_erase;            // ACMD23 count for the next CMD25
+    DWORD pre_us;               // Its erase time, charged to the first block
+    DWORD erase_first, erase_last;
+    DWORD open_block;           // Rewritten block taking sectors at prog_us
+} c;
+
+static SD_CACHE sim_cache;
+static BOOL sim_cache_valid;
+
+/******************************************************************************
+ Card registers
+******************************************************************************/
+
+static void sim_csd(BYTE *csd)
+{
+    DWORD c_size = card.sectors / 1024 - 1;
+    static const BYTE v2[16] = {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+                                0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01};
+
+    // CSD v2, 25 MHz, CCC 0x5B5 (classes 0, 2, 4, 5, 7, 8, 10)
+    memcpy(csd, v2, 16);
+    csd[7] = (BYTE)((c_size >> 16) & 0x3F);
+    csd[8] = (BYTE)(c_size >> 8);
+    csd[9] = (BYTE)c_size;
+}
+
+static const BYTE sim_cid[16] = {0x03, 'S', 'M', 'S', 'I', 'M', 'C', 'D',
+                                 0x10, 0x12, 0x34, 0x56, 0x78, 0x01, 0x6A, 0x01};
+
+static void sim_scr(BYTE *scr)
+{
+    // SD 3.0, 1 and 4 bit bus, CMD20 and CMD23
+    static const BYTE v[8] = {0x02, 0x35, 0x84, 0x43, 0x00, 0x00, 0x00, 0x00};
+
+    memcpy(scr, v, 8);
+    if(card.erased)
+        scr[1] |= 0x80;
+}
+
+static void sim_ssr(BYTE *ssr)
+{
+    memset(ssr, 0, SD_SSR_SIZE);
+    ssr[8] = 0x02;              // Speed class 4
+    ssr[10] = 0x90;             // AU 4 MB
+    ssr[12] = 0x08;             // ERASE_SIZE 8 AUs...
+    ssr[13] = 0x29;             // ...in ERASE_TIMEOUT 10 s, ERASE_OFFSET 1 s
+}
+
+/******************************************************************************
+ Flash model
+******************************************************************************/
+
+// Program one sector, returns its busy time
+static DWORD sim_program(DWORD sector, const BYTE *dat)
+{
+    DWORD us = card.prog_us + c.pre_us;
+
+    c.pre_us = 0;
+    if(!clean[sector] && (sector / card.block != c.open_block)) {
+        us += card.merge_us;
+        c.open_block = sector / card.block;
+        Sim_Stats.merges++;
+    }
+    memcpy(&mem[(size_t)sector * SD_BLK_SIZE], dat, SD_BLK_SIZE);
+    clean[sector] = 0;
+    Sim_Stats.programs++;
+    return(us);
+}
+
+static void sim_clear(DWORD first, DWORD last)
+{
+    memset(&mem[(size_t)first * SD_BLK_SIZE], card.erased, (size_t)(last - first + 1) * SD_BLK_SIZE);
+    memset(&clean[first], 1, last - first + 1);
+}
+
+// Erase a sector range, returns the busy time. Whole blocks are erased,
+// a partly covered block is rewritten around the range.
+static DWORD sim_erase(DWORD first, DWORD last, BOOL whole_only)
+{
+    DWORD b, lo, hi, us = 0;
+
+    for(b = first / card.block; b <= last / card.block; b++) {
+        lo = (b * card.block > first) ? b * card.block : first;
+        hi = (b * card.block + card.block - 1 < last) ? b * card.block + card.block - 1 : last;
+        if((lo == b * card.block) && (hi == b * card.block + card.block - 1)) {
+            us += card.erase_us;
+            Sim_Stats.erased_blocks++;
+        } else if(whole_only) {
+            continue;
+        } else {
+            us += card.merge_us;
+            Sim_Stats.merges++;
+        }
+        sim_clear(lo, hi);
+    }
+    c.open_block = SIM_NONE;
+    return(us);
+}
+
+/******************************************************************************
+ SPI mode protocol
+******************************************************************************/
+
+static void q(BYTE d)
+{
+    if(c.out_pos + c.out_n < sizeof(c.out))
+        c.out[c.out_pos + c.out_n++] = d;
+}
+
+static void q_reset(void)
+{
+    c.out_pos = c.out_n = 0;
+}
+
+// Data block: token, payload and a CRC the driver does not check
+static void q_data(const BYTE *dat, WORD n)
+{
+    q(0xFE);
+    while(n--)
+        q(*dat++);
+    q(0xFF);
+    q(0xFF);
+}
+
+static void sim_command(void)
+{
+    BYTE idx = c.cmd[0] & 0x3F, r1 = c.idle ? 0x01 : 0x00, buf[SD_SSR_SIZE];
+    DWORD arg = ((DWORD)c.cmd[1] << 24) | ((DWORD)c.cmd[2] << 16) | ((DWORD)c.cmd[3] << 8) | c.cmd[4];
+    BOOL app = c.app;
+
+    Sim_Stats.cmds++;
+    if(app)
+        Sim_Stats.acmd[idx]++;
+    else
+        Sim_Stats.cmd[idx]++;
+    if(now_ns < c.busy_until)
+        Sim_Stats.busy_cmds++;
+    c.app = FALSE;
+    q_reset();
+    if(!app && (idx == 12) && c.stream) {
+        // Stop the stream: a stuff byte, then R1 and a short busy
+        c.stream = FALSE;
+        c.read = SIM_NONE;
+        q(SIM_STUFF);
+        q(0xFF);
+        q(r1);
+        c.busy_until = now_ns + SIM_STOP_US * 1000ULL;
+        return;
+    }
+    q(0xFF);    // NCR
+    if(app) {
+        switch(idx) {
+            case 41:
+                if(++c.inits >= 3)
+                    c.idle = FALSE;
+                q(c.idle ? 0x01 : 0x00);
+                break;
+            case 51:
+                q(r1);
+                sim_scr(buf);
+                q_data(buf, SD_SCR_SIZE);
+                break;
+            case 13:
+                q(r1);
+                q(0x00);
+                sim_ssr(buf);
+                q_data(buf, SD_SSR_SIZE);
+                break;
+            case 23:
+                c.pre_erase = arg & 0x7FFFFF;
+                q(r1);
+                break;
+            default:
+                q(r1 | 0x04);
+                break;
+        }
+        return;
+    }
+    switch(idx) {
+        case 0:
+            c.idle = TRUE;
+            c.inits = 0;
+            c.stream = FALSE;
+            c.read = SIM_NONE;
+            c.wr = WR_NONE;
+            q(0x01);
+            break;
+        case 8:
+            q(r1);
+            q(0x00);
+            q(0x00);
+            q((BYTE)((arg >> 8) & 0x0F));
+            q((BYTE)arg);
+            break;
+        case 55:
+            c.app = TRUE;
+            q(r1);
+            break;
+        case 58:
+            q(r1);
+            q(c.idle ? 0x00 : 0xC0);    // Power up done, CCS
+            q(0xFF);
+            q(0x80);
+            q(0x00);
+            break;
+        case 9:
+            q(r1);
+            sim_csd(buf);
+            q_data(buf, 16);
+            break;
+        case 10:
+            q(r1);
+            q_data(sim_cid, 16);
+            break;
+        case 6:
+            q(r1);
+            memset(buf, 0, 64);
+            buf[16] = (BYTE)(arg & 0x0F);   // Group 1 function as asked
+            q_data(buf, 64);
+            break;
+        case 13:
+            q(r1);
+            q(0x00);
+            break;
+        case 17:
+        case 18:
+            if(arg >= card.sectors) {
+                q(r1 | 0x40);
+                break;
+            }
+            q(r1);
+            c.read = arg;
+            c.read_at = now_ns + card.access_us * 1000ULL;
+            c.stream = (idx == 18);
+            break;
+        case 24:
+        case 25:
+            if(arg >= card.sectors) {
+                q(r1 | 0x40);
+                break;
+            }
+            q(r1);
+            c.wr = (idx == 24) ? WR_SINGLE : WR_MULTI;
+            c.wr_sector = arg;
+            c.rx = RX_TOKEN;
+            if((idx == 25) && c.pre_erase) {
+                DWORD last = arg + c.pre_erase - 1;
+
+                c.pre_us = sim_erase(arg, (last < card.sectors) ? last : card.sectors - 1, TRUE);
+            }
+            c.pre_erase = 0;
+            break;
+        case 32:
+            c.erase_first = arg;
+            q(r1);
+            break;
+        case 33:
+            c.erase_last = arg;
+            q(r1);
+            break;
+        case 38:
+            if((c.erase_first > c.erase_last) || (c.erase_last >= card.sectors)) {
+                q(r1 | 0x40);
+                break;
+            }
+            q(r1);
+            c.busy_until = now_ns + sim_erase(c.erase_first, c.erase_last, FALSE) * 1000ULL;
+            break;
+        case 12:
+        case 16:
+        case 59:
+            q(r1);
+            break;
+        default:
+            q(r1 | 0x04);
+            break;
+    }
+}
+
+// Byte the card drives while the host clocks one
+static BYTE sim_out(void)
+{
+    if(!c.cs)
+        return(0xFF);
+    if(c.out_n) {
+        c.out_n--;
+        return(c.out[c.out_pos++]);
+    }
+    q_reset();
+    if((c.read != SIM_NONE) && (now_ns >= c.read_at)) {
+        q_data(&mem[(size_t)c.read * SD_BLK_SIZE], SD_BLK_SIZE);
+        Sim_Stats.reads++;
+        if(c.stream && (c.read + 1 < card.sectors)) {
+            c.read++;
+            c.read_at = now_ns + card.access_us * 1000ULL;
+        } else {
+            c.read = SIM_NONE;
+        }
+        c.out_n--;
+        return(c.out[c.out_pos++]);
+    }
+    return((now_ns < c.busy_until) ? 0x00 : 0xFF);
+}
+
+// Byte the host drives
+static void sim_in(BYTE d)
+{
+    if(!c.cs)
+        return;
+    if(c.rx == RX_DATA) {
+        c.wr_buf[c.wr_n++] = d;
+        if(c.wr_n == sizeof(c.wr_buf)) {
+            DWORD us = sim_program(c.wr_sector++, c.wr_buf);
+
+            q_reset();
+            q(0x05);    // Data accepted
+            c.busy_until = now_ns + us * 1000ULL;
+            c.rx = (c.wr == WR_MULTI) ? RX_TOKEN : RX_CMD;
+            if(c.wr == WR_SINGLE)
+                c.wr = WR_NONE;
+            if(c.wr_sector >= card.sectors)
+                c.wr = WR_NONE;
+        }
+        return;
+    }
+    if(c.rx == RX_TOKEN) {
+        if(((d == 0xFE) && (c.wr == WR_SINGLE)) || ((d == 0xFC) && (c.wr == WR_MULTI))) {
+            if(now_ns < c.busy_until)
+                Sim_Stats.busy_cmds++;
+            c.rx = RX_DATA;
+            c.wr_n = 0;
+            return;
+        }
+        if((d == 0xFD) && (c.wr == WR_MULTI)) {
+            c.wr = WR_NONE;
+            c.rx = RX_CMD;
+            q_reset();
+            q(0xFF);
+            c.busy_until = ((now_ns > c.busy_until) ? now_ns : c.busy_until) + SIM_STOP_US * 1000ULL;
+            return;
+        }
+        if((d & 0xC0) != 0x40)
+            return;
+        c.rx = RX_CMD;
+        c.wr = WR_NONE;
+    }
+    if(c.cmd_n == 0) {
+        if((d & 0xC0) != 0x40)
+            return;
+    }
+    c.cmd[c.cmd_n++] = d;
+    if(c.cmd_n == 6) {
+        c.cmd_n = 0;
+        sim_command();
+    }
+}
+
+/******************************************************************************
+ Public
+******************************************************************************/
+
+void Sim_Card_Init(const SIM_CARD *cfg, BOOL used)
+{
+    DWORD s;
+
+    card = *cfg;
+    free(mem);
+    free(clean);
+    mem = malloc((size_t)card.sectors * SD_BLK_SIZE);
+    clean = malloc(card.sectors);
+    if((mem == NULL) || (clean == NULL)) {
+        fprintf(stderr, "sdsim: out of memory\n");
+        exit(2);
+    }
+    if(used) {
+        // Old data: every byte tells its sector
+        for(s = 0; s < card.sectors; s++)
+            memset(&mem[(size_t)s * SD_BLK_SIZE], (BYTE)(s * 7 + 1), SD_BLK_SIZE);
+        memset(clean, 0, card.sectors);
+    } else {
+        sim_clear(0, card.sectors - 1);
+    }
+    memset(&c, 0, sizeof(c));
+    c.read = SIM_NONE;
+    c.open_block = SIM_NONE;
+    sim_cache_valid = FALSE;
+    now_ns = 0;
+    sck_hz = SIM_LOW_HZ;
+    Sim_Stats_Reset();
+}
+
+uint64_t Sim_Now_us(void)
+{
+    return(now_ns / 1000);
+}
+
+void Sim_Idle(DWORD us)
+{
+    now_ns += us * 1000ULL;
+}
+
+BYTE *Sim_Sector(DWORD sector)
+{
+    return(&mem[(size_t)sector * SD_BLK_SIZE]);
+}
+
+BOOL Sim_Erased(DWORD sector)
+{
+    return(clean[sector] ? TRUE : FALSE);
+}
+
+void Sim_Stats_Reset(void)
+{
+    memset(&Sim_Stats, 0, sizeof(Sim_Stats));
+}
+
+/******************************************************************************
+ spi_io.h
+******************************************************************************/
+
+void SPI_Init(void)
+{
+    sck_hz = SIM_LOW_HZ;
+}
+
+BYTE SPI_RW(BYTE d)
+{
+    BYTE r = sim_out();
+
+    sim_in(d);
+    now_ns += 8000000000ULL / sck_hz;
+    Sim_Stats.bytes++;
+    return(r);
+}
+
+void SPI_Skip(WORD n)
+{
+    while(n--)
+        SPI_RW(0xFF);
+}
+
+void SPI_Read(BYTE *dst, WORD n)
+{
+    while(n--)
+        *dst++ = SPI_RW(0xFF);
+}
+
+void SPI_Write(const BYTE *src, WORD n)
+{
+    while(n--)
+        SPI_RW(*src++);
+}
+
+void SPI_Write_Xor(const BYTE *src, const BYTE *ks, WORD n)
+{
+    while(n--)
+        SPI_RW(*src++ ^ (ks ? *ks++ : 0));
+}
+
+void SPI_Read_Xor(BYTE *dst, const BYTE *ks, WORD n)
+{
+    while(n--)
+        *dst++ = SPI_RW(0xFF) ^ (ks ? *ks++ : 0);
+}
+
+DWORD SPI_Read_Check(BYTE *dst, const BYTE *ks, WORD n, BYTE kind, DWORD ck)
+{
+    SPI_Read_Xor(dst, ks, n);
+    return(Blk_Check(kind, ck, dst, n));
+}
+
+DWORD SPI_Write_Adler(const BYTE *src, const BYTE *ks, WORD n, DWORD adler)
+{
+    SPI_Write_Xor(src, ks, n);
+    return(Blk_Adler32(adler, src, n));
+}
+
+void SPI_Release(void)
+{
+    WORD idx;
+
+    for(idx = 512; idx && (SPI_RW(0xFF) != 0xFF); idx--)
+        ;
+}
+
+void SPI_CS_Low(void)
+{
+    c.cs = TRUE;
+}
+
+void SPI_CS_High(void)
+{
+    // Deselect drops a half received command and pending output
+    c.cs = FALSE;
+    c.cmd_n = 0;
+    q_reset();
+}
+
+DWORD SPI_Freq_Set(DWORD hz)
+{
+    // SPI1 runs from the 24 MHz bus clock, divided by powers of two
+    sck_hz = SPI_MAX_FREQ;
+    while((sck_hz > hz) && (sck_hz > SIM_LOW_HZ))
+        sck_hz /= 2;
+    return(sck_hz);
+}
+
+void SPI_Freq_High(void)
+{
+    SPI_Freq_Set(SPI_MAX_FREQ);
+}
+
+void SPI_Freq_Low(void)
+{
+    sck_hz = SIM_LOW_HZ;
+}
+
+void SPI_Timer_On(WORD ms)
+{
+    timer_end_ns = now_ns + ms * 1000000ULL;
+}
+
+BOOL SPI_Timer_Status(void)
+{
+    return((now_ns < timer_end_ns) ? TRUE : FALSE);
+}
+
+void SPI_Timer_Off(void)
+{
+}
+
+void SPI_Nap(DWORD us)
+{
+    now_ns += us * 1000ULL;
+}
+
+/******************************************************************************
+ Identity cache and flash: RAM instead of the reserved sector
+******************************************************************************/
+
+BOOL SD_Cache_Load(SD_CACHE *rec)
+{
+    if(!sim_cache_valid)
+        return(FALSE);
+    *rec = sim_cache;
+    Sim_Stats.cache_loads++;
+    return(TRUE);
+}
+
+void SD_Cache_Store(const SD_CACHE *rec)
+{
+    sim_cache = *rec;
+    sim_cache_valid = TRUE;
+    Sim_Stats.cache_stores++;
+}
+
+BOOL Flash_Erase(DWORD addr)
+{
+    (void)addr;
+    return(FALSE);
+}
+
+BOOL Flash_Write(DWORD addr, const void *src, WORD n)
+{
+    (void)addr;
+    (void)src;
+    (void)n;
+    return(FALSE);
+}
+
+/******************************************************************************
+ cmsis_os2.h: simulated time, one thread
+******************************************************************************/
+
+typedef struct {
+    uint32_t count, size, head, n;
+    BYTE *buf;
+} SIM_QUEUE;
+
+static uint32_t sim_flags;
+
+uint32_t osKernelGetTickCount(void)
+{
+    return((uint32_t)(now_ns / 1000000ULL));
+}
+
+uint32_t osKernelGetTickFreq(void)
+{
+    return(tick_freq);
+}
+
+uint32_t osKernelGetSysTimerCount(void)
+{
+    return((uint32_t)(now_ns * (SIM_SYSTIMER_HZ / 1000000UL) / 1000ULL));
+}
+
+uint32_t osKernelGetSysTimerFreq(void)
+{
+    return(SIM_SYSTIMER_HZ);
+}
+
+osStatus_t osDelay(uint32_t ticks)
+{
+    // Wakes on a tick boundary, as the kernel does
+    now_ns = (now_ns / 1000000ULL + ticks) * 1000000ULL;
+    return(osOK);
+}
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr)
+{
+    (void)func;
+    (void)argument;
+    (void)attr;
+    return(NULL);
+}
+
+osThreadId_t osThreadGetId(void)
+{
+    return((osThreadId_t)&sim_flags);
+}
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags)
+{
+    (void)thread_id;
+    sim_flags |= flags;
+    return(sim_flags);
+}
+
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout)
+{
+    uint32_t r = sim_flags;
+
+    // Nothing else runs: what is not set now never will be
+    if(!(r & flags)) {
+        osDelay((timeout == osWaitForever) ? 1 : timeout);
+        return(osFlagsErrorTimeout);
+    }
+    if(!(options & osFlagsNoClear))
+        sim_flags &= ~flags;
+    return(r);
+}
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr)
+{
+    SIM_QUEUE *mq = calloc(1, sizeof(SIM_QUEUE));
+
+    (void)attr;
+    if(mq == NULL)
+        return(NULL);
+    mq->count = msg_count;
+    mq->size = msg_size;
+    mq->buf = calloc(msg_count, msg_size);
+    return(mq);
+}
+
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout)
+{
+    SIM_QUEUE *mq = mq_id;
+
+    (void)msg_prio;
+    (void)timeout;
+    if(mq->n == mq->count)
+        return(osErrorResource);
+    memcpy(&mq->buf[((mq->head + mq->n) % mq->count) * mq->size], msg_ptr, mq->size);
+    mq->n++;
+    return(osOK);
+}
+
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout)
+{
+    SIM_QUEUE *mq = mq_id;
+
+    if(msg_prio)
+        *msg_prio = 0;
+    if(mq->n == 0) {
+        if(timeout == 0)
+            return(osErrorResource);
+        osDelay((timeout == osWaitForever) ? 1 : timeout);
+        return(osErrorTimeout);
+    }
+    memcpy(msg_ptr, &mq->buf[mq->head * mq->size], mq->size);
+    mq->head = (mq->head + 1) % mq->count;
+    mq->n--;
+    return(osOK);
+}
+
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id)
+{
+    return(((SIM_QUEUE *)mq_id)->n);
+}
@@ -0,0 +1,90 @@
+/*
+ * Simulated SD card for host programs
+ *
+ * Implements spi_io.h for the development machine: every byte the driver
+ * clocks goes to a card model that speaks the SPI mode protocol (init,
+ * register reads, single and multiple block transfers, erase) and keeps its
+ * data in memory. Time is simulated: each byte costs its SPI bit time and
+ * osDelay() moves the clock on, so driver waits cost nothing on the host.
+ *
+ * The flash model is what makes erase visible. A sector is erased or holds
+ * data. Programming an erased sector costs prog_us. Programming over data
+ * makes the card rewrite the whole internal block first (merge_us: erase
+ * plus copy of the rest); the rewritten block then stays open and takes
+ * further sectors at prog_us until a write lands in another block. CMD38
+ * and the ACMD23 pre-erase of a multiple block write erase whole blocks at
+ * erase_us each.
+ */
+
+#ifndef SDSIM_H
+#define SDSIM_H
+
+#include <stdint.h>
+#include <integer.h>
+
+typedef struct {
+    DWORD sectors;          // Capacity, a multiple of 1024
+    WORD block;             // Sectors per internal erase block
+    DWORD prog_us;          // Program one sector into erased flash
+    DWORD merge_us;         // Rewrite a block that holds data: erase plus copy
+    DWORD erase_us;         // Erase one block by CMD38 or ACMD23
+    DWORD access_us;        // Read access, command to data token
+    BYTE erased;            // Value of erased bytes, SCR DATA_STAT_AFTER_ERASE
+} SIM_CARD;
+
+typedef struct {
+    DWORD cmds;             // Commands received
+    DWORD cmd[64];          // ...per CMD index
+    DWORD acmd[64];         // ...per ACMD index
+    DWORD programs;         // Sectors programmed
+    DWORD merges;           // Block rewrites forced by programming over data
+    DWORD erased_blocks;    // Blocks erased by CMD38 or ACMD23
+    DWORD reads;            // Sectors sent
+    DWORD bytes;            // SPI bytes clocked
+    DWORD busy_cmds;        // Commands or tokens sent while the card was busy
+    DWORD cache_loads;      // SD_Cache_Load calls that found a record
+    DWORD cache_stores;     // SD_Cache_Store calls
+} SIM_STATS;
+
+extern const SIM_CARD Sim_Default;
+extern SIM_STATS Sim_Stats;
+
+/**
+ \brief Power up a card, forgetting all data and the stored identity.
+ \param card Flash model, copied.
+ \param used TRUE: every sector holds data, FALSE: all erased.
+ */
+void Sim_Card_Init(const SIM_CARD *card, BOOL used);
+
+/**
+ \brief Simulated time since Sim_Card_Init.
+ \return Microseconds.
+ */
+uint64_t Sim_Now_us(void);
+
+/**
+ \brief Let time pass without SPI traffic, as an idle thread would.
+ \param us Microseconds.
+ */
+void Sim_Idle(DWORD us);
+
+/**
+ \brief Card content, for checks behind the driver's back.
+ \param sector Sector number.
+ \return Its 512 bytes.
+ */
+BYTE *Sim_Sector(DWORD sector);
+
+/**
+ \brief Erase state of a sector.
+ \param sector Sector number.
+ \return TRUE if erased since its last program.
+ */
+BOOL Sim_Erased(DWORD sector);
+
+/**
+ \brief Clear the counters of Sim_Stats.
+ */
+void Sim_Stats_Reset(void);
+
+#endif // SDSIM_H
@@ -0,0 +1,257 @@
+/*
+ * Delta packing: round trip, frame sizing, and raw against packed logging
+ *
+ * - Round trip: random rows of 1..8 channels (full scale jumps, small
+ *   steps, extremes, zeros) packed into frames of 512 and 504 bytes and
+ *   decoded again. Frames must never overflow, a full frame must not have
+ *   room for a worst case row, and foreign or damaged frames decode to 0.
+ * - The log bench of main.c on the simulated card: the same sensor stream
+ *   written raw, packed, and packed into sectors erased while idle. Reports
+ *   sectors written, simulated time, and host time per input byte to build
+ *   the sectors; reads every sector back and decodes it.
+ *
+ * Build and run from the repository root:
+ *   S="Using CMSIS-RTOS v2 RTX5/Source"
+ *   cc -std=gnu99 -fgnu89-inline -O2 -Itools/host -I"$S" -o pack_sim tools/pack_sim.c tools/host/sdsim.c \
+ *      "$S/sd_io.c" "$S/sd_reg.c" "$S/blkutil.c" "$S/blkcrypt.c" "$S/blkpack.c"
+ *   ./pack_sim
+ * Exit status 1 if a check fails or packing does not save sectors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd_io.h"
+#include "blkpack.h"
+#include "blkutil.h"
+#include "sdsim.h"
+
+#define FUZZ_RUNS   200
+#define FUZZ_ROWS   400
+#define MAX_ROWS    ((SD_BLK_SIZE - BLK_PACK_HDR) / 1 + 1)
+
+// As main.c
+#define LOG_ROWS    4000
+#define LOG_CH      3
+#define LOG_SECTOR  4096
+#define LOG_ERASE   32
+#define LOG_IDLE_MS 250
+
+static SD_DEV dev;
+static BYTE buffer[SD_BLK_SIZE];
+static SHORT in[FUZZ_ROWS * BLK_PACK_MAX_CH], out[MAX_ROWS * BLK_PACK_MAX_CH];
+static SHORT stream[LOG_ROWS][LOG_CH];
+static int fails;
+
+static void check(int ok, const char *what)
+{
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        fails++;
+    }
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void round_trip(void)
+{
+    static BYTE blk[SD_BLK_SIZE];
+    BLK_PACK p;
+    DWORD rows = 0, frames = 0, bytes = 0;
+    WORD cap, n, len;
+    BYTE ch, c;
+    int t, i, m;
+
+    srand(1);
+    for(t = 0; t < FUZZ_RUNS; t++) {
+        ch = 1 + rand() % BLK_PACK_MAX_CH;
+        cap = (t & 1) ? SD_BLK_SIZE - 8 : SD_BLK_SIZE;
+        for(i = 0; i < FUZZ_ROWS * ch; i++) {
+            m = rand() % 4;
+            in[i] = (m == 0) ? (SHORT)rand()
+                  : (m == 1) ? (SHORT)((i >= ch ? in[i - ch] : 0) + rand() % 7 - 3)
+                  : (m == 2) ? ((rand() & 1) ? 32767 : -32768) : 0;
+        }
+        for(i = 0; i < FUZZ_ROWS; ) {
+            Blk_Pack_Start(&p, blk, cap, ch);
+            while((i < FUZZ_ROWS) && Blk_Pack_Row(&p, &in[i * ch]))
+                i++;
+            if(i < FUZZ_ROWS)
+                check(p.len + BLK_PACK_ROW_MAX(ch) > cap, "frame closed with room for a row");
+            len = Blk_Pack_Finish(&p);
+            check((len <= cap) && (len == p.len), "frame size");
+            n = Blk_Unpack(blk, cap, out, MAX_ROWS, &c);
+            check((n == p.rows) && (c == ch), "rows and channels decoded");
+            check(!memcmp(out, &in[(i - n) * ch], n * ch * sizeof(SHORT)), "samples decoded");
+            for(m = len; (m < cap) && !blk[m]; m++)
+                ;
+            check(m == cap, "zero padding");
+            rows += n;
+            frames++;
+            bytes += len;
+        }
+    }
+    blk[0] ^= 0xFF;
+    check(Blk_Unpack(blk, SD_BLK_SIZE, out, MAX_ROWS, &c) == 0, "foreign frame");
+    blk[0] ^= 0xFF;
+    blk[4] = 0xFF;
+    blk[5] = 0xFF;
+    check(Blk_Unpack(blk, SD_BLK_SIZE, out, MAX_ROWS, &c) == 0, "frame length beyond the sector");
+    Blk_Fill(blk, 0xFF, SD_BLK_SIZE);
+    check(Blk_Unpack(blk, SD_BLK_SIZE, out, MAX_ROWS, &c) == 0, "erased sector");
+    printf("round trip: %lu rows in %lu frames, %.1f bytes per frame\n", (unsigned long)rows,
+           (unsigned long)frames, (double)bytes / frames);
+}
+
+// Sensor_Row of main.c
+static void Sensor_Row(SHORT *row, DWORD i, WORD *lfsr)
+{
+    WORD t = i & 511;
+    SHORT tri = (SHORT)((t < 256) ? t : 511 - t);
+
+    *lfsr = (*lfsr >> 1) ^ (-(*lfsr & 1) & 0xB400);
+    row[0] = tri * 8 - 1024 + (*lfsr & 7) - 4;
+    row[1] = tri * 4 - 512 + ((*lfsr >> 3) & 3) - 2;
+    row[2] = 1000 + ((*lfsr >> 5) & 15) - 8;
+}
+
+static BOOL Log_Add(BOOL packed, BLK_PACK *pack, WORD *len, const SHORT *row)
+{
+    BYTE c;
+
+    if(packed)
+        return(Blk_Pack_Row(pack, row));
+    if(*len + 2 * LOG_CH > SD_PAYLOAD_SIZE)
+        return(FALSE);
+    for(c = 0; c < LOG_CH; c++) {
+        buffer[(*len)++] = (BYTE)row[c];
+        buffer[(*len)++] = (BYTE)((WORD)row[c] >> 8);
+    }
+    return(TRUE);
+}
+
+typedef struct {
+    DWORD first, sectors;
+    DWORD write_us;         // Simulated time in SD_Write and the final SD_Sync
+    DWORD merges;           // Block rewrites on the card
+    double build_s;         // Host time to produce the sectors
+} LOG_RUN;
+
+static void Log_Flush(BOOL packed, BLK_PACK *pack, WORD len, LOG_RUN *b)
+{
+    uint64_t t0;
+
+    if(packed)
+        Blk_Pack_Finish(pack);
+    else
+        Blk_Fill(&buffer[len], 0, SD_PAYLOAD_SIZE - len);
+    t0 = Sim_Now_us();
+    check(SD_Write(&dev, buffer, b->first + b->sectors) == SD_OK, "SD_Write");
+    b->write_us += (DWORD)(Sim_Now_us() - t0);
+    b->sectors++;
+}
+
+// Bench_Log of main.c, one run
+static void log_run(BYTE run, DWORD first, LOG_RUN *b)
+{
+    SHORT row[LOG_CH];
+    BLK_PACK pack;
+    BOOL packed = (run != 0);
+    uint64_t t0;
+    double t;
+    DWORD i;
+    WORD lfsr = 0xACE1, len = 0;
+
+    memset(b, 0, sizeof(*b));
+    b->first = first;
+    if(run == 2) {
+        check(SD_Erase(&dev, first, first + LOG_ERASE - 1) == SD_OK, "SD_Erase");
+        Sim_Idle(LOG_IDLE_MS * 1000UL);
+    }
+    Sim_Stats_Reset();
+    Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+    t = seconds();
+    for(i = 0; i < LOG_ROWS; i++) {
+        Sensor_Row(row, i, &lfsr);
+        if(!Log_Add(packed, &pack, &len, row)) {
+            b->build_s += seconds() - t;
+            Log_Flush(packed, &pack, len, b);
+            t = seconds();
+            len = 0;
+            Blk_Pack_Start(&pack, buffer, SD_PAYLOAD_SIZE, LOG_CH);
+            Log_Add(packed, &pack, &len, row);
+        }
+    }
+    b->build_s += seconds() - t;
+    Log_Flush(packed, &pack, len, b);
+    t0 = Sim_Now_us();
+    check(SD_Sync(&dev) == SD_OK, "SD_Sync");
+    b->write_us += (DWORD)(Sim_Now_us() - t0);
+    b->merges = Sim_Stats.merges;
+}
+
+// Read a run back and compare it with the stream
+static void log_verify(BOOL packed, const LOG_RUN *b)
+{
+    DWORD s, row = 0;
+    WORD n, r;
+    BYTE ch;
+
+    for(s = 0; s < b->sectors; s++) {
+        check(SD_Read(&dev, buffer, b->first + s, 0, SD_BLK_SIZE) == SD_OK, "SD_Read");
+        if(packed) {
+            n = Blk_Unpack(buffer, SD_PAYLOAD_SIZE, out, MAX_ROWS, &ch);
+            check(ch == LOG_CH, "channels read back");
+        } else {
+            n = (row + SD_PAYLOAD_SIZE / (2 * LOG_CH) <= LOG_ROWS) ? SD_PAYLOAD_SIZE / (2 * LOG_CH) : LOG_ROWS - row;
+            for(r = 0; r < n * LOG_CH; r++)
+                out[r] = (SHORT)(buffer[2 * r] | (buffer[2 * r + 1] << 8));
+        }
+        if((row + n > LOG_ROWS) || memcmp(out, stream[row], n * LOG_CH * sizeof(SHORT))) {
+            check(0, "rows read back");
+            return;
+        }
+        row += n;
+    }
+    check(row == LOG_ROWS, "all rows read back");
+}
+
+int main(void)
+{
+    static const char *name[3] = {"raw", "packed", "pre-erased"};
+    LOG_RUN b[3];
+    DWORD i, first = LOG_SECTOR;
+    WORD lfsr = 0xACE1;
+    BYTE run;
+
+    round_trip();
+
+    for(i = 0; i < LOG_ROWS; i++)
+        Sensor_Row(stream[i], i, &lfsr);
+    Sim_Card_Init(&Sim_Default, TRUE);
+    check(SD_Init(&dev) == SD_OK, "SD_Init");
+    for(run = 0; run < 3; run++) {
+        log_run(run, first, &b[run]);
+        log_verify(run != 0, &b[run]);
+        first += 2 * LOG_ERASE;
+    }
+    printf("%d rows of %d channels, %d input bytes\n", LOG_ROWS, LOG_CH, LOG_ROWS * LOG_CH * 2);
+    printf("run         sectors  sim us  block rewrites  host ns/input byte\n");
+    for(run = 0; run < 3; run++)
+        printf("%-10s %8lu %7lu %15lu %19.2f\n", name[run], (unsigned long)b[run].sectors,
+               (unsigned long)b[run].write_us, (unsigned long)b[run].merges,
+               b[run].build_s * 1e9 / (LOG_ROWS * LOG_CH * 2));
+    check(b[1].sectors < b[0].sectors, "packing saves sectors");
+    check(b[2].sectors <= LOG_ERASE, "packed run fits the pre-erased extent");
+    check(b[1].write_us < b[0].write_us, "packed run faster");
+
+    printf(fails ? "FAILED\n" : "OK\n");
+    return(fails ? 1 : 0);
+}
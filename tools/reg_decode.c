@@ -0,0 +1,171 @@
+/*
+ * SD register decoders against sample images
+ *
+ * Each image below is a register as a card sends it, with the fields the
+ * SD Physical Layer Specification gives for its bits worked out by hand in
+ * the comments. sd_reg.c must decode exactly those values.
+ *
+ * Build and run from the repository root:
+ *   S="Using CMSIS-RTOS v2 RTX5/Source"
+ *   cc -std=c99 -I"$S" -o reg_decode tools/reg_decode.c "$S/sd_reg.c"
+ *   ./reg_decode
+ * Exit status 1 if a field differs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sd_reg.h"
+
+static int fails;
+
+static void expect(const char *reg, const char *field, unsigned long got, unsigned long want)
+{
+    if(got != want) {
+        printf("FAIL: %s %s = %lu, expected %lu\n", reg, field, got, want);
+        fails++;
+    }
+}
+
+#define EXPECT(reg, s, field, want) expect(reg, #field, (unsigned long)(s).field, (unsigned long)(want))
+
+typedef struct {
+    const char *name;
+    BYTE raw[16];
+    BOOL ok;                // SD_Reg_Csd result
+    BYTE structure;
+    DWORD tran_speed;
+    WORD ccc;
+    BYTE read_bl_len, write_bl_len;
+    DWORD c_size;
+    BYTE c_size_mult;
+    DWORD sectors, erase_sectors;
+} CSD_SAMPLE;
+
+static const CSD_SAMPLE csd_samples[] = {
+    // Version 1, 2 GB SDSC: TRAN_SPEED 0x32 = 2.5 x 10 Mbit/s, CCC 0x5B5,
+    // READ_BL_LEN 10, C_SIZE 0xEB7, C_SIZE_MULT 7: 3768 x 512 blocks of 1 KB,
+    // ERASE_BLK_EN 1, WRITE_BL_LEN 10
+    {"CSD v1", {0x00, 0x2E, 0x00, 0x32, 0x5B, 0x5A, 0xA3, 0xAD, 0xFF, 0xFF, 0xFF, 0x80, 0x0A, 0x80, 0x00, 0x8D},
+     TRUE, 0, 25000000UL, 0x5B5, 10, 10, 0xEB7, 7, 3858432UL, 1},
+    // Same card with ERASE_BLK_EN 0: SECTOR_SIZE 127, 128 write blocks of 1 KB
+    {"CSD v1 sector erase", {0x00, 0x2E, 0x00, 0x32, 0x5B, 0x5A, 0xA3, 0xAD, 0xFF, 0xFF, 0xBF, 0x80, 0x0A, 0x80, 0x00, 0x8D},
+     TRUE, 0, 25000000UL, 0x5B5, 10, 10, 0xEB7, 7, 3858432UL, 256},
+    // Version 2, 8 GB SDHC: C_SIZE 0x3B37, (C_SIZE + 1) x 512 KB
+    {"CSD v2", {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00, 0x3B, 0x37, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x43},
+     TRUE, 1, 25000000UL, 0x5B5, 9, 9, 0x3B37, 0, 15523840UL, 1},
+    // Version 3, SDUC: C_SIZE 0x1000000 (8 TB), beyond 32-bit sector numbers
+    {"CSD v3", {0x80, 0x0E, 0x00, 0x5A, 0x5B, 0x59, 0x01, 0x00, 0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x43},
+     TRUE, 2, 50000000UL, 0x5B5, 9, 9, 0x1000000UL, 0, 0xFFFFFFFFUL, 1},
+    // CSD_STRUCTURE 3 is reserved
+    {"CSD reserved", {0xC0, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00, 0x3B, 0x37, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x43},
+     FALSE, 3, 25000000UL, 0x5B5, 9, 9, 0, 0, 0, 1},
+};
+
+// MID 0x03, OID "SD", PNM "SU08G", PRV 8.0, PSN 0x12345678, MDT 0x14A:
+// October 2020
+static const BYTE cid_raw[16] = {0x03, 'S', 'D', 'S', 'U', '0', '8', 'G', 0x80, 0x12, 0x34, 0x56, 0x78, 0x01, 0x4A, 0x01};
+
+typedef struct {
+    const char *name;
+    BYTE raw[8];
+    BYTE structure, spec, erase_value, security, bus_widths, cmd_support;
+} SCR_SAMPLE;
+
+static const SCR_SAMPLE scr_samples[] = {
+    // SD_SPEC 2, SD_SPEC3 1, SD_SPEC4 1, SD_SPECX 1: version 5.xx; DATA_STAT_AFTER_ERASE 0,
+    // SD_SECURITY 3, bus widths 1 and 4 bit, CMD20 and CMD23
+    {"SCR 5.xx", {0x02, 0x35, 0x84, 0x43, 0, 0, 0, 0}, 0, 50, 0x00, 3, 0x5, 0x3},
+    // SD_SPEC 2, SD_SPEC3 1, SD_SPEC4 0: version 3.0x; erased bytes read 0xFF
+    {"SCR 3.0x", {0x02, 0xB5, 0x80, 0x00, 0, 0, 0, 0}, 0, 30, 0xFF, 3, 0x5, 0x0},
+    // SD_SPEC 2, SD_SPEC3 1, SD_SPEC4 1, SD_SPECX 0: version 4.xx; CMD23
+    {"SCR 4.xx", {0x02, 0x35, 0x84, 0x02, 0, 0, 0, 0}, 0, 40, 0x00, 3, 0x5, 0x2},
+    // SD_SPEC 1: version 1.10, SD_SECURITY 2, 1 bit only
+    {"SCR 1.10", {0x01, 0x21, 0x00, 0x00, 0, 0, 0, 0}, 0, 11, 0x00, 2, 0x1, 0x0},
+};
+
+int main(void)
+{
+    SD_CSD_INFO csd;
+    SD_CID_INFO cid;
+    SD_SCR_INFO scr;
+    SD_SSR_INFO ssr;
+    BYTE raw[SD_SSR_SIZE];
+    unsigned i;
+    BOOL ok;
+
+    for(i = 0; i < sizeof(csd_samples) / sizeof(csd_samples[0]); i++) {
+        const CSD_SAMPLE *s = &csd_samples[i];
+
+        memset(&csd, 0xA5, sizeof(csd));
+        ok = SD_Reg_Csd(s->raw, &csd);
+        expect(s->name, "result", ok, s->ok);
+        EXPECT(s->name, csd, structure, s->structure);
+        EXPECT(s->name, csd, tran_speed, s->tran_speed);
+        EXPECT(s->name, csd, ccc, s->ccc);
+        EXPECT(s->name, csd, read_bl_len, s->read_bl_len);
+        EXPECT(s->name, csd, write_bl_len, s->write_bl_len);
+        EXPECT(s->name, csd, c_size, s->c_size);
+        EXPECT(s->name, csd, c_size_mult, s->c_size_mult);
+        EXPECT(s->name, csd, sectors, s->sectors);
+        EXPECT(s->name, csd, erase_sectors, s->erase_sectors);
+    }
+
+    SD_Reg_Cid(cid_raw, &cid);
+    EXPECT("CID", cid, mid, 0x03);
+    expect("CID", "oid", strcmp(cid.oid, "SD"), 0);
+    expect("CID", "pnm", strcmp(cid.pnm, "SU08G"), 0);
+    EXPECT("CID", cid, prv, 0x80);
+    EXPECT("CID", cid, psn, 0x12345678UL);
+    EXPECT("CID", cid, year, 2020);
+    EXPECT("CID", cid, month, 10);
+
+    for(i = 0; i < sizeof(scr_samples) / sizeof(scr_samples[0]); i++) {
+        const SCR_SAMPLE *s = &scr_samples[i];
+
+        SD_Reg_Scr(s->raw, &scr);
+        EXPECT(s->name, scr, structure, s->structure);
+        EXPECT(s->name, scr, spec, s->spec);
+        EXPECT(s->name, scr, erase_value, s->erase_value);
+        EXPECT(s->name, scr, security, s->security);
+        EXPECT(s->name, scr, bus_widths, s->bus_widths);
+        EXPECT(s->name, scr, cmd_support, s->cmd_support);
+    }
+
+    // SD Status of a class 10, U1, V10, A1 card: SPEED_CLASS 4, AU_SIZE 9
+    // (4 MB), ERASE_SIZE 8 AUs in ERASE_TIMEOUT 10 s, ERASE_OFFSET 1 s,
+    // DISCARD_SUPPORT 1
+    memset(raw, 0, sizeof(raw));
+    raw[8] = 0x04;          // SPEED_CLASS [447:440]
+    raw[9] = 0x00;          // PERFORMANCE_MOVE [439:432]
+    raw[10] = 0x90;         // AU_SIZE [431:428]
+    raw[11] = 0x00;         // ERASE_SIZE [423:408]
+    raw[12] = 0x08;
+    raw[13] = 0x29;         // ERASE_TIMEOUT [407:402], ERASE_OFFSET [401:400]
+    raw[14] = 0x10;         // UHS_SPEED_GRADE [399:396], UHS_AU_SIZE [395:392]
+    raw[15] = 0x0A;         // VIDEO_SPEED_CLASS [391:384]
+    raw[21] = 0x01;         // APP_PERF_CLASS [339:336]
+    raw[24] = 0x02;         // DISCARD_SUPPORT [313]
+    SD_Reg_Ssr(raw, &ssr);
+    EXPECT("SSR", ssr, speed_class, 10);
+    EXPECT("SSR", ssr, au_sectors, 8192);
+    EXPECT("SSR", ssr, erase_size, 8);
+    EXPECT("SSR", ssr, erase_timeout, 10);
+    EXPECT("SSR", ssr, erase_offset, 1);
+    EXPECT("SSR", ssr, uhs_grade, 1);
+    EXPECT("SSR", ssr, uhs_au_sectors, 0);
+    EXPECT("SSR", ssr, video_class, 10);
+    EXPECT("SSR", ssr, app_class, 1);
+    EXPECT("SSR", ssr, discard, 1);
+    EXPECT("SSR", ssr, fule, 0);
+    // 10 s / 8 AUs per AU touched, plus the 1 s offset
+    expect("SSR", "erase ms, 32 sectors", SD_Reg_Erase_Ms(&ssr, 32), 2250);
+    expect("SSR", "erase ms, 100000 sectors", SD_Reg_Erase_Ms(&ssr, 100000), 13 * 1250 + 1000);
+
+    // No erase parameters: no estimate
+    raw[12] = 0x00;
+    SD_Reg_Ssr(raw, &ssr);
+    expect("SSR", "erase ms without ERASE_SIZE", SD_Reg_Erase_Ms(&ssr, 32), 0);
+
+    printf(fails ? "FAILED\n" : "OK\n");
+    return(fails ? 1 : 0);
+}
@@ -0,0 +1,234 @@
+/*
+ * Deferred write staging of the SD server, on the simulated card
+ *
+ * SD_Server.c is built into this program and its request loop is run one
+ * request at a time (Serve), over the RTX driver and tools/host/sdsim.c.
+ * - A log of one whole AU written sector by sector, write-through with
+ *   SDS_Write and deferred: the deferred one must go out as a single
+ *   multi-block write with the AU pre-erased, ended at the AU boundary.
+ * - The scattered windows of Bench_Stage in main.c, write-through and
+ *   deferred. The card model charges nothing per command, so these cost
+ *   about the same either way; what must drop is the command count.
+ * - Semantics: a write-through write is on the card when it completes, a
+ *   deferred one only after SDS_Sync or the idle timeout, a read returns
+ *   staged data, the open command ends when idle, and with staging off a
+ *   deferred write is written through.
+ * Reports simulated time, block rewrites and commands per run, and reads
+ * every sector back.
+ *
+ * Build and run from the repository root:
+ *   S="Using CMSIS-RTOS v2 RTX5/Source"
+ *   cc -std=gnu99 -fgnu89-inline -O2 -Itools/host -I"$S" -o stage_sim tools/stage_sim.c tools/host/sdsim.c \
+ *      "$S/sd_io.c" "$S/sd_reg.c" "$S/blkutil.c" "$S/blkcrypt.c"
+ *   ./stage_sim
+ * Exit status 1 if a check fails or the deferred log is not faster.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sdsim.h"
+#include "../Using CMSIS-RTOS v2 RTX5/Source/SD_Server.c"
+
+#define LOG_AU      2           // AU written by the log runs, the deferred one gets the next
+#define SCAT_SECTOR 1024        // First sector of the scattered runs, not an AU start
+#define SCAT_WINDOWS 64         // As STAGE_WINDOWS in main.c
+
+static SD_DEV sd;
+static BYTE buf[SD_BLK_SIZE], back[SD_BLK_SIZE];
+static int fails;
+
+typedef struct {
+    DWORD us;               // Simulated time of the writes and the final sync
+    DWORD merges;           // Block rewrites on the card
+    DWORD single, multi;    // CMD24 and CMD25 received
+    DWORD pre_erase;        // ACMD23 received
+} RUN;
+
+static void check(int ok, const char *what)
+{
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        fails++;
+    }
+}
+
+static void fill(DWORD sector)
+{
+    memset(buf, (BYTE)(sector ^ 0x5A), sizeof(buf));
+    buf[0] = (BYTE)sector;
+    buf[1] = (BYTE)(sector >> 8);
+}
+
+static BOOL on_card(DWORD sector)
+{
+    fill(sector);
+    return(memcmp(Sim_Sector(sector), buf, SD_BLK_SIZE) == 0);
+}
+
+// Submit t and run the server until it is done
+static SDRESULTS request(SDS_TD_T *t)
+{
+    SDRESULTS res = SDS_Submit(t);
+
+    if(res != SD_OK)
+        return(res);
+    while(t->Status != STAT_IDLE)
+        Serve();
+    return(t->ErrorCode);
+}
+
+static SDRESULTS write(DWORD sector, BOOL defer)
+{
+    SDS_TD_T t = {REQ_WRITE, &sd, buf, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+
+    fill(sector);
+    t.Sector = sector;
+    t.Defer = defer;
+    return(request(&t));
+}
+
+static SDRESULTS sync(void)
+{
+    SDS_TD_T t = {REQ_SYNC, &sd, NULL, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+
+    return(request(&t));
+}
+
+static BOOL read_back(DWORD sector)
+{
+    SDS_TD_T t = {REQ_READ, &sd, back, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+
+    t.Sector = sector;
+    fill(sector);
+    return((request(&t) == SD_OK) && !memcmp(back, buf, SD_BLK_SIZE));
+}
+
+static void run_begin(uint64_t *t0)
+{
+    Sim_Stats_Reset();
+    memset(&SDS_Stage_Stats, 0, sizeof(SDS_Stage_Stats));
+    *t0 = Sim_Now_us();
+}
+
+static void run_end(RUN *r, uint64_t t0)
+{
+    check(sync() == SD_OK, "SDS_Sync");
+    r->us = (DWORD)(Sim_Now_us() - t0);
+    r->merges = Sim_Stats.merges;
+    r->single = Sim_Stats.cmd[24];
+    r->multi = Sim_Stats.cmd[25];
+    r->pre_erase = Sim_Stats.acmd[23];
+}
+
+static void log_run(DWORD first, DWORD n, BOOL defer, RUN *r)
+{
+    uint64_t t0;
+    DWORD s;
+
+    run_begin(&t0);
+    for(s = first; s < first + n; s++)
+        check(write(s, defer) == SD_OK, "log write");
+    run_end(r, t0);
+    for(s = first; s < first + n; s++)
+        check(on_card(s), "log sector on the card");
+}
+
+// Bench_Stage of main.c, one run
+static void scattered_run(DWORD first, BOOL defer, RUN *r)
+{
+    uint64_t t0;
+    DWORD w, i, s;
+
+    run_begin(&t0);
+    for(w = 0; w < SCAT_WINDOWS; w++)
+        for(i = 0; i < SDS_STAGE_SECTORS; i++)
+            check(write(first + w * SDS_STAGE_SECTORS + ((i * 5 + 3) & (SDS_STAGE_SECTORS - 1)), defer) == SD_OK,
+                  "scattered write");
+    run_end(r, t0);
+    for(s = first; s < first + SCAT_WINDOWS * SDS_STAGE_SECTORS; s++)
+        check(read_back(s), "scattered sector read back");
+}
+
+static void print_run(const char *name, const RUN *r)
+{
+    printf("%-22s %9lu %7lu %6lu %6lu %7lu\n", name, (unsigned long)r->us, (unsigned long)r->merges,
+           (unsigned long)r->single, (unsigned long)r->multi, (unsigned long)r->pre_erase);
+}
+
+// Write-through, deferred, read, idle and staging off, a few sectors each
+static void semantics(DWORD base)
+{
+    check(write(base, FALSE) == SD_OK, "SDS_Write");
+    check(on_card(base), "write-through sector on the card at once");
+    check(write(base + 1, TRUE) == SD_OK, "deferred write");
+    check(!on_card(base + 1), "deferred sector staged");
+    check(read_back(base + 1), "read of a staged sector");
+    check(on_card(base + 1), "staged sector flushed for the read");
+    check(!sd.stream, "read ends the multi-block write");
+
+    check(write(base + 2, TRUE) == SD_OK, "deferred write");
+    check(write(base + SDS_STAGE_SECTORS, FALSE) == SD_OK, "SDS_Write beside the window");
+    check(on_card(base + SDS_STAGE_SECTORS) && !on_card(base + 2), "write-through leaves the window staged");
+    check(sync() == SD_OK, "SDS_Sync");
+    check(on_card(base + 2), "staged sector on the card after SDS_Sync");
+
+    // Idle: the window goes out, then the open command ends
+    check(write(base + 4, TRUE) == SD_OK, "deferred write");
+    Serve();
+    check(on_card(base + 4), "staged sector flushed when idle");
+    check(sd.stream, "multi-block write kept open for the next window");
+    Serve();
+    check(!sd.stream, "multi-block write ended when idle");
+
+    SDS_Set_Staging(FALSE);
+    check(write(base + 5, TRUE) == SD_OK, "deferred write, staging off");
+    check(on_card(base + 5), "written through with staging off");
+    SDS_Set_Staging(TRUE);
+    printf("semantics: write-through, deferred, read, idle, staging off\n");
+}
+
+int main(void)
+{
+    static const char *log_name[2] = {"AU log, SDS_Write", "AU log, deferred"};
+    static const char *scat_name[2] = {"scattered, SDS_Write", "scattered, deferred"};
+    SDS_TD_T init = {REQ_INIT, &sd, NULL, 0, 0, FALSE, BLK_CK_NONE, 0, NULL, 0, STAT_IDLE, SD_OK};
+    RUN lr[2], sr[2];
+    DWORD au;
+    BYTE defer;
+
+    Sim_Card_Init(&Sim_Default, TRUE);
+    tick_freq = osKernelGetTickFreq();
+    SD_Server_Init();
+    if(request(&init) != SD_OK) {
+        printf("FAIL: SD_Init\n");
+        return(1);
+    }
+    au = sd.info.ssr.au_sectors;
+    printf("card: %lu sectors, AU %lu sectors, window %d sectors\n", (unsigned long)(sd.last_sector + 1),
+           (unsigned long)au, SDS_STAGE_SECTORS);
+
+    for(defer = 0; defer < 2; defer++)
+        log_run((LOG_AU + defer) * au, au, defer, &lr[defer]);
+    check(SDS_Stage_Stats.AU_Erases == 1, "deferred log pre-erased its AU once");
+    check(SDS_Stage_Stats.AU_Whole == 1, "deferred log wrote the whole AU");
+    check(lr[1].multi == 1, "deferred log in one multi-block write");
+    check(lr[1].single == 0, "deferred log without single block writes");
+    check(lr[1].pre_erase == 1, "deferred log pre-erase");
+    check(!sd.stream, "multi-block write ended at the AU boundary");
+    for(defer = 0; defer < 2; defer++)
+        scattered_run(SCAT_SECTOR + defer * SCAT_WINDOWS * SDS_STAGE_SECTORS, defer, &sr[defer]);
+    check(SDS_Stage_Stats.AU_Erases == 0, "scattered windows do not pre-erase the AU");
+    check(sr[1].multi < SCAT_WINDOWS, "scattered windows joined into longer writes");
+
+    printf("run                      sim us  rewrites  CMD24  CMD25  ACMD23\n");
+    for(defer = 0; defer < 2; defer++)
+        print_run(log_name[defer], &lr[defer]);
+    for(defer = 0; defer < 2; defer++)
+        print_run(scat_name[defer], &sr[defer]);
+    check(lr[1].us < lr[0].us, "deferred log faster");
+
+    semantics(SCAT_SECTOR + 2 * SCAT_WINDOWS * SDS_STAGE_SECTORS);
+
+    printf(fails ? "FAILED\n" : "OK\n");
+    return(fails ? 1 : 0);
+}